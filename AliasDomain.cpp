@@ -106,6 +106,17 @@ static int ADomRebuildADomainIndexes(char const *pszADomainFilePath)
 	return 0;
 }
 
+static int ADomAppendADomainIndexes(char const *pszADomainFilePath, SYS_OFF_T llRecOffset,
+				    time_t tTabMod)
+{
+	/* Add the new record to the Alias index */
+	if (TbixAppendRecord(pszADomainFilePath, iIdxADomain_Alias, false, llRecOffset,
+			     tTabMod, ADomCalcAliasHash) < 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
 static int ADomLookupDomainLK(const char *pszADomainFilePath, const char *pszADomain,
 			      char *pszDomain, bool bWildMatch)
 {
@@ -177,6 +188,41 @@ int ADomLookupDomain(const char *pszADomain, char *pszDomain, bool bWildMatch)
 	return iLookupResult;
 }
 
+static int ADomADomainExistLK(char const *pszADomainFilePath, char const *pszADomain)
+{
+	char **ppszTabTokens;
+
+	if (!ADomIsWildAlias(pszADomain)) {
+		if ((ppszTabTokens = TbixLookup(pszADomainFilePath, iIdxADomain_Alias, false,
+						pszADomain,
+						NULL)) == NULL)
+			return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+		StrFreeStrings(ppszTabTokens);
+
+		return 1;
+	}
+
+	/* Wild aliases are all grouped under the WILD_ADOMAIN_HASH hash key */
+	int iExist = 0;
+	unsigned long ulLkHVal = WILD_ADOMAIN_HASH;
+	INDEX_HANDLE hIndexLookup = TbixOpenHandle(pszADomainFilePath, iIdxADomain_Alias,
+						   &ulLkHVal, 1);
+
+	if (hIndexLookup == INVALID_INDEX_HANDLE)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+	for (ppszTabTokens = TbixFirstRecord(hIndexLookup); ppszTabTokens != NULL;
+	     ppszTabTokens = TbixNextRecord(hIndexLookup)) {
+		iExist = StrStringsCount(ppszTabTokens) >= adomMax &&
+			stricmp(pszADomain, ppszTabTokens[adomADomain]) == 0;
+		StrFreeStrings(ppszTabTokens);
+		if (iExist)
+			break;
+	}
+	TbixCloseHandle(hIndexLookup);
+
+	return iExist;
+}
+
 int ADomAddADomain(char const *pszADomain, char const *pszDomain)
 {
 	char szADomainFilePath[SYS_MAX_PATH] = "";
@@ -190,43 +236,44 @@ int ADomAddADomain(char const *pszADomain, char const *pszDomain)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pDomainsFile = fopen(szADomainFilePath, "r+t");
+	int iExist = ADomADomainExistLK(szADomainFilePath, pszADomain);
 
-	if (pDomainsFile == NULL) {
+	/* A lookup failing for other reasons than a missing record means a broken index */
+	if (iExist < 0 && ADomRebuildADomainIndexes(szADomainFilePath) == 0)
+		iExist = ADomADomainExistLK(szADomainFilePath, pszADomain);
+
+	if (iExist != 0) {
 		RLckUnlockEX(hResLock);
+		if (iExist < 0)
+			return iExist;
 
-		ErrSetErrorCode(ERR_ADOMAIN_FILE_NOT_FOUND);
-		return ERR_ADOMAIN_FILE_NOT_FOUND;
+		ErrSetErrorCode(ERR_ADOMAIN_EXIST);
+		return ERR_ADOMAIN_EXIST;
 	}
 
-	char szADomainLine[ADOMAIN_LINE_MAX] = "";
-
-	while (MscFGets(szADomainLine, sizeof(szADomainLine) - 1, pDomainsFile) != NULL) {
-		char **ppszStrings = StrGetTabLineStrings(szADomainLine);
-
-		if (ppszStrings == NULL)
-			continue;
+	/* The index is later checked against the table as it is before our write */
+	SYS_FILE_INFO TabFI;
 
-		int iFieldsCount = StrStringsCount(ppszStrings);
+	if (SysGetFileInfo(szADomainFilePath, TabFI) < 0)
+		TabFI.tMod = 0;
 
-		if (iFieldsCount >= adomMax &&
-		    stricmp(pszADomain, ppszStrings[adomADomain]) == 0) {
-			StrFreeStrings(ppszStrings);
-			fclose(pDomainsFile);
-			RLckUnlockEX(hResLock);
+	FILE *pDomainsFile = fopen(szADomainFilePath, "r+t");
 
-			ErrSetErrorCode(ERR_ADOMAIN_EXIST);
-			return ERR_ADOMAIN_EXIST;
-		}
+	if (pDomainsFile == NULL) {
+		RLckUnlockEX(hResLock);
 
-		StrFreeStrings(ppszStrings);
+		ErrSetErrorCode(ERR_ADOMAIN_FILE_NOT_FOUND);
+		return ERR_ADOMAIN_FILE_NOT_FOUND;
 	}
 	fseek(pDomainsFile, 0, SEEK_END);
+
+	SYS_OFF_T llRecOffset = Sys_ftell(pDomainsFile);
+
 	fprintf(pDomainsFile, "\"%s\"\t\"%s\"\n", pszADomain, pszDomain);
 	fclose(pDomainsFile);
 
-	/* Rebuild indexes */
-	if (ADomRebuildADomainIndexes(szADomainFilePath) < 0) {
+	/* Update indexes */
+	if (ADomAppendADomainIndexes(szADomainFilePath, llRecOffset, TabFI.tMod) < 0) {
 		ErrorPush();
 		RLckUnlockEX(hResLock);
 		return ErrorPop();
@@ -34,6 +34,7 @@
 #define BSOCK_READ(p, d, n, t) (*(p)->IOops.pRead)((p)->IOops.pPrivate, d, n, t)
 #define BSOCK_WRITE(p, d, n, t) (*(p)->IOops.pWrite)((p)->IOops.pPrivate, d, n, t)
 #define BSOCK_SENDFILE(p, f, b, e, t) (*(p)->IOops.pSendFile)((p)->IOops.pPrivate, f, b, e, t)
+#define BSOCK_PENDING(p) (*(p)->IOops.pPending)((p)->IOops.pPrivate)
 
 
 struct BuffSocketData {
@@ -42,6 +43,10 @@ struct BuffSocketData {
 	char *pszBuffer;
 	size_t sBytesInBuffer;
 	ssize_t sReadIndex;
+	char *pszOutBuffer;
+	size_t sOutBufferSize;
+	size_t sOutBytes;
+	int iOutTimeout;
 	BufSockIOOps IOops;
 };
 
@@ -76,6 +81,35 @@ static ssize_t BSckWriteLL(BuffSocketData *pBSD, void const *pData, size_t sSize
 	return sCount;
 }
 
+static int BSckFlushLL(BuffSocketData *pBSD)
+{
+	size_t sOutBytes = pBSD->sOutBytes;
+
+	pBSD->sOutBytes = 0;
+	if (sOutBytes > 0 &&
+	    BSckWriteLL(pBSD, pBSD->pszOutBuffer, sOutBytes, pBSD->iOutTimeout) != sOutBytes)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
+static ssize_t BSckBuffWrite(BuffSocketData *pBSD, void const *pData, size_t sSize, int iTimeout)
+{
+	if (pBSD->pszOutBuffer == NULL)
+		return BSckWriteLL(pBSD, pData, sSize, iTimeout);
+	pBSD->iOutTimeout = iTimeout;
+	if (pBSD->sOutBytes + sSize > pBSD->sOutBufferSize) {
+		if (BSckFlushLL(pBSD) < 0)
+			return 0;
+		if (sSize > pBSD->sOutBufferSize)
+			return BSckWriteLL(pBSD, pData, sSize, iTimeout);
+	}
+	memcpy(pBSD->pszOutBuffer + pBSD->sOutBytes, pData, sSize);
+	pBSD->sOutBytes += sSize;
+
+	return sSize;
+}
+
 static char const *BSckSock_Name(void *pPrivate)
 {
 	return BSOCK_BIO_NAME;
@@ -103,6 +137,11 @@ static int BSckSock_SendFile(void *pPrivate, char const *pszFilePath, SYS_OFF_T
 			   llEndOffset, iTimeout);
 }
 
+static int BSckSock_Pending(void *pPrivate)
+{
+	return 0;
+}
+
 BSOCK_HANDLE BSckAttach(SYS_SOCKET SockFD, int iBufferSize)
 {
 	BuffSocketData *pBSD = (BuffSocketData *) SysAlloc(sizeof(BuffSocketData));
@@ -122,12 +161,16 @@ BSOCK_HANDLE BSckAttach(SYS_SOCKET SockFD, int iBufferSize)
 	pBSD->pszBuffer = pszBuffer;
 	pBSD->sBytesInBuffer = 0;
 	pBSD->sReadIndex = 0;
+	pBSD->pszOutBuffer = NULL;
+	pBSD->sOutBufferSize = 0;
+	pBSD->sOutBytes = 0;
 	pBSD->IOops.pPrivate = (void *) (size_t) SockFD;
 	pBSD->IOops.pName = BSckSock_Name;
 	pBSD->IOops.pFree = BSckSock_Free;
 	pBSD->IOops.pRead = BSckSock_Read;
 	pBSD->IOops.pWrite = BSckSock_Write;
 	pBSD->IOops.pSendFile = BSckSock_SendFile;
+	pBSD->IOops.pPending = BSckSock_Pending;
 
 	return (BSOCK_HANDLE) pBSD;
 }
@@ -139,7 +182,14 @@ SYS_SOCKET BSckDetach(BSOCK_HANDLE hBSock, int iCloseSocket)
 
 	if (pBSD != NULL) {
 		SockFD = pBSD->SockFD;
+		/*
+		 * Best effort delivery of the responses still sitting inside the
+		 * output buffer (like the final reply to a QUIT command).
+		 */
+		if (pBSD->sOutBytes > 0)
+			BSckFlushLL(pBSD);
 		BSOCK_FREE(pBSD);
+		SysFree(pBSD->pszOutBuffer);
 		SysFree(pBSD->pszBuffer);
 		SysFree(pBSD);
 		if (iCloseSocket) {
@@ -155,6 +205,13 @@ static ssize_t BSckFetchData(BuffSocketData *pBSD, int iTimeout)
 {
 	ssize_t sRdBytes;
 
+	/*
+	 * We are about to wait for the peer, so whatever we have corked so far
+	 * needs to go out, since the peer might be waiting for it before
+	 * sending us more data.
+	 */
+	if (pBSD->sOutBytes > 0 && BSckFlushLL(pBSD) < 0)
+		return -1;
 	pBSD->sReadIndex = 0;
 	if ((sRdBytes = BSOCK_READ(pBSD, pBSD->pszBuffer, pBSD->iBufferSize,
 				   iTimeout)) <= 0) {
@@ -283,7 +340,7 @@ ssize_t BSckSendString(BSOCK_HANDLE hBSock, char const *pszBuffer, int iTimeout)
 
 	size_t sSendLength = strlen(pszSendBuffer);
 
-	if (BSckWriteLL(pBSD, pszSendBuffer, sSendLength, iTimeout) != sSendLength) {
+	if (BSckBuffWrite(pBSD, pszSendBuffer, sSendLength, iTimeout) != sSendLength) {
 		SysFree(pszSendBuffer);
 		return ErrGetErrorCode();
 	}
@@ -314,7 +371,7 @@ ssize_t BSckSendData(BSOCK_HANDLE hBSock, char const *pszBuffer, size_t sSize, i
 {
 	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
 
-	if (BSckWriteLL(pBSD, pszBuffer, sSize, iTimeout) != sSize)
+	if (BSckBuffWrite(pBSD, pszBuffer, sSize, iTimeout) != sSize)
 		return ErrGetErrorCode();
 
 	return sSize;
@@ -348,6 +405,9 @@ int BSckSendFile(BSOCK_HANDLE hBSock, char const *pszFilePath, SYS_OFF_T llBaseO
 {
 	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
 
+	if (pBSD->sOutBytes > 0 && BSckFlushLL(pBSD) < 0)
+		return ErrGetErrorCode();
+
 	return BSOCK_SENDFILE(pBSD, pszFilePath, llBaseOffset, llEndOffset, iTimeout);
 }
 
@@ -358,10 +418,63 @@ SYS_SOCKET BSckGetAttachedSocket(BSOCK_HANDLE hBSock)
 	return pBSD->SockFD;
 }
 
+int BSckCork(BSOCK_HANDLE hBSock, int iBufferSize)
+{
+	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
+
+	if (pBSD->pszOutBuffer == NULL) {
+		if ((pBSD->pszOutBuffer = (char *) SysAlloc(iBufferSize)) == NULL)
+			return ErrGetErrorCode();
+		pBSD->sOutBufferSize = iBufferSize;
+		pBSD->sOutBytes = 0;
+	}
+
+	return 0;
+}
+
+int BSckFlush(BSOCK_HANDLE hBSock, int iTimeout)
+{
+	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
+
+	pBSD->iOutTimeout = iTimeout;
+
+	return BSckFlushLL(pBSD);
+}
+
+int BSckUncork(BSOCK_HANDLE hBSock, int iTimeout)
+{
+	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
+	int iError = BSckFlush(hBSock, iTimeout);
+
+	SysFreeNullify(pBSD->pszOutBuffer);
+	pBSD->sOutBufferSize = 0;
+
+	return iError;
+}
+
+int BSckInputPending(BSOCK_HANDLE hBSock)
+{
+	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
+
+	/*
+	 * Data can be sitting either inside our own buffer, or inside the I/O
+	 * layer one (like SSL records already pulled from the socket).
+	 */
+	return pBSD->sBytesInBuffer > 0 || BSOCK_PENDING(pBSD) > 0;
+}
+
 int BSckSetIOops(BSOCK_HANDLE hBSock, BufSockIOOps const *pIOops)
 {
 	BuffSocketData *pBSD = (BuffSocketData *) hBSock;
 
+	/*
+	 * Whatever has been read with the old I/O layer cannot be trusted to
+	 * belong to the new one. With pipelining clients, this is what keeps
+	 * plain text commands sent after a STARTTLS from being executed inside
+	 * the TLS session.
+	 */
+	pBSD->sBytesInBuffer = 0;
+	pBSD->sReadIndex = 0;
 	pBSD->IOops = *pIOops;
 
 	return 0;
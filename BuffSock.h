@@ -43,6 +43,7 @@ struct BufSockIOOps {
 	ssize_t (*pRead)(void *, void *, size_t, int);
 	ssize_t (*pWrite)(void *, void const *, size_t, int);
 	int (*pSendFile)(void *, char const *, SYS_OFF_T, SYS_OFF_T, int);
+	int (*pPending)(void *);
 };
 
 BSOCK_HANDLE BSckAttach(SYS_SOCKET SockFD, int iBufferSize = STD_SOCK_BUFFER_SIZE);
@@ -60,6 +61,10 @@ ssize_t BSckReadData(BSOCK_HANDLE hBSock, char *pszBuffer, size_t sSize, int iTi
 int BSckSendFile(BSOCK_HANDLE hBSock, char const *pszFilePath, SYS_OFF_T llBaseOffset,
 		 SYS_OFF_T llEndOffset, int iTimeout);
 SYS_SOCKET BSckGetAttachedSocket(BSOCK_HANDLE hBSock);
+int BSckCork(BSOCK_HANDLE hBSock, int iBufferSize = STD_SOCK_BUFFER_SIZE);
+int BSckFlush(BSOCK_HANDLE hBSock, int iTimeout);
+int BSckUncork(BSOCK_HANDLE hBSock, int iTimeout);
+int BSckInputPending(BSOCK_HANDLE hBSock);
 int BSckSetIOops(BSOCK_HANDLE hBSock, BufSockIOOps const *pIOops);
 char const *BSckBioName(BSOCK_HANDLE hBSock);
 int BSckBufferInit(BSockLineBuffer *pBLB, ssize_t sSize = -1);
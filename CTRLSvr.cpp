@@ -48,6 +48,7 @@
 #include "MailConfig.h"
 #include "AppDefines.h"
 #include "MailSvr.h"
+#include "SMAILSvr.h"
 #include "CTRLSvr.h"
 
 #define CTRL_ACCOUNTS_FILE      "ctrlaccounts.tab"
@@ -1643,6 +1644,129 @@ static int CTRLDo_noop(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
 	return 0;
 }
 
+static int CTRLDo_sslstats(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
+			   char const *const *ppszTokens, int iTokensCount)
+{
+	if (iTokensCount != 1) {
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ERR_BAD_CTRL_COMMAND);
+		ErrSetErrorCode(ERR_BAD_CTRL_COMMAND);
+		return ERR_BAD_CTRL_COMMAND;
+	}
+
+	SslSessStats SStats;
+
+	if (BSslGetSessStats(&SStats) < 0) {
+		ErrorPush();
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ErrorFetch());
+		return ErrorPop();
+	}
+
+	CTRLSendCmdResult(pCTRLCfg, hBSock, CTRL_LISTFOLLOW_RESULT);
+
+	if (BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ServerSessionHits\"\t\"%lu\"",
+			    SStats.ulSvrHits) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ServerSessionMisses\"\t\"%lu\"",
+			    SStats.ulSvrMisses) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ClientSessionHits\"\t\"%lu\"",
+			    SStats.ulCliHits) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ClientSessionMisses\"\t\"%lu\"",
+			    SStats.ulCliMisses) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ClientSessionsCached\"\t\"%lu\"",
+			    SStats.ulCliCached) < 0)
+		return ErrGetErrorCode();
+
+	BSckSendString(hBSock, ".", pCTRLCfg->iTimeout);
+
+	return 0;
+}
+
+static int CTRLDo_smailstats(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
+			     char const *const *ppszTokens, int iTokensCount)
+{
+	if (iTokensCount != 1) {
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ERR_BAD_CTRL_COMMAND);
+		ErrSetErrorCode(ERR_BAD_CTRL_COMMAND);
+		return ERR_BAD_CTRL_COMMAND;
+	}
+
+	int iReadyCount;
+	time_t tOldestReady;
+
+	if (QueGetReadyStats(hSpoolQueue, &iReadyCount, &tOldestReady) < 0) {
+		ErrorPush();
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ErrorFetch());
+		return ErrorPop();
+	}
+
+	SMAILConfig *pSMAILCfg = (SMAILConfig *) ShbLock(hShbSMAIL);
+
+	if (pSMAILCfg == NULL) {
+		ErrorPush();
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ErrorFetch());
+		return ErrorPop();
+	}
+
+	SMAILConfig SMAILCfg = *pSMAILCfg;
+
+	ShbUnlock(hShbSMAIL);
+
+	CTRLSendCmdResult(pCTRLCfg, hBSock, CTRL_LISTFOLLOW_RESULT);
+
+	if (BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ThreadCount\"\t\"%ld\"",
+			    SMAILCfg.lThreadCount) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"MinThreads\"\t\"%ld\"",
+			    SMAILCfg.lMinThreads) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"MaxThreads\"\t\"%ld\"",
+			    SMAILCfg.lMaxThreads) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"BusyThreads\"\t\"%ld\"",
+			    SMAILCfg.lBusyThreads) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"NetworkThreads\"\t\"%ld\"",
+			    SMAILCfg.lNetThreads) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"ReadyMessages\"\t\"%d\"",
+			    iReadyCount) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"OldestReadyAge\"\t\"%ld\"",
+			    (long) (time(NULL) - tOldestReady)) < 0)
+		return ErrGetErrorCode();
+
+	BSckSendString(hBSock, ".", pCTRLCfg->iTimeout);
+
+	return 0;
+}
+
+static int CTRLDo_lockstats(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
+			    char const *const *ppszTokens, int iTokensCount)
+{
+	if (iTokensCount != 1) {
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ERR_BAD_CTRL_COMMAND);
+		ErrSetErrorCode(ERR_BAD_CTRL_COMMAND);
+		return ERR_BAD_CTRL_COMMAND;
+	}
+
+	RLckStats RLS;
+
+	if (RLckGetStats(&RLS) < 0) {
+		ErrorPush();
+		CTRLSendCmdResult(pCTRLCfg, hBSock, ErrorFetch());
+		return ErrorPop();
+	}
+
+	CTRLSendCmdResult(pCTRLCfg, hBSock, CTRL_LISTFOLLOW_RESULT);
+
+	if (BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"Locks\"\t\"" SYS_LLU_FMT "\"",
+			    RLS.ullLocks) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"Waits\"\t\"" SYS_LLU_FMT "\"",
+			    RLS.ullWaits) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"WaitTime\"\t\"" SYS_LLU_FMT "\"",
+			    RLS.ullWaitTime) < 0 ||
+	    BSckVSendString(hBSock, pCTRLCfg->iTimeout, "\"MaxWait\"\t\"" SYS_LLU_FMT "\"",
+			    (SYS_UINT64) RLS.llMaxWait) < 0)
+		return ErrGetErrorCode();
+
+	BSckSendString(hBSock, ".", pCTRLCfg->iTimeout);
+
+	return 0;
+}
+
 static int CTRLDo_quit(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
 		       char const *const *ppszTokens, int iTokensCount)
 {
@@ -2018,6 +2142,9 @@ static int CTRLDo_cfgfileset(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock,
 
 	RLckUnlockEX(hResLock);
 
+	/* Do not let a same-second, same-size update hide behind the cache */
+	SvrInvalidateConfigCache();
+
 	CTRLSendCmdResult(pCTRLCfg, hBSock, 0);
 
 	SysRemove(szClientFile);
@@ -2426,6 +2553,12 @@ static int CTRLProcessCommand(CTRLConfig *pCTRLCfg, BSOCK_HANDLE hBSock, char co
 		iCmdResult = CTRLDo_aliasdomainlist(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
 	else if (stricmp(ppszTokens[0], "etrn") == 0)
 		iCmdResult = CTRLDo_etrn(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
+	else if (stricmp(ppszTokens[0], "sslstats") == 0)
+		iCmdResult = CTRLDo_sslstats(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
+	else if (stricmp(ppszTokens[0], "smailstats") == 0)
+		iCmdResult = CTRLDo_smailstats(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
+	else if (stricmp(ppszTokens[0], "lockstats") == 0)
+		iCmdResult = CTRLDo_lockstats(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
 	else if (stricmp(ppszTokens[0], "noop") == 0)
 		iCmdResult = CTRLDo_noop(pCTRLCfg, hBSock, ppszTokens, iTokensCount);
 	else if (stricmp(ppszTokens[0], "quit") == 0)
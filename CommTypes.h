@@ -28,6 +28,8 @@ struct FileSection {
 	char szFilePath[SYS_MAX_PATH];
 	SYS_OFF_T llStartOffset;
 	SYS_OFF_T llEndOffset;
+	/* File whose whole content follows the section (if not empty) */
+	char szTailFilePath[SYS_MAX_PATH];
 };
 
 struct Datum {
@@ -0,0 +1,311 @@
+/*
+ *  XMail by Davide Libenzi (Intranet and Internet mail server)
+ *  Copyright (C) 1999,..,2010  Davide Libenzi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#include "SysInclude.h"
+#include "SysDep.h"
+#include "SvrDefines.h"
+#include "ShBlocks.h"
+#include "MessQueue.h"
+#include "ThreadPool.h"
+#include "ConnEngine.h"
+#include "AppDefines.h"
+#include "MailSvr.h"
+
+#define CENG_MAX_REACTORS       32
+#define CENG_WAIT_TIMEOUT       1000
+#define CENG_MAX_EVENTS         128
+#define CENG_POOL_MIN_THREADS   2
+#define CENG_POOL_MAX_THREADS   1024
+
+struct CEngEntry {
+	SysListHead LLink;
+	SYS_SOCKET SockFD;
+	SYS_INT64 tExpire;
+	int iEvent;
+	int (*pfResume)(void *, int);
+	void *pPrivate;
+};
+
+struct CEngReactor {
+	SYS_MUTEX hMutex;
+	SYS_HANDLE hIOPoll;
+	SYS_THREAD hThread;
+	SysListHead ParkList;
+	int iStopped;
+};
+
+static THPOOL_HANDLE hCEngPool = INVALID_THPOOL_HANDLE;
+static int iNumCEngReactors;
+static CEngReactor CEngReactors[CENG_MAX_REACTORS];
+static int volatile iStopCEng;
+
+static unsigned int CEngResumeThread(void *pThreadData)
+{
+	CEngEntry *pCE = (CEngEntry *) pThreadData;
+	int (*pfResume)(void *, int) = pCE->pfResume;
+	void *pPrivate = pCE->pPrivate;
+	int iEvent = pCE->iEvent;
+
+	SysFree(pCE);
+
+	return (unsigned int) (*pfResume)(pPrivate, iEvent);
+}
+
+static void CEngDispatch(SysListHead *pHead)
+{
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_FIRST(pHead)) != NULL) {
+		CEngEntry *pCE = SYS_LIST_ENTRY(pLLink, CEngEntry, LLink);
+
+		SYS_LIST_DEL(pLLink);
+		if (ThpQueue(hCEngPool, CEngResumeThread, pCE) < 0) {
+			/*
+			 * We cannot afford to run a full session inside the reactor
+			 * thread, so let the owner know it has to tear down.
+			 */
+			pCE->iEvent = CENG_EV_ERROR;
+			CEngResumeThread(pCE);
+		}
+	}
+}
+
+static void CEngPark__Unlink(CEngReactor *pRct, CEngEntry *pCE, int iEvent,
+			     SysListHead *pDispList)
+{
+	SYS_LIST_DEL(&pCE->LLink);
+	SysIOPollDel(pRct->hIOPoll, pCE->SockFD);
+	pCE->iEvent = iEvent;
+	SYS_LIST_ADDT(&pCE->LLink, pDispList);
+}
+
+static unsigned int CEngReactorThread(void *pThreadData)
+{
+	CEngReactor *pRct = (CEngReactor *) pThreadData;
+	int i, iNumReady;
+	SYS_INT64 tNow;
+	SysListHead *pLLink;
+	SysListHead DispList;
+	void *ReadyEnts[CENG_MAX_EVENTS];
+
+	SYS_INIT_LIST_HEAD(&DispList);
+	while (!iStopCEng && !SvrInShutdown()) {
+		iNumReady = SysIOPollWait(pRct->hIOPoll, ReadyEnts, CountOf(ReadyEnts),
+					  CENG_WAIT_TIMEOUT);
+		if (iNumReady < 0 && iNumReady != ERR_TIMEOUT)
+			SysMsSleep(CENG_WAIT_TIMEOUT);
+
+		SysLockMutex(pRct->hMutex, SYS_INFINITE_TIMEOUT);
+		for (i = 0; i < iNumReady; i++)
+			CEngPark__Unlink(pRct, (CEngEntry *) ReadyEnts[i], CENG_EV_READ,
+					 &DispList);
+
+		/*
+		 * The park list is sorted by expire time, so we can stop at the
+		 * first entry which is still within its session timeout.
+		 */
+		tNow = SysMsTime();
+		while ((pLLink = SYS_LIST_FIRST(&pRct->ParkList)) != NULL) {
+			CEngEntry *pCE = SYS_LIST_ENTRY(pLLink, CEngEntry, LLink);
+
+			if (pCE->tExpire > tNow)
+				break;
+			CEngPark__Unlink(pRct, pCE, CENG_EV_TIMEOUT, &DispList);
+		}
+		SysUnlockMutex(pRct->hMutex);
+
+		CEngDispatch(&DispList);
+	}
+
+	/*
+	 * Give back all the parked sessions, so that they can release their
+	 * thread count slots and let the service threads complete the shutdown.
+	 */
+	SysLockMutex(pRct->hMutex, SYS_INFINITE_TIMEOUT);
+	pRct->iStopped++;
+	while ((pLLink = SYS_LIST_FIRST(&pRct->ParkList)) != NULL)
+		CEngPark__Unlink(pRct, SYS_LIST_ENTRY(pLLink, CEngEntry, LLink),
+				 CENG_EV_SHUTDOWN, &DispList);
+	SysUnlockMutex(pRct->hMutex);
+
+	CEngDispatch(&DispList);
+
+	return 0;
+}
+
+static void CEngFreeReactor(CEngReactor *pRct)
+{
+	SysCloseIOPoll(pRct->hIOPoll);
+	SysCloseMutex(pRct->hMutex);
+}
+
+int CEngInit(int iNumReactors, int iIdleTimeout)
+{
+	int i;
+
+	iNumReactors = Min(iNumReactors, CENG_MAX_REACTORS);
+	iStopCEng = 0;
+	for (i = 0; i < iNumReactors; i++) {
+		CEngReactor *pRct = &CEngReactors[i];
+
+		ZeroData(*pRct);
+		pRct->hThread = SYS_INVALID_THREAD;
+		SYS_INIT_LIST_HEAD(&pRct->ParkList);
+		if ((pRct->hIOPoll = SysCreateIOPoll()) == SYS_INVALID_HANDLE) {
+			/*
+			 * Platforms w/out a scalable readiness API simply keep
+			 * running with the thread-per-connection model.
+			 */
+			if (ErrGetErrorCode() == ERR_NOT_SUPPORTED) {
+				SysLogMessage(LOG_LEV_MESSAGE,
+					      "Connection engine not supported on this platform\n");
+				break;
+			}
+			ErrorPush();
+			for (; i > 0; i--)
+				CEngFreeReactor(&CEngReactors[i - 1]);
+			return ErrorPop();
+		}
+		if ((pRct->hMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+			ErrorPush();
+			SysCloseIOPoll(pRct->hIOPoll);
+			for (; i > 0; i--)
+				CEngFreeReactor(&CEngReactors[i - 1]);
+			return ErrorPop();
+		}
+	}
+	if ((iNumCEngReactors = i) == 0)
+		return 0;
+
+	/*
+	 * Resumed sessions are run by a pool of worker threads, instead of
+	 * paying a thread creation each time a client sends a command.
+	 */
+	if ((hCEngPool = ThpCreate(CENG_POOL_MIN_THREADS, CENG_POOL_MAX_THREADS,
+				   iIdleTimeout)) == INVALID_THPOOL_HANDLE) {
+		ErrorPush();
+		for (; i > 0; i--)
+			CEngFreeReactor(&CEngReactors[i - 1]);
+		iNumCEngReactors = 0;
+		return ErrorPop();
+	}
+	for (i = 0; i < iNumCEngReactors; i++) {
+		CEngReactor *pRct = &CEngReactors[i];
+
+		if ((pRct->hThread = SysCreateThread(CEngReactorThread,
+						     pRct)) == SYS_INVALID_THREAD) {
+			ErrorPush();
+			CEngCleanup();
+			return ErrorPop();
+		}
+	}
+
+	return 0;
+}
+
+void CEngCleanup(void)
+{
+	int i;
+
+	iStopCEng++;
+	for (i = 0; i < iNumCEngReactors; i++) {
+		CEngReactor *pRct = &CEngReactors[i];
+
+		if (pRct->hThread != SYS_INVALID_THREAD) {
+			SysWaitThread(pRct->hThread, SYS_INFINITE_TIMEOUT);
+			SysCloseThread(pRct->hThread, 0);
+		}
+		CEngFreeReactor(pRct);
+	}
+	iNumCEngReactors = 0;
+	if (hCEngPool != INVALID_THPOOL_HANDLE) {
+		ThpClose(hCEngPool);
+		hCEngPool = INVALID_THPOOL_HANDLE;
+	}
+}
+
+int CEngEnabled(void)
+{
+	return iNumCEngReactors > 0;
+}
+
+int CEngPark(SYS_SOCKET SockFD, int iTimeout, int (*pfResume)(void *, int),
+	     void *pPrivate)
+{
+	CEngReactor *pRct;
+	CEngEntry *pCE;
+	SysListHead *pLLink;
+
+	if (iNumCEngReactors == 0) {
+		ErrSetErrorCode(ERR_NOT_SUPPORTED);
+		return ERR_NOT_SUPPORTED;
+	}
+	if ((pCE = (CEngEntry *) SysAlloc(sizeof(CEngEntry))) == NULL)
+		return ErrGetErrorCode();
+	pCE->SockFD = SockFD;
+	pCE->tExpire = SysMsTime() + iTimeout;
+	pCE->iEvent = 0;
+	pCE->pfResume = pfResume;
+	pCE->pPrivate = pPrivate;
+
+	pRct = &CEngReactors[(unsigned long) SockFD % iNumCEngReactors];
+	if (SysLockMutex(pRct->hMutex, SYS_INFINITE_TIMEOUT) < 0) {
+		ErrorPush();
+		SysFree(pCE);
+		return ErrorPop();
+	}
+	if (pRct->iStopped) {
+		SysUnlockMutex(pRct->hMutex);
+		SysFree(pCE);
+		ErrSetErrorCode(ERR_SERVER_SHUTDOWN);
+		return ERR_SERVER_SHUTDOWN;
+	}
+
+	/*
+	 * Session timeouts are mostly the same, so walking from the tail
+	 * finds the insertion point in a few steps.
+	 */
+	for (pLLink = SYS_LIST_LAST(&pRct->ParkList); pLLink != NULL;
+	     pLLink = SYS_LIST_PREV(pLLink, &pRct->ParkList))
+		if (SYS_LIST_ENTRY(pLLink, CEngEntry, LLink)->tExpire <= pCE->tExpire)
+			break;
+	if (pLLink != NULL)
+		SYS_LIST_ADDH(&pCE->LLink, pLLink);
+	else
+		SYS_LIST_ADDH(&pCE->LLink, &pRct->ParkList);
+
+	/*
+	 * The socket is added while holding the reactor lock, so an event
+	 * firing right away will find the entry fully linked.
+	 */
+	if (SysIOPollAdd(pRct->hIOPoll, SockFD, pCE) < 0) {
+		ErrorPush();
+		SYS_LIST_DEL(&pCE->LLink);
+		SysUnlockMutex(pRct->hMutex);
+		SysFree(pCE);
+		return ErrorPop();
+	}
+	SysUnlockMutex(pRct->hMutex);
+
+	return 0;
+}
+
@@ -0,0 +1,38 @@
+/*
+ *  XMail by Davide Libenzi (Intranet and Internet mail server)
+ *  Copyright (C) 1999,..,2010  Davide Libenzi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#ifndef _CONNENGINE_H
+#define _CONNENGINE_H
+
+#define CENG_EV_READ            1
+#define CENG_EV_TIMEOUT         2
+#define CENG_EV_SHUTDOWN        3
+#define CENG_EV_ERROR           4
+
+int CEngInit(int iNumReactors, int iIdleTimeout);
+void CEngCleanup(void);
+int CEngEnabled(void);
+int CEngPark(SYS_SOCKET SockFD, int iTimeout, int (*pfResume)(void *, int),
+	     void *pPrivate);
+
+#endif
+
@@ -306,6 +306,12 @@ static ErrorStrings Errors[] = {
 	{ ERR_GET_RAND_BYTES, "Failed to retrieve entropy bytes" },
 	{ ERR_WAIT, "Failed to wait for event" },
 	{ ERR_EVENTFD, "Failed to create for eventfd" },
+	{ ERR_NOT_SUPPORTED, "Operation not supported on this platform" },
+	{ ERR_IOPOLL, "I/O poll set error" },
+	{ ERR_SET_THREAD_AFFINITY, "Error setting thread CPU affinity" },
+	{ ERR_FILE_LINK, "Unable to link file" },
+	{ ERR_SMTP_HOST_DOWN, "Remote SMTP server recently unreachable" },
+	{ ERR_INDEX_COMPACT, "Table index needs compaction" },
 
 };
 
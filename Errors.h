@@ -832,6 +832,24 @@ enum XMailErrors {
 	__ERR_TOO_BIG,
 #define ERR_TOO_BIG (-__ERR_TOO_BIG)
 
+	__ERR_NOT_SUPPORTED,
+#define ERR_NOT_SUPPORTED (-__ERR_NOT_SUPPORTED)
+
+	__ERR_IOPOLL,
+#define ERR_IOPOLL (-__ERR_IOPOLL)
+
+	__ERR_SET_THREAD_AFFINITY,
+#define ERR_SET_THREAD_AFFINITY (-__ERR_SET_THREAD_AFFINITY)
+
+	__ERR_FILE_LINK,
+#define ERR_FILE_LINK (-__ERR_FILE_LINK)
+
+	__ERR_SMTP_HOST_DOWN,
+#define ERR_SMTP_HOST_DOWN (-__ERR_SMTP_HOST_DOWN)
+
+	__ERR_INDEX_COMPACT,
+#define ERR_INDEX_COMPACT (-__ERR_INDEX_COMPACT)
+
 	ERROR_COUNT
 };
 
@@ -90,6 +90,17 @@ static int ExAlRebuildAliasIndexes(char const *pszAliasFilePath)
 	return 0;
 }
 
+static int ExAlAppendAliasIndexes(char const *pszAliasFilePath, SYS_OFF_T llRecOffset,
+				  time_t tTabMod)
+{
+	/* Add the new record to the RmtDomain-RmtName index */
+	if (TbixAppendRecord(pszAliasFilePath, iIdxExAlias_RmtDomain_RmtName, false,
+			     llRecOffset, tTabMod) < 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
 static ExtAlias *ExAlGetAliasFromStrings(char **ppszStrings)
 {
 	int iFieldsCount = StrStringsCount(ppszStrings);
@@ -179,6 +190,19 @@ static int ExAlWriteAlias(FILE * pAliasFile, ExtAlias * pExtAlias)
 	return 0;
 }
 
+static int ExAlAliasExistLK(char const *pszAliasFilePath, char const *pszRmtDomain,
+			    char const *pszRmtName)
+{
+	char **ppszTabTokens = TbixLookup(pszAliasFilePath, iIdxExAlias_RmtDomain_RmtName, false,
+					  pszRmtDomain, pszRmtName, NULL);
+
+	if (ppszTabTokens == NULL)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+	StrFreeStrings(ppszTabTokens);
+
+	return 1;
+}
+
 int ExAlAddAlias(ExtAlias * pExtAlias)
 {
 	char szAliasFilePath[SYS_MAX_PATH] = "";
@@ -192,38 +216,41 @@ int ExAlAddAlias(ExtAlias * pExtAlias)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pAliasFile = fopen(szAliasFilePath, "r+t");
+	int iExist = ExAlAliasExistLK(szAliasFilePath, pExtAlias->pszRmtDomain,
+				      pExtAlias->pszRmtName);
 
-	if (pAliasFile == NULL) {
+	/* A lookup failing for other reasons than a missing record means a broken index */
+	if (iExist < 0 && ExAlRebuildAliasIndexes(szAliasFilePath) == 0)
+		iExist = ExAlAliasExistLK(szAliasFilePath, pExtAlias->pszRmtDomain,
+					  pExtAlias->pszRmtName);
+
+	if (iExist != 0) {
 		RLckUnlockEX(hResLock);
+		if (iExist < 0)
+			return iExist;
 
-		ErrSetErrorCode(ERR_EXTALIAS_FILE_NOT_FOUND);
-		return ERR_EXTALIAS_FILE_NOT_FOUND;
+		ErrSetErrorCode(ERR_EXTALIAS_EXIST);
+		return ERR_EXTALIAS_EXIST;
 	}
 
-	char szAliasLine[ALIAS_TABLE_LINE_MAX] = "";
+	/* The index is later checked against the table as it is before our write */
+	SYS_FILE_INFO TabFI;
 
-	while (MscFGets(szAliasLine, sizeof(szAliasLine) - 1, pAliasFile) != NULL) {
-		char **ppszStrings = StrGetTabLineStrings(szAliasLine);
+	if (SysGetFileInfo(szAliasFilePath, TabFI) < 0)
+		TabFI.tMod = 0;
 
-		if (ppszStrings == NULL)
-			continue;
-
-		int iFieldsCount = StrStringsCount(ppszStrings);
+	FILE *pAliasFile = fopen(szAliasFilePath, "r+t");
 
-		if (iFieldsCount >= ealMax &&
-		    stricmp(pExtAlias->pszRmtDomain, ppszStrings[ealRmtDomain]) == 0 &&
-		    stricmp(pExtAlias->pszRmtName, ppszStrings[ealRmtName]) == 0) {
-			StrFreeStrings(ppszStrings);
-			fclose(pAliasFile);
-			RLckUnlockEX(hResLock);
+	if (pAliasFile == NULL) {
+		RLckUnlockEX(hResLock);
 
-			ErrSetErrorCode(ERR_EXTALIAS_EXIST);
-			return ERR_EXTALIAS_EXIST;
-		}
-		StrFreeStrings(ppszStrings);
+		ErrSetErrorCode(ERR_EXTALIAS_FILE_NOT_FOUND);
+		return ERR_EXTALIAS_FILE_NOT_FOUND;
 	}
 	fseek(pAliasFile, 0, SEEK_END);
+
+	SYS_OFF_T llRecOffset = Sys_ftell(pAliasFile);
+
 	if (ExAlWriteAlias(pAliasFile, pExtAlias) < 0) {
 		fclose(pAliasFile);
 		RLckUnlockEX(hResLock);
@@ -233,8 +260,8 @@ int ExAlAddAlias(ExtAlias * pExtAlias)
 	}
 	fclose(pAliasFile);
 
-	/* Rebuild indexes */
-	if (ExAlRebuildAliasIndexes(szAliasFilePath) < 0) {
+	/* Update indexes */
+	if (ExAlAppendAliasIndexes(szAliasFilePath, llRecOffset, TabFI.tMod) < 0) {
 		ErrorPush();
 		RLckUnlockEX(hResLock);
 		return ErrorPop();
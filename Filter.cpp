@@ -394,6 +394,9 @@ static char *FilMacroLkupProc(void *pPrivate, char const *pszName, size_t sSize)
 
 		return SysStrDup(pFMS->pFMI->szRecipient);
 	} else if (MemMatch(pszName, sSize, "FILE", 4)) {
+		/* External programs get the whole message inside the spool file */
+		if (USmlAttachMsgBody(pFMS->hFSpool) < 0)
+			return NULL;
 
 		return SysStrDup(pFMS->FSect.szFilePath);
 	} else if (MemMatch(pszName, sSize, "MSGID", 5)) {
@@ -35,6 +35,7 @@
 #include "UsrUtils.h"
 #include "SMTPUtils.h"
 #include "SMAILUtils.h"
+#include "QueueUtils.h"
 #include "ExtAliases.h"
 #include "UsrMailList.h"
 #include "MailConfig.h"
@@ -323,6 +324,12 @@ static int LMAILSubmitLocalFile(LMAILConfig *pLMAILCfg, const char *pszMailFile,
 			fclose(pMailFile);
 			return ErrorPop();
 		}
+		if (QueUtSetMessageDomain(hMessage, szSpoolLine) < 0) {
+			ErrorPush();
+			QueCloseMessage(hSpoolQueue, hMessage);
+			fclose(pMailFile);
+			return ErrorPop();
+		}
 
 		char szQueueFilePath[SYS_MAX_PATH];
 
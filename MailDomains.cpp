@@ -89,6 +89,17 @@ static int MDomRebuildDomainsIndexes(char const *pszDomainsFilePath)
 	return 0;
 }
 
+static int MDomAppendDomainsIndexes(char const *pszDomainsFilePath, SYS_OFF_T llRecOffset,
+				    time_t tTabMod)
+{
+	/* Add the new record to the Domain index */
+	if (TbixAppendRecord(pszDomainsFilePath, iIdxDomains_Domain, false, llRecOffset,
+			     tTabMod) < 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
 char *MDomGetDomainPath(char const *pszDomain, char *pszDomainPath, size_t sMaxPath, int iFinalSlash)
 {
 	/* Make the domain lower-case */
@@ -148,6 +159,19 @@ int MDomLookupDomain(char const *pszDomain)
 	return 0;
 }
 
+static int MDomDomainExistLK(char const *pszDomainsFilePath, char const *pszDomain)
+{
+	char **ppszTabTokens = TbixLookup(pszDomainsFilePath, iIdxDomains_Domain, false,
+					  pszDomain,
+					  NULL);
+
+	if (ppszTabTokens == NULL)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+	StrFreeStrings(ppszTabTokens);
+
+	return 1;
+}
+
 int MDomAddDomain(char const *pszDomain)
 {
 	char szDomainsFilePath[SYS_MAX_PATH] = "";
@@ -161,43 +185,45 @@ int MDomAddDomain(char const *pszDomain)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pDomainsFile = fopen(szDomainsFilePath, "r+t");
+	int iExist = MDomDomainExistLK(szDomainsFilePath, pszDomain);
 
-	if (pDomainsFile == NULL) {
+	/* A lookup failing for other reasons than a missing record means a broken index */
+	if (iExist < 0 && MDomRebuildDomainsIndexes(szDomainsFilePath) == 0)
+		iExist = MDomDomainExistLK(szDomainsFilePath, pszDomain);
+
+	if (iExist != 0) {
 		RLckUnlockEX(hResLock);
+		if (iExist < 0)
+			return iExist;
 
-		ErrSetErrorCode(ERR_ALIAS_FILE_NOT_FOUND);
-		return ERR_ALIAS_FILE_NOT_FOUND;
+		ErrSetErrorCode(ERR_DOMAIN_ALREADY_HANDLED);
+		return ERR_DOMAIN_ALREADY_HANDLED;
 	}
 
-	char szDomainsLine[MAIL_DOMAINS_LINE_MAX] = "";
+	/* The index is later checked against the table as it is before our write */
+	SYS_FILE_INFO TabFI;
 
-	while (MscFGets(szDomainsLine, sizeof(szDomainsLine) - 1, pDomainsFile) != NULL) {
-		char **ppszStrings = StrGetTabLineStrings(szDomainsLine);
+	if (SysGetFileInfo(szDomainsFilePath, TabFI) < 0)
+		TabFI.tMod = 0;
 
-		if (ppszStrings == NULL)
-			continue;
-
-		int iFieldsCount = StrStringsCount(ppszStrings);
+	FILE *pDomainsFile = fopen(szDomainsFilePath, "r+t");
 
-		if ((iFieldsCount >= domMax) && (stricmp(pszDomain, ppszStrings[domDomain]) == 0)) {
-			StrFreeStrings(ppszStrings);
-			fclose(pDomainsFile);
-			RLckUnlockEX(hResLock);
+	if (pDomainsFile == NULL) {
+		RLckUnlockEX(hResLock);
 
-			ErrSetErrorCode(ERR_DOMAIN_ALREADY_HANDLED);
-			return ERR_DOMAIN_ALREADY_HANDLED;
-		}
-		StrFreeStrings(ppszStrings);
+		ErrSetErrorCode(ERR_ALIAS_FILE_NOT_FOUND);
+		return ERR_ALIAS_FILE_NOT_FOUND;
 	}
 	fseek(pDomainsFile, 0, SEEK_END);
 
+	SYS_OFF_T llRecOffset = Sys_ftell(pDomainsFile);
+
 	fprintf(pDomainsFile, "\"%s\"\n", pszDomain);
 
 	fclose(pDomainsFile);
 
-	/* Rebuild indexes */
-	if (MDomRebuildDomainsIndexes(szDomainsFilePath) < 0) {
+	/* Update indexes */
+	if (MDomAppendDomainsIndexes(szDomainsFilePath, llRecOffset, TabFI.tMod) < 0) {
 		ErrorPush();
 		RLckUnlockEX(hResLock);
 		return ErrorPop();
@@ -31,6 +31,7 @@
 #include "MiscUtils.h"
 #include "SSLBind.h"
 #include "ResLocks.h"
+#include "TabIndex.h"
 #include "POP3Svr.h"
 #include "SMTPSvr.h"
 #include "SMAILSvr.h"
@@ -42,6 +43,7 @@
 #include "MessQueue.h"
 #include "SMAILUtils.h"
 #include "QueueUtils.h"
+#include "SMTPUtils.h"
 #include "ExtAliases.h"
 #include "AliasDomain.h"
 #include "MailDomains.h"
@@ -49,6 +51,7 @@
 #include "CTRLSvr.h"
 #include "FINGSvr.h"
 #include "LMAILSvr.h"
+#include "ConnEngine.h"
 #include "AppDefines.h"
 #include "MailSvr.h"
 
@@ -57,6 +60,9 @@
 #define SVR_SHUTDOWN_FILE           ".shutdown"
 #define STD_SMAIL_THREADS           16
 #define MAX_SMAIL_THREADS           256
+#define SMAIL_POOL_CHECK_WAIT       1
+#define SMAIL_POOL_GROW_AGE         2
+#define SMAIL_POOL_IDLE_WAIT        30
 #define STD_SMAIL_RETRY_TIMEOUT     480
 #define STD_SMAIL_RETRY_INCR_RATIO  16
 #define STD_SMAIL_MAX_RETRY         32
@@ -80,6 +86,11 @@
 #define STD_POP3AUTH_EXPIRE_TIME    (15 * 60)
 #define FILTER_TIMEOUT              90000
 #define SVR_MAX_SERVICES            32
+#define STD_CENG_REACTORS           1
+#define STD_POOL_MIN_THREADS        2
+#define STD_POOL_IDLE_TIMEOUT       60
+#define POOL_SPARE_THREADS          4
+#define MAX_FING_THREADS            64
 
 
 enum SvrServices {
@@ -131,9 +142,12 @@ int iMailboxType = XMAIL_MAILBOX;
 /* Local visible variabiles */
 static int iNumShCtxs;
 static SvrShutdownCtx ShCtxs[SVR_MAX_SERVICES];
+static int iPoolIdleTimeout = STD_POOL_IDLE_TIMEOUT * 1000;
+static bool bPinAcceptors = false;
 static char szShutdownFile[SYS_MAX_PATH];
 static bool bServerShutdown = false;
 static int iNumSMAILThreads;
+static int iMaxSMAILThreads;
 static int iNumLMAILThreads;
 static SYS_THREAD hCTRLThread;
 static ThreadConfig ThCfgCTRL;
@@ -150,6 +164,7 @@ static ThreadConfig ThCfgSMTP;
 static SYS_THREAD hSMTPSThread;
 static ThreadConfig ThCfgSMTPS;
 static SYS_THREAD hSMAILThreads[MAX_SMAIL_THREADS];
+static SYS_THREAD hSMAILPoolThread;
 static SYS_THREAD hLMAILThreads[MAX_LMAIL_THREADS];
 static SYS_THREAD hPSYNCThread;
 
@@ -254,6 +269,7 @@ static int SvrSetupCTRL(int iArgCount, char *pszArgs[])
 	int iPort = STD_CTRL_PORT, iDisable = 0, iFamily = AF_INET;
 	int iSessionTimeout = CTRL_SERVER_SESSION_TIMEOUT;
 	long lMaxThreads = MAX_CTRL_THREADS;
+	int iMinThreads = STD_POOL_MIN_THREADS, iNumAcceptors = 1;
 	unsigned long ulFlags = 0;
 
 	/*
@@ -298,6 +314,16 @@ static int SvrSetupCTRL(int iArgCount, char *pszArgs[])
 				lMaxThreads = atol(pszArgs[i]);
 			break;
 
+		case 'a':
+			if (++i < iArgCount)
+				iNumAcceptors = atoi(pszArgs[i]);
+			break;
+
+		case 'm':
+			if (++i < iArgCount)
+				iMinThreads = atoi(pszArgs[i]);
+			break;
+
 		case '-':
 			iDisable++;
 			break;
@@ -308,6 +334,13 @@ static int SvrSetupCTRL(int iArgCount, char *pszArgs[])
 		}
 	}
 
+	ThCfgCTRL.iMinThreads = iMinThreads;
+	ThCfgCTRL.iMaxThreads = (int) lMaxThreads + POOL_SPARE_THREADS;
+	ThCfgCTRL.iIdleTimeout = iPoolIdleTimeout;
+	ThCfgCTRL.iNumAcceptors = iNumAcceptors;
+	if (bPinAcceptors)
+		ThCfgCTRL.ulFlags |= THCF_PIN_ACCEPTORS;
+
 	if ((hShbCTRL = ShbCreateBlock(sizeof(CTRLConfig))) == SHB_INVALID_HANDLE)
 		return ErrGetErrorCode();
 
@@ -331,7 +364,7 @@ static int SvrSetupCTRL(int iArgCount, char *pszArgs[])
 
 	if (MscCreateServerSockets(ThCfgCTRL.iNumAddr, ThCfgCTRL.SvrAddr, iFamily,
 				   iPort, CTRL_LISTEN_SIZE, ThCfgCTRL.SockFDs,
-				   ThCfgCTRL.iNumSockFDs) < 0) {
+				   ThCfgCTRL.iNumSockFDs, &ThCfgCTRL.iNumAcceptors) < 0) {
 		ShbCloseBlock(hShbCTRL);
 		return ErrGetErrorCode();
 	}
@@ -367,8 +400,12 @@ static int SvrSetupCTRLS(int iArgCount, char *pszArgs[])
 	ThCfgCTRLS.pszName = CTRLS_SERVER_NAME;
 	ThCfgCTRLS.pfThreadProc = CTRLClientThread;
 	ThCfgCTRLS.pfThreadCnt = SvrThreadCntCTRL;
-	ThCfgCTRLS.ulFlags = THCF_USE_SSL;
+	ThCfgCTRLS.ulFlags = THCF_USE_SSL | (ThCfgCTRL.ulFlags & THCF_PIN_ACCEPTORS);
 	ThCfgCTRLS.hThShb = hShbCTRL;
+	ThCfgCTRLS.iMinThreads = ThCfgCTRL.iMinThreads;
+	ThCfgCTRLS.iMaxThreads = ThCfgCTRL.iMaxThreads;
+	ThCfgCTRLS.iIdleTimeout = ThCfgCTRL.iIdleTimeout;
+	ThCfgCTRLS.iNumAcceptors = ThCfgCTRL.iNumAcceptors;
 	for (int i = 0; i < iArgCount; i++) {
 		if (pszArgs[i][0] != '-' || pszArgs[i][1] != 'W')
 			continue;
@@ -397,7 +434,7 @@ static int SvrSetupCTRLS(int iArgCount, char *pszArgs[])
 	}
 	if (MscCreateServerSockets(ThCfgCTRLS.iNumAddr, ThCfgCTRLS.SvrAddr, iFamily,
 				   iPort, CTRL_LISTEN_SIZE, ThCfgCTRLS.SockFDs,
-				   ThCfgCTRLS.iNumSockFDs) < 0)
+				   ThCfgCTRLS.iNumSockFDs, &ThCfgCTRLS.iNumAcceptors) < 0)
 		return ErrGetErrorCode();
 	if ((hCTRLSThread = SysCreateThread(MscServiceThread,
 					    &ThCfgCTRLS)) == SYS_INVALID_THREAD) {
@@ -451,6 +488,7 @@ static void SvrCleanupFING(void)
 static int SvrSetupFING(int iArgCount, char *pszArgs[])
 {
 	int iPort = STD_FINGER_PORT, iDisable = 0, iFamily = AF_INET;
+	int iMinThreads = STD_POOL_MIN_THREADS, iNumAcceptors = 1;
 	unsigned long ulFlags = 0;
 
 	/*
@@ -485,6 +523,16 @@ static int SvrSetupFING(int iArgCount, char *pszArgs[])
 				return ErrGetErrorCode();
 			break;
 
+		case 'a':
+			if (++i < iArgCount)
+				iNumAcceptors = atoi(pszArgs[i]);
+			break;
+
+		case 'm':
+			if (++i < iArgCount)
+				iMinThreads = atoi(pszArgs[i]);
+			break;
+
 		case '-':
 			iDisable++;
 			break;
@@ -495,6 +543,13 @@ static int SvrSetupFING(int iArgCount, char *pszArgs[])
 		}
 	}
 
+	ThCfgFING.iMinThreads = iMinThreads;
+	ThCfgFING.iMaxThreads = MAX_FING_THREADS;
+	ThCfgFING.iIdleTimeout = iPoolIdleTimeout;
+	ThCfgFING.iNumAcceptors = iNumAcceptors;
+	if (bPinAcceptors)
+		ThCfgFING.ulFlags |= THCF_PIN_ACCEPTORS;
+
 	if ((hShbFING = ShbCreateBlock(sizeof(FINGConfig))) == SHB_INVALID_HANDLE)
 		return ErrGetErrorCode();
 
@@ -515,7 +570,7 @@ static int SvrSetupFING(int iArgCount, char *pszArgs[])
 
 	if (MscCreateServerSockets(ThCfgFING.iNumAddr, ThCfgFING.SvrAddr, iFamily,
 				   iPort, FING_LISTEN_SIZE, ThCfgFING.SockFDs,
-				   ThCfgFING.iNumSockFDs) < 0) {
+				   ThCfgFING.iNumSockFDs, &ThCfgFING.iNumAcceptors) < 0) {
 		ShbCloseBlock(hShbFING);
 		return ErrGetErrorCode();
 	}
@@ -567,6 +622,7 @@ static int SvrSetupPOP3(int iArgCount, char *pszArgs[])
 	int iSessionTimeout = STD_SERVER_SESSION_TIMEOUT;
 	int iBadLoginWait = STD_POP3_BADLOGIN_WAIT;
 	long lMaxThreads = MAX_POP3_THREADS;
+	int iMinThreads = STD_POOL_MIN_THREADS, iNumAcceptors = 1;
 	unsigned long ulFlags = 0;
 
 	/*
@@ -620,6 +676,16 @@ static int SvrSetupPOP3(int iArgCount, char *pszArgs[])
 				lMaxThreads = atol(pszArgs[i]);
 			break;
 
+		case 'a':
+			if (++i < iArgCount)
+				iNumAcceptors = atoi(pszArgs[i]);
+			break;
+
+		case 'm':
+			if (++i < iArgCount)
+				iMinThreads = atoi(pszArgs[i]);
+			break;
+
 		case '-':
 			iDisable++;
 			break;
@@ -630,6 +696,13 @@ static int SvrSetupPOP3(int iArgCount, char *pszArgs[])
 		}
 	}
 
+	ThCfgPOP3.iMinThreads = iMinThreads;
+	ThCfgPOP3.iMaxThreads = (int) lMaxThreads + POOL_SPARE_THREADS;
+	ThCfgPOP3.iIdleTimeout = iPoolIdleTimeout;
+	ThCfgPOP3.iNumAcceptors = iNumAcceptors;
+	if (bPinAcceptors)
+		ThCfgPOP3.ulFlags |= THCF_PIN_ACCEPTORS;
+
 	if ((hShbPOP3 = ShbCreateBlock(sizeof(POP3Config))) == SHB_INVALID_HANDLE)
 		return ErrGetErrorCode();
 
@@ -656,7 +729,7 @@ static int SvrSetupPOP3(int iArgCount, char *pszArgs[])
 
 	if (MscCreateServerSockets(ThCfgPOP3.iNumAddr, ThCfgPOP3.SvrAddr, iFamily,
 				   iPort, POP3_LISTEN_SIZE, ThCfgPOP3.SockFDs,
-				   ThCfgPOP3.iNumSockFDs) < 0) {
+				   ThCfgPOP3.iNumSockFDs, &ThCfgPOP3.iNumAcceptors) < 0) {
 		ShbCloseBlock(hShbPOP3);
 		return ErrGetErrorCode();
 	}
@@ -692,8 +765,12 @@ static int SvrSetupPOP3S(int iArgCount, char *pszArgs[])
 	ThCfgPOP3S.pszName = POP3S_SERVER_NAME;
 	ThCfgPOP3S.pfThreadProc = POP3ClientThread;
 	ThCfgPOP3S.pfThreadCnt = SvrThreadCntPOP3;
-	ThCfgPOP3S.ulFlags = THCF_USE_SSL;
+	ThCfgPOP3S.ulFlags = THCF_USE_SSL | (ThCfgPOP3.ulFlags & THCF_PIN_ACCEPTORS);
 	ThCfgPOP3S.hThShb = hShbPOP3;
+	ThCfgPOP3S.iMinThreads = ThCfgPOP3.iMinThreads;
+	ThCfgPOP3S.iMaxThreads = ThCfgPOP3.iMaxThreads;
+	ThCfgPOP3S.iIdleTimeout = ThCfgPOP3.iIdleTimeout;
+	ThCfgPOP3S.iNumAcceptors = ThCfgPOP3.iNumAcceptors;
 	for (int i = 0; i < iArgCount; i++) {
 		if (pszArgs[i][0] != '-' || pszArgs[i][1] != 'B')
 			continue;
@@ -722,7 +799,7 @@ static int SvrSetupPOP3S(int iArgCount, char *pszArgs[])
 	}
 	if (MscCreateServerSockets(ThCfgPOP3S.iNumAddr, ThCfgPOP3S.SvrAddr, iFamily,
 				   iPort, POP3_LISTEN_SIZE, ThCfgPOP3S.SockFDs,
-				   ThCfgPOP3S.iNumSockFDs) < 0)
+				   ThCfgPOP3S.iNumSockFDs, &ThCfgPOP3S.iNumAcceptors) < 0)
 		return ErrGetErrorCode();
 	if ((hPOP3SThread = SysCreateThread(MscServiceThread,
 					    &ThCfgPOP3S)) == SYS_INVALID_THREAD) {
@@ -780,6 +857,7 @@ static int SvrSetupSMTP(int iArgCount, char *pszArgs[])
 	int iMaxRcpts = STD_SMTP_MAX_RCPTS;
 	unsigned int uPopAuthExpireTime = STD_POP3AUTH_EXPIRE_TIME;
 	long lMaxThreads = MAX_SMTP_THREADS;
+	int iMinThreads = STD_POOL_MIN_THREADS, iNumAcceptors = 1;
 	unsigned long ulFlags = 0;
 
 	/*
@@ -834,6 +912,16 @@ static int SvrSetupSMTP(int iArgCount, char *pszArgs[])
 				uPopAuthExpireTime = (unsigned int) atol(pszArgs[i]);
 			break;
 
+		case 'a':
+			if (++i < iArgCount)
+				iNumAcceptors = atoi(pszArgs[i]);
+			break;
+
+		case 'm':
+			if (++i < iArgCount)
+				iMinThreads = atoi(pszArgs[i]);
+			break;
+
 		case '-':
 			iDisable++;
 			break;
@@ -844,6 +932,13 @@ static int SvrSetupSMTP(int iArgCount, char *pszArgs[])
 		}
 	}
 
+	ThCfgSMTP.iMinThreads = iMinThreads;
+	ThCfgSMTP.iMaxThreads = (int) lMaxThreads + POOL_SPARE_THREADS;
+	ThCfgSMTP.iIdleTimeout = iPoolIdleTimeout;
+	ThCfgSMTP.iNumAcceptors = iNumAcceptors;
+	if (bPinAcceptors)
+		ThCfgSMTP.ulFlags |= THCF_PIN_ACCEPTORS;
+
 	if ((hShbSMTP = ShbCreateBlock(sizeof(SMTPConfig))) == SHB_INVALID_HANDLE)
 		return ErrGetErrorCode();
 
@@ -868,7 +963,7 @@ static int SvrSetupSMTP(int iArgCount, char *pszArgs[])
 
 	if (MscCreateServerSockets(ThCfgSMTP.iNumAddr, ThCfgSMTP.SvrAddr, iFamily,
 				   iPort, SMTP_LISTEN_SIZE, ThCfgSMTP.SockFDs,
-				   ThCfgSMTP.iNumSockFDs) < 0) {
+				   ThCfgSMTP.iNumSockFDs, &ThCfgSMTP.iNumAcceptors) < 0) {
 		ShbCloseBlock(hShbSMTP);
 		return ErrGetErrorCode();
 	}
@@ -904,8 +999,12 @@ static int SvrSetupSMTPS(int iArgCount, char *pszArgs[])
 	ThCfgSMTPS.pszName = SMTPS_SERVER_NAME;
 	ThCfgSMTPS.pfThreadProc = SMTPClientThread;
 	ThCfgSMTPS.pfThreadCnt = SvrThreadCntSMTP;
-	ThCfgSMTPS.ulFlags = THCF_USE_SSL;
+	ThCfgSMTPS.ulFlags = THCF_USE_SSL | (ThCfgSMTP.ulFlags & THCF_PIN_ACCEPTORS);
 	ThCfgSMTPS.hThShb = hShbSMTP;
+	ThCfgSMTPS.iMinThreads = ThCfgSMTP.iMinThreads;
+	ThCfgSMTPS.iMaxThreads = ThCfgSMTP.iMaxThreads;
+	ThCfgSMTPS.iIdleTimeout = ThCfgSMTP.iIdleTimeout;
+	ThCfgSMTPS.iNumAcceptors = ThCfgSMTP.iNumAcceptors;
 	for (int i = 0; i < iArgCount; i++) {
 		if (pszArgs[i][0] != '-' || pszArgs[i][1] != 'X')
 			continue;
@@ -934,7 +1033,7 @@ static int SvrSetupSMTPS(int iArgCount, char *pszArgs[])
 	}
 	if (MscCreateServerSockets(ThCfgSMTPS.iNumAddr, ThCfgSMTPS.SvrAddr, iFamily,
 				   iPort, SMTP_LISTEN_SIZE, ThCfgSMTPS.SockFDs,
-				   ThCfgSMTPS.iNumSockFDs) < 0)
+				   ThCfgSMTPS.iNumSockFDs, &ThCfgSMTPS.iNumAcceptors) < 0)
 		return ErrGetErrorCode();
 	if ((hSMTPSThread = SysCreateThread(MscServiceThread,
 					    &ThCfgSMTPS)) == SYS_INVALID_THREAD) {
@@ -971,15 +1070,113 @@ static void SvrShutdown__SMAIL(void *pPrivate)
 	ShbUnlock(hShb);
 }
 
+static int SvrStartSMAILThread(void)
+{
+	for (int i = 0; i < MAX_SMAIL_THREADS; i++)
+		if (hSMAILThreads[i] == SYS_INVALID_THREAD) {
+			if ((hSMAILThreads[i] = SysCreateThread(SMAILThreadProc,
+								(void *) (long) i)) ==
+			    SYS_INVALID_THREAD)
+				return ErrGetErrorCode();
+			return 0;
+		}
+
+	ErrSetErrorCode(ERR_TOO_MANY_ELEMENTS);
+	return ERR_TOO_MANY_ELEMENTS;
+}
+
+static int SvrReapSMAILThreads(void)
+{
+	int iCount = 0;
+
+	/* Free the slots of the threads that retired, and count the others */
+	for (int i = 0; i < MAX_SMAIL_THREADS; i++) {
+		if (hSMAILThreads[i] == SYS_INVALID_THREAD)
+			continue;
+		if (SysWaitThread(hSMAILThreads[i], 0) == 0) {
+			SysCloseThread(hSMAILThreads[i], 0);
+			hSMAILThreads[i] = SYS_INVALID_THREAD;
+		} else
+			iCount++;
+	}
+
+	return iCount;
+}
+
+static unsigned int SvrSMAILPoolThread(void *pThreadData)
+{
+	int iIdleTime = 0;
+
+	for (;;) {
+		SysSleep(SMAIL_POOL_CHECK_WAIT);
+
+		int iThreads = SvrReapSMAILThreads(), iReadyCount, iGrow = 0;
+		time_t tOldestReady;
+
+		if (QueGetReadyStats(hSpoolQueue, &iReadyCount, &tOldestReady) < 0)
+			continue;
+
+		SMAILConfig *pSMAILCfg = (SMAILConfig *) ShbLock(hShbSMAIL);
+
+		if (pSMAILCfg == NULL)
+			continue;
+		if (pSMAILCfg->ulFlags & SMAILF_STOP_SERVER) {
+			ShbUnlock(hShbSMAIL);
+			break;
+		}
+
+		/*
+		 * Messages are waiting, and nobody is free to pick them up. If most
+		 * of the busy threads are waiting on remote servers, adding threads
+		 * buys throughput, so grow fast. Otherwise grow one at a time.
+		 */
+		int iIdle = iThreads - (int) (pSMAILCfg->lBusyThreads + pSMAILCfg->lRetireCount);
+
+		if (iReadyCount > 0) {
+			iIdleTime = 0;
+			pSMAILCfg->lRetireCount = 0;
+			if (iThreads - pSMAILCfg->lBusyThreads <= 0 &&
+			    time(NULL) - tOldestReady >= SMAIL_POOL_GROW_AGE) {
+				iGrow = 2 * pSMAILCfg->lNetThreads >= pSMAILCfg->lBusyThreads ?
+					Min(iReadyCount, Max(1, iThreads / 2)): 1;
+				iGrow = Min(iGrow, iMaxSMAILThreads - iThreads);
+			}
+		} else if (iIdle > 0) {
+			/* Give back one idle thread per check, once idle long enough */
+			if (++iIdleTime >= SMAIL_POOL_IDLE_WAIT &&
+			    iThreads - pSMAILCfg->lRetireCount > iNumSMAILThreads)
+				pSMAILCfg->lRetireCount++;
+		} else
+			iIdleTime = 0;
+		ShbUnlock(hShbSMAIL);
+
+		for (; iGrow > 0; iGrow--)
+			if (SvrStartSMAILThread() < 0) {
+				SysLogMessage(LOG_LEV_ERROR, "Unable to start SMAIL thread (%d)\n",
+					      ErrGetErrorCode());
+				break;
+			}
+	}
+
+	return 0;
+}
+
 static int SvrSetupSMAIL(int iArgCount, char *pszArgs[])
 {
 	int i;
 	int iRetryTimeout = STD_SMAIL_RETRY_TIMEOUT;
 	int iRetryIncrRatio = STD_SMAIL_RETRY_INCR_RATIO;
 	int iMaxRetry = STD_SMAIL_MAX_RETRY;
+	int iChCacheSize = STD_SMTPCH_CACHE_SIZE;
+	int iChMaxIdle = STD_SMTPCH_MAX_IDLE;
+	int iChMaxMsgs = STD_SMTPCH_MAX_MSGS;
+	int iHostDownExpire = STD_SMTP_HOST_DOWN_EXPIRE;
+	int iDomainMaxActive = -1;
+	int iNumShards = -1;
 	unsigned long ulFlags = 0;
 
 	iNumSMAILThreads = STD_SMAIL_THREADS;
+	iMaxSMAILThreads = -1;
 
 	for (i = 0; i < iArgCount; i++) {
 		if (pszArgs[i][0] != '-' || pszArgs[i][1] != 'Q')
@@ -1021,8 +1218,51 @@ static int SvrSetupSMAIL(int iArgCount, char *pszArgs[])
 		case 'g':
 			bFilterLogEnabled = true;
 			break;
+
+		case 'c':
+			if (++i < iArgCount)
+				iChCacheSize = atoi(pszArgs[i]);
+			break;
+
+		case 'I':
+			if (++i < iArgCount)
+				iChMaxIdle = atoi(pszArgs[i]);
+			break;
+
+		case 'M':
+			if (++i < iArgCount)
+				iChMaxMsgs = Max(1, atoi(pszArgs[i]));
+			break;
+
+		case 'd':
+			if (++i < iArgCount)
+				iDomainMaxActive = Max(0, atoi(pszArgs[i]));
+			break;
+
+		case 'H':
+			if (++i < iArgCount)
+				iHostDownExpire = atoi(pszArgs[i]);
+			break;
+
+		case 'S':
+			if (++i < iArgCount)
+				iNumShards = Max(1, atoi(pszArgs[i]));
+			break;
+
+		case 'x':
+			if (++i < iArgCount)
+				iMaxSMAILThreads = Min(MAX_SMAIL_THREADS, atoi(pszArgs[i]));
+			break;
 		}
 	}
+	/* The pool of mailer threads is fixed, unless a larger maximum is given */
+	iMaxSMAILThreads = Max(iNumSMAILThreads, iMaxSMAILThreads);
+	/* By default a single remote domain can take half of the mailer threads */
+	if (iDomainMaxActive < 0)
+		iDomainMaxActive = Max(1, iMaxSMAILThreads / 2);
+	/* One ready queue shard every eight mailer threads, if not specified */
+	if (iNumShards < 0)
+		iNumShards = Max(1, iMaxSMAILThreads / 8);
 
 	if ((hShbSMAIL = ShbCreateBlock(sizeof(SMAILConfig))) == SHB_INVALID_HANDLE)
 		return ErrGetErrorCode();
@@ -1038,6 +1278,11 @@ static int SvrSetupSMAIL(int iArgCount, char *pszArgs[])
 
 	pSMAILCfg->ulFlags = ulFlags;
 	pSMAILCfg->lThreadCount = 0;
+	pSMAILCfg->lMinThreads = iNumSMAILThreads;
+	pSMAILCfg->lMaxThreads = iMaxSMAILThreads;
+	pSMAILCfg->lBusyThreads = 0;
+	pSMAILCfg->lNetThreads = 0;
+	pSMAILCfg->lRetireCount = 0;
 
 	ShbUnlock(hShbSMAIL);
 
@@ -1046,15 +1291,37 @@ static int SvrSetupSMAIL(int iArgCount, char *pszArgs[])
 
 	SvrGetSpoolDir(szSpoolDir, sizeof(szSpoolDir));
 	if ((hSpoolQueue = QueOpen(szSpoolDir, iMaxRetry, iRetryTimeout, iRetryIncrRatio,
-				   iQueueSplitLevel)) == INVALID_QUEUE_HANDLE) {
+				   iQueueSplitLevel, iDomainMaxActive,
+				   iNumShards)) == INVALID_QUEUE_HANDLE) {
 		ErrorPush();
 		ShbCloseBlock(hShbSMAIL);
 
 		return ErrorPop();
 	}
+	/* Setup the cache of the idle outbound SMTP channels */
+	if (USmtpInitChannelCache(iChCacheSize, iChMaxIdle, iChMaxMsgs) < 0) {
+		ErrorPush();
+		QueClose(hSpoolQueue);
+		ShbCloseBlock(hShbSMAIL);
+
+		return ErrorPop();
+	}
+	/* Setup the cache of the recently unreachable SMTP servers */
+	if (USmtpInitHostCache(iHostDownExpire) < 0) {
+		ErrorPush();
+		USmtpCleanupChannelCache();
+		QueClose(hSpoolQueue);
+		ShbCloseBlock(hShbSMAIL);
+
+		return ErrorPop();
+	}
 	/* Create mailer threads */
 	for (i = 0; i < iNumSMAILThreads; i++)
-		hSMAILThreads[i] = SysCreateThread(SMAILThreadProc, NULL);
+		SvrStartSMAILThread();
+
+	/* And the manager that sizes the pool according to the load */
+	hSMAILPoolThread = iMaxSMAILThreads > iNumSMAILThreads ?
+		SysCreateThread(SvrSMAILPoolThread, NULL): SYS_INVALID_THREAD;
 
 	/*
 	 * Register the shutdown function.
@@ -1068,10 +1335,21 @@ static void SvrCleanupSMAIL(void)
 {
 	int i;
 
-	for (i = 0; i < iNumSMAILThreads; i++)
-		SysWaitThread(hSMAILThreads[i], SVR_EXIT_WAIT);
-	for (i = 0; i < iNumSMAILThreads; i++)
-		SysCloseThread(hSMAILThreads[i], 1);
+	/* The pool manager goes first, so that no thread gets started from now on */
+	if (hSMAILPoolThread != SYS_INVALID_THREAD) {
+		SysWaitThread(hSMAILPoolThread, SVR_EXIT_WAIT);
+		SysCloseThread(hSMAILPoolThread, 1);
+	}
+	for (i = 0; i < MAX_SMAIL_THREADS; i++)
+		if (hSMAILThreads[i] != SYS_INVALID_THREAD)
+			SysWaitThread(hSMAILThreads[i], SVR_EXIT_WAIT);
+	for (i = 0; i < MAX_SMAIL_THREADS; i++)
+		if (hSMAILThreads[i] != SYS_INVALID_THREAD) {
+			SysCloseThread(hSMAILThreads[i], 1);
+			hSMAILThreads[i] = SYS_INVALID_THREAD;
+		}
+	USmtpCleanupHostCache();
+	USmtpCleanupChannelCache();
 	ShbCloseBlock(hShbSMAIL);
 	QueClose(hSpoolQueue);
 }
@@ -1289,6 +1567,7 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 
 	int iSndBufSize = -1, iRcvBufSize = -1;
 	int iDnsCacheDirs = DNS_HASH_NUM_DIRS;
+	int iNumReactors = STD_CENG_REACTORS;
 
 	for (int i = 0; i < iArgCount; i++) {
 		if (pszArgs[i][0] != '-' || pszArgs[i][1] != 'M')
@@ -1347,6 +1626,20 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 				iDnsCacheDirs = atoi(pszArgs[i]);
 			break;
 
+		case 'e':
+			if (++i < iArgCount)
+				iNumReactors = atoi(pszArgs[i]);
+			break;
+
+		case 'I':
+			if (++i < iArgCount)
+				iPoolIdleTimeout = atoi(pszArgs[i]) * 1000;
+			break;
+
+		case 'A':
+			bPinAcceptors = true;
+			break;
+
 		case '4':
 			iAddrFamily = AF_INET;
 			break;
@@ -1381,6 +1674,16 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 	/* Setup resource lockers */
 	if (RLckInitLockers() < 0)
 		return ErrGetErrorCode();
+	/* Setup the message ID allocator, the server.tab and table index caches */
+	if (SvrInitMessageID() < 0 || SvrInitConfigCache() < 0 || TbixInitCache() < 0) {
+		ErrorPush();
+		TbixCleanupCache();
+		SvrCleanupConfigCache();
+		SvrCleanupMessageID();
+		RLckCleanupLockers();
+
+		return ErrorPop();
+	}
 
 	/* Clear shutdown condition */
 	SvrShutdownCleanup();
@@ -1391,6 +1694,9 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 	    ExAlCheckAliasIndexes() < 0 ||
 	    MDomCheckDomainsIndexes() < 0 || ADomCheckDomainsIndexes() < 0) {
 		ErrorPush();
+		TbixCleanupCache();
+		SvrCleanupConfigCache();
+		SvrCleanupMessageID();
 		RLckCleanupLockers();
 
 		return ErrorPop();
@@ -1399,6 +1705,20 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 	if (CDNS_Initialize(iDnsCacheDirs) < 0 ||
 	    BSslInit() < 0) {
 		ErrorPush();
+		TbixCleanupCache();
+		SvrCleanupConfigCache();
+		SvrCleanupMessageID();
+		RLckCleanupLockers();
+
+		return ErrorPop();
+	}
+	/* Start the connection engine parking idle client sessions */
+	if (CEngInit(iNumReactors, iPoolIdleTimeout) < 0) {
+		ErrorPush();
+		BSslCleanup();
+		TbixCleanupCache();
+		SvrCleanupConfigCache();
+		SvrCleanupMessageID();
 		RLckCleanupLockers();
 
 		return ErrorPop();
@@ -1409,7 +1729,11 @@ static int SvrSetup(int iArgCount, char *pszArgs[])
 
 static void SvrCleanup(void)
 {
+	CEngCleanup();
 	BSslCleanup();
+	TbixCleanupCache();
+	SvrCleanupConfigCache();
+	SvrCleanupMessageID();
 	RLckCleanupLockers();
 	SvrShutdownCleanup();
 }
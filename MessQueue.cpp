@@ -43,20 +43,66 @@
 
 #define QUMF_DELETED                (1 << 0)
 #define QUMF_FREEZE                 (1 << 1)
+#define QUMF_LOCAL                  (1 << 2)
 
 #define QUE_MASK_TMPFLAGS(v)        ((v) & ~(QUMF_DELETED | QUMF_FREEZE))
 
-#define QUE_ARENA_SCAN_INTERVAL     15
 #define QUE_ARENA_SCAN_WAIT         2
+#define QUE_ARENA_HEAP_INIT         256
 #define QUE_SCAN_THREAD_MAXWAIT     60
+#define QUE_GROUP_MAX_MSGS          100
+#define QUE_JNL_FILE                "queue.jnl"
+#define QUE_JNL_HEADER              "XMQJ"
+#define QUE_JNL_VERSION             2
+#define QUE_JNL_HASH_INIT           1024
+#define QUE_JNL_COMPACT_MIN         16384
+#define QUE_JNL_COMPACT_RATIO       4
+#define QUE_DOMAIN_HASH_INIT        256
+#define QUE_GROUP_HASH_INIT         256
+#define QUE_MAX_SHARDS              64
+
+struct QueueMessage;
+struct QueueShard;
+
+struct QueueDomain {
+	HashNode HN;
+	SysListHead RLink;
+	QueueShard *pQS;
+	char *pszDomain;
+	SysListHead MsgList;
+	int iMsgCount;
+	int iActive;
+	bool bLocal;
+};
 
-struct MessageQueue {
-	SysListHead ReadyQueue;
-	SysListHead RsndArenaQueue;
-	int iReadyCount;
-	int iRsndArenaCount;
+struct QueueShard {
 	SYS_MUTEX hMutex;
+	HASH_HANDLE hDomainHash;
+	HASH_HANDLE hGroupHash;
+	QueueDomain DefDomain;
+	SysListHead DomainRing;
+	bool bReady;
+};
+
+struct MessageQueue {
+	QueueShard *pShards;
+	int iNumShards;
+	int iReadyShards;
+	SYS_MUTEX hReadyMutex;
 	SYS_EVENT hReadyEvent;
+	int iDomainMaxActive;
+	QueueMessage **ppRsndArena;
+	int iRsndArenaCount;
+	int iRsndArenaSize;
+	SYS_MUTEX hRsndMutex;
+	SysListHead SyncQueue;
+	int iSyncActive;
+	int iSyncRunning;
+	SYS_MUTEX hSyncMutex;
+	FILE *pJnlFile;
+	int iJnlRecords;
+	int iJnlLive;
+	SYS_MUTEX hJnlMutex;
 	char *pszRootPath;
 	int iMaxRetry;
 	int iRetryTimeout;
@@ -74,11 +120,29 @@ struct QueueMessage {
 	char *pszFileName;
 	int iNumTries;
 	time_t tLastTry;
+	time_t tNextTry;
+	time_t tReady;
 	unsigned long ulFlags;
+	char *pszDomain;
+	QueueDomain *pQD;
+	char *pszGroupKey;
+	SysListHead GroupList;
+	int iGroupCount;
+	HashNode GHN;
+	HashNode HN;
+};
+
+struct QueueSyncRequest {
+	SysListHead LLink;
+	QMSG_HANDLE const *phMessages;
+	int iCount;
+	int iError;
+	SYS_EVENT hDoneEvent;
 };
 
 static int QueGetFilePath(MessageQueue *pMQ, QueueMessage *pQM, char *pszFilePath,
 			  char const *pszQueueDir = NULL);
+static int QueFreeMessList(SysListHead *pHead);
 
 static QueueMessage *QueAllocMessage(int iLevel1, int iLevel2, char const *pszQueueDir,
 				     char const *pszFileName, int iNumTries, time_t tLastTry)
@@ -96,13 +160,23 @@ static QueueMessage *QueAllocMessage(int iLevel1, int iLevel2, char const *pszQu
 	pQM->iNumTries = iNumTries;
 	pQM->tLastTry = tLastTry;
 	pQM->ulFlags = 0;
+	pQM->pszDomain = NULL;
+	pQM->pQD = NULL;
+	pQM->pszGroupKey = NULL;
+	SYS_INIT_LIST_HEAD(&pQM->GroupList);
+	pQM->iGroupCount = 0;
+	HashInitNode(&pQM->GHN);
+	HashInitNode(&pQM->HN);
 
 	return pQM;
 }
 
 static int QueFreeMessage(QueueMessage *pQM)
 {
+	QueFreeMessList(&pQM->GroupList);
 	SysFree(pQM->pszFileName);
+	SysFree(pQM->pszDomain);
+	SysFree(pQM->pszGroupKey);
 	SysFree(pQM);
 
 	return 0;
@@ -122,6 +196,414 @@ static int QueFreeMessList(SysListHead *pHead)
 	return 0;
 }
 
+static time_t QueNextRetryOp(int iNumTries, unsigned int uRetryTimeout,
+			     unsigned int uRetryIncrRatio)
+{
+	unsigned int uNextOp = uRetryTimeout;
+
+	if (uRetryIncrRatio != 0)
+		for (int i = 1; i < iNumTries; i++)
+			uNextOp += uNextOp / uRetryIncrRatio;
+
+	return (time_t) uNextOp;
+}
+
+static void QueRsndArenaSiftUp(MessageQueue *pMQ, int i)
+{
+	QueueMessage *pQM = pMQ->ppRsndArena[i];
+
+	for (; i > 0 && pMQ->ppRsndArena[(i - 1) / 2]->tNextTry > pQM->tNextTry;
+	     i = (i - 1) / 2)
+		pMQ->ppRsndArena[i] = pMQ->ppRsndArena[(i - 1) / 2];
+	pMQ->ppRsndArena[i] = pQM;
+}
+
+static void QueRsndArenaSiftDown(MessageQueue *pMQ, int i)
+{
+	QueueMessage *pQM = pMQ->ppRsndArena[i];
+
+	for (;;) {
+		int iChild = 2 * i + 1;
+
+		if (iChild >= pMQ->iRsndArenaCount)
+			break;
+		if (iChild + 1 < pMQ->iRsndArenaCount &&
+		    pMQ->ppRsndArena[iChild + 1]->tNextTry < pMQ->ppRsndArena[iChild]->tNextTry)
+			iChild++;
+		if (pMQ->ppRsndArena[iChild]->tNextTry >= pQM->tNextTry)
+			break;
+		pMQ->ppRsndArena[i] = pMQ->ppRsndArena[iChild];
+		i = iChild;
+	}
+	pMQ->ppRsndArena[i] = pQM;
+}
+
+static int QueRsndArenaPush(MessageQueue *pMQ, QueueMessage *pQM)
+{
+	if (pMQ->iRsndArenaCount >= pMQ->iRsndArenaSize) {
+		int iSize = pMQ->iRsndArenaSize > 0 ? 2 * pMQ->iRsndArenaSize: QUE_ARENA_HEAP_INIT;
+		QueueMessage **ppRsndArena = (QueueMessage **)
+			SysRealloc(pMQ->ppRsndArena, iSize * sizeof(QueueMessage *));
+
+		if (ppRsndArena == NULL)
+			return ErrGetErrorCode();
+		pMQ->ppRsndArena = ppRsndArena;
+		pMQ->iRsndArenaSize = iSize;
+	}
+	/* The retry time is computed once, when the message enters the arena */
+	pQM->tNextTry = pQM->tLastTry +
+		QueNextRetryOp(pQM->iNumTries, (unsigned int) pMQ->iRetryTimeout,
+			       (unsigned int) pMQ->iRetryIncrRatio);
+	pMQ->ppRsndArena[pMQ->iRsndArenaCount++] = pQM;
+	QueRsndArenaSiftUp(pMQ, pMQ->iRsndArenaCount - 1);
+
+	return 0;
+}
+
+static QueueMessage *QueRsndArenaPop(MessageQueue *pMQ)
+{
+	QueueMessage *pQM = pMQ->ppRsndArena[0];
+
+	if (--pMQ->iRsndArenaCount > 0) {
+		pMQ->ppRsndArena[0] = pMQ->ppRsndArena[pMQ->iRsndArenaCount];
+		QueRsndArenaSiftDown(pMQ, 0);
+	}
+
+	return pQM;
+}
+
+static void QueRsndArenaHeapify(MessageQueue *pMQ)
+{
+	for (int i = pMQ->iRsndArenaCount / 2 - 1; i >= 0; i--)
+		QueRsndArenaSiftDown(pMQ, i);
+}
+
+static void QueFreeRsndArena(MessageQueue *pMQ)
+{
+	for (int i = 0; i < pMQ->iRsndArenaCount; i++)
+		QueFreeMessage(pMQ->ppRsndArena[i]);
+	SysFree(pMQ->ppRsndArena);
+	pMQ->ppRsndArena = NULL;
+	pMQ->iRsndArenaCount = pMQ->iRsndArenaSize = 0;
+}
+
+static void QueInitDomain(QueueShard *pQS, QueueDomain *pQD)
+{
+	HashInitNode(&pQD->HN);
+	SYS_INIT_LIST_LINK(&pQD->RLink);
+	pQD->pQS = pQS;
+	pQD->pszDomain = NULL;
+	SYS_INIT_LIST_HEAD(&pQD->MsgList);
+	pQD->iMsgCount = 0;
+	pQD->iActive = 0;
+	pQD->bLocal = false;
+}
+
+static void QueFreeDomain(void *pPrivate, HashNode *pHNode)
+{
+	QueueDomain *pQD = SYS_LIST_ENTRY(pHNode, QueueDomain, HN);
+
+	QueFreeMessList(&pQD->MsgList);
+	SysFree(pQD->pszDomain);
+	SysFree(pQD);
+}
+
+static int QueInitShard(QueueShard *pQS)
+{
+	HashOps HOps;
+
+	QueInitDomain(pQS, &pQS->DefDomain);
+	SYS_INIT_LIST_HEAD(&pQS->DomainRing);
+	pQS->bReady = false;
+	if ((pQS->hMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
+		return ErrGetErrorCode();
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((pQS->hDomainHash = HashCreate(&HOps, QUE_DOMAIN_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		SysCloseMutex(pQS->hMutex);
+		return ErrorPop();
+	}
+	if ((pQS->hGroupHash = HashCreate(&HOps, QUE_GROUP_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		HashFree(pQS->hDomainHash, NULL, NULL);
+		SysCloseMutex(pQS->hMutex);
+		return ErrorPop();
+	}
+
+	return 0;
+}
+
+static void QueCleanupShard(QueueShard *pQS)
+{
+	QueFreeMessList(&pQS->DefDomain.MsgList);
+	HashFree(pQS->hDomainHash, QueFreeDomain, NULL);
+	HashFree(pQS->hGroupHash, NULL, NULL);
+	SysCloseMutex(pQS->hMutex);
+}
+
+static int QueCreateShards(MessageQueue *pMQ, int iNumShards)
+{
+	if ((pMQ->pShards = (QueueShard *) SysAlloc(iNumShards * sizeof(QueueShard))) == NULL)
+		return ErrGetErrorCode();
+	for (pMQ->iNumShards = 0; pMQ->iNumShards < iNumShards; pMQ->iNumShards++)
+		if (QueInitShard(&pMQ->pShards[pMQ->iNumShards]) < 0) {
+			ErrorPush();
+			while (--pMQ->iNumShards >= 0)
+				QueCleanupShard(&pMQ->pShards[pMQ->iNumShards]);
+			SysFree(pMQ->pShards);
+			return ErrorPop();
+		}
+
+	return 0;
+}
+
+static void QueFreeShards(MessageQueue *pMQ)
+{
+	for (int i = 0; i < pMQ->iNumShards; i++)
+		QueCleanupShard(&pMQ->pShards[i]);
+	SysFree(pMQ->pShards);
+}
+
+static QueueShard *QueGetShard(MessageQueue *pMQ, QueueMessage *pQM)
+{
+	/*
+	 * All the messages of a domain must live inside the same shard, for the
+	 * domain delivery limit to be enforced under a single lock. Messages
+	 * whose destination is not known yet are spread by spool directory.
+	 */
+	unsigned long ulIdx = (unsigned long) pQM->iLevel1;
+
+	if (pQM->pszDomain != NULL) {
+		HashDatum Key;
+
+		Key.pData = pQM->pszDomain;
+		ulIdx = MscStringHashCB(NULL, &Key);
+	}
+
+	return &pMQ->pShards[ulIdx % (unsigned long) pMQ->iNumShards];
+}
+
+static QueueDomain *QueGetDomain(QueueShard *pQS, char const *pszDomain, bool bLocal)
+{
+	/*
+	 * Messages whose destination is not known (yet), share the default
+	 * queue. The same happens if we fail to allocate a new domain queue.
+	 */
+	if (pszDomain == NULL)
+		return &pQS->DefDomain;
+
+	HashDatum Key;
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	Key.pData = (void *) pszDomain;
+	if (HashGetFirst(pQS->hDomainHash, &Key, &HEnum, &pHNode) == 0)
+		return SYS_LIST_ENTRY(pHNode, QueueDomain, HN);
+
+	QueueDomain *pQD = (QueueDomain *) SysAlloc(sizeof(QueueDomain));
+
+	if (pQD == NULL)
+		return &pQS->DefDomain;
+	QueInitDomain(pQS, pQD);
+	pQD->bLocal = bLocal;
+	if ((pQD->pszDomain = SysStrDup(pszDomain)) == NULL) {
+		SysFree(pQD);
+		return &pQS->DefDomain;
+	}
+	pQD->HN.Key.pData = pQD->pszDomain;
+	if (HashAdd(pQS->hDomainHash, &pQD->HN) < 0) {
+		SysFree(pQD->pszDomain);
+		SysFree(pQD);
+		return &pQS->DefDomain;
+	}
+
+	return pQD;
+}
+
+static bool QueDomainReady(MessageQueue *pMQ, QueueDomain *pQD)
+{
+	/* Local deliveries do not load any remote server, and are never limited */
+	return pQD->iMsgCount > 0 &&
+		(pQD->pszDomain == NULL || pQD->bLocal || pMQ->iDomainMaxActive <= 0 ||
+		 pQD->iActive < pMQ->iDomainMaxActive);
+}
+
+static void QueSetShardReady(MessageQueue *pMQ, QueueShard *pQS, bool bReady)
+{
+	if (pQS->bReady == bReady)
+		return;
+	pQS->bReady = bReady;
+
+	/*
+	 * The ready event is shared by all the shards, so it is driven by the
+	 * count of shards having something to deliver. Shard transitions are
+	 * serialized by the ready mutex, and no wakeup gets lost.
+	 */
+	SysLockMutex(pMQ->hReadyMutex, SYS_INFINITE_TIMEOUT);
+	if (bReady) {
+		if (pMQ->iReadyShards++ == 0)
+			SysSetEvent(pMQ->hReadyEvent);
+	} else if (--pMQ->iReadyShards == 0)
+		SysResetEvent(pMQ->hReadyEvent);
+	SysUnlockMutex(pMQ->hReadyMutex);
+}
+
+static void QueUpdateDomain(MessageQueue *pMQ, QueueDomain *pQD)
+{
+	QueueShard *pQS = pQD->pQS;
+
+	/*
+	 * Only domains having messages, and not having reached their limit of
+	 * concurrent deliveries, sit inside the ring SMAIL threads pick from.
+	 */
+	if (QueDomainReady(pMQ, pQD)) {
+		if (!SYS_LIST_LINKED(&pQD->RLink))
+			SYS_LIST_ADDT(&pQD->RLink, &pQS->DomainRing);
+	} else if (SYS_LIST_LINKED(&pQD->RLink)) {
+		SYS_LIST_DEL(&pQD->RLink);
+		SYS_INIT_LIST_LINK(&pQD->RLink);
+	}
+	if (pQD != &pQS->DefDomain && pQD->iMsgCount == 0 && pQD->iActive == 0) {
+		HashDel(pQS->hDomainHash, &pQD->HN);
+		SysFree(pQD->pszDomain);
+		SysFree(pQD);
+	}
+	QueSetShardReady(pMQ, pQS, !SYS_LIST_EMTPY(&pQS->DomainRing));
+}
+
+static void QueGroupIndexAdd(QueueShard *pQS, QueueMessage *pQM)
+{
+	/*
+	 * Ready messages having a group key are indexed by it, so that the
+	 * group companions can be reserved without walking the domain queue.
+	 * A message failing to enter the index is simply delivered alone.
+	 */
+	if (pQM->pszGroupKey != NULL) {
+		pQM->GHN.Key.pData = pQM->pszGroupKey;
+		if (HashAdd(pQS->hGroupHash, &pQM->GHN) < 0)
+			SYS_INIT_LIST_HEAD(&pQM->GHN.Lnk);
+	}
+}
+
+static void QueGroupIndexDel(QueueShard *pQS, QueueMessage *pQM)
+{
+	if (!SYS_LIST_EMTPY(&pQM->GHN.Lnk))
+		HashDel(pQS->hGroupHash, &pQM->GHN);
+}
+
+static void QueReadyAdd(MessageQueue *pMQ, QueueShard *pQS, QueueMessage *pQM, bool bHead)
+{
+	QueueDomain *pQD = QueGetDomain(pQS, pQM->pszDomain, (pQM->ulFlags & QUMF_LOCAL) != 0);
+
+	/* Messages going back to the head keep the time they became ready */
+	if (bHead)
+		SYS_LIST_ADDH(&pQM->LLink, &pQD->MsgList);
+	else {
+		SYS_LIST_ADDT(&pQM->LLink, &pQD->MsgList);
+		pQM->tReady = time(NULL);
+	}
+	++pQD->iMsgCount;
+	QueGroupIndexAdd(pQS, pQM);
+	QueUpdateDomain(pMQ, pQD);
+}
+
+static int QueReadyPush(MessageQueue *pMQ, QueueMessage *pQM, bool bHead)
+{
+	QueueShard *pQS = QueGetShard(pMQ, pQM);
+
+	if (SysLockMutex(pQS->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+	QueReadyAdd(pMQ, pQS, pQM, bHead);
+	SysUnlockMutex(pQS->hMutex);
+
+	return 0;
+}
+
+static bool QueBatchInShard(MessageQueue *pMQ, QueueShard *pQS, QMSG_HANDLE const *phMessages,
+			    int iCount)
+{
+	for (int i = 0; i < iCount; i++)
+		if (QueGetShard(pMQ, (QueueMessage *) phMessages[i]) == pQS)
+			return true;
+
+	return false;
+}
+
+static void QueUnlockBatchShards(MessageQueue *pMQ, int iNumShards, QMSG_HANDLE const *phMessages,
+				 int iCount)
+{
+	for (int i = 0; i < iNumShards; i++)
+		if (QueBatchInShard(pMQ, &pMQ->pShards[i], phMessages, iCount))
+			SysUnlockMutex(pMQ->pShards[i].hMutex);
+}
+
+static int QueReadyPushBatch(MessageQueue *pMQ, QMSG_HANDLE const *phMessages, int iCount)
+{
+	int i;
+
+	/*
+	 * All the shards touched by the batch are locked (always in index
+	 * order) before any message is added, so that either the whole batch
+	 * becomes visible to the SMAIL threads, or none of it does. This also
+	 * lets them see messages sharing the same destination together.
+	 */
+	for (i = 0; i < pMQ->iNumShards; i++)
+		if (QueBatchInShard(pMQ, &pMQ->pShards[i], phMessages, iCount) &&
+		    SysLockMutex(pMQ->pShards[i].hMutex, SYS_INFINITE_TIMEOUT) < 0) {
+			ErrorPush();
+			QueUnlockBatchShards(pMQ, i, phMessages, iCount);
+			return ErrorPop();
+		}
+	for (i = 0; i < iCount; i++) {
+		QueueMessage *pQM = (QueueMessage *) phMessages[i];
+
+		QueReadyAdd(pMQ, QueGetShard(pMQ, pQM), pQM, false);
+	}
+	QueUnlockBatchShards(pMQ, pMQ->iNumShards, phMessages, iCount);
+
+	return 0;
+}
+
+static void QueLoadRsnd(MessageQueue *pMQ, QueueMessage *pQM)
+{
+	/*
+	 * A message that cannot enter the resend arena would be forgotten until
+	 * the next restart, so it is rather tried again right away.
+	 */
+	if (QueRsndArenaPush(pMQ, pQM) < 0) {
+		SysLogMessage(LOG_LEV_ERROR, "Unable to add '%s' to the resend arena (%d)\n",
+			      pQM->pszFileName, ErrGetErrorCode());
+		QueReadyAdd(pMQ, QueGetShard(pMQ, pQM), pQM, false);
+	}
+}
+
+static QueueMessage *QueReadyGet(QueueShard *pQS)
+{
+	SysListHead *pRLink = SYS_LIST_FIRST(&pQS->DomainRing);
+
+	if (pRLink == NULL)
+		return NULL;
+
+	QueueDomain *pQD = SYS_LIST_ENTRY(pRLink, QueueDomain, RLink);
+	QueueMessage *pQM = SYS_LIST_ENTRY(SYS_LIST_FIRST(&pQD->MsgList), QueueMessage, LLink);
+
+	SYS_LIST_DEL(&pQM->LLink);
+	--pQD->iMsgCount;
+	QueGroupIndexDel(pQS, pQM);
+
+	/* The message holds a delivery slot of its domain, until released */
+	++pQD->iActive;
+	pQM->pQD = pQD;
+
+	/* Round robin, the domain goes back to the tail of the ring */
+	SYS_LIST_DEL(&pQD->RLink);
+	SYS_INIT_LIST_LINK(&pQD->RLink);
+
+	return pQM;
+}
+
 static int QueCreateStruct(char const *pszRootPath)
 {
 	/* Create message dir (new messages queue) */
@@ -187,6 +669,14 @@ static int QueCreateStruct(char const *pszRootPath)
 	AppendSlash(szDirPath);
 	StrSNCat(szDirPath, QUEUE_FROZ_DIR);
 
+	if (!SysExistDir(szDirPath) && SysMakeDir(szDirPath) < 0)
+		return ErrGetErrorCode();
+
+	/* Create shared message body dir */
+	StrSNCpy(szDirPath, pszRootPath);
+	AppendSlash(szDirPath);
+	StrSNCat(szDirPath, QUEUE_BODY_DIR);
+
 	if (!SysExistDir(szDirPath) && SysMakeDir(szDirPath) < 0)
 		return ErrGetErrorCode();
 
@@ -221,6 +711,63 @@ static int QueLoadMessageStat(MessageQueue *pMQ, QueueMessage *pQM)
 	return 0;
 }
 
+static bool QueMessageExist(MessageQueue *pMQ, int iLevel1, int iLevel2,
+			    char const *pszQueueDir, char const *pszFileName)
+{
+	char szFilePath[SYS_MAX_PATH];
+
+	SysSNPrintf(szFilePath, sizeof(szFilePath) - 1, "%s%d%s%d%s%s%s%s",
+		    pMQ->pszRootPath, iLevel1, SYS_SLASH_STR, iLevel2,
+		    SYS_SLASH_STR, pszQueueDir, SYS_SLASH_STR, pszFileName);
+
+	return SysExistFile(szFilePath) != 0;
+}
+
+static int QueCleanupBodies(MessageQueue *pMQ, int iLevel1, int iLevel2,
+			    HASH_HANDLE hLiveHash = INVALID_HASH_HANDLE)
+{
+	/*
+	 * Drop the shared body links whose message did not make it to the
+	 * queue (or has been removed by hand), since nobody else would
+	 * ever release them. Bodies are released together with their message,
+	 * so these are only left behind by submissions interrupted before the
+	 * commit. Links of messages known to be alive (if we have them at
+	 * hand) do not need to be checked against the spool directories.
+	 */
+	char szDirPath[SYS_MAX_PATH];
+	HashDatum Key;
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	SysSNPrintf(szDirPath, sizeof(szDirPath) - 1, "%s%d%s%d%s%s",
+		    pMQ->pszRootPath, iLevel1, SYS_SLASH_STR, iLevel2,
+		    SYS_SLASH_STR, QUEUE_BODY_DIR);
+
+	char szFileName[SYS_MAX_PATH];
+	FSCAN_HANDLE hFileScan = MscFirstFile(szDirPath, 0, szFileName, sizeof(szFileName));
+
+	if (hFileScan != INVALID_FSCAN_HANDLE) {
+		do {
+			Key.pData = szFileName;
+			if (!IsDotFilename(szFileName) &&
+			    (hLiveHash == INVALID_HASH_HANDLE ||
+			     HashGetFirst(hLiveHash, &Key, &HEnum, &pHNode) < 0) &&
+			    !QueMessageExist(pMQ, iLevel1, iLevel2, QUEUE_MESS_DIR, szFileName) &&
+			    !QueMessageExist(pMQ, iLevel1, iLevel2, QUEUE_RSND_DIR, szFileName) &&
+			    !QueMessageExist(pMQ, iLevel1, iLevel2, QUEUE_FROZ_DIR, szFileName)) {
+				char szFilePath[SYS_MAX_PATH];
+
+				SysSNPrintf(szFilePath, sizeof(szFilePath) - 1, "%s%s%s",
+					    szDirPath, SYS_SLASH_STR, szFileName);
+				SysRemove(szFilePath);
+			}
+		} while (MscNextFile(hFileScan, szFileName, sizeof(szFileName)));
+		MscCloseFindFile(hFileScan);
+	}
+
+	return 0;
+}
+
 static int QueLoadMessages(MessageQueue *pMQ, int iLevel1, int iLevel2)
 {
 	/* File scan the new messages dir */
@@ -241,18 +788,12 @@ static int QueLoadMessages(MessageQueue *pMQ, int iLevel1, int iLevel2)
 					QueAllocMessage(iLevel1, iLevel2, QUEUE_MESS_DIR,
 							szMsgFileName, 0, 0);
 
-				if (pQM != NULL) {
-					/* Add the file to the message queue */
-					SYS_LIST_ADDT(&pQM->LLink, &pMQ->ReadyQueue);
-					++pMQ->iReadyCount;
-				}
+				/* Add the file to the message queue */
+				if (pQM != NULL)
+					QueReadyAdd(pMQ, QueGetShard(pMQ, pQM), pQM, false);
 			}
 		} while (MscNextFile(hFileScan, szMsgFileName, sizeof(szMsgFileName)));
 		MscCloseFindFile(hFileScan);
-
-		/* Set the mess event if the queue is not empty */
-		if (pMQ->iReadyCount > 0)
-			SysSetEvent(pMQ->hReadyEvent);
 	}
 	/* File scan the resend messages dir */
 	SysSNPrintf(szDirPath, sizeof(szDirPath) - 1, "%s%d%s%d%s%s",
@@ -277,90 +818,604 @@ static int QueLoadMessages(MessageQueue *pMQ, int iLevel1, int iLevel2)
 							      SYS_SLASH_STR, QUEUE_RSND_DIR,
 							      SYS_SLASH_STR, szMsgFileName);
 
-						QueFreeMessage(pQM);
-					} else {
-						/* Add the file to the resend queue */
-						SYS_LIST_ADDT(&pQM->LLink, &pMQ->RsndArenaQueue);
-						++pMQ->iRsndArenaCount;
-					}
-				}
-			}
-		} while (MscNextFile(hFileScan, szMsgFileName, sizeof(szMsgFileName)));
-		MscCloseFindFile(hFileScan);
+						QueFreeMessage(pQM);
+					} else {
+						/* Add the file to the resend queue */
+						QueLoadRsnd(pMQ, pQM);
+					}
+				}
+			}
+		} while (MscNextFile(hFileScan, szMsgFileName, sizeof(szMsgFileName)));
+		MscCloseFindFile(hFileScan);
+	}
+
+	return QueCleanupBodies(pMQ, iLevel1, iLevel2);
+}
+
+static int QueLoad(MessageQueue *pMQ)
+{
+	char szCurrPath[SYS_MAX_PATH];
+
+	for (int i = 0; i < pMQ->iNumDirsLevel; i++) {
+		SysSNPrintf(szCurrPath, sizeof(szCurrPath) - 1, "%s%d", pMQ->pszRootPath, i);
+		if (!SysExistDir(szCurrPath) && (SysMakeDir(szCurrPath) < 0))
+			return ErrGetErrorCode();
+
+		for (int j = 0; j < pMQ->iNumDirsLevel; j++) {
+			SysSNPrintf(szCurrPath, sizeof(szCurrPath) - 1, "%s%d%s%d",
+				    pMQ->pszRootPath, i, SYS_SLASH_STR, j);
+			if (!SysExistDir(szCurrPath) && (SysMakeDir(szCurrPath) < 0))
+				return ErrGetErrorCode();
+
+			if (QueCreateStruct(szCurrPath) < 0 ||
+			    QueLoadMessages(pMQ, i, j) < 0)
+				return ErrGetErrorCode();
+		}
+	}
+
+	return 0;
+}
+
+static void QueJnlGetPath(MessageQueue *pMQ, char *pszJnlFile, char const *pszSuffix = "")
+{
+	SysSNPrintf(pszJnlFile, SYS_MAX_PATH - 1, "%s%s%s", pMQ->pszRootPath, QUE_JNL_FILE,
+		    pszSuffix);
+}
+
+static void QueJnlFreeMessage(void *pPrivate, HashNode *pHNode)
+{
+	QueFreeMessage(SYS_LIST_ENTRY(pHNode, QueueMessage, HN));
+}
+
+static QueueMessage *QueJnlFindMessage(HASH_HANDLE hHash, char const *pszFileName)
+{
+	HashDatum Key;
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	Key.pData = (void *) pszFileName;
+	if (HashGetFirst(hHash, &Key, &HEnum, &pHNode) < 0)
+		return NULL;
+
+	return SYS_LIST_ENTRY(pHNode, QueueMessage, HN);
+}
+
+static int QueJnlReplay(MessageQueue *pMQ, FILE *pJnlFile, SYS_OFF_T llEnd, HASH_HANDLE hHash,
+			SysListHead *pMsgList, bool bNeedClose)
+{
+	int iVersion = 0, iNumDirsLevel = 0;
+	bool bClosed = false;
+	char szJnlLine[SYS_MAX_PATH + 128];
+
+	if (MscFGets(szJnlLine, sizeof(szJnlLine) - 1, pJnlFile) == NULL ||
+	    sscanf(szJnlLine, QUE_JNL_HEADER " %d %d", &iVersion, &iNumDirsLevel) != 2 ||
+	    iVersion != QUE_JNL_VERSION || iNumDirsLevel != pMQ->iNumDirsLevel) {
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+	while ((llEnd < 0 || Sys_ftell(pJnlFile) < llEnd) &&
+	       MscFGets(szJnlLine, sizeof(szJnlLine) - 1, pJnlFile) != NULL) {
+		char cOp;
+		int iLevel1, iLevel2;
+		unsigned long ulLastTry = 0;
+		char szFileName[SYS_MAX_PATH];
+		char szArg[SYS_MAX_PATH];
+
+		/* Nothing can follow the close record */
+		if (bClosed) {
+			ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+			return ERR_INVALID_SPOOL_FILE;
+		}
+		if (strcmp(szJnlLine, "C") == 0) {
+			bClosed = true;
+			continue;
+		}
+
+		int iFields = sscanf(szJnlLine, "%c %d %d %255s %255s %lu", &cOp, &iLevel1,
+				     &iLevel2, szFileName, szArg, &ulLastTry);
+
+		if (iFields < 4 || iLevel1 < 0 || iLevel1 >= pMQ->iNumDirsLevel ||
+		    iLevel2 < 0 || iLevel2 >= pMQ->iNumDirsLevel) {
+			ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+			return ERR_INVALID_SPOOL_FILE;
+		}
+
+		QueueMessage *pQM = QueJnlFindMessage(hHash, szFileName);
+
+		switch (cOp) {
+		case 'M':
+		case 'R':
+			if (pQM == NULL) {
+				if ((pQM = QueAllocMessage(iLevel1, iLevel2, QUEUE_MESS_DIR,
+							   szFileName, 0, 0)) == NULL)
+					return ErrGetErrorCode();
+				pQM->HN.Key.pData = pQM->pszFileName;
+				if (HashAdd(hHash, &pQM->HN) < 0) {
+					ErrorPush();
+					QueFreeMessage(pQM);
+					return ErrorPop();
+				}
+
+				/* Keep the spool order, that the hash does not preserve */
+				SYS_LIST_ADDT(&pQM->LLink, pMsgList);
+			}
+			pQM->pszQueueDir = cOp == 'M' ? QUEUE_MESS_DIR: QUEUE_RSND_DIR;
+
+			/* The destination domain, if known, follows the file name */
+			if (iFields > 4 && pQM->pszDomain == NULL)
+				pQM->pszDomain = SysStrDup(szArg);
+			break;
+
+		case 'T':
+			if (iFields != 6) {
+				ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+				return ERR_INVALID_SPOOL_FILE;
+			}
+			if (pQM != NULL) {
+				pQM->iNumTries = atoi(szArg);
+				pQM->tLastTry = (time_t) ulLastTry;
+			}
+			break;
+
+		case 'L':
+			if (pQM != NULL)
+				pQM->ulFlags |= QUMF_LOCAL;
+			break;
+
+		case 'G':
+			if (iFields != 5) {
+				ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+				return ERR_INVALID_SPOOL_FILE;
+			}
+			if (pQM != NULL) {
+				char *pszGroupKey = SysStrDup(szArg);
+
+				if (pszGroupKey == NULL)
+					return ErrGetErrorCode();
+				SysFree(pQM->pszGroupKey);
+				pQM->pszGroupKey = pszGroupKey;
+			}
+			break;
+
+		case 'D':
+			if (pQM != NULL) {
+				HashDel(hHash, &pQM->HN);
+				SYS_LIST_DEL(&pQM->LLink);
+				QueFreeMessage(pQM);
+			}
+			break;
+
+		default:
+			ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+			return ERR_INVALID_SPOOL_FILE;
+		}
+	}
+
+	/*
+	 * Without the close record, the journal might be missing the last
+	 * operations done on the spool (crash, or threads killed at shutdown).
+	 */
+	if (bNeedClose && !bClosed) {
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+
+	return 0;
+}
+
+static int QueJnlLoad(MessageQueue *pMQ)
+{
+	char szJnlFile[SYS_MAX_PATH];
+
+	QueJnlGetPath(pMQ, szJnlFile);
+
+	FILE *pJnlFile = fopen(szJnlFile, "rt");
+
+	if (pJnlFile == NULL) {
+		ErrSetErrorCode(ERR_FILE_OPEN, szJnlFile);
+		return ERR_FILE_OPEN;
+	}
+
+	HashOps HOps;
+	HASH_HANDLE hHash;
+	SysListHead MsgList;
+
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((hHash = HashCreate(&HOps, QUE_JNL_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		fclose(pJnlFile);
+		return ErrorPop();
+	}
+	SYS_INIT_LIST_HEAD(&MsgList);
+	if (QueJnlReplay(pMQ, pJnlFile, -1, hHash, &MsgList, true) < 0) {
+		ErrorPush();
+		HashFree(hHash, QueJnlFreeMessage, NULL);
+		fclose(pJnlFile);
+		SysLogMessage(LOG_LEV_MESSAGE, "Spool journal not usable, scanning the spool\n");
+		return ErrorPop();
+	}
+	fclose(pJnlFile);
+
+	/*
+	 * The journal does not track the shared message bodies, so the links
+	 * left behind by submissions that never made it to the queue need to be
+	 * swept here too. Only the (small) body directories get scanned, and
+	 * only the links not belonging to a journaled message are checked.
+	 */
+	for (int i = 0; i < pMQ->iNumDirsLevel; i++)
+		for (int j = 0; j < pMQ->iNumDirsLevel; j++)
+			QueCleanupBodies(pMQ, i, j, hHash);
+
+	/*
+	 * Messages still in the spool go to the ready queue or to the resend
+	 * arena, in the order they were committed.
+	 */
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_FIRST(&MsgList)) != NULL) {
+		QueueMessage *pQM = SYS_LIST_ENTRY(pLLink, QueueMessage, LLink);
+
+		SYS_LIST_DEL(&pQM->LLink);
+		if (strcmp(pQM->pszQueueDir, QUEUE_RSND_DIR) == 0)
+			QueLoadRsnd(pMQ, pQM);
+		else
+			QueReadyAdd(pMQ, QueGetShard(pMQ, pQM), pQM, false);
+	}
+	HashFree(hHash, NULL, NULL);
+
+	return 0;
+}
+
+static int QueJnlWriteRecord(FILE *pJnlFile, char cOp, QueueMessage *pQM)
+{
+	if (cOp == 'T')
+		fprintf(pJnlFile, "%c %d %d %s %d %lu\n", cOp, pQM->iLevel1, pQM->iLevel2,
+			pQM->pszFileName, pQM->iNumTries, (unsigned long) pQM->tLastTry);
+	else if (cOp == 'G')
+		fprintf(pJnlFile, "%c %d %d %s %s\n", cOp, pQM->iLevel1, pQM->iLevel2,
+			pQM->pszFileName, pQM->pszGroupKey);
+	else if ((cOp == 'M' || cOp == 'R') && pQM->pszDomain != NULL)
+		fprintf(pJnlFile, "%c %d %d %s %s\n", cOp, pQM->iLevel1, pQM->iLevel2,
+			pQM->pszFileName, pQM->pszDomain);
+	else
+		fprintf(pJnlFile, "%c %d %d %s\n", cOp, pQM->iLevel1, pQM->iLevel2,
+			pQM->pszFileName);
+
+	return 0;
+}
+
+static int QueJnlWriteMessage(FILE *pJnlFile, QueueMessage *pQM)
+{
+	QueJnlWriteRecord(pJnlFile, strcmp(pQM->pszQueueDir, QUEUE_RSND_DIR) == 0 ? 'R': 'M',
+			  pQM);
+	if (pQM->ulFlags & QUMF_LOCAL)
+		QueJnlWriteRecord(pJnlFile, 'L', pQM);
+	if (pQM->pszGroupKey != NULL)
+		QueJnlWriteRecord(pJnlFile, 'G', pQM);
+	if (pQM->iNumTries > 0)
+		QueJnlWriteRecord(pJnlFile, 'T', pQM);
+
+	return 0;
+}
+
+static int QueJnlWriteDomain(FILE *pJnlFile, QueueDomain *pQD)
+{
+	SysListHead *pLLink;
+
+	SYS_LIST_FOR_EACH(pLLink, &pQD->MsgList)
+		QueJnlWriteMessage(pJnlFile, SYS_LIST_ENTRY(pLLink, QueueMessage, LLink));
+
+	return pQD->iMsgCount;
+}
+
+static int QueJnlInstall(MessageQueue *pMQ, FILE *pTmpFile, char const *pszTmpFile,
+			 char const *pszJnlFile, int iLive)
+{
+	/*
+	 * Any failure leaves us without a journal, and the next startup will
+	 * scan the spool directories.
+	 */
+	if (ferror(pTmpFile) || fclose(pTmpFile)) {
+		SysRemove(pszTmpFile);
+		SysRemove(pszJnlFile);
+		ErrSetErrorCode(ERR_FILE_WRITE, pszTmpFile);
+		return ERR_FILE_WRITE;
+	}
+	if (SysMoveFile(pszTmpFile, pszJnlFile) < 0) {
+		ErrorPush();
+		SysRemove(pszTmpFile);
+		SysRemove(pszJnlFile);
+		return ErrorPop();
+	}
+	if ((pMQ->pJnlFile = fopen(pszJnlFile, "at")) == NULL) {
+		SysRemove(pszJnlFile);
+		ErrSetErrorCode(ERR_FILE_OPEN, pszJnlFile);
+		return ERR_FILE_OPEN;
+	}
+	pMQ->iJnlRecords = 0;
+	pMQ->iJnlLive = iLive;
+
+	return 0;
+}
+
+static int QueJnlCheckpoint(MessageQueue *pMQ)
+{
+	int iLive = 0;
+	char szJnlFile[SYS_MAX_PATH];
+	char szTmpFile[SYS_MAX_PATH];
+
+	/*
+	 * Start a new journal with the current content of the queue. This also
+	 * drops the close record of the old one, that is no more valid as soon
+	 * as the queue starts being used.
+	 */
+	QueJnlGetPath(pMQ, szJnlFile);
+	QueJnlGetPath(pMQ, szTmpFile, ".tmp");
+
+	FILE *pJnlFile = fopen(szTmpFile, "wt");
+
+	if (pJnlFile == NULL) {
+		SysRemove(szJnlFile);
+		ErrSetErrorCode(ERR_FILE_CREATE, szTmpFile);
+		return ERR_FILE_CREATE;
+	}
+	fprintf(pJnlFile, "%s %d %d\n", QUE_JNL_HEADER, QUE_JNL_VERSION, pMQ->iNumDirsLevel);
+	for (int i = 0; i < pMQ->iNumShards; i++) {
+		QueueShard *pQS = &pMQ->pShards[i];
+		HashEnum HEnum;
+		HashNode *pHNode;
+
+		iLive += QueJnlWriteDomain(pJnlFile, &pQS->DefDomain);
+		if (HashFirst(pQS->hDomainHash, &HEnum, &pHNode) == 0) {
+			do
+				iLive += QueJnlWriteDomain(pJnlFile,
+							   SYS_LIST_ENTRY(pHNode, QueueDomain, HN));
+			while (HashNext(pQS->hDomainHash, &HEnum, &pHNode) == 0);
+		}
+	}
+	for (int i = 0; i < pMQ->iRsndArenaCount; i++, iLive++)
+		QueJnlWriteMessage(pJnlFile, pMQ->ppRsndArena[i]);
+
+	return QueJnlInstall(pMQ, pJnlFile, szTmpFile, szJnlFile, iLive);
+}
+
+static int QueJnlCopyTail(MessageQueue *pMQ, FILE *pTmpFile, char const *pszJnlFile,
+			  SYS_OFF_T llOffset)
+{
+	/* Called with the journal lock held */
+	if (fflush(pMQ->pJnlFile)) {
+		ErrSetErrorCode(ERR_FILE_WRITE, pszJnlFile);
+		return ERR_FILE_WRITE;
+	}
+
+	FILE *pJnlFile = fopen(pszJnlFile, "rb");
+
+	if (pJnlFile == NULL) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszJnlFile);
+		return ERR_FILE_OPEN;
+	}
+	if (Sys_fseek(pJnlFile, llOffset, SEEK_SET)) {
+		fclose(pJnlFile);
+		ErrSetErrorCode(ERR_FILE_READ, pszJnlFile);
+		return ERR_FILE_READ;
+	}
+
+	char szJnlLine[SYS_MAX_PATH + 128];
+
+	while (MscFGets(szJnlLine, sizeof(szJnlLine) - 1, pJnlFile) != NULL)
+		fprintf(pTmpFile, "%s\n", szJnlLine);
+	if (ferror(pJnlFile)) {
+		fclose(pJnlFile);
+		ErrSetErrorCode(ERR_FILE_READ, pszJnlFile);
+		return ERR_FILE_READ;
+	}
+	fclose(pJnlFile);
+
+	return 0;
+}
+
+static int QueJnlCompact(MessageQueue *pMQ)
+{
+	/*
+	 * Messages being processed by the SMAIL threads are in neither the ready
+	 * queue nor the resend arena, so the compacted journal is built by
+	 * replaying the current one, and not from the queue content like
+	 * QueJnlCheckpoint() does. The replay works on a snapshot of the
+	 * journal, and the journal lock is taken again only to append the
+	 * records logged meanwhile, and to swap the files.
+	 */
+	int iLive = 0, iRecords;
+	SYS_FILE_INFO FI;
+	char szJnlFile[SYS_MAX_PATH];
+	char szTmpFile[SYS_MAX_PATH];
+
+	QueJnlGetPath(pMQ, szJnlFile);
+	QueJnlGetPath(pMQ, szTmpFile, ".tmp");
+	if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+	if (pMQ->pJnlFile == NULL) {
+		SysUnlockMutex(pMQ->hJnlMutex);
+		return 0;
+	}
+	if (fflush(pMQ->pJnlFile)) {
+		SysUnlockMutex(pMQ->hJnlMutex);
+		ErrSetErrorCode(ERR_FILE_WRITE, szJnlFile);
+		return ERR_FILE_WRITE;
+	}
+	if (SysGetFileInfo(szJnlFile, FI) < 0) {
+		ErrorPush();
+		SysUnlockMutex(pMQ->hJnlMutex);
+		return ErrorPop();
+	}
+	iRecords = pMQ->iJnlRecords;
+	SysUnlockMutex(pMQ->hJnlMutex);
+
+	FILE *pJnlFile = fopen(szJnlFile, "rb");
+
+	if (pJnlFile == NULL) {
+		ErrSetErrorCode(ERR_FILE_OPEN, szJnlFile);
+		return ERR_FILE_OPEN;
+	}
+
+	HashOps HOps;
+	HASH_HANDLE hHash;
+	SysListHead MsgList;
+
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((hHash = HashCreate(&HOps, QUE_JNL_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		fclose(pJnlFile);
+		return ErrorPop();
+	}
+	SYS_INIT_LIST_HEAD(&MsgList);
+	if (QueJnlReplay(pMQ, pJnlFile, FI.llSize, hHash, &MsgList, false) < 0) {
+		ErrorPush();
+		HashFree(hHash, QueJnlFreeMessage, NULL);
+		fclose(pJnlFile);
+		return ErrorPop();
+	}
+	fclose(pJnlFile);
+	if ((pJnlFile = fopen(szTmpFile, "wt")) == NULL) {
+		HashFree(hHash, QueJnlFreeMessage, NULL);
+		ErrSetErrorCode(ERR_FILE_CREATE, szTmpFile);
+		return ERR_FILE_CREATE;
+	}
+	fprintf(pJnlFile, "%s %d %d\n", QUE_JNL_HEADER, QUE_JNL_VERSION, pMQ->iNumDirsLevel);
+
+	SysListHead *pLLink;
+
+	SYS_LIST_FOR_EACH(pLLink, &MsgList) {
+		QueJnlWriteMessage(pJnlFile, SYS_LIST_ENTRY(pLLink, QueueMessage, LLink));
+		iLive++;
 	}
+	HashFree(hHash, QueJnlFreeMessage, NULL);
 
-	return 0;
+	if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) < 0) {
+		ErrorPush();
+		fclose(pJnlFile);
+		SysRemove(szTmpFile);
+		return ErrorPop();
+	}
+
+	/* Closed while we were working */
+	if (pMQ->pJnlFile == NULL) {
+		SysUnlockMutex(pMQ->hJnlMutex);
+		fclose(pJnlFile);
+		SysRemove(szTmpFile);
+		return 0;
+	}
+	/* On failure, the old journal is still good */
+	if (QueJnlCopyTail(pMQ, pJnlFile, szJnlFile, FI.llSize) < 0) {
+		ErrorPush();
+		SysUnlockMutex(pMQ->hJnlMutex);
+		fclose(pJnlFile);
+		SysRemove(szTmpFile);
+		return ErrorPop();
+	}
+	iRecords = pMQ->iJnlRecords - iRecords;
+
+	/* The old journal must be closed before being replaced */
+	bool bFailed = ferror(pMQ->pJnlFile) != 0;
+	int iError;
+
+	if (fclose(pMQ->pJnlFile) || bFailed) {
+		pMQ->pJnlFile = NULL;
+		fclose(pJnlFile);
+		SysRemove(szTmpFile);
+		SysRemove(szJnlFile);
+		ErrSetErrorCode(ERR_FILE_WRITE, szJnlFile);
+		iError = ERR_FILE_WRITE;
+	} else {
+		pMQ->pJnlFile = NULL;
+		if ((iError = QueJnlInstall(pMQ, pJnlFile, szTmpFile, szJnlFile, iLive)) == 0)
+			pMQ->iJnlRecords = iRecords;
+	}
+	SysUnlockMutex(pMQ->hJnlMutex);
+
+	return iError;
 }
 
-static int QueLoad(MessageQueue *pMQ)
+static int QueJnlCheckCompact(MessageQueue *pMQ)
 {
-	char szCurrPath[SYS_MAX_PATH];
+	int iError = 0;
 
-	for (int i = 0; i < pMQ->iNumDirsLevel; i++) {
-		SysSNPrintf(szCurrPath, sizeof(szCurrPath) - 1, "%s%d", pMQ->pszRootPath, i);
-		if (!SysExistDir(szCurrPath) && (SysMakeDir(szCurrPath) < 0))
-			return ErrGetErrorCode();
+	if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
 
-		for (int j = 0; j < pMQ->iNumDirsLevel; j++) {
-			SysSNPrintf(szCurrPath, sizeof(szCurrPath) - 1, "%s%d%s%d",
-				    pMQ->pszRootPath, i, SYS_SLASH_STR, j);
-			if (!SysExistDir(szCurrPath) && (SysMakeDir(szCurrPath) < 0))
-				return ErrGetErrorCode();
+	bool bCompact = pMQ->pJnlFile != NULL &&
+		pMQ->iJnlRecords > Max(QUE_JNL_COMPACT_MIN, QUE_JNL_COMPACT_RATIO * pMQ->iJnlLive);
 
-			if (QueCreateStruct(szCurrPath) < 0 ||
-			    QueLoadMessages(pMQ, i, j) < 0)
-				return ErrGetErrorCode();
+	SysUnlockMutex(pMQ->hJnlMutex);
+	if (bCompact && (iError = QueJnlCompact(pMQ)) < 0) {
+		SysLogMessage(LOG_LEV_ERROR, "Unable to compact the spool journal (%d)\n", iError);
+
+		/* Do not retry on every scan */
+		if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) == 0) {
+			pMQ->iJnlRecords = 0;
+			SysUnlockMutex(pMQ->hJnlMutex);
 		}
 	}
 
-	return 0;
+	return iError;
 }
 
-static time_t QueNextRetryOp(int iNumTries, unsigned int uRetryTimeout,
-			     unsigned int uRetryIncrRatio)
+static int QueJnlLog(MessageQueue *pMQ, char cOp, QueueMessage *pQM)
 {
-	unsigned int uNextOp = uRetryTimeout;
-
-	if (uRetryIncrRatio != 0)
-		for (int i = 1; i < iNumTries; i++)
-			uNextOp += uNextOp / uRetryIncrRatio;
+	if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+	if (pMQ->pJnlFile != NULL) {
+		QueJnlWriteRecord(pMQ->pJnlFile, cOp, pQM);
+		pMQ->iJnlRecords++;
+	}
+	SysUnlockMutex(pMQ->hJnlMutex);
 
-	return (time_t) uNextOp;
+	return 0;
 }
 
-static bool QueMessageReadyToSend(MessageQueue *pMQ, QueueMessage *pQM)
+static int QueJnlClose(MessageQueue *pMQ)
 {
-	return (time(NULL) > (pQM->tLastTry +
-			      QueNextRetryOp(pQM->iNumTries, (unsigned int) pMQ->iRetryTimeout,
-					     (unsigned int) pMQ->iRetryIncrRatio)));
+	if (SysLockMutex(pMQ->hJnlMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+	if (pMQ->pJnlFile != NULL) {
+		/* A journal that failed to record everything must not be trusted */
+		bool bFailed = ferror(pMQ->pJnlFile) != 0;
+
+		if (!bFailed)
+			fprintf(pMQ->pJnlFile, "C\n");
+		bFailed = bFailed || ferror(pMQ->pJnlFile);
+		if (fclose(pMQ->pJnlFile) || bFailed) {
+			char szJnlFile[SYS_MAX_PATH];
+
+			QueJnlGetPath(pMQ, szJnlFile);
+			SysRemove(szJnlFile);
+		}
+		pMQ->pJnlFile = NULL;
+	}
+	SysUnlockMutex(pMQ->hJnlMutex);
+
+	return 0;
 }
 
 static int QueScanRsndArena(MessageQueue *pMQ)
 {
-	if (SysLockMutex(pMQ->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+	if (SysLockMutex(pMQ->hRsndMutex, SYS_INFINITE_TIMEOUT) < 0)
 		return ErrGetErrorCode();
 
-	SysListHead *pLLink;
-
-	SYS_LIST_FOR_EACH(pLLink, &pMQ->RsndArenaQueue) {
-		QueueMessage *pQM = SYS_LIST_ENTRY(pLLink, QueueMessage, LLink);
-
-		if (QueMessageReadyToSend(pMQ, pQM)) {
-			/* Set the list pointer to the next item */
-			pLLink = pLLink->pPrev;
-
-			/* Remove item from resend arena */
-			SYS_LIST_DEL(&pQM->LLink);
-			--pMQ->iRsndArenaCount;
+	/*
+	 * The arena is a heap ordered by retry time, so only the messages that
+	 * are due get looked at.
+	 */
+	time_t tCurr = time(NULL);
 
-			/* Add item from resend queue */
-			SYS_LIST_ADDT(&pQM->LLink, &pMQ->ReadyQueue);
-			++pMQ->iReadyCount;
-		}
+	while (pMQ->iRsndArenaCount > 0 && tCurr > pMQ->ppRsndArena[0]->tNextTry) {
+		/* Add item from resend queue */
+		QueReadyPush(pMQ, QueRsndArenaPop(pMQ), false);
 	}
-	if (pMQ->iReadyCount > 0)
-		SysSetEvent(pMQ->hReadyEvent);
-	SysUnlockMutex(pMQ->hMutex);
+	SysUnlockMutex(pMQ->hRsndMutex);
 
 	return 0;
 }
@@ -368,18 +1423,15 @@ static int QueScanRsndArena(MessageQueue *pMQ)
 static unsigned int QueRsndThread(void *pThreadData)
 {
 	MessageQueue *pMQ = (MessageQueue *) pThreadData;
-	int iElapsedTime = 0;
 
 	while ((pMQ->ulFlags & QUEF_SHUTDOWN) == 0) {
 		SysSleep(QUE_ARENA_SCAN_WAIT);
 
-		iElapsedTime += QUE_ARENA_SCAN_WAIT;
-		if (iElapsedTime > QUE_ARENA_SCAN_INTERVAL) {
-			iElapsedTime = 0;
+		/* Promote the rsnd arena messages that are due */
+		QueScanRsndArena(pMQ);
 
-			/* Scan rsnd arena to prepare messages to resend */
-			QueScanRsndArena(pMQ);
-		}
+		/* Keep the spool journal from growing without bounds */
+		QueJnlCheckCompact(pMQ);
 	}
 	pMQ->ulFlags &= ~QUEF_SHUTDOWN;
 
@@ -387,29 +1439,64 @@ static unsigned int QueRsndThread(void *pThreadData)
 }
 
 QUEUE_HANDLE QueOpen(char const *pszRootPath, int iMaxRetry, int iRetryTimeout,
-		     int iRetryIncrRatio, int iNumDirsLevel)
+		     int iRetryIncrRatio, int iNumDirsLevel, int iDomainMaxActive,
+		     int iNumShards)
 {
 	MessageQueue *pMQ = (MessageQueue *) SysAlloc(sizeof(MessageQueue));
 
 	if (pMQ == NULL)
 		return INVALID_QUEUE_HANDLE;
 
-	SYS_INIT_LIST_HEAD(&pMQ->ReadyQueue);
-	SYS_INIT_LIST_HEAD(&pMQ->RsndArenaQueue);
-	pMQ->iReadyCount = 0;
+	pMQ->iReadyShards = 0;
+	pMQ->iDomainMaxActive = iDomainMaxActive;
+	SYS_INIT_LIST_HEAD(&pMQ->SyncQueue);
+	pMQ->iSyncActive = 0;
+	pMQ->iSyncRunning = 0;
+	pMQ->ppRsndArena = NULL;
 	pMQ->iRsndArenaCount = 0;
+	pMQ->iRsndArenaSize = 0;
 	pMQ->iMaxRetry = iMaxRetry;
 	pMQ->iRetryTimeout = iRetryTimeout;
 	pMQ->iRetryIncrRatio = iRetryIncrRatio;
 	pMQ->iNumDirsLevel = iNumDirsLevel;
 	pMQ->ulFlags = 0;
 
-	if ((pMQ->hMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+	if ((pMQ->hRsndMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
 		SysFree(pMQ);
 		return INVALID_QUEUE_HANDLE;
 	}
 	if ((pMQ->hReadyEvent = SysCreateEvent(1)) == SYS_INVALID_EVENT) {
-		SysCloseMutex(pMQ->hMutex);
+		SysCloseMutex(pMQ->hRsndMutex);
+		SysFree(pMQ);
+		return INVALID_QUEUE_HANDLE;
+	}
+	if ((pMQ->hReadyMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+		SysCloseEvent(pMQ->hReadyEvent);
+		SysCloseMutex(pMQ->hRsndMutex);
+		SysFree(pMQ);
+		return INVALID_QUEUE_HANDLE;
+	}
+	if ((pMQ->hSyncMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+		SysCloseMutex(pMQ->hReadyMutex);
+		SysCloseEvent(pMQ->hReadyEvent);
+		SysCloseMutex(pMQ->hRsndMutex);
+		SysFree(pMQ);
+		return INVALID_QUEUE_HANDLE;
+	}
+	if ((pMQ->hJnlMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+		SysCloseMutex(pMQ->hSyncMutex);
+		SysCloseMutex(pMQ->hReadyMutex);
+		SysCloseEvent(pMQ->hReadyEvent);
+		SysCloseMutex(pMQ->hRsndMutex);
+		SysFree(pMQ);
+		return INVALID_QUEUE_HANDLE;
+	}
+	if (QueCreateShards(pMQ, Min(QUE_MAX_SHARDS, Max(1, iNumShards))) < 0) {
+		SysCloseMutex(pMQ->hJnlMutex);
+		SysCloseMutex(pMQ->hSyncMutex);
+		SysCloseMutex(pMQ->hReadyMutex);
+		SysCloseEvent(pMQ->hReadyEvent);
+		SysCloseMutex(pMQ->hRsndMutex);
 		SysFree(pMQ);
 		return INVALID_QUEUE_HANDLE;
 	}
@@ -421,25 +1508,45 @@ QUEUE_HANDLE QueOpen(char const *pszRootPath, int iMaxRetry, int iRetryTimeout,
 
 	pMQ->pszRootPath = SysStrDup(szRootPath);
 
-	/* Load queue status */
-	if (QueLoad(pMQ) < 0) {
+	/*
+	 * Load queue status. The journal left by a clean shutdown saves us the
+	 * scan of the whole spool, otherwise the spool directories are the only
+	 * reliable source.
+	 */
+	pMQ->pJnlFile = NULL;
+	pMQ->iJnlRecords = 0;
+	pMQ->iJnlLive = 0;
+	if (QueJnlLoad(pMQ) < 0 && QueLoad(pMQ) < 0) {
 		ErrorPush();
+		QueFreeShards(pMQ);
+		QueFreeRsndArena(pMQ);
 		SysFree(pMQ->pszRootPath);
+		SysCloseMutex(pMQ->hJnlMutex);
+		SysCloseMutex(pMQ->hSyncMutex);
+		SysCloseMutex(pMQ->hReadyMutex);
 		SysCloseEvent(pMQ->hReadyEvent);
-		SysCloseMutex(pMQ->hMutex);
+		SysCloseMutex(pMQ->hRsndMutex);
 		SysFree(pMQ);
 
 		ErrSetErrorCode(ErrorPop());
 		return INVALID_QUEUE_HANDLE;
 	}
+	if (QueJnlCheckpoint(pMQ) < 0)
+		SysLogMessage(LOG_LEV_ERROR, "Unable to create the spool journal (%d)\n",
+			      ErrGetErrorCode());
+
 	/* Start rsnd arena scan thread */
 	if ((pMQ->hRsndScanThread = SysCreateThread(QueRsndThread, pMQ)) == SYS_INVALID_THREAD) {
 		ErrorPush();
-		QueFreeMessList(&pMQ->ReadyQueue);
-		QueFreeMessList(&pMQ->RsndArenaQueue);
+		QueJnlClose(pMQ);
+		QueFreeShards(pMQ);
+		QueFreeRsndArena(pMQ);
 		SysFree(pMQ->pszRootPath);
+		SysCloseMutex(pMQ->hJnlMutex);
+		SysCloseMutex(pMQ->hSyncMutex);
+		SysCloseMutex(pMQ->hReadyMutex);
 		SysCloseEvent(pMQ->hReadyEvent);
-		SysCloseMutex(pMQ->hMutex);
+		SysCloseMutex(pMQ->hRsndMutex);
 		SysFree(pMQ);
 
 		ErrSetErrorCode(ErrorPop());
@@ -458,11 +1565,16 @@ int QueClose(QUEUE_HANDLE hQueue)
 	SysWaitThread(pMQ->hRsndScanThread, QUE_SCAN_THREAD_MAXWAIT);
 	SysCloseThread(pMQ->hRsndScanThread, 1);
 
+	QueJnlClose(pMQ);
+
 	/* Clear queues */
-	QueFreeMessList(&pMQ->ReadyQueue);
-	QueFreeMessList(&pMQ->RsndArenaQueue);
+	QueFreeShards(pMQ);
+	QueFreeRsndArena(pMQ);
+	SysCloseMutex(pMQ->hJnlMutex);
+	SysCloseMutex(pMQ->hSyncMutex);
+	SysCloseMutex(pMQ->hReadyMutex);
 	SysCloseEvent(pMQ->hReadyEvent);
-	SysCloseMutex(pMQ->hMutex);
+	SysCloseMutex(pMQ->hRsndMutex);
 	SysFree(pMQ->pszRootPath);
 	SysFree(pMQ);
 
@@ -555,6 +1667,8 @@ static int QueStatMessage(MessageQueue *pMQ, QueueMessage *pQM)
 	fprintf(pLogFile, "[PeekTime] %lu : %s\n", (unsigned long) tCurr, szTime);
 	fclose(pLogFile);
 
+	QueJnlLog(pMQ, 'T', pQM);
+
 	return 0;
 }
 
@@ -612,11 +1726,43 @@ int QueGetFilePath(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, char *pszFilePath,
 	return QueGetFilePath(pMQ, pQM, pszFilePath, pszQueueDir);
 }
 
+static int QueReleaseMessage(MessageQueue *pMQ, QueueMessage *pQM)
+{
+	/*
+	 * Group companions not claimed by the message owner go back to the head
+	 * of the ready queue, where they were taken from.
+	 */
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_LAST(&pQM->GroupList)) != NULL) {
+		SYS_LIST_DEL(pLLink);
+		QueReadyPush(pMQ, SYS_LIST_ENTRY(pLLink, QueueMessage, LLink), true);
+	}
+	pQM->iGroupCount = 0;
+
+	/* Give back the delivery slot taken on the message domain */
+	if (pQM->pQD != NULL) {
+		QueueDomain *pQD = pQM->pQD;
+		QueueShard *pQS = pQD->pQS;
+
+		if (SysLockMutex(pQS->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+			return ErrGetErrorCode();
+		pQM->pQD = NULL;
+		--pQD->iActive;
+		QueUpdateDomain(pMQ, pQD);
+		SysUnlockMutex(pQS->hMutex);
+	}
+
+	return 0;
+}
+
 static int QueDoMessageCleanup(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 {
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
 	QueueMessage *pQM = (QueueMessage *) hMessage;
 	char szQueueFilePath[SYS_MAX_PATH];
+	bool bQueued = strcmp(pQM->pszQueueDir, QUEUE_MESS_DIR) == 0 ||
+		strcmp(pQM->pszQueueDir, QUEUE_RSND_DIR) == 0;
 
 	if (pQM->ulFlags & QUMF_FREEZE) {
 		/* Move message file */
@@ -641,8 +1787,15 @@ static int QueDoMessageCleanup(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 		/* Clean 'slog' file */
 		QueGetFilePath(pMQ, pQM, szQueueFilePath, QUEUE_SLOG_DIR);
 		SysRemove(szQueueFilePath);
+
+		/* Release the shared message body */
+		QueGetFilePath(pMQ, pQM, szQueueFilePath, QUEUE_BODY_DIR);
+		CheckRemoveFile(szQueueFilePath);
 	}
 
+	if (bQueued)
+		QueJnlLog(pMQ, 'D', pQM);
+
 	/* Clean 'temp' file */
 	QueGetFilePath(pMQ, pQM, szQueueFilePath, QUEUE_TEMP_DIR);
 	SysRemove(szQueueFilePath);
@@ -663,6 +1816,7 @@ int QueCloseMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
 	QueueMessage *pQM = (QueueMessage *) hMessage;
 
+	QueReleaseMessage(pMQ, pQM);
 	if (pQM->ulFlags & QUMF_DELETED)
 		QueDoMessageCleanup(hQueue, hMessage);
 	QueFreeMessage(pQM);
@@ -727,6 +1881,50 @@ time_t QueGetLastTryTime(QMSG_HANDLE hMessage)
 	return pQM->tLastTry;
 }
 
+int QueSetMessageGroup(QMSG_HANDLE hMessage, char const *pszGroupKey)
+{
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+	char *pszKey = NULL;
+
+	if (pszGroupKey != NULL && (pszKey = SysStrDup(pszGroupKey)) == NULL)
+		return ErrGetErrorCode();
+	SysFree(pQM->pszGroupKey);
+	pQM->pszGroupKey = pszKey;
+
+	return 0;
+}
+
+char const *QueGetMessageGroup(QMSG_HANDLE hMessage)
+{
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+
+	return pQM->pszGroupKey;
+}
+
+int QueSetMessageDomain(QMSG_HANDLE hMessage, char const *pszDomain, bool bLocal)
+{
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+	char *pszDom = NULL;
+
+	if (pszDomain != NULL && (pszDom = SysStrDup(pszDomain)) == NULL)
+		return ErrGetErrorCode();
+	SysFree(pQM->pszDomain);
+	pQM->pszDomain = pszDom;
+	if (bLocal)
+		pQM->ulFlags |= QUMF_LOCAL;
+	else
+		pQM->ulFlags &= ~QUMF_LOCAL;
+
+	return 0;
+}
+
+char const *QueGetMessageDomain(QMSG_HANDLE hMessage)
+{
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+
+	return pQM->pszDomain;
+}
+
 time_t QueGetMessageNextOp(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 {
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
@@ -748,6 +1946,7 @@ int QueInitMessageStats(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	/* Init message statistics */
 	pQM->iNumTries = 0;
 	pQM->tLastTry = 0;
+	QueJnlLog(pMQ, 'T', pQM);
 
 	return 0;
 }
@@ -767,22 +1966,11 @@ int QueCleanupMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, bool bFreeze)
 static int QueAddNew(MessageQueue *pMQ, QueueMessage *pQM)
 {
 	/* Add the queue entry */
-	if (SysLockMutex(pMQ->hMutex, SYS_INFINITE_TIMEOUT) < 0)
-		return ErrGetErrorCode();
-
-	SYS_LIST_ADDT(&pQM->LLink, &pMQ->ReadyQueue);
-	++pMQ->iReadyCount;
-	SysSetEvent(pMQ->hReadyEvent);
-	SysUnlockMutex(pMQ->hMutex);
-
-	return 0;
+	return QueReadyPush(pMQ, pQM, false);
 }
 
-int QueCommitMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
+static int QueMoveToMess(MessageQueue *pMQ, QueueMessage *pQM)
 {
-	MessageQueue *pMQ = (MessageQueue *) hQueue;
-	QueueMessage *pQM = (QueueMessage *) hMessage;
-
 	/* Move message file (if not in mess) */
 	if (strcmp(pQM->pszQueueDir, QUEUE_MESS_DIR) != 0) {
 		char szSourceFile[SYS_MAX_PATH];
@@ -800,6 +1988,24 @@ int QueCommitMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	/* Unmask temporary flags */
 	pQM->ulFlags = QUE_MASK_TMPFLAGS(pQM->ulFlags);
 
+	QueJnlLog(pMQ, 'M', pQM);
+	if (pQM->ulFlags & QUMF_LOCAL)
+		QueJnlLog(pMQ, 'L', pQM);
+	if (pQM->pszGroupKey != NULL)
+		QueJnlLog(pMQ, 'G', pQM);
+
+	return 0;
+}
+
+int QueCommitMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+
+	QueReleaseMessage(pMQ, pQM);
+	if (QueMoveToMess(pMQ, pQM) < 0)
+		return ErrGetErrorCode();
+
 	/* Add to queue */
 	if (QueAddNew(pMQ, pQM) < 0)
 		return ErrGetErrorCode();
@@ -807,6 +2013,210 @@ int QueCommitMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	return 0;
 }
 
+int QueCommitMessages(QUEUE_HANDLE hQueue, QMSG_HANDLE const *phMessages, int iCount)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	int i;
+
+	/*
+	 * No message reaches the ready queue unless all of them have been
+	 * moved inside the mess directories. In case of failure the caller
+	 * still owns all the handles, and dropping them (QueCleanupMessage()
+	 * and QueCloseMessage()) also removes, and journals the removal of,
+	 * the files that were already moved.
+	 */
+	for (i = 0; i < iCount; i++)
+		if (QueMoveToMess(pMQ, (QueueMessage *) phMessages[i]) < 0)
+			return ErrGetErrorCode();
+
+	return QueReadyPushBatch(pMQ, phMessages, iCount);
+}
+
+static bool QueSyncDirDone(SysListHead *pBatch, QueueSyncRequest *pLastSR, int iLast,
+			   QueueMessage *pQM)
+{
+	SysListHead *pPos;
+
+	SYS_LIST_FOR_EACH(pPos, pBatch) {
+		QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+		int iCount = pSR == pLastSR ? iLast: pSR->iCount;
+
+		if (pSR->iError == 0)
+			for (int i = 0; i < iCount; i++) {
+				QueueMessage *pCurrQM = (QueueMessage *) pSR->phMessages[i];
+
+				if (pCurrQM->iLevel1 == pQM->iLevel1 &&
+				    pCurrQM->iLevel2 == pQM->iLevel2)
+					return true;
+			}
+		if (pSR == pLastSR)
+			break;
+	}
+
+	return false;
+}
+
+static void QueSyncBatchError(SysListHead *pBatch, int iError)
+{
+	SysListHead *pPos;
+
+	SYS_LIST_FOR_EACH(pPos, pBatch) {
+		QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+		if (pSR->iError == 0)
+			pSR->iError = iError;
+	}
+}
+
+static int QueSyncBatch(MessageQueue *pMQ, SysListHead *pBatch)
+{
+	int i;
+	char szFilePath[SYS_MAX_PATH];
+	SysListHead *pPos;
+
+	/*
+	 * Flush the data of all the messages in the batch, with a single flush
+	 * of the spool file system where supported (this flushes everything
+	 * else living on it too, which is still cheaper than one flush per
+	 * file), or one file at a time ...
+	 */
+	bool bFsSync = SysFsSync(pMQ->pszRootPath) == 0;
+
+	if (!bFsSync)
+		SYS_LIST_FOR_EACH(pPos, pBatch) {
+			QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+			for (i = 0; i < pSR->iCount && pSR->iError == 0; i++) {
+				QueGetFilePath(pMQ, (QueueMessage *) pSR->phMessages[i],
+					       szFilePath);
+				if (SysPathSync(szFilePath) < 0)
+					pSR->iError = ErrGetErrorCode();
+			}
+		}
+
+	/* ... move them inside the mess directories ... */
+	SYS_LIST_FOR_EACH(pPos, pBatch) {
+		QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+		for (i = 0; i < pSR->iCount && pSR->iError == 0; i++)
+			if (QueMoveToMess(pMQ, (QueueMessage *) pSR->phMessages[i]) < 0)
+				pSR->iError = ErrGetErrorCode();
+	}
+
+	/* ... and flush the file system again, or each touched mess directory once */
+	if (bFsSync) {
+		if (SysFsSync(pMQ->pszRootPath) < 0)
+			QueSyncBatchError(pBatch, ErrGetErrorCode());
+	} else
+		SYS_LIST_FOR_EACH(pPos, pBatch) {
+			QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+			for (i = 0; i < pSR->iCount && pSR->iError == 0; i++) {
+				QueueMessage *pQM = (QueueMessage *) pSR->phMessages[i];
+
+				if (QueSyncDirDone(pBatch, pSR, i, pQM))
+					continue;
+				SysSNPrintf(szFilePath, sizeof(szFilePath) - 1, "%s%d%s%d%s%s",
+					    pMQ->pszRootPath, pQM->iLevel1, SYS_SLASH_STR,
+					    pQM->iLevel2, SYS_SLASH_STR, QUEUE_MESS_DIR);
+				if (SysPathSync(szFilePath) < 0)
+					pSR->iError = ErrGetErrorCode();
+			}
+		}
+
+	/* Hand over the messages that made it to disk */
+	SYS_LIST_FOR_EACH(pPos, pBatch) {
+		QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+		if (pSR->iError == 0)
+			pSR->iError = QueReadyPushBatch(pMQ, pSR->phMessages, pSR->iCount);
+	}
+
+	return 0;
+}
+
+int QueSyncCommitMessages(QUEUE_HANDLE hQueue, QMSG_HANDLE const *phMessages, int iCount,
+			  int iSyncWait)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	QueueSyncRequest SR;
+
+	SR.phMessages = phMessages;
+	SR.iCount = iCount;
+	SR.iError = 0;
+	if ((SR.hDoneEvent = SysCreateEvent(1)) == SYS_INVALID_EVENT)
+		return ErrGetErrorCode();
+	if (SysLockMutex(pMQ->hSyncMutex, SYS_INFINITE_TIMEOUT) < 0) {
+		ErrorPush();
+		SysCloseEvent(SR.hDoneEvent);
+		return ErrorPop();
+	}
+	if (pMQ->iSyncActive) {
+		/* Someone else is collecting a batch, and will commit us too */
+		SYS_LIST_ADDT(&SR.LLink, &pMQ->SyncQueue);
+		SysUnlockMutex(pMQ->hSyncMutex);
+
+		SysWaitEvent(SR.hDoneEvent, SYS_INFINITE_TIMEOUT);
+	} else {
+		SysListHead Batch;
+		SysListHead *pPos;
+		SysListHead *pNext;
+
+		/*
+		 * We are the committer for this batch. Other sessions are given the
+		 * chance to join it only if other batches are being flushed, since
+		 * otherwise there is nobody to wait for. The batch is then taken
+		 * over, so that a new one can start collecting while we sync this
+		 * one.
+		 */
+		bool bWait = pMQ->iSyncRunning > 0;
+
+		pMQ->iSyncActive = 1;
+		SysUnlockMutex(pMQ->hSyncMutex);
+
+		if (bWait)
+			SysMsSleep(iSyncWait);
+
+		/*
+		 * Should we fail to take the batch over, our messages are committed
+		 * alone, and the sessions that joined us are left to the next
+		 * committer.
+		 */
+		bool bTaken = SysLockMutex(pMQ->hSyncMutex, SYS_INFINITE_TIMEOUT) == 0;
+
+		SYS_INIT_LIST_HEAD(&Batch);
+		if (bTaken) {
+			SYS_LIST_SPLICE(&pMQ->SyncQueue, &Batch);
+			pMQ->iSyncRunning++;
+		}
+		pMQ->iSyncActive = 0;
+		if (bTaken)
+			SysUnlockMutex(pMQ->hSyncMutex);
+		SYS_LIST_ADDT(&SR.LLink, &Batch);
+
+		if (QueSyncBatch(pMQ, &Batch) < 0)
+			QueSyncBatchError(&Batch, ErrGetErrorCode());
+		SYS_LIST_FOR_EACH_SAFE(pPos, pNext, &Batch) {
+			QueueSyncRequest *pSR = SYS_LIST_ENTRY(pPos, QueueSyncRequest, LLink);
+
+			SYS_LIST_DEL(&pSR->LLink);
+			if (pSR != &SR)
+				SysSetEvent(pSR->hDoneEvent);
+		}
+		if (bTaken && SysLockMutex(pMQ->hSyncMutex, SYS_INFINITE_TIMEOUT) == 0) {
+			pMQ->iSyncRunning--;
+			SysUnlockMutex(pMQ->hSyncMutex);
+		}
+	}
+	SysCloseEvent(SR.hDoneEvent);
+	if (SR.iError < 0) {
+		ErrSetErrorCode(SR.iError);
+		return SR.iError;
+	}
+
+	return 0;
+}
+
 static bool QueMessageExpired(MessageQueue *pMQ, QueueMessage *pQM)
 {
 	return pQM->iNumTries >= pMQ->iMaxRetry;
@@ -815,12 +2225,21 @@ static bool QueMessageExpired(MessageQueue *pMQ, QueueMessage *pQM)
 static int QueAddRsnd(MessageQueue *pMQ, QueueMessage *pQM)
 {
 	/* Add the queue entry */
-	if (SysLockMutex(pMQ->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+	if (SysLockMutex(pMQ->hRsndMutex, SYS_INFINITE_TIMEOUT) < 0)
 		return ErrGetErrorCode();
 
-	SYS_LIST_ADDT(&pQM->LLink, &pMQ->RsndArenaQueue);
-	++pMQ->iRsndArenaCount;
-	SysUnlockMutex(pMQ->hMutex);
+	if (QueRsndArenaPush(pMQ, pQM) < 0) {
+		int iError = ErrGetErrorCode();
+
+		SysUnlockMutex(pMQ->hRsndMutex);
+
+		/* Better an early retry than a message lost until the next restart */
+		SysLogMessage(LOG_LEV_ERROR, "Unable to add '%s' to the resend arena (%d)\n",
+			      pQM->pszFileName, iError);
+
+		return QueReadyPush(pMQ, pQM, false);
+	}
+	SysUnlockMutex(pMQ->hRsndMutex);
 
 	return 0;
 }
@@ -830,6 +2249,8 @@ int QueResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
 	QueueMessage *pQM = (QueueMessage *) hMessage;
 
+	QueReleaseMessage(pMQ, pQM);
+
 	/* Check for message expired */
 	if (QueMessageExpired(pMQ, pQM)) {
 		ErrSetErrorCode(ERR_SPOOL_FILE_EXPIRED);
@@ -849,6 +2270,9 @@ int QueResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 		/* Change message location */
 		pQM->pszQueueDir = QUEUE_RSND_DIR;
 	}
+	QueJnlLog(pMQ, 'R', pQM);
+	if (pQM->ulFlags & QUMF_LOCAL)
+		QueJnlLog(pMQ, 'L', pQM);
 	/* Unmask temporary flags */
 	pQM->ulFlags = QUE_MASK_TMPFLAGS(pQM->ulFlags);
 
@@ -859,35 +2283,108 @@ int QueResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 	return 0;
 }
 
-QMSG_HANDLE QueExtractMessage(QUEUE_HANDLE hQueue, int iTimeout)
+static void QueReserveGroup(QueueShard *pQS, QueueMessage *pQM)
 {
-	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	HashDatum Key;
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	/*
+	 * Group companions are reserved for the owner of the group leader, so
+	 * that other threads do not pick them up in the meantime. The group key
+	 * carries the destination domain, but only messages sitting inside the
+	 * leader domain queue are taken, to keep the domain counts right.
+	 */
+	Key.pData = pQM->pszGroupKey;
+	if (HashGetFirst(pQS->hGroupHash, &Key, &HEnum, &pHNode) < 0)
+		return;
+	do {
+		QueueMessage *pCurr = SYS_LIST_ENTRY(pHNode, QueueMessage, GHN);
+
+		if (pQM->iGroupCount >= QUE_GROUP_MAX_MSGS)
+			break;
+		if ((pCurr->pszDomain == NULL) != (pQM->pszDomain == NULL) ||
+		    (pCurr->pszDomain != NULL && strcmp(pCurr->pszDomain, pQM->pszDomain) != 0))
+			continue;
+		HashDel(pQS->hGroupHash, pHNode);
+		SYS_LIST_DEL(&pCurr->LLink);
+		SYS_LIST_ADDT(&pCurr->LLink, &pQM->GroupList);
+		pQM->iGroupCount++;
+		pQM->pQD->iMsgCount--;
+	} while (HashGetNext(pQS->hGroupHash, &Key, &HEnum, &pHNode) == 0);
+}
 
-	/* Wait for message available */
-	if (SysWaitEvent(pMQ->hReadyEvent, iTimeout) < 0)
-		return INVALID_QMSG_HANDLE;
+static QueueMessage *QueShardExtract(MessageQueue *pMQ, QueueShard *pQS)
+{
+	if (SysLockMutex(pQS->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
 
-	if (SysLockMutex(pMQ->hMutex, SYS_INFINITE_TIMEOUT) < 0)
-		return INVALID_QMSG_HANDLE;
+	/* Get the first message of the next domain in turn */
+	QueueMessage *pQM = QueReadyGet(pQS);
 
-	/* Get the first message of the queue */
-	SysListHead *pLLink = SYS_LIST_FIRST(&pMQ->ReadyQueue);
+	if (pQM != NULL) {
+		if (pQM->pszGroupKey != NULL)
+			QueReserveGroup(pQS, pQM);
 
-	if (pLLink == NULL) {
-		SysUnlockMutex(pMQ->hMutex);
-		return INVALID_QMSG_HANDLE;
+		/* Put the domain back in the ring (if it can get more) */
+		QueUpdateDomain(pMQ, pQM->pQD);
 	}
-	/* Remove the message from the list */
-	SYS_LIST_DEL(pLLink);
+	SysUnlockMutex(pQS->hMutex);
 
-	/* Decrement message count by resetting the event if no more messages are in */
-	if (--pMQ->iReadyCount == 0)
-		SysResetEvent(pMQ->hReadyEvent);
+	return pQM;
+}
+
+int QueGetReadyStats(QUEUE_HANDLE hQueue, int *piReadyCount, time_t *ptOldestReady)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	time_t tOldest = time(NULL);
+
+	/*
+	 * Only the domains inside the rings count. Messages of domains that have
+	 * reached their delivery limit would not be helped by more threads.
+	 */
+	*piReadyCount = 0;
+	for (int i = 0; i < pMQ->iNumShards; i++) {
+		QueueShard *pQS = &pMQ->pShards[i];
+		SysListHead *pRLink;
+
+		if (SysLockMutex(pQS->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+			return ErrGetErrorCode();
+		SYS_LIST_FOR_EACH(pRLink, &pQS->DomainRing) {
+			QueueDomain *pQD = SYS_LIST_ENTRY(pRLink, QueueDomain, RLink);
+			QueueMessage *pQM = SYS_LIST_ENTRY(SYS_LIST_FIRST(&pQD->MsgList),
+							   QueueMessage, LLink);
+
+			*piReadyCount += pQD->iMsgCount;
+			if (pQM->tReady < tOldest)
+				tOldest = pQM->tReady;
+		}
+		SysUnlockMutex(pQS->hMutex);
+	}
+	*ptOldestReady = tOldest;
+
+	return 0;
+}
+
+QMSG_HANDLE QueExtractMessage(QUEUE_HANDLE hQueue, int iTimeout, int iHomeShard)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+
+	/* Wait for message available */
+	if (SysWaitEvent(pMQ->hReadyEvent, iTimeout) < 0)
+		return INVALID_QMSG_HANDLE;
 
-	SysUnlockMutex(pMQ->hMutex);
+	/*
+	 * Start from the home shard of the caller, and steal from the other
+	 * ones only if that has nothing ready.
+	 */
+	QueueMessage *pQM = NULL;
 
-	/* Get queue message pointer */
-	QueueMessage *pQM = SYS_LIST_ENTRY(pLLink, QueueMessage, LLink);
+	iHomeShard = (int) ((unsigned int) iHomeShard % (unsigned int) pMQ->iNumShards);
+	for (int i = 0; i < pMQ->iNumShards && pQM == NULL; i++)
+		pQM = QueShardExtract(pMQ, &pMQ->pShards[(iHomeShard + i) % pMQ->iNumShards]);
+	if (pQM == NULL)
+		return INVALID_QMSG_HANDLE;
 
 	/* Update message statistics */
 	++pQM->iNumTries;
@@ -899,6 +2396,33 @@ QMSG_HANDLE QueExtractMessage(QUEUE_HANDLE hQueue, int iTimeout)
 	return (QMSG_HANDLE) pQM;
 }
 
+int QueExtractGroup(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, QMSG_HANDLE *phMessages,
+		    int iMaxMessages)
+{
+	MessageQueue *pMQ = (MessageQueue *) hQueue;
+	QueueMessage *pQM = (QueueMessage *) hMessage;
+	int iCount = 0;
+	SysListHead *pLLink;
+
+	/* Companions left out are released when the group leader is */
+	for (; iCount < iMaxMessages && (pLLink = SYS_LIST_FIRST(&pQM->GroupList)) != NULL;
+	     iCount++) {
+		QueueMessage *pCurr = SYS_LIST_ENTRY(pLLink, QueueMessage, LLink);
+
+		SYS_LIST_DEL(pLLink);
+		pQM->iGroupCount--;
+
+		/* Update message statistics */
+		++pCurr->iNumTries;
+		pCurr->tLastTry = time(NULL);
+		QueStatMessage(pMQ, pCurr);
+
+		phMessages[iCount] = (QMSG_HANDLE) pCurr;
+	}
+
+	return iCount;
+}
+
 int QueCheckMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 {
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
@@ -919,7 +2443,9 @@ int QueCheckMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage)
 			ErrSetErrorCode(ERR_NO_MESSAGE_FILE);
 			return ERR_NO_MESSAGE_FILE;
 		}
-	}
+		pQM->pszQueueDir = QUEUE_RSND_DIR;
+	} else
+		pQM->pszQueueDir = QUEUE_MESS_DIR;
 
 	return 0;
 }
@@ -961,33 +2487,25 @@ int QueFlushRsndArena(QUEUE_HANDLE hQueue, char const *pszAddressMatch)
 {
 	MessageQueue *pMQ = (MessageQueue *) hQueue;
 
-	if (SysLockMutex(pMQ->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+	if (SysLockMutex(pMQ->hRsndMutex, SYS_INFINITE_TIMEOUT) < 0)
 		return ErrGetErrorCode();
 
-	SysListHead *pLLink;
+	int i, iCount = 0;
 
-	SYS_LIST_FOR_EACH(pLLink, &pMQ->RsndArenaQueue) {
-		QueueMessage *pQM = SYS_LIST_ENTRY(pLLink, QueueMessage, LLink);
+	for (i = 0; i < pMQ->iRsndArenaCount; i++) {
+		QueueMessage *pQM = pMQ->ppRsndArena[i];
 
 		if (pszAddressMatch == NULL ||
-		    QueMessageDestMatch(pMQ, pQM, pszAddressMatch)) {
-			/* Set the list pointer to the next item */
-			pLLink = pLLink->pPrev;
-
-			/* Remove item from resend arena */
-			SYS_LIST_DEL(&pQM->LLink);
-			--pMQ->iRsndArenaCount;
-
+		    QueMessageDestMatch(pMQ, pQM, pszAddressMatch))
 			/* Add item from resend queue */
-			SYS_LIST_ADDT(&pQM->LLink, &pMQ->ReadyQueue);
-			++pMQ->iReadyCount;
-		}
+			QueReadyPush(pMQ, pQM, false);
+		else
+			pMQ->ppRsndArena[iCount++] = pQM;
 	}
-
-	/* If the count of rsnd queue is not zero, set the event */
-	if (pMQ->iReadyCount > 0)
-		SysSetEvent(pMQ->hReadyEvent);
-	SysUnlockMutex(pMQ->hMutex);
+	/* Rebuild the heap with the messages left inside the arena */
+	pMQ->iRsndArenaCount = iCount;
+	QueRsndArenaHeapify(pMQ);
+	SysUnlockMutex(pMQ->hRsndMutex);
 
 	return 0;
 }
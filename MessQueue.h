@@ -31,6 +31,7 @@
 #define QUEUE_CUST_DIR              "cust"
 #define QUEUE_MPRC_DIR              "mprc"
 #define QUEUE_FROZ_DIR              "froz"
+#define QUEUE_BODY_DIR              "body"
 
 #define STD_QUEUEFS_DIRS_X_LEVEL    23
 
@@ -44,7 +45,8 @@ typedef struct QMSG_HANDLE_struct {
 } *QMSG_HANDLE;
 
 QUEUE_HANDLE QueOpen(char const *pszRootPath, int iMaxRetry, int iRetryTimeout,
-		     int iRetryIncrRatio, int iNumDirsLevel = STD_QUEUEFS_DIRS_X_LEVEL);
+		     int iRetryIncrRatio, int iNumDirsLevel = STD_QUEUEFS_DIRS_X_LEVEL,
+		     int iDomainMaxActive = 0, int iNumShards = 1);
 int QueClose(QUEUE_HANDLE hQueue);
 int QueGetDirsLevel(QUEUE_HANDLE hQueue);
 char const *QueGetRootPath(QUEUE_HANDLE hQueue);
@@ -61,12 +63,22 @@ int QueGetLevel1(QMSG_HANDLE hMessage);
 int QueGetLevel2(QMSG_HANDLE hMessage);
 int QueGetTryCount(QMSG_HANDLE hMessage);
 time_t QueGetLastTryTime(QMSG_HANDLE hMessage);
+int QueSetMessageGroup(QMSG_HANDLE hMessage, char const *pszGroupKey);
+char const *QueGetMessageGroup(QMSG_HANDLE hMessage);
+int QueSetMessageDomain(QMSG_HANDLE hMessage, char const *pszDomain, bool bLocal);
+char const *QueGetMessageDomain(QMSG_HANDLE hMessage);
 time_t QueGetMessageNextOp(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage);
 int QueInitMessageStats(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage);
 int QueCleanupMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, bool bFreeze = false);
 int QueCommitMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage);
+int QueCommitMessages(QUEUE_HANDLE hQueue, QMSG_HANDLE const *phMessages, int iCount);
+int QueSyncCommitMessages(QUEUE_HANDLE hQueue, QMSG_HANDLE const *phMessages, int iCount,
+			  int iSyncWait);
 int QueResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage);
-QMSG_HANDLE QueExtractMessage(QUEUE_HANDLE hQueue, int iTimeout);
+int QueGetReadyStats(QUEUE_HANDLE hQueue, int *piReadyCount, time_t *ptOldestReady);
+QMSG_HANDLE QueExtractMessage(QUEUE_HANDLE hQueue, int iTimeout, int iHomeShard = 0);
+int QueExtractGroup(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, QMSG_HANDLE *phMessages,
+		    int iMaxMessages);
 int QueCheckMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage);
 int QueFlushRsndArena(QUEUE_HANDLE hQueue, char const *pszAddressMatch);
 
@@ -27,6 +27,7 @@
 #include "StrUtils.h"
 #include "SList.h"
 #include "Hash.h"
+#include "ThreadPool.h"
 #include "MD5.h"
 #include "Base64Enc.h"
 #include "BuffSock.h"
@@ -59,6 +60,13 @@ struct FileScan {
 	SysListHead *pPos;
 };
 
+struct MscAcceptorCtx {
+	ThreadConfig const *pThCfg;
+	THPOOL_HANDLE hThPool;
+	SYS_SOCKET const *pSockFDs;
+	int iNumSockFDs;
+};
+
 
 int MscDatumAlloc(Datum *pDm, void const *pData, size_t sSize)
 {
@@ -909,58 +917,91 @@ int MscCreateClientSocket(char const *pszServer, int iPortNo, int iSockType,
 	return 0;
 }
 
-int MscCreateServerSockets(int iNumAddr, SYS_INET_ADDR const *pSvrAddr, int iFamily,
-			   int iPortNo, int iListenSize, SYS_SOCKET *pSockFDs,
-			   int &iNumSockFDs)
+static SYS_SOCKET MscCreateServerSocket(SYS_INET_ADDR const *pSvrAddr, int iListenSize,
+					bool bReusePort)
 {
-	if (iNumAddr == 0) {
-		SYS_SOCKET SvrSockFD = SysCreateSocket(iFamily, SOCK_STREAM, 0);
+	SYS_SOCKET SvrSockFD = SysCreateSocket(SysGetAddrFamily(*pSvrAddr), SOCK_STREAM, 0);
 
-		if (SvrSockFD == SYS_INVALID_SOCKET)
-			return ErrGetErrorCode();
+	if (SvrSockFD == SYS_INVALID_SOCKET)
+		return SYS_INVALID_SOCKET;
+	if ((bReusePort && SysSetReusePort(SvrSockFD) < 0) ||
+	    SysBindSocket(SvrSockFD, pSvrAddr) < 0) {
+		ErrorPush();
+		SysCloseSocket(SvrSockFD);
+		ErrorPop();
+		return SYS_INVALID_SOCKET;
+	}
+	SysListenSocket(SvrSockFD, iListenSize);
 
-		SYS_INET_ADDR InSvrAddr;
+	return SvrSockFD;
+}
+
+static int MscCreateSocketSet(SYS_INET_ADDR const *pBindAddr, int iNumBind,
+			      int iNumAcceptors, int iListenSize, SYS_SOCKET *pSockFDs,
+			      int &iNumSockFDs)
+{
+	for (iNumSockFDs = 0; iNumSockFDs < iNumBind * iNumAcceptors; iNumSockFDs++) {
+		SYS_SOCKET SvrSockFD = MscCreateServerSocket(&pBindAddr[iNumSockFDs % iNumBind],
+							     iListenSize, iNumAcceptors > 1);
 
-		if (SysInetAnySetup(InSvrAddr, iFamily, iPortNo) < 0 ||
-		    SysBindSocket(SvrSockFD, &InSvrAddr) < 0) {
+		if (SvrSockFD == SYS_INVALID_SOCKET) {
 			ErrorPush();
-			SysCloseSocket(SvrSockFD);
+			for (; iNumSockFDs > 0; iNumSockFDs--)
+				SysCloseSocket(pSockFDs[iNumSockFDs - 1]);
 			return ErrorPop();
 		}
-		SysListenSocket(SvrSockFD, iListenSize);
-
-		*pSockFDs = SvrSockFD;
-		iNumSockFDs = 1;
-	} else {
-		iNumSockFDs = 0;
-
-		for (int i = 0; i < iNumAddr; i++) {
-			SYS_SOCKET SvrSockFD = SysCreateSocket(SysGetAddrFamily(pSvrAddr[i]),
-							       SOCK_STREAM, 0);
-
-			if (SvrSockFD == SYS_INVALID_SOCKET) {
-				ErrorPush();
-				for (--iNumSockFDs; iNumSockFDs >= 0; iNumSockFDs--)
-					SysCloseSocket(pSockFDs[iNumSockFDs]);
-				return ErrorPop();
-			}
+		pSockFDs[iNumSockFDs] = SvrSockFD;
+	}
 
-			SYS_INET_ADDR InSvrAddr = pSvrAddr[i];
+	return 0;
+}
 
-			if (SysGetAddrPort(InSvrAddr) == 0)
-				SysSetAddrPort(InSvrAddr, iPortNo);
-			if (SysBindSocket(SvrSockFD, &InSvrAddr) < 0) {
-				ErrorPush();
-				SysCloseSocket(SvrSockFD);
-				for (--iNumSockFDs; iNumSockFDs >= 0; iNumSockFDs--)
-					SysCloseSocket(pSockFDs[iNumSockFDs]);
-				return ErrorPop();
-			}
-			SysListenSocket(SvrSockFD, iListenSize);
+/*
+ * With more than one acceptor, every address gets one SO_REUSEPORT listening
+ * socket per acceptor. Sockets are stored acceptor by acceptor, so acceptor N
+ * owns the N-th slice of (iNumSockFDs / *piNumAcceptors) sockets. If the
+ * SO_REUSEPORT set cannot be created, *piNumAcceptors is set back to 1.
+ */
+int MscCreateServerSockets(int iNumAddr, SYS_INET_ADDR const *pSvrAddr, int iFamily,
+			   int iPortNo, int iListenSize, SYS_SOCKET *pSockFDs,
+			   int &iNumSockFDs, int *piNumAcceptors)
+{
+	int iNumBind, iNumAcceptors = 1;
+	SYS_INET_ADDR BindAddr[MAX_ACCEPT_ADDRESSES];
 
-			pSockFDs[iNumSockFDs++] = SvrSockFD;
+	if (piNumAcceptors != NULL)
+		iNumAcceptors = Max(1, Min(*piNumAcceptors, MAX_ACCEPT_THREADS));
+	if (iNumAddr == 0) {
+		if (SysInetAnySetup(BindAddr[0], iFamily, iPortNo) < 0)
+			return ErrGetErrorCode();
+		iNumBind = 1;
+	} else {
+		for (iNumBind = 0; iNumBind < Min(iNumAddr, MAX_ACCEPT_ADDRESSES); iNumBind++) {
+			BindAddr[iNumBind] = pSvrAddr[iNumBind];
+			if (SysGetAddrPort(BindAddr[iNumBind]) == 0)
+				SysSetAddrPort(BindAddr[iNumBind], iPortNo);
 		}
 	}
+	if (MscCreateSocketSet(BindAddr, iNumBind, iNumAcceptors, iListenSize,
+			       pSockFDs, iNumSockFDs) < 0) {
+		/*
+		 * Whatever made the SO_REUSEPORT set fail, retry the plain single
+		 * acceptor setup. If the problem is not SO_REUSEPORT related, that
+		 * will fail as well and report it.
+		 */
+		if (iNumAcceptors == 1)
+			return ErrGetErrorCode();
+
+		SysLogMessage(LOG_LEV_MESSAGE,
+			      "SO_REUSEPORT listeners failed (%s), using a single acceptor\n",
+			      ErrGetErrorString(ErrGetErrorCode()));
+		iNumAcceptors = 1;
+		if (MscCreateSocketSet(BindAddr, iNumBind, iNumAcceptors, iListenSize,
+				       pSockFDs, iNumSockFDs) < 0)
+			return ErrGetErrorCode();
+	}
+	if (piNumAcceptors != NULL)
+		*piNumAcceptors = iNumAcceptors;
 
 	return 0;
 }
@@ -1400,6 +1441,13 @@ int MscGetSectionSize(FileSection const *pFS, SYS_OFF_T *pllSize)
 		*pllSize = FI.llSize - pFS->llStartOffset;
 	} else
 		*pllSize = pFS->llEndOffset - pFS->llStartOffset;
+	if (!IsEmptyString(pFS->szTailFilePath)) {
+		SYS_FILE_INFO FI;
+
+		if (SysGetFileInfo(pFS->szTailFilePath, FI) < 0)
+			return ErrGetErrorCode();
+		*pllSize += FI.llSize;
+	}
 
 	return 0;
 }
@@ -1477,39 +1525,132 @@ int MscGetAddrString(SYS_INET_ADDR const &AddrInfo, char *pszAStr, int iSize)
 	return 0;
 }
 
-unsigned int MscServiceThread(void *pThreadData)
+static int MscDispatchClient(ThreadConfig const *pThCfg, THPOOL_HANDLE hThPool,
+			     SYS_SOCKET SockFD)
 {
-	ThreadConfig const *pThCfg = (ThreadConfig const *) pThreadData;
+	SYS_THREAD hClientThread;
+	ThreadCreateCtx *pThCtx = (ThreadCreateCtx *) SysAlloc(sizeof(ThreadCreateCtx));
 
-	SysLogMessage(LOG_LEV_MESSAGE, "%s started\n", pThCfg->pszName);
+	if (pThCtx == NULL)
+		return ErrGetErrorCode();
+	pThCtx->SockFD = SockFD;
+	pThCtx->pThCfg = pThCfg;
+	if (hThPool != INVALID_THPOOL_HANDLE) {
+		if (ThpQueue(hThPool, pThCfg->pfThreadProc, pThCtx) < 0) {
+			ErrorPush();
+			SysFree(pThCtx);
+			return ErrorPop();
+		}
+	} else {
+		if ((hClientThread = SysCreateThread(pThCfg->pfThreadProc,
+						     pThCtx)) == SYS_INVALID_THREAD) {
+			ErrorPush();
+			SysFree(pThCtx);
+			return ErrorPop();
+		}
+		SysCloseThread(hClientThread, 0);
+	}
+
+	return 0;
+}
 
+static void MscAcceptLoop(ThreadConfig const *pThCfg, THPOOL_HANDLE hThPool,
+			  SYS_SOCKET const *pSockFDs, int iNumSockFDs)
+{
 	for (;;) {
 		int iNumConnSockFD = 0;
-		SYS_SOCKET ConnSockFD[MAX_ACCEPT_ADDRESSES];
+		SYS_SOCKET ConnSockFD[MAX_ACCEPT_ADDRESSES * MAX_ACCEPT_THREADS];
 
-		if (MscAcceptServerConnection(pThCfg->SockFDs, pThCfg->iNumSockFDs, ConnSockFD,
+		if (MscAcceptServerConnection(pSockFDs, iNumSockFDs, ConnSockFD,
 					      iNumConnSockFD, SERVICE_ACCEPT_TIMEOUT) < 0) {
 			if (pThCfg->ulFlags & THCF_SHUTDOWN)
 				break;
 			continue;
 		}
-		for (int i = 0; i < iNumConnSockFD; i++) {
-			SYS_THREAD hClientThread = SYS_INVALID_THREAD;
-			ThreadCreateCtx *pThCtx = (ThreadCreateCtx *) SysAlloc(sizeof(ThreadCreateCtx));
-
-			if (pThCtx != NULL) {
-				pThCtx->SockFD = ConnSockFD[i];
-				pThCtx->pThCfg = pThCfg;
-				hClientThread = SysCreateThread(pThCfg->pfThreadProc, pThCtx);
-			}
-			if (hClientThread != SYS_INVALID_THREAD)
-				SysCloseThread(hClientThread, 0);
-			else {
-				SysFree(pThCtx);
+		for (int i = 0; i < iNumConnSockFD; i++)
+			if (MscDispatchClient(pThCfg, hThPool, ConnSockFD[i]) < 0) {
+				/* A full worker pool refuses the client (ERR_SERVER_BUSY) */
+				SysLogMessage(LOG_LEV_ERROR, "%s client refused: %s\n",
+					      pThCfg->pszName, ErrGetErrorString());
 				SysCloseSocket(ConnSockFD[i]);
 			}
+	}
+}
+
+static unsigned int MscAcceptorThread(void *pThreadData)
+{
+	MscAcceptorCtx *pAccCtx = (MscAcceptorCtx *) pThreadData;
+
+	MscAcceptLoop(pAccCtx->pThCfg, pAccCtx->hThPool, pAccCtx->pSockFDs,
+		      pAccCtx->iNumSockFDs);
+
+	return 0;
+}
+
+static void MscRunAcceptors(ThreadConfig const *pThCfg, THPOOL_HANDLE hThPool)
+{
+	int i, iNumOrphans = 0, iNumCPUs = SysGetCPUCount();
+	int iNumSlice = pThCfg->iNumSockFDs / pThCfg->iNumAcceptors;
+	MscAcceptorCtx AccCtxs[MAX_ACCEPT_THREADS];
+	SYS_THREAD hAccThreads[MAX_ACCEPT_THREADS];
+	SYS_SOCKET OrphanFDs[MAX_ACCEPT_ADDRESSES * MAX_ACCEPT_THREADS];
+
+	for (i = 0; i < pThCfg->iNumAcceptors; i++) {
+		AccCtxs[i].pThCfg = pThCfg;
+		AccCtxs[i].hThPool = hThPool;
+		AccCtxs[i].pSockFDs = pThCfg->SockFDs + i * iNumSlice;
+		AccCtxs[i].iNumSockFDs = iNumSlice;
+		if ((hAccThreads[i] = SysCreateThread(MscAcceptorThread,
+						      &AccCtxs[i])) == SYS_INVALID_THREAD) {
+			/*
+			 * The kernel keeps routing connections to this slice of
+			 * listeners, so somebody has to accept them.
+			 */
+			memcpy(OrphanFDs + iNumOrphans, AccCtxs[i].pSockFDs,
+			       iNumSlice * sizeof(SYS_SOCKET));
+			iNumOrphans += iNumSlice;
+			continue;
 		}
+		if ((pThCfg->ulFlags & THCF_PIN_ACCEPTORS) &&
+		    SysSetThreadAffinity(hAccThreads[i], i % iNumCPUs) < 0)
+			SysLogMessage(LOG_LEV_MESSAGE, "%s acceptor %d: %s\n",
+				      pThCfg->pszName, i, ErrGetErrorString());
 	}
+	if (iNumOrphans > 0)
+		MscAcceptLoop(pThCfg, hThPool, OrphanFDs, iNumOrphans);
+	for (i = 0; i < pThCfg->iNumAcceptors; i++)
+		if (hAccThreads[i] != SYS_INVALID_THREAD) {
+			SysWaitThread(hAccThreads[i], SYS_INFINITE_TIMEOUT);
+			SysCloseThread(hAccThreads[i], 0);
+		}
+}
+
+unsigned int MscServiceThread(void *pThreadData)
+{
+	ThreadConfig const *pThCfg = (ThreadConfig const *) pThreadData;
+	THPOOL_HANDLE hThPool = INVALID_THPOOL_HANDLE;
+
+	/*
+	 * Client sessions are handed to a pool of worker threads, so that we
+	 * do not pay a thread creation for each accepted connection. If the
+	 * pool cannot be created, we fall back to one new thread per client.
+	 */
+	if (pThCfg->iMaxThreads > 0 &&
+	    (hThPool = ThpCreate(pThCfg->iMinThreads, pThCfg->iMaxThreads,
+				 pThCfg->iIdleTimeout)) == INVALID_THPOOL_HANDLE)
+		SysLogMessage(LOG_LEV_ERROR, "%s thread pool creation failed: %s\n",
+			      pThCfg->pszName, ErrGetErrorString());
+
+	SysLogMessage(LOG_LEV_MESSAGE, "%s started\n", pThCfg->pszName);
+
+	/*
+	 * With SO_REUSEPORT listeners, each acceptor thread gets its own set
+	 * of sockets and the kernel spreads new connections among them.
+	 */
+	if (pThCfg->iNumAcceptors > 1)
+		MscRunAcceptors(pThCfg, hThPool);
+	else
+		MscAcceptLoop(pThCfg, hThPool, pThCfg->SockFDs, pThCfg->iNumSockFDs);
 
 	/* Wait for client completion */
 	for (int iTotalWait = 0; iTotalWait < MAX_CLIENTS_WAIT;
@@ -1518,6 +1659,9 @@ unsigned int MscServiceThread(void *pThreadData)
 			break;
 		SysSleep(SERVICE_WAIT_SLEEP);
 	}
+	if (hThPool != INVALID_THPOOL_HANDLE)
+		ThpClose(hThPool);
+
 	SysLogMessage(LOG_LEV_MESSAGE, "%s stopped\n", pThCfg->pszName);
 
 	return 0;
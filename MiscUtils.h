@@ -33,6 +33,7 @@
 
 #define THCF_USE_SSL           (1 << 0)
 #define THCF_SHUTDOWN          (1 << 1)
+#define THCF_PIN_ACCEPTORS     (1 << 2)
 
 typedef struct FSCAN_HANDLE_struct {
 } *FSCAN_HANDLE;
@@ -50,8 +51,12 @@ struct ThreadConfig {
 	unsigned long ulFlags;
 	int iNumAddr;
 	SYS_INET_ADDR SvrAddr[MAX_ACCEPT_ADDRESSES];
+	int iNumAcceptors;
 	int iNumSockFDs;
-	SYS_SOCKET SockFDs[MAX_ACCEPT_ADDRESSES];
+	SYS_SOCKET SockFDs[MAX_ACCEPT_ADDRESSES * MAX_ACCEPT_THREADS];
+	int iMinThreads;
+	int iMaxThreads;
+	int iIdleTimeout;
 };
 
 struct ThreadCreateCtx {
@@ -112,7 +117,7 @@ int MscCreateClientSocket(char const *pszServer, int iPortNo, int iSockType,
 			  SYS_INET_ADDR *pSockAddr, int iTimeout);
 int MscCreateServerSockets(int iNumAddr, SYS_INET_ADDR const *pSvrAddr, int iFamily,
 			   int iPortNo, int iListenSize, SYS_SOCKET *pSockFDs,
-			   int &iNumSockFDs);
+			   int &iNumSockFDs, int *piNumAcceptors = NULL);
 int MscGetMaxSockFD(SYS_SOCKET const *pSockFDs, int iNumSockFDs);
 int MscAcceptServerConnection(SYS_SOCKET const *pSockFDs, int iNumSockFDs,
 			      SYS_SOCKET *pConnSockFD, int &iNumConnSockFD, int iTimeout);
@@ -40,6 +40,7 @@
 #include "MessQueue.h"
 #include "MailDomains.h"
 #include "MailConfig.h"
+#include "ConnEngine.h"
 #include "AppDefines.h"
 #include "MailSvr.h"
 
@@ -58,6 +59,7 @@ enum POP3States {
 struct POP3Session {
 	int iPOP3State;
 	ThreadConfig const *pThCfg;
+	BSOCK_HANDLE hBSock;
 	POP3Config *pPOP3Cfg;
 	SVRCFG_HANDLE hSvrConfig;
 	int iBadLoginWait;
@@ -167,6 +169,7 @@ static int POP3InitSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock,
 	ZeroData(POP3S);
 	POP3S.iPOP3State = stateInit;
 	POP3S.pThCfg = pThCfg;
+	POP3S.hBSock = INVALID_BSOCK_HANDLE;
 	POP3S.hSvrConfig = INVALID_SVRCFG_HANDLE;
 	POP3S.pPOP3Cfg = NULL;
 	POP3S.hPOPSession = INVALID_POP3_HANDLE;
@@ -891,15 +894,86 @@ static int POP3HandleCommand(char const *pszCommand, BSOCK_HANDLE hBSock,
 	return iCmdResult;
 }
 
+static void POP3EndSession(POP3Session *pPOP3S)
+{
+	char szIP[128] = "???.???.???.???";
+
+	SysLogMessage(LOG_LEV_MESSAGE, "POP3 client exit [%s]\n",
+		      SysInetNToA(pPOP3S->PeerInfo, szIP, sizeof(szIP)));
+
+	POP3ThreadCountAdd(-1, pPOP3S->pThCfg->hThShb);
+	POP3ClearSession(*pPOP3S);
+
+	/* Unlink socket from the bufferer and close it */
+	BSckDetach(pPOP3S->hBSock, 1);
+	SysFree(pPOP3S);
+}
+
+static int POP3ResumeSession(void *pPrivate, int iEvent);
+
+static int POP3SessionLoop(POP3Session &POP3S, bool bCanPark)
+{
+	char szCommand[1024] = "";
+
+	while (!SvrInShutdown() && POP3S.iPOP3State != stateExit) {
+		if (POP3S.pThCfg->ulFlags & THCF_SHUTDOWN)
+			break;
+
+		/*
+		 * Idle clients are handed to the connection engine, which will
+		 * resume the session (with data ready to read) once the next
+		 * command arrives.
+		 */
+		if (bCanPark && CEngEnabled() && !BSckInputPending(POP3S.hBSock) &&
+		    CEngPark(BSckGetAttachedSocket(POP3S.hBSock),
+			     POP3S.pPOP3Cfg->iSessionTimeout, POP3ResumeSession,
+			     &POP3S) == 0)
+			return 1;
+		bCanPark = true;
+
+		if (BSckGetString(POP3S.hBSock, szCommand, sizeof(szCommand) - 1,
+				  POP3S.pPOP3Cfg->iSessionTimeout) == NULL ||
+		    MscCmdStringCheck(szCommand) < 0)
+			break;
+
+		/* Handle coomand */
+		POP3HandleCommand(szCommand, POP3S.hBSock, POP3S);
+	}
+
+	return 0;
+}
+
+static int POP3ResumeSession(void *pPrivate, int iEvent)
+{
+	POP3Session *pPOP3S = (POP3Session *) pPrivate;
+
+	if (iEvent == CENG_EV_READ && POP3SessionLoop(*pPOP3S, false) > 0)
+		return 0;
+	POP3EndSession(pPOP3S);
+
+	return 0;
+}
+
 static int POP3HandleSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock)
 {
 	/* Session structure declaration and init */
-	POP3Session POP3S;
+	POP3Session *pPOP3S = (POP3Session *) SysAlloc(sizeof(POP3Session));
+
+	if (pPOP3S == NULL) {
+		ErrorPush();
+
+		UPopSendErrorResponse(hBSock, ErrGetErrorCode(), STD_POP3_TIMEOUT);
+
+		return ErrorPop();
+	}
+
+	POP3Session &POP3S = *pPOP3S;
 
 	if (POP3InitSession(pThCfg, hBSock, POP3S) < 0) {
 		ErrorPush();
 
 		UPopSendErrorResponse(hBSock, ErrGetErrorCode(), STD_POP3_TIMEOUT);
+		SysFree(pPOP3S);
 
 		return ErrorPop();
 	}
@@ -916,27 +990,18 @@ static int POP3HandleSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock)
 	if (BSckVSendString(hBSock, POP3S.pPOP3Cfg->iTimeout,
 			    "+OK %s %s service ready; %s", POP3S.szTimeStamp,
 			    POP3_SERVER_NAME, szTime) < 0) {
+		ErrorPush();
 		POP3ClearSession(POP3S);
-		return ErrGetErrorCode();
-	}
-	/* Command loop */
-	char szCommand[1024] = "";
-
-	while (!SvrInShutdown() && POP3S.iPOP3State != stateExit &&
-	       BSckGetString(hBSock, szCommand, sizeof(szCommand) - 1,
-			     POP3S.pPOP3Cfg->iSessionTimeout) != NULL &&
-	       MscCmdStringCheck(szCommand) == 0) {
-		if (pThCfg->ulFlags & THCF_SHUTDOWN)
-			break;
-
-		/* Handle coomand */
-		POP3HandleCommand(szCommand, hBSock, POP3S);
+		SysFree(pPOP3S);
+		return ErrorPop();
 	}
-
-	SysLogMessage(LOG_LEV_MESSAGE, "POP3 client exit [%s]\n",
-		      SysInetNToA(POP3S.PeerInfo, szIP, sizeof(szIP)));
-
-	POP3ClearSession(POP3S);
+	/*
+	 * The session owns socket and thread count slot from here on, and
+	 * POP3EndSession() will release them.
+	 */
+	POP3S.hBSock = hBSock;
+	if (POP3SessionLoop(POP3S, true) == 0)
+		POP3EndSession(pPOP3S);
 
 	return 0;
 }
@@ -1012,13 +1077,13 @@ unsigned int POP3ClientThread(void *pThreadData)
 	}
 
 	/* Handle client session */
-	POP3HandleSession(pThCtx->pThCfg, hBSock);
-
-	/* Decrease threads count */
-	POP3ThreadCountAdd(-1, pThCtx->pThCfg->hThShb);
+	if (POP3HandleSession(pThCtx->pThCfg, hBSock) < 0) {
+		/* Decrease threads count */
+		POP3ThreadCountAdd(-1, pThCtx->pThCfg->hThShb);
 
-	/* Unlink socket from the bufferer and close it */
-	BSckDetach(hBSock, 1);
+		/* Unlink socket from the bufferer and close it */
+		BSckDetach(hBSock, 1);
+	}
 	SysFree(pThCtx);
 
 	return 0;
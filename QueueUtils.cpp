@@ -39,6 +39,7 @@
 #include "MiscUtils.h"
 #include "SMTPUtils.h"
 #include "SMAILUtils.h"
+#include "MailDomains.h"
 #include "QueueUtils.h"
 
 #define QUE_SMTP_MAILER_ERROR_HDR   "X-MailerError"
@@ -208,6 +209,14 @@ int QueUtGetFrozenMsgFile(QUEUE_HANDLE hQueue, int iLevel1, int iLevel2,
 
 	QueGetFilePath(hQueue, hMessage, szQueueFilePath);
 
+	/* Reattach the shared message body, if any, before handing out the file */
+	SPLF_HANDLE hFSpool = USmlCreateHandle(szQueueFilePath);
+
+	if (hFSpool != INVALID_SPLF_HANDLE) {
+		USmlAttachMsgBody(hFSpool);
+		USmlCloseHandle(hFSpool);
+	}
+
 	/* Copy the requested file */
 	if (MscCopyFile(pszOutFile, szQueueFilePath) < 0) {
 		ErrorPush();
@@ -504,10 +513,10 @@ static int QueUtBuildErrorResponse(char const *pszSMTPDomain, SPLF_HANDLE hFSpoo
 		}
 	}
 	/* This function retrieve the spool file message section and sync the content. */
-	/* This is necessary before reading the file */
+	/* This is necessary before reading the file, which must carry the whole message */
 	FileSection FSect;
 
-	if (USmlGetMsgFileSection(hFSpool, FSect) < 0) {
+	if (USmlAttachMsgBody(hFSpool) < 0 || USmlGetMsgFileSection(hFSpool, FSect) < 0) {
 		ErrorPush();
 		fclose(pRespFile);
 		SysRemove(pszResponseFile);
@@ -872,6 +881,10 @@ int QueUtCleanupNotifyRoot(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage,
 
 int QueUtResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, SPLF_HANDLE hFSpool)
 {
+	/* Messages loaded by the spool scan get their destination domain here */
+	if (hFSpool != INVALID_SPLF_HANDLE && QueGetMessageDomain(hMessage) == NULL)
+		QueUtSetMessageDomain(hMessage, USmlRcptTo(hFSpool));
+
 	/* Try to resend the message */
 	int iResult = QueResendMessage(hQueue, hMessage);
 
@@ -887,3 +900,21 @@ int QueUtResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, SPLF_HANDLE hF
 
 	return iResult;
 }
+
+int QueUtSetMessageDomain(QMSG_HANDLE hMessage, char const *pszRcpt)
+{
+	char szAddress[MAX_SMTP_ADDRESS] = "";
+	char szUser[MAX_ADDR_NAME] = "";
+	char szDomain[MAX_HOST_NAME] = "";
+
+	/*
+	 * Messages whose destination domain cannot be told (like source routed
+	 * ones), are left in the spool default queue.
+	 */
+	if (USmlParseAddress(pszRcpt, NULL, 0, szAddress, sizeof(szAddress) - 1) < 0 ||
+	    szAddress[0] == '@' || USmtpSplitEmailAddr(szAddress, szUser, szDomain) < 0)
+		return 0;
+
+	return QueSetMessageDomain(hMessage, StrLower(szDomain),
+				   MDomIsHandledDomain(szDomain) == 0);
+}
@@ -50,5 +50,6 @@ int QueUtNotifyTempErrDelivery(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage,
 int QueUtCleanupNotifyRoot(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage,
 			   SPLF_HANDLE hFSpool, char const *pszReason);
 int QueUtResendMessage(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage, SPLF_HANDLE hFSpool);
+int QueUtSetMessageDomain(QMSG_HANDLE hMessage, char const *pszRcpt);
 
 #endif
@@ -34,18 +34,35 @@
 #define STD_WAIT_GATES              37
 #define STD_RES_HASH_SIZE           251
 #define STD_RLCK_HASH_INIT          9677
+#define STD_FREE_ENTRIES            16
 
+/*
+ * Resources are striped over the wait gates, each one with its own mutex,
+ * so that lockers of unrelated resources do not contend. Lock entries are
+ * kept around in a per gate free list, and the entry itself is the lock
+ * handle, so the fast path does not touch the heap.
+ */
 struct ResWaitGate {
-	SYS_SEMAPHORE hSemaphore;
-	int iWaitingProcesses;
+	SYS_MUTEX hMutex;
 	int iHashSize;
 	SysListHead *pResList;
+	SysListHead FreeList;
+	int iFreeCount;
+	SYS_UINT64 ullLocks;
+	SYS_UINT64 ullWaits;
+	SYS_UINT64 ullWaitTime;
+	SYS_INT64 llMaxWait;
 };
 
 struct ResLockEntry {
 	SysListHead LLink;
+	int iWaitGate;
 	int iShLocks;
 	int iExLocks;
+	int iWaiters;
+	int iWakePending;
+	SYS_SEMAPHORE hSemaphore;
+	size_t sNameSize;
 	char szName[1];
 };
 
@@ -57,78 +74,92 @@ struct ResLocator {
 static unsigned long RLckHashString(char const *pData,
 				    unsigned long ulHashInit = STD_RLCK_HASH_INIT);
 
-static SYS_MUTEX hRLMutex = SYS_INVALID_MUTEX;
 static ResWaitGate RLGates[STD_WAIT_GATES];
 
-int RLckInitLockers(void)
+static void RLckFreeEntry(ResLockEntry *pRLE)
 {
-	/* Create resource locking mutex */
-	if ((hRLMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
-		return ErrGetErrorCode();
+	if (pRLE->hSemaphore != SYS_INVALID_SEMAPHORE)
+		SysCloseSemaphore(pRLE->hSemaphore);
+	SysFree(pRLE);
+}
+
+static void RLckCleanupGate(ResWaitGate *pRLG)
+{
+	SysListHead *pLLink;
+
+	for (int i = 0; i < pRLG->iHashSize; i++) {
+		SysListHead *pHead = &pRLG->pResList[i];
+
+		while ((pLLink = SYS_LIST_FIRST(pHead)) != NULL) {
+			ResLockEntry *pRLE = SYS_LIST_ENTRY(pLLink, ResLockEntry, LLink);
 
+			SYS_LIST_DEL(&pRLE->LLink);
+			RLckFreeEntry(pRLE);
+		}
+	}
+	while ((pLLink = SYS_LIST_FIRST(&pRLG->FreeList)) != NULL) {
+		ResLockEntry *pRLE = SYS_LIST_ENTRY(pLLink, ResLockEntry, LLink);
+
+		SYS_LIST_DEL(&pRLE->LLink);
+		RLckFreeEntry(pRLE);
+	}
+	SysFree(pRLG->pResList);
+	SysCloseMutex(pRLG->hMutex);
+}
+
+int RLckInitLockers(void)
+{
 	/* Initialize wait gates */
 	for (int i = 0; i < STD_WAIT_GATES; i++) {
-		if ((RLGates[i].hSemaphore = SysCreateSemaphore(0,
-								SYS_DEFAULT_MAXCOUNT)) ==
-		    SYS_INVALID_SEMAPHORE) {
+		ResWaitGate *pRLG = &RLGates[i];
+
+		ZeroData(*pRLG);
+		SYS_INIT_LIST_HEAD(&pRLG->FreeList);
+		if ((pRLG->hMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
 			ErrorPush();
-			for (--i; i >= 0; i--) {
-				SysFree(RLGates[i].pResList);
-				SysCloseSemaphore(RLGates[i].hSemaphore);
-			}
-			SysCloseMutex(hRLMutex);
+			for (--i; i >= 0; i--)
+				RLckCleanupGate(&RLGates[i]);
 			return ErrorPop();
 		}
-
-		RLGates[i].iWaitingProcesses = 0;
-		RLGates[i].iHashSize = STD_RES_HASH_SIZE;
-
-		if ((RLGates[i].pResList = (SysListHead *)
-		     SysAlloc(RLGates[i].iHashSize * sizeof(SysListHead))) == NULL) {
+		pRLG->iHashSize = STD_RES_HASH_SIZE;
+		if ((pRLG->pResList = (SysListHead *)
+		     SysAlloc(pRLG->iHashSize * sizeof(SysListHead))) == NULL) {
 			ErrorPush();
-			SysCloseSemaphore(RLGates[i].hSemaphore);
-			for (--i; i >= 0; i--) {
-				SysFree(RLGates[i].pResList);
-				SysCloseSemaphore(RLGates[i].hSemaphore);
-			}
-			SysCloseMutex(hRLMutex);
+			SysCloseMutex(pRLG->hMutex);
+			for (--i; i >= 0; i--)
+				RLckCleanupGate(&RLGates[i]);
 			return ErrorPop();
 		}
-		for (int j = 0; j < RLGates[i].iHashSize; j++)
-			SYS_INIT_LIST_HEAD(&RLGates[i].pResList[j]);
+		for (int j = 0; j < pRLG->iHashSize; j++)
+			SYS_INIT_LIST_HEAD(&pRLG->pResList[j]);
 	}
 
 	return 0;
 }
 
-static int RLckFreeEntry(ResLockEntry * pRLE)
+int RLckCleanupLockers(void)
 {
-	SysFree(pRLE);
+	for (int i = 0; i < STD_WAIT_GATES; i++)
+		RLckCleanupGate(&RLGates[i]);
 
 	return 0;
 }
 
-int RLckCleanupLockers(void)
+int RLckGetStats(RLckStats *pRLS)
 {
-	if (SysLockMutex(hRLMutex, SYS_INFINITE_TIMEOUT) < 0)
-		return ErrGetErrorCode();
+	ZeroData(*pRLS);
 	for (int i = 0; i < STD_WAIT_GATES; i++) {
-		for (int j = 0; j < RLGates[i].iHashSize; j++) {
-			SysListHead *pHead = &RLGates[i].pResList[j];
-			SysListHead *pLLink;
-
-			while ((pLLink = SYS_LIST_FIRST(pHead)) != NULL) {
-				ResLockEntry *pRLE = SYS_LIST_ENTRY(pLLink, ResLockEntry, LLink);
+		ResWaitGate *pRLG = &RLGates[i];
 
-				SYS_LIST_DEL(&pRLE->LLink);
-				RLckFreeEntry(pRLE);
-			}
-		}
-		SysFree(RLGates[i].pResList);
-		SysCloseSemaphore(RLGates[i].hSemaphore);
+		if (SysLockMutex(pRLG->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+			return ErrGetErrorCode();
+		pRLS->ullLocks += pRLG->ullLocks;
+		pRLS->ullWaits += pRLG->ullWaits;
+		pRLS->ullWaitTime += pRLG->ullWaitTime;
+		if (pRLS->llMaxWait < pRLG->llMaxWait)
+			pRLS->llMaxWait = pRLG->llMaxWait;
+		SysUnlockMutex(pRLG->hMutex);
 	}
-	SysUnlockMutex(hRLMutex);
-	SysCloseMutex(hRLMutex);
 
 	return 0;
 }
@@ -170,213 +201,186 @@ static ResLockEntry *RLckGetEntry(ResLocator const *pRL, char const *pszResource
 			return pRLE;
 	}
 
-	ErrSetErrorCode(ERR_LOCK_ENTRY_NOT_FOUND);
-
 	return NULL;
 }
 
-static int RLckRemoveEntry(ResLocator const *pRL, ResLockEntry * pRLE)
+static ResLockEntry *RLckAllocEntry(ResLocator const *pRL, char const *pszResourceName)
 {
-	SysListHead *pHead = &RLGates[pRL->iWaitGate].pResList[pRL->iResIdx];
+	ResWaitGate *pRLG = &RLGates[pRL->iWaitGate];
+	size_t sNameLen = strlen(pszResourceName);
 	SysListHead *pLLink;
+	ResLockEntry *pRLE = NULL;
 
-	SYS_LIST_FOR_EACH(pLLink, pHead) {
-		ResLockEntry *pCurrRLE = SYS_LIST_ENTRY(pLLink, ResLockEntry, LLink);
+	/* Try to recycle an entry from the gate free list first */
+	SYS_LIST_FOR_EACH(pLLink, &pRLG->FreeList) {
+		ResLockEntry *pFreeRLE = SYS_LIST_ENTRY(pLLink, ResLockEntry, LLink);
 
-		if (pCurrRLE == pRLE) {
+		if (sNameLen < pFreeRLE->sNameSize) {
+			pRLE = pFreeRLE;
 			SYS_LIST_DEL(&pRLE->LLink);
-			RLckFreeEntry(pRLE);
-			return 0;
+			pRLG->iFreeCount--;
+			break;
 		}
 	}
-
-	ErrSetErrorCode(ERR_LOCK_ENTRY_NOT_FOUND);
-	return ERR_LOCK_ENTRY_NOT_FOUND;
-}
-
-static ResLockEntry *RLckAllocEntry(char const *pszResourceName)
-{
-	ResLockEntry *pRLE = (ResLockEntry *) SysAlloc(sizeof(ResLockEntry) +
-						       strlen(pszResourceName));
-
-	if (pRLE == NULL)
-		return NULL;
-
+	if (pRLE == NULL) {
+		size_t sNameSize = Max(sNameLen + 1, SYS_MAX_PATH);
+
+		if ((pRLE = (ResLockEntry *) SysAlloc(sizeof(ResLockEntry) +
+						      sNameSize)) == NULL)
+			return NULL;
+		pRLE->iWaitGate = pRL->iWaitGate;
+		pRLE->hSemaphore = SYS_INVALID_SEMAPHORE;
+		pRLE->sNameSize = sNameSize;
+	}
 	SYS_INIT_LIST_LINK(&pRLE->LLink);
 	strcpy(pRLE->szName, pszResourceName);
+	SYS_LIST_ADDH(&pRLE->LLink, &pRLG->pResList[pRL->iResIdx]);
 
 	return pRLE;
 }
 
-static int RLckTryLockEX(ResLocator const *pRL, char const *pszResourceName)
+static void RLckReleaseEntry(ResLockEntry *pRLE)
 {
-	ResLockEntry *pRLE = RLckGetEntry(pRL, pszResourceName);
-
-	if (pRLE == NULL) {
-		SysListHead *pHead = &RLGates[pRL->iWaitGate].pResList[pRL->iResIdx];
-
-		if ((pRLE = RLckAllocEntry(pszResourceName)) == NULL)
-			return ErrGetErrorCode();
-		pRLE->iExLocks = 1;
-		SYS_LIST_ADDH(&pRLE->LLink, pHead);
-	} else {
-		if (pRLE->iExLocks > 0 || pRLE->iShLocks > 0) {
-			ErrSetErrorCode(ERR_LOCKED_RESOURCE);
-			return ERR_LOCKED_RESOURCE;
-		}
-		pRLE->iExLocks = 1;
-	}
-
-	return 0;
+	ResWaitGate *pRLG = &RLGates[pRLE->iWaitGate];
+
+	/* Entries stay in the table while someone holds, waits or is being woken */
+	if (pRLE->iShLocks > 0 || pRLE->iExLocks > 0 || pRLE->iWaiters > 0 ||
+	    pRLE->iWakePending > 0)
+		return;
+	SYS_LIST_DEL(&pRLE->LLink);
+	if (pRLG->iFreeCount < STD_FREE_ENTRIES) {
+		SYS_LIST_ADDH(&pRLE->LLink, &pRLG->FreeList);
+		pRLG->iFreeCount++;
+	} else
+		RLckFreeEntry(pRLE);
 }
 
-static int RLckDoUnlockEX(ResLocator const *pRL, char const *pszResourceName)
+static void RLckWakeWaiter(ResLockEntry *pRLE)
 {
-	ResLockEntry *pRLE = RLckGetEntry(pRL, pszResourceName);
-
-	if (pRLE == NULL || pRLE->iExLocks == 0) {
-		ErrSetErrorCode(ERR_RESOURCE_NOT_LOCKED);
-		return ERR_RESOURCE_NOT_LOCKED;
-	}
-
-	pRLE->iExLocks = 0;
-
-	/* Remove entry from list and delete entry memory */
-	if (RLckRemoveEntry(pRL, pRLE) < 0)
-		return ErrGetErrorCode();
-
-	/* Release waiting processes */
-	if (RLGates[pRL->iWaitGate].iWaitingProcesses > 0) {
-		SysReleaseSemaphore(RLGates[pRL->iWaitGate].hSemaphore,
-				    RLGates[pRL->iWaitGate].iWaitingProcesses);
-
-		RLGates[pRL->iWaitGate].iWaitingProcesses = 0;
+	/* Wake a single waiter, that will pass the token along if it can */
+	if (pRLE->iWaiters > 0) {
+		pRLE->iWaiters--;
+		pRLE->iWakePending++;
+		SysReleaseSemaphore(pRLE->hSemaphore, 1);
 	}
-
-	return 0;
 }
 
-static int RLckTryLockSH(ResLocator const *pRL, char const *pszResourceName)
+static RLCK_HANDLE RLckLock(char const *pszResourceName, bool bExclusive)
 {
-	ResLockEntry *pRLE = RLckGetEntry(pRL, pszResourceName);
+	ResLocator RL;
 
-	if (pRLE == NULL) {
-		SysListHead *pHead = &RLGates[pRL->iWaitGate].pResList[pRL->iResIdx];
+	RLckGetResLocator(pszResourceName, &RL);
 
-		if ((pRLE = RLckAllocEntry(pszResourceName)) == NULL)
-			return ErrGetErrorCode();
-		pRLE->iShLocks = 1;
-		SYS_LIST_ADDH(&pRLE->LLink, pHead);
-	} else {
-		if (pRLE->iExLocks > 0) {
-			ErrSetErrorCode(ERR_LOCKED_RESOURCE);
-			return ERR_LOCKED_RESOURCE;
-		}
-		++pRLE->iShLocks;
-	}
+	ResWaitGate *pRLG = &RLGates[RL.iWaitGate];
 
-	return 0;
-}
+	if (SysLockMutex(pRLG->hMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return INVALID_RLCK_HANDLE;
 
-static int RLckDoUnlockSH(ResLocator const *pRL, char const *pszResourceName)
-{
-	ResLockEntry *pRLE = RLckGetEntry(pRL, pszResourceName);
+	ResLockEntry *pRLE = RLckGetEntry(&RL, pszResourceName);
 
-	if (pRLE == NULL || pRLE->iShLocks == 0) {
-		ErrSetErrorCode(ERR_RESOURCE_NOT_LOCKED);
-		return ERR_RESOURCE_NOT_LOCKED;
+	if (pRLE == NULL &&
+	    (pRLE = RLckAllocEntry(&RL, pszResourceName)) == NULL) {
+		ErrorPush();
+		SysUnlockMutex(pRLG->hMutex);
+		ErrorPop();
+		return INVALID_RLCK_HANDLE;
 	}
-	if (--pRLE->iShLocks == 0) {
-		/* Remove entry from list and delete entry heap memory */
-		if (RLckRemoveEntry(pRL, pRLE) < 0)
-			return ErrGetErrorCode();
 
-		/* Release waiting processes */
-		if (RLGates[pRL->iWaitGate].iWaitingProcesses > 0) {
-			SysReleaseSemaphore(RLGates[pRL->iWaitGate].hSemaphore,
-					    RLGates[pRL->iWaitGate].iWaitingProcesses);
+	bool bWaited = false;
+	SYS_INT64 llWaitStart = 0;
 
-			RLGates[pRL->iWaitGate].iWaitingProcesses = 0;
+	while (pRLE->iExLocks > 0 || (bExclusive && pRLE->iShLocks > 0)) {
+		if (pRLE->hSemaphore == SYS_INVALID_SEMAPHORE &&
+		    (pRLE->hSemaphore = SysCreateSemaphore(0, SYS_DEFAULT_MAXCOUNT)) ==
+		    SYS_INVALID_SEMAPHORE) {
+			ErrorPush();
+			RLckReleaseEntry(pRLE);
+			SysUnlockMutex(pRLG->hMutex);
+			ErrorPop();
+			return INVALID_RLCK_HANDLE;
 		}
-	}
-
-	return 0;
-}
-
-static RLCK_HANDLE RLckLock(char const *pszResourceName,
-			    int (*pLockProc) (ResLocator const *, char const *))
-{
-	ResLocator RL;
+		if (!bWaited) {
+			bWaited = true;
+			llWaitStart = SysMsTime();
+		}
+		pRLE->iWaiters++;
+		SysUnlockMutex(pRLG->hMutex);
 
-	RLckGetResLocator(pszResourceName, &RL);
-	for (;;) {
-		/* Lock resources list access */
-		if (SysLockMutex(hRLMutex, SYS_INFINITE_TIMEOUT) < 0)
+		if (SysWaitSemaphore(pRLE->hSemaphore, SYS_INFINITE_TIMEOUT) < 0 ||
+		    SysLockMutex(pRLG->hMutex, SYS_INFINITE_TIMEOUT) < 0)
 			return INVALID_RLCK_HANDLE;
+		pRLE->iWakePending--;
+	}
+	if (bExclusive)
+		pRLE->iExLocks = 1;
+	else
+		pRLE->iShLocks++;
 
-		int iLockResult = (*pLockProc)(&RL, pszResourceName);
-
-		if (iLockResult == ERR_LOCKED_RESOURCE) {
-			SYS_SEMAPHORE SemID = RLGates[RL.iWaitGate].hSemaphore;
+	pRLG->ullLocks++;
+	if (bWaited) {
+		SYS_INT64 llWait = SysMsTime() - llWaitStart;
 
-			++RLGates[RL.iWaitGate].iWaitingProcesses;
-			SysUnlockMutex(hRLMutex);
+		pRLG->ullWaits++;
+		pRLG->ullWaitTime += (SYS_UINT64) llWait;
+		if (pRLG->llMaxWait < llWait)
+			pRLG->llMaxWait = llWait;
 
-			if (SysWaitSemaphore(SemID, SYS_INFINITE_TIMEOUT) < 0)
-				return INVALID_RLCK_HANDLE;
-		} else if (iLockResult == 0) {
-			SysUnlockMutex(hRLMutex);
-			break;
-		} else {
-			SysUnlockMutex(hRLMutex);
-			return INVALID_RLCK_HANDLE;
-		}
+		/* Let other shared lockers that were queued behind us in */
+		if (!bExclusive)
+			RLckWakeWaiter(pRLE);
 	}
+	SysUnlockMutex(pRLG->hMutex);
 
-	return (RLCK_HANDLE) SysStrDup(pszResourceName);
+	return (RLCK_HANDLE) pRLE;
 }
 
-static int RLckUnlock(RLCK_HANDLE hLock,
-		      int (*pUnlockProc) (ResLocator const *, char const *))
+static int RLckUnlock(RLCK_HANDLE hLock, bool bExclusive)
 {
-	char *pszResourceName = (char *) hLock;
-	ResLocator RL;
+	ResLockEntry *pRLE = (ResLockEntry *) hLock;
+	ResWaitGate *pRLG = &RLGates[pRLE->iWaitGate];
 
-	RLckGetResLocator(pszResourceName, &RL);
-
-	/* Lock resources list access */
-	if (SysLockMutex(hRLMutex, SYS_INFINITE_TIMEOUT) < 0)
+	if (SysLockMutex(pRLG->hMutex, SYS_INFINITE_TIMEOUT) < 0)
 		return ErrGetErrorCode();
-
-	if ((*pUnlockProc)(&RL, pszResourceName) < 0) {
-		ErrorPush();
-		SysUnlockMutex(hRLMutex);
-		SysFree(pszResourceName);
-		return ErrorPop();
+	if (bExclusive) {
+		if (pRLE->iExLocks == 0) {
+			SysUnlockMutex(pRLG->hMutex);
+			ErrSetErrorCode(ERR_RESOURCE_NOT_LOCKED);
+			return ERR_RESOURCE_NOT_LOCKED;
+		}
+		pRLE->iExLocks = 0;
+	} else {
+		if (pRLE->iShLocks == 0) {
+			SysUnlockMutex(pRLG->hMutex);
+			ErrSetErrorCode(ERR_RESOURCE_NOT_LOCKED);
+			return ERR_RESOURCE_NOT_LOCKED;
+		}
+		pRLE->iShLocks--;
+	}
+	if (pRLE->iShLocks == 0 && pRLE->iExLocks == 0) {
+		RLckWakeWaiter(pRLE);
+		RLckReleaseEntry(pRLE);
 	}
-	SysUnlockMutex(hRLMutex);
-	SysFree(pszResourceName);
+	SysUnlockMutex(pRLG->hMutex);
 
 	return 0;
 }
 
 RLCK_HANDLE RLckLockEX(char const *pszResourceName)
 {
-	return RLckLock(pszResourceName, RLckTryLockEX);
+	return RLckLock(pszResourceName, true);
 }
 
 int RLckUnlockEX(RLCK_HANDLE hLock)
 {
-	return hLock != INVALID_RLCK_HANDLE ? RLckUnlock(hLock, RLckDoUnlockEX): 0;
+	return hLock != INVALID_RLCK_HANDLE ? RLckUnlock(hLock, true): 0;
 }
 
 RLCK_HANDLE RLckLockSH(char const *pszResourceName)
 {
-	return RLckLock(pszResourceName, RLckTryLockSH);
+	return RLckLock(pszResourceName, false);
 }
 
 int RLckUnlockSH(RLCK_HANDLE hLock)
 {
-	return hLock != INVALID_RLCK_HANDLE ? RLckUnlock(hLock, RLckDoUnlockSH): 0;
+	return hLock != INVALID_RLCK_HANDLE ? RLckUnlock(hLock, false): 0;
 }
-
@@ -28,8 +28,16 @@
 typedef struct RLCK_HANDLE_struct {
 } *RLCK_HANDLE;
 
+struct RLckStats {
+	SYS_UINT64 ullLocks;
+	SYS_UINT64 ullWaits;
+	SYS_UINT64 ullWaitTime;
+	SYS_INT64 llMaxWait;
+};
+
 int RLckInitLockers(void);
 int RLckCleanupLockers(void);
+int RLckGetStats(RLckStats *pRLS);
 RLCK_HANDLE RLckLockEX(char const *pszResourceName);
 int RLckUnlockEX(RLCK_HANDLE hLock);
 RLCK_HANDLE RLckLockSH(char const *pszResourceName);
@@ -51,14 +51,40 @@
 #define CUSTOM_PROC_LINE_MAX        1024
 #define SMAIL_EXTERNAL_EXIT_BREAK   16
 #define SMAIL_STOP_PROCESSING       3111965L
+#define SMAIL_MAX_GROUP_RCPTS       100
 
 struct MacroSubstCtx {
 	SPLF_HANDLE hFSpool;
 	FileSection FSect;
 };
 
+struct SMAILGroupRcpt {
+	QMSG_HANDLE hMessage;
+	SPLF_HANDLE hFSpool;
+	SMTPError *pSMTPE;
+	SMTPError SMTPE;
+	FileSection FSect;
+	int iError;
+	bool bSolo;
+	bool bDone;
+};
+
+struct SMAILRcptGroup {
+	QUEUE_HANDLE hQueue;
+	char const *pszDestDomain;
+	int iMaxRcpts;
+	bool bJoined;
+	int iRcptCount;
+	SMAILGroupRcpt Rcpts[SMAIL_MAX_GROUP_RCPTS];
+	int iOrphanCount;
+	QMSG_HANDLE hOrphans[SMAIL_MAX_GROUP_RCPTS];
+};
+
 static int SMAILThreadCountAdd(long lCount, SHB_HANDLE hShbSMAIL, SMAILConfig *pSMAILCfg = NULL);
 static int SMAILLogEnabled(SHB_HANDLE hShbSMAIL, SMAILConfig *pSMAILCfg = NULL);
+static int SMAILTryProcessMessage(SVRCFG_HANDLE hSvrConfig, QUEUE_HANDLE hQueue,
+				  QMSG_HANDLE hMessage, SHB_HANDLE hShbSMAIL,
+				  SMAILConfig *pSMAILCfg);
 
 static SMAILConfig *SMAILGetConfigCopy(SHB_HANDLE hShbSMAIL)
 {
@@ -92,6 +118,23 @@ static int SMAILThreadCountAdd(long lCount, SHB_HANDLE hShbSMAIL, SMAILConfig *p
 	return 0;
 }
 
+static int SMAILBusyCountAdd(long lBusy, long lNet, SHB_HANDLE hShbSMAIL)
+{
+	/*
+	 * These change a few times per message, so they skip the shared block
+	 * lock. The pool manager reading them under the lock only needs an
+	 * approximate value.
+	 */
+	SMAILConfig *pSMAILCfg = (SMAILConfig *) ShbGetData(hShbSMAIL);
+
+	if (lBusy != 0)
+		SysInterlockedAdd(&pSMAILCfg->lBusyThreads, lBusy);
+	if (lNet != 0)
+		SysInterlockedAdd(&pSMAILCfg->lNetThreads, lNet);
+
+	return 0;
+}
+
 static int SMAILLogEnabled(SHB_HANDLE hShbSMAIL, SMAILConfig *pSMAILCfg)
 {
 	int iDoUnlock = 0;
@@ -230,23 +273,349 @@ static int SMAILMailingListExplode(UserInfo *pUI, SPLF_HANDLE hFSpool)
 	return 0;
 }
 
+static SMAILRcptGroup *SMAILCreateGroup(QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage,
+					SPLF_HANDLE hFSpool, char const *pszDestDomain,
+					SMTPError *pSMTPE, int iMaxRcpts)
+{
+	SMAILRcptGroup *pGroup = (SMAILRcptGroup *) SysAlloc(sizeof(SMAILRcptGroup));
+
+	if (pGroup == NULL)
+		return NULL;
+	pGroup->hQueue = hQueue;
+	pGroup->pszDestDomain = pszDestDomain;
+	pGroup->iMaxRcpts = Min(iMaxRcpts, SMAIL_MAX_GROUP_RCPTS);
+	pGroup->Rcpts[0].hMessage = hMessage;
+	pGroup->Rcpts[0].hFSpool = hFSpool;
+	pGroup->Rcpts[0].pSMTPE = pSMTPE;
+	pGroup->Rcpts[0].iError = ERR_INCOMPLETE_PROCESSING;
+	pGroup->iRcptCount = 1;
+
+	return pGroup;
+}
+
+static int SMAILCloseGroupRcpt(SVRCFG_HANDLE hSvrConfig, QUEUE_HANDLE hQueue,
+			       SMAILGroupRcpt *pRcpt)
+{
+	if (pRcpt->iError == 0) {
+		USmlCloseHandle(pRcpt->hFSpool);
+
+		/* Cleanup message */
+		QueCleanupMessage(hQueue, pRcpt->hMessage);
+		QueCloseMessage(hQueue, pRcpt->hMessage);
+	} else {
+		/*
+		 * If a permanent SMTP error has been detected, then notify the message
+		 * sender and remove the spool file
+		 */
+		if (USmtpIsFatalError(pRcpt->pSMTPE))
+			QueUtNotifyPermErrDelivery(hQueue, pRcpt->hMessage, pRcpt->hFSpool,
+						   USmtpGetErrorMessage(pRcpt->pSMTPE),
+						   USmtpGetErrorServer(pRcpt->pSMTPE), true);
+
+		/* Resend the message if it's not been cleaned up */
+		if (QueCheckMessage(hQueue, pRcpt->hMessage) == 0) {
+			USmlSyncChanges(pRcpt->hFSpool);
+
+			/* Handle resend notifications */
+			SMAILHandleResendNotify(hSvrConfig, hQueue, pRcpt->hMessage,
+						pRcpt->hFSpool);
+
+			/* Resend the message */
+			QueUtResendMessage(hQueue, pRcpt->hMessage, pRcpt->hFSpool);
+		} else
+			QueCloseMessage(hQueue, pRcpt->hMessage);
+
+		USmlCloseHandle(pRcpt->hFSpool);
+	}
+	USmtpCleanupError(pRcpt->pSMTPE);
+
+	return 0;
+}
+
+static void SMAILFreeGroup(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
+			   SMAILRcptGroup *pGroup)
+{
+	int i;
+
+	/* The group leader is handled by the caller */
+	for (i = 1; i < pGroup->iRcptCount; i++)
+		SMAILCloseGroupRcpt(hSvrConfig, pGroup->hQueue, &pGroup->Rcpts[i]);
+
+	/*
+	 * Messages extracted from the queue, but that did not qualify to join
+	 * the group, are processed the standard way.
+	 */
+	for (i = 0; i < pGroup->iOrphanCount; i++)
+		SMAILTryProcessMessage(hSvrConfig, pGroup->hQueue, pGroup->hOrphans[i],
+				       hShbSMAIL, NULL);
+	SysFree(pGroup);
+}
+
+static bool SMAILGroupSameContent(SMAILRcptGroup const *pGroup, SMAILGroupRcpt const *pRcpt)
+{
+	/*
+	 * Group members carry the same SMTP message ID and destination domain,
+	 * inside the group key, so they share the same content unless a filter
+	 * has changed either the leader or the member message.
+	 */
+	char const *pszKey = QueGetMessageGroup(pRcpt->hMessage);
+	char const *pszLeaderKey = QueGetMessageGroup(pGroup->Rcpts[0].hMessage);
+
+	return pszKey != NULL && pszLeaderKey != NULL && strcmp(pszKey, pszLeaderKey) == 0 &&
+		!USmlMessageModified(pGroup->Rcpts[0].hFSpool) &&
+		!USmlMessageModified(pRcpt->hFSpool);
+}
+
+static SPLF_HANDLE SMAILGroupOpenRcpt(SVRCFG_HANDLE hSvrConfig, SMAILRcptGroup *pGroup,
+				      QMSG_HANDLE hMessage)
+{
+	char szMessFilePath[SYS_MAX_PATH];
+
+	QueGetFilePath(pGroup->hQueue, hMessage, szMessFilePath);
+
+	SPLF_HANDLE hFSpool = USmlCreateHandle(szMessFilePath);
+
+	if (hFSpool == INVALID_SPLF_HANDLE)
+		return INVALID_SPLF_HANDLE;
+
+	/*
+	 * The message must be a plain remote delivery to the group destination
+	 * domain, through the same relay of the group leader. Everything else
+	 * is left to the standard processing.
+	 */
+	SPLF_HANDLE hLeader = pGroup->Rcpts[0].hFSpool;
+	char const *pszRelayDomain = USmlGetRelayDomain(hFSpool);
+	char const *pszLeaderRelay = USmlGetRelayDomain(hLeader);
+	char const *const *ppszRcpt = USmlGetRcptTo(hFSpool);
+	char szDestUser[MAX_ADDR_NAME], szDestDomain[MAX_ADDR_NAME];
+	char szADomain[MAX_HOST_NAME], szAliasFilePath[SYS_MAX_PATH];
+
+	if (USmlMailLoopCheck(hFSpool, hSvrConfig) < 0 ||
+	    StrStringsCount(ppszRcpt) != 1 ||
+	    USmtpSplitEmailAddr(ppszRcpt[0], szDestUser, szDestDomain) < 0 ||
+	    stricmp(szDestDomain, pGroup->pszDestDomain) != 0 ||
+	    strcmp(USmlSendMailFrom(hFSpool), USmlSendMailFrom(hLeader)) != 0 ||
+	    (pszRelayDomain == NULL) != (pszLeaderRelay == NULL) ||
+	    (pszRelayDomain != NULL && stricmp(pszRelayDomain, pszLeaderRelay) != 0)) {
+		USmlCloseHandle(hFSpool);
+		return INVALID_SPLF_HANDLE;
+	}
+	if (USmlGetCmdAliasCustomFile(hFSpool, pGroup->hQueue, hMessage,
+				      ADomLookupDomain(szDestDomain, szADomain, true) ?
+				      szADomain: szDestDomain, szDestUser,
+				      szAliasFilePath) == 0) {
+		USmlCloseHandle(hFSpool);
+		return INVALID_SPLF_HANDLE;
+	}
+
+	return hFSpool;
+}
+
+static int SMAILGroupJoin(SVRCFG_HANDLE hSvrConfig, SMAILRcptGroup *pGroup)
+{
+	int i, iCount;
+	QMSG_HANDLE hMessages[SMAIL_MAX_GROUP_RCPTS];
+
+	pGroup->bJoined = true;
+	if ((iCount = QueExtractGroup(pGroup->hQueue, pGroup->Rcpts[0].hMessage, hMessages,
+				      pGroup->iMaxRcpts - pGroup->iRcptCount)) <= 0)
+		return iCount;
+	for (i = 0; i < iCount; i++) {
+		SPLF_HANDLE hFSpool = SMAILGroupOpenRcpt(hSvrConfig, pGroup, hMessages[i]);
+
+		if (hFSpool == INVALID_SPLF_HANDLE) {
+			pGroup->hOrphans[pGroup->iOrphanCount++] = hMessages[i];
+			continue;
+		}
+
+		SMAILGroupRcpt *pRcpt = &pGroup->Rcpts[pGroup->iRcptCount++];
+
+		pRcpt->hMessage = hMessages[i];
+		pRcpt->hFSpool = hFSpool;
+		pRcpt->pSMTPE = &pRcpt->SMTPE;
+		USmtpInitError(pRcpt->pSMTPE);
+
+		/*
+		 * Apply filters. A failure here is reported as the delivery result
+		 * for the message. Filters might also change the message content,
+		 * in which case the message gets its own SMTP transaction.
+		 */
+		if ((pRcpt->iError = FilFilterMessage(hFSpool, pGroup->hQueue, hMessages[i],
+						      FILTER_MODE_OUTBOUND)) < 0 ||
+		    (pRcpt->iError = USmlGetMsgFileSection(hFSpool, pRcpt->FSect)) < 0) {
+			pRcpt->bDone = true;
+			continue;
+		}
+		pRcpt->iError = ERR_INCOMPLETE_PROCESSING;
+		pRcpt->bSolo = !SMAILGroupSameContent(pGroup, pRcpt);
+	}
+
+	return 0;
+}
+
+static int SMAILGroupDeliver(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
+			     SMAILRcptGroup *pGroup, SMAILGroupRcpt **ppRcpts, int iRcptCount,
+			     char const *pszType, SMTPGateway const *pGw, char const *pszServer,
+			     char const *pszHeloDomain, FileSection const *pFS,
+			     char const *pszMedium, bool bNoAddrFatal)
+{
+	int i;
+	SMTPRecipient Rcpts[SMAIL_MAX_GROUP_RCPTS];
+
+	for (i = 0; i < iRcptCount; i++) {
+		SPLF_HANDLE hFSpool = ppRcpts[i]->hFSpool;
+
+		SysLogMessage(LOG_LEV_MESSAGE,
+			      "SMAIL SMTP-Send %s = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
+			      pszType, pszServer, USmlGetSMTPDomain(hFSpool), USmlMailFrom(hFSpool),
+			      USmlRcptTo(hFSpool));
+
+		USmtpCleanupError(ppRcpts[i]->pSMTPE);
+		Rcpts[i].pszRcpt = USmlSendRcptTo(hFSpool);
+		Rcpts[i].pSMTPE = ppRcpts[i]->pSMTPE;
+	}
+	SMAILBusyCountAdd(0, +1, hShbSMAIL);
+	if (pGw != NULL)
+		USmtpSendMail(pGw, pszHeloDomain, USmlSendMailFrom(ppRcpts[0]->hFSpool),
+			      Rcpts, iRcptCount, pFS);
+	else
+		USmtpMailRmtDeliver(hSvrConfig, pszServer, pszHeloDomain,
+				    USmlSendMailFrom(ppRcpts[0]->hFSpool), Rcpts, iRcptCount,
+				    pFS);
+	SMAILBusyCountAdd(0, -1, hShbSMAIL);
+
+	for (i = 0; i < iRcptCount; i++) {
+		SMAILGroupRcpt *pRcpt = ppRcpts[i];
+		SPLF_HANDLE hFSpool = pRcpt->hFSpool;
+
+		if ((pRcpt->iError = Rcpts[i].iError) == 0) {
+			pRcpt->bDone = true;
+
+			/* Log Mailer operation */
+			if (SMAILLogEnabled(hShbSMAIL)) {
+				char szRmtMsgID[256];
+
+				USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pRcpt->pSMTPE),
+						     szRmtMsgID, sizeof(szRmtMsgID));
+				USmlLogMessage(hFSpool, pszMedium, szRmtMsgID, pszServer);
+			}
+			continue;
+		}
+
+		/*
+		 * If the A record of the recipient host does not exist, set the
+		 * fatal SMTP error so that the caller can properly bounce the
+		 * message.
+		 */
+		if (bNoAddrFatal &&
+		    (pRcpt->iError == ERR_DNS_NOTFOUND || pRcpt->iError == ERR_BAD_SERVER_ADDR))
+			USmtpSetError(pRcpt->pSMTPE, SMTP_FATAL_ERROR,
+				      ErrGetErrorString(pRcpt->iError), pszServer);
+
+		char szSmtpError[512];
+
+		USmtpGetSMTPError(pRcpt->pSMTPE, szSmtpError, sizeof(szSmtpError));
+
+		/*
+		 * The error context holds the last error of the whole transaction,
+		 * so restore the one of this member before logging it.
+		 */
+		ErrSetErrorCode(pRcpt->iError, USmtpGetErrorMessage(pRcpt->pSMTPE));
+		ErrLogMessage(LOG_LEV_MESSAGE,
+			      "SMAIL SMTP-Send %s = \"%s\" SMTP = \"%s\" "
+			      "From = \"%s\" To = \"%s\" Failed !\n"
+			      "%s = \"%s\"\n"
+			      "%s = \"%s\"\n", pszType, pszServer, USmlGetSMTPDomain(hFSpool),
+			      USmlMailFrom(hFSpool), USmlRcptTo(hFSpool), SMTP_ERROR_VARNAME,
+			      szSmtpError, SMTP_SERVER_VARNAME, USmtpGetErrorServer(pRcpt->pSMTPE));
+
+		QueUtErrLogMessage(pGroup->hQueue, pRcpt->hMessage,
+				   "SMAIL SMTP-Send %s = \"%s\" SMTP = \"%s\" "
+				   "From = \"%s\" To = \"%s\" Failed !\n"
+				   "%s = \"%s\"\n"
+				   "%s = \"%s\"\n", pszType, pszServer, USmlGetSMTPDomain(hFSpool),
+				   USmlMailFrom(hFSpool), USmlRcptTo(hFSpool), SMTP_ERROR_VARNAME,
+				   szSmtpError, SMTP_SERVER_VARNAME,
+				   USmtpGetErrorServer(pRcpt->pSMTPE));
+
+		if (USmtpIsFatalError(pRcpt->pSMTPE))
+			pRcpt->bDone = true;
+	}
+
+	return 0;
+}
+
+static int SMAILGroupSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
+			  SMAILRcptGroup *pGroup, char const *pszType, SMTPGateway const *pGw,
+			  char const *pszServer, char const *pszHeloDomain,
+			  FileSection const *pFS, char const *pszMedium, bool bNoAddrFatal = false)
+{
+	int i, iRcptCount = 0;
+	SMAILGroupRcpt *pRcpts[SMAIL_MAX_GROUP_RCPTS];
+
+	/*
+	 * Companion messages are pulled out of the queue only once we know
+	 * where the message is going, and right before the first delivery
+	 * attempt.
+	 */
+	if (!pGroup->bJoined && pGroup->iMaxRcpts > 1)
+		SMAILGroupJoin(hSvrConfig, pGroup);
+	if (pGw != NULL)
+		pszServer = pGw->pszHost;
+
+	/* Messages sharing the group body go inside a single SMTP transaction */
+	for (i = 0; i < pGroup->iRcptCount; i++)
+		if (!pGroup->Rcpts[i].bDone && !pGroup->Rcpts[i].bSolo)
+			pRcpts[iRcptCount++] = &pGroup->Rcpts[i];
+	if (iRcptCount > 0)
+		SMAILGroupDeliver(hSvrConfig, hShbSMAIL, pGroup, pRcpts, iRcptCount, pszType,
+				  pGw, pszServer, pszHeloDomain, pFS, pszMedium, bNoAddrFatal);
+
+	/* While the ones whose content has been changed by filters go alone */
+	for (i = 0; i < pGroup->iRcptCount; i++) {
+		SMAILGroupRcpt *pRcpt = &pGroup->Rcpts[i];
+
+		if (!pRcpt->bDone && pRcpt->bSolo)
+			SMAILGroupDeliver(hSvrConfig, hShbSMAIL, pGroup, &pRcpt, 1, pszType,
+					  pGw, pszServer, pszHeloDomain, &pRcpt->FSect,
+					  pszMedium, bNoAddrFatal);
+	}
+
+	return pGroup->Rcpts[0].iError;
+}
+
+static bool SMAILGroupPending(SMAILRcptGroup const *pGroup)
+{
+	for (int i = 0; i < pGroup->iRcptCount; i++)
+		if (!pGroup->Rcpts[i].bDone)
+			return true;
+
+	return false;
+}
+
+static int SMAILGroupResult(SMAILRcptGroup const *pGroup)
+{
+	int iError = pGroup->Rcpts[0].iError;
+
+	return iError < 0 ? ErrorSet(iError): 0;
+}
+
 static int SMAILRemoteMsgSMTPSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
-				  SPLF_HANDLE hFSpool, QUEUE_HANDLE hQueue, QMSG_HANDLE hMessage,
-				  char const *pszDestDomain, SMTPError *pSMTPE)
+				  SMAILRcptGroup *pGroup)
 {
+	SPLF_HANDLE hFSpool = pGroup->Rcpts[0].hFSpool;
+	QUEUE_HANDLE hQueue = pGroup->hQueue;
+	QMSG_HANDLE hMessage = pGroup->Rcpts[0].hMessage;
+	char const *pszDestDomain = pGroup->pszDestDomain;
+
 	/* Apply filters ... */
 	if (FilFilterMessage(hFSpool, hQueue, hMessage, FILTER_MODE_OUTBOUND) < 0)
 		return ErrGetErrorCode();
 
 	int iError;
 	char const *pszSMTPDomain = USmlGetSMTPDomain(hFSpool);
-	char const *pszSmtpMessageID = USmlGetSmtpMessageID(hFSpool);
-	char const *pszSpoolFile = USmlGetSpoolFile(hFSpool);
-	char const *pszSpoolFilePath = USmlGetSpoolFilePath(hFSpool);
 	char const *pszMailFrom = USmlMailFrom(hFSpool);
-	char const *pszSendMailFrom = USmlSendMailFrom(hFSpool);
 	char const *pszRcptTo = USmlRcptTo(hFSpool);
-	char const *pszSendRcptTo = USmlSendRcptTo(hFSpool);
 	char const *pszRelayDomain = USmlGetRelayDomain(hFSpool);
 	FileSection FSect;
 
@@ -264,48 +633,10 @@ static int SMAILRemoteMsgSMTPSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL
 
 	/* If it's a relayed message use the associated relay */
 	if (pszRelayDomain != NULL) {
-		SysLogMessage(LOG_LEV_MESSAGE,
-			      "SMAIL SMTP-Send CMX = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
-			      pszRelayDomain, pszSMTPDomain, pszMailFrom, pszRcptTo);
-
-		USmtpCleanupError(pSMTPE);
-
-		if (USmtpMailRmtDeliver(hSvrConfig, pszRelayDomain, pszHeloDomain, pszSendMailFrom,
-					pszSendRcptTo, &FSect, pSMTPE) < 0) {
-			ErrorPush();
-
-			char szSmtpError[512];
-
-			USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
-
-			ErrLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send CMX = \"%s\" SMTP = \"%s\" "
-				      "From = \"%s\" To = \"%s\" Failed !\n"
-				      "%s = \"%s\"\n"
-				      "%s = \"%s\"\n", pszRelayDomain, pszSMTPDomain, pszMailFrom,
-				      pszRcptTo, SMTP_ERROR_VARNAME, szSmtpError,
-				      SMTP_SERVER_VARNAME, USmtpGetErrorServer(pSMTPE));
+		SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "CMX", NULL, pszRelayDomain,
+			       pszHeloDomain, &FSect, "SMTP");
 
-			QueUtErrLogMessage(hQueue, hMessage,
-					   "SMAIL SMTP-Send CMX = \"%s\" SMTP = \"%s\" "
-					   "From = \"%s\" To = \"%s\" Failed !\n"
-					   "%s = \"%s\"\n"
-					   "%s = \"%s\"\n", pszRelayDomain, pszSMTPDomain,
-					   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					   szSmtpError, SMTP_SERVER_VARNAME,
-					   USmtpGetErrorServer(pSMTPE));
-
-			return ErrorPop();
-		}
-		if (SMAILLogEnabled(hShbSMAIL)) {
-			char szRmtMsgID[256];
-
-			USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE), szRmtMsgID,
-					     sizeof(szRmtMsgID));
-			USmlLogMessage(hFSpool, "SMTP", szRmtMsgID, pszRelayDomain);
-		}
-
-		return 0;
+		return SMAILGroupResult(pGroup);
 	}
 	/* Check the existance of direct SMTP forwarders */
 	SMTPGateway **ppszFwdGws = USmtpGetFwdGateways(hSvrConfig, pszDestDomain);
@@ -316,53 +647,12 @@ static int SMAILRemoteMsgSMTPSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL
 		 * for domains that have an empty forwarders list
 		 */
 		iError = 0;
-		for (int i = 0; ppszFwdGws[i] != NULL; i++) {
-			SysLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send FWD = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
-				      ppszFwdGws[i]->pszHost, pszSMTPDomain, pszMailFrom, pszRcptTo);
-
-			USmtpCleanupError(pSMTPE);
-
-			if ((iError = USmtpSendMail(ppszFwdGws[i], pszHeloDomain, pszSendMailFrom,
-						    pszSendRcptTo, &FSect, pSMTPE)) == 0) {
-				/* Log Mailer operation */
-				if (SMAILLogEnabled(hShbSMAIL)) {
-					char szRmtMsgID[256];
-
-					USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE), szRmtMsgID,
-							     sizeof(szRmtMsgID));
-					USmlLogMessage(hFSpool, "FWD", szRmtMsgID, ppszFwdGws[i]->pszHost);
-				}
-				break;
-			}
-
-			char szSmtpError[512];
-
-			USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
-
-			ErrLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send FWD = \"%s\" SMTP = \"%s\" "
-				      "From = \"%s\" To = \"%s\" Failed !\n"
-				      "%s = \"%s\"\n"
-				      "%s = \"%s\"\n", ppszFwdGws[i]->pszHost, pszSMTPDomain, pszMailFrom,
-				      pszRcptTo, SMTP_ERROR_VARNAME, szSmtpError,
-				      SMTP_SERVER_VARNAME, USmtpGetErrorServer(pSMTPE));
-
-			QueUtErrLogMessage(hQueue, hMessage,
-					   "SMAIL SMTP-Send FWD = \"%s\" SMTP = \"%s\" "
-					   "From = \"%s\" To = \"%s\" Failed !\n"
-					   "%s = \"%s\"\n"
-					   "%s = \"%s\"\n", ppszFwdGws[i]->pszHost, pszSMTPDomain,
-					   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					   szSmtpError, SMTP_SERVER_VARNAME,
-					   USmtpGetErrorServer(pSMTPE));
-
-			if (USmtpIsFatalError(pSMTPE))
-				break;
-		}
+		for (int i = 0; ppszFwdGws[i] != NULL && SMAILGroupPending(pGroup); i++)
+			iError = SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "FWD", ppszFwdGws[i],
+						NULL, pszHeloDomain, &FSect, "FWD");
 		USmtpFreeGateways(ppszFwdGws);
 
-		return iError;
+		return iError < 0 ? SMAILGroupResult(pGroup): 0;
 	}
 	/* Try to get custom mail exchangers or DNS mail exchangers and if both tests */
 	/* fails try direct */
@@ -375,49 +665,10 @@ static int SMAILRemoteMsgSMTPSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL
 		if (MscIsIPDomain(pszDestDomain, szIP, sizeof(szIP))) {
 			SysLogMessage(LOG_LEV_MESSAGE, "Direct IP delivery for \"%s\".\n", szIP);
 
-			SysLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send IP = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
-				      szIP, pszSMTPDomain, pszMailFrom, pszRcptTo);
-
-			USmtpCleanupError(pSMTPE);
-
-			if (USmtpMailRmtDeliver(hSvrConfig, szIP, pszHeloDomain, pszSendMailFrom, pszSendRcptTo,
-						&FSect, pSMTPE) < 0) {
-				ErrorPush();
-
-				char szSmtpError[512];
-
-				USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
+			SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "IP", NULL, szIP,
+				       pszHeloDomain, &FSect, "SMTP");
 
-				ErrLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send IP = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\" Failed !\n"
-					      "%s = \"%s\"\n"
-					      "%s = \"%s\"\n", szIP, pszSMTPDomain, pszMailFrom,
-					      pszRcptTo, SMTP_ERROR_VARNAME, szSmtpError,
-					      SMTP_SERVER_VARNAME, USmtpGetErrorServer(pSMTPE));
-
-				QueUtErrLogMessage(hQueue, hMessage,
-						   "SMAIL SMTP-Send IP = \"%s\" SMTP = \"%s\" "
-						   "From = \"%s\" To = \"%s\" Failed !\n"
-						   "%s = \"%s\"\n"
-						   "%s = \"%s\"\n", szIP, pszSMTPDomain,
-						   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-						   szSmtpError, SMTP_SERVER_VARNAME,
-						   USmtpGetErrorServer(pSMTPE));
-
-				return ErrorPop();
-			}
-			/* Log Mailer operation */
-			if (SMAILLogEnabled(hShbSMAIL)) {
-				char szRmtMsgID[256];
-
-				USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE), szRmtMsgID,
-						     sizeof(szRmtMsgID));
-				USmlLogMessage(hFSpool, "SMTP", szRmtMsgID, szIP);
-			}
-
-			return 0;
+			return SMAILGroupResult(pGroup);
 		}
 
 		/* Do DNS MX lookup and send to mail exchangers */
@@ -426,231 +677,87 @@ static int SMAILRemoteMsgSMTPSend(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL
 							szDomainMXHost);
 
 		if (hMXSHandle != INVALID_MXS_HANDLE) {
-			iError = 0;
 			do {
-				SysLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\"\n",
-					      szDomainMXHost, pszSMTPDomain, pszMailFrom,
-					      pszRcptTo);
-
-				USmtpCleanupError(pSMTPE);
-
-				if ((iError = USmtpMailRmtDeliver(hSvrConfig, szDomainMXHost,
-								  pszHeloDomain,
-								  pszSendMailFrom,
-								  pszSendRcptTo, &FSect,
-								  pSMTPE)) == 0) {
-					/* Log Mailer operation */
-					if (SMAILLogEnabled(hShbSMAIL)) {
-						char szRmtMsgID[256];
-
-						USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE),
-								     szRmtMsgID,
-								     sizeof(szRmtMsgID));
-						USmlLogMessage(hFSpool, "SMTP", szRmtMsgID,
-							       szDomainMXHost);
-					}
-					break;
-				}
-
-				char szSmtpError[512];
-
-				USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
-
-				ErrLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\" Failed !\n"
-					      "%s = \"%s\"\n"
-					      "%s = \"%s\"\n", szDomainMXHost, pszSMTPDomain,
-					      pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					      szSmtpError, SMTP_SERVER_VARNAME,
-					      USmtpGetErrorServer(pSMTPE));
-
-				QueUtErrLogMessage(hQueue, hMessage,
-						   "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" "
-						   "From = \"%s\" To = \"%s\" Failed !\n"
-						   "%s = \"%s\"\n"
-						   "%s = \"%s\"\n", szDomainMXHost, pszSMTPDomain,
-						   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-						   szSmtpError, SMTP_SERVER_VARNAME,
-						   USmtpGetErrorServer(pSMTPE));
-
-				if (USmtpIsFatalError(pSMTPE))
-					break;
-			} while (USmtpGetMXNext(hMXSHandle, szDomainMXHost) == 0);
+				SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "MX", NULL,
+					       szDomainMXHost, pszHeloDomain, &FSect, "SMTP");
+			} while (SMAILGroupPending(pGroup) &&
+				 USmtpGetMXNext(hMXSHandle, szDomainMXHost) == 0);
 			USmtpMXSClose(hMXSHandle);
 
-			if (iError < 0)
-				return iError;
-		} else {
-			iError = ErrGetErrorCode();
-
-			/*
-			 * If the target domain does not exist at all (or it has a
-			 * misconfigured DNS), bounce soon without trying the A record.
-			 * It's pointless engaging in retry policies when the recipient
-			 * domain does not exist.
-			 */
-			if (DNS_FatalError(iError)) {
-				ErrorPush();
-
-				/* No account inside the handled domain */
-				char szBounceMsg[512];
-
-				SysSNPrintf(szBounceMsg, sizeof(szBounceMsg) - 1,
-					    "Recipient domain \"%s\" does not exist "
-					    "(or it has a misconfigured DNS)", pszDestDomain);
-
-				SysLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send NXD/EDNS = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\" Failed!\n",
-					      pszDestDomain, pszSMTPDomain, pszMailFrom, pszRcptTo);
-				QueUtErrLogMessage(hQueue, hMessage, "%s\n", szBounceMsg);
-				QueUtNotifyPermErrDelivery(hQueue, hMessage, hFSpool, szBounceMsg, NULL,
-							   true);
+			return SMAILGroupResult(pGroup);
+		}
+		iError = ErrGetErrorCode();
 
-				return ErrorPop();
-			}
+		/*
+		 * If the target domain does not exist at all (or it has a
+		 * misconfigured DNS), bounce soon without trying the A record.
+		 * It's pointless engaging in retry policies when the recipient
+		 * domain does not exist.
+		 */
+		if (DNS_FatalError(iError)) {
+			ErrorPush();
 
-			/*
-			 * Fall back to A record delivery only if the domain has
-			 * no MX records.
-			 */
-			if (iError != ERR_DNS_NOTFOUND) {
-				ErrLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send EDNS = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\" Failed !\n"
-					      "%s = \"%s\"\n"
-					      "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
-					      pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					      ErrGetErrorString(iError), SMTP_SERVER_VARNAME,
-					      pszDestDomain);
-
-				QueUtErrLogMessage(hQueue, hMessage,
-						   "SMAIL SMTP-Send EDNS = \"%s\" SMTP = \"%s\" "
-						   "From = \"%s\" To = \"%s\" Failed !\n"
-						   "%s = \"%s\"\n"
-						   "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
-						   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-						   ErrGetErrorString(iError), SMTP_SERVER_VARNAME,
-						   pszDestDomain);
-
-				return ErrorSet(iError);
-			}
+			/* No account inside the handled domain */
+			char szBounceMsg[512];
 
-			/* MX records for destination domain not found, try direct ! */
-			SysLogMessage(LOG_LEV_MESSAGE,
-				      "MX records for domain \"%s\" not found, trying direct.\n",
-				      pszDestDomain);
+			SysSNPrintf(szBounceMsg, sizeof(szBounceMsg) - 1,
+				    "Recipient domain \"%s\" does not exist "
+				    "(or it has a misconfigured DNS)", pszDestDomain);
 
 			SysLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send FF = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
+				      "SMAIL SMTP-Send NXD/EDNS = \"%s\" SMTP = \"%s\" "
+				      "From = \"%s\" To = \"%s\" Failed!\n",
 				      pszDestDomain, pszSMTPDomain, pszMailFrom, pszRcptTo);
+			QueUtErrLogMessage(hQueue, hMessage, "%s\n", szBounceMsg);
+			QueUtNotifyPermErrDelivery(hQueue, hMessage, hFSpool, szBounceMsg, NULL,
+						   true);
 
-			USmtpCleanupError(pSMTPE);
-
-			if ((iError = USmtpMailRmtDeliver(hSvrConfig, pszDestDomain,
-							  pszHeloDomain, pszSendMailFrom,
-							  pszSendRcptTo, &FSect, pSMTPE)) < 0) {
-				ErrorPush();
-
-				/*
-				 * If the A record of the recipient host does not exist, set the
-				 * fatal SMTP error so that the caller can properly bounce the
-				 * message.
-				 */
-				if (iError == ERR_DNS_NOTFOUND || iError == ERR_BAD_SERVER_ADDR)
-					USmtpSetError(pSMTPE, SMTP_FATAL_ERROR,
-						      ErrGetErrorString(iError), pszDestDomain);
-
-				char szSmtpError[512];
-
-				USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
-
-				ErrLogMessage(LOG_LEV_MESSAGE,
-					      "SMAIL SMTP-Send FF = \"%s\" SMTP = \"%s\" "
-					      "From = \"%s\" To = \"%s\" Failed !\n"
-					      "%s = \"%s\"\n"
-					      "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
-					      pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					      szSmtpError, SMTP_SERVER_VARNAME,
-					      USmtpGetErrorServer(pSMTPE));
-
-				QueUtErrLogMessage(hQueue, hMessage,
-						   "SMAIL SMTP-Send FF = \"%s\" SMTP = \"%s\" "
-						   "From = \"%s\" To = \"%s\" Failed !\n"
-						   "%s = \"%s\"\n"
-						   "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
-						   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-						   szSmtpError, SMTP_SERVER_VARNAME,
-						   USmtpGetErrorServer(pSMTPE));
-
-				return ErrorPop();
-			}
-			/* Log Mailer operation */
-			if (SMAILLogEnabled(hShbSMAIL)) {
-				char szRmtMsgID[256];
-
-				USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE),
-						     szRmtMsgID, sizeof(szRmtMsgID));
-				USmlLogMessage(hFSpool, "SMTP", szRmtMsgID, pszDestDomain);
-			}
+			return ErrorPop();
 		}
-	} else {
-		iError = 0;
-		for (int i = 0; ppMXGWs[i] != NULL; i++) {
-			SysLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" From = \"%s\" To = \"%s\"\n",
-				      ppMXGWs[i]->pszHost, pszSMTPDomain, pszMailFrom, pszRcptTo);
-
-			USmtpCleanupError(pSMTPE);
-
-			if ((iError = USmtpSendMail(ppMXGWs[i], pszHeloDomain, pszSendMailFrom,
-						    pszSendRcptTo, &FSect, pSMTPE)) == 0) {
-				/* Log Mailer operation */
-				if (SMAILLogEnabled(hShbSMAIL)) {
-					char szRmtMsgID[256];
-
-					USmtpGetSMTPRmtMsgID(USmtpGetErrorMessage(pSMTPE),
-							     szRmtMsgID, sizeof(szRmtMsgID));
-					USmlLogMessage(hFSpool, "SMTP", szRmtMsgID,
-						       ppMXGWs[i]->pszHost);
-				}
-				break;
-			}
-
-			char szSmtpError[512];
-
-			USmtpGetSMTPError(pSMTPE, szSmtpError, sizeof(szSmtpError));
 
+		/*
+		 * Fall back to A record delivery only if the domain has
+		 * no MX records.
+		 */
+		if (iError != ERR_DNS_NOTFOUND) {
 			ErrLogMessage(LOG_LEV_MESSAGE,
-				      "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" "
+				      "SMAIL SMTP-Send EDNS = \"%s\" SMTP = \"%s\" "
 				      "From = \"%s\" To = \"%s\" Failed !\n"
 				      "%s = \"%s\"\n"
-				      "%s = \"%s\"\n", ppMXGWs[i]->pszHost, pszSMTPDomain, pszMailFrom,
-				      pszRcptTo, SMTP_ERROR_VARNAME, szSmtpError,
-				      SMTP_SERVER_VARNAME, USmtpGetErrorServer(pSMTPE));
+				      "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
+				      pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
+				      ErrGetErrorString(iError), SMTP_SERVER_VARNAME,
+				      pszDestDomain);
 
 			QueUtErrLogMessage(hQueue, hMessage,
-					   "SMAIL SMTP-Send MX = \"%s\" SMTP = \"%s\" "
+					   "SMAIL SMTP-Send EDNS = \"%s\" SMTP = \"%s\" "
 					   "From = \"%s\" To = \"%s\" Failed !\n"
 					   "%s = \"%s\"\n"
-					   "%s = \"%s\"\n", ppMXGWs[i]->pszHost, pszSMTPDomain,
+					   "%s = \"%s\"\n", pszDestDomain, pszSMTPDomain,
 					   pszMailFrom, pszRcptTo, SMTP_ERROR_VARNAME,
-					   szSmtpError, SMTP_SERVER_VARNAME,
-					   USmtpGetErrorServer(pSMTPE));
+					   ErrGetErrorString(iError), SMTP_SERVER_VARNAME,
+					   pszDestDomain);
 
-			if (USmtpIsFatalError(pSMTPE))
-				break;
+			return ErrorSet(iError);
 		}
-		USmtpFreeGateways(ppMXGWs);
 
-		if (iError < 0)
-			return iError;
+		/* MX records for destination domain not found, try direct ! */
+		SysLogMessage(LOG_LEV_MESSAGE,
+			      "MX records for domain \"%s\" not found, trying direct.\n",
+			      pszDestDomain);
+
+		SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "FF", NULL, pszDestDomain,
+			       pszHeloDomain, &FSect, "SMTP", true);
+
+		return SMAILGroupResult(pGroup);
 	}
+	iError = 0;
+	for (int i = 0; ppMXGWs[i] != NULL && SMAILGroupPending(pGroup); i++)
+		iError = SMAILGroupSend(hSvrConfig, hShbSMAIL, pGroup, "MX", ppMXGWs[i], NULL,
+					pszHeloDomain, &FSect, "SMTP");
+	USmtpFreeGateways(ppMXGWs);
 
-	return 0;
+	return iError < 0 ? SMAILGroupResult(pGroup): 0;
 }
 
 static char *SMAILMacroLkupProc(void *pPrivate, char const *pszName, size_t sSize)
@@ -668,6 +775,9 @@ static char *SMAILMacroLkupProc(void *pPrivate, char const *pszName, size_t sSiz
 
 		return SysStrDup((iRcptDomains > 0) ? ppszRcpt[iRcptDomains - 1] : "");
 	} else if (MemMatch(pszName, sSize, "FILE", 4)) {
+		/* External programs get the whole message inside the spool file */
+		if (USmlAttachMsgBody(pMSC->hFSpool) < 0)
+			return NULL;
 
 		return SysStrDup(pMSC->FSect.szFilePath);
 	} else if (MemMatch(pszName, sSize, "MSGID", 5)) {
@@ -687,6 +797,8 @@ static char *SMAILMacroLkupProc(void *pPrivate, char const *pszName, size_t sSiz
 	} else if (MemMatch(pszName, sSize, "TMPFILE", 7)) {
 		char szTmpFile[SYS_MAX_PATH];
 
+		if (USmlAttachMsgBody(pMSC->hFSpool) < 0)
+			return NULL;
 		MscSafeGetTmpFile(szTmpFile, sizeof(szTmpFile));
 		if (MscCopyFile(szTmpFile, pMSC->FSect.szFilePath) < 0) {
 			CheckRemoveFile(szTmpFile);
@@ -858,11 +970,16 @@ static int SMAILCmd_smtp(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
 	}
 
 	SMTPError SMTPE;
+	SMAILRcptGroup *pGroup;
 
 	USmtpInitError(&SMTPE);
+	if ((pGroup = SMAILCreateGroup(hQueue, hMessage, hFSpool, pszDestDomain,
+				       &SMTPE, 1)) == NULL)
+		return ErrGetErrorCode();
+
+	if (SMAILRemoteMsgSMTPSend(hSvrConfig, hShbSMAIL, pGroup) < 0) {
+		SMAILFreeGroup(hSvrConfig, hShbSMAIL, pGroup);
 
-	if (SMAILRemoteMsgSMTPSend(hSvrConfig, hShbSMAIL, hFSpool, hQueue, hMessage,
-				   pszDestDomain, &SMTPE) < 0) {
 		/* If we get an SMTP fatal error We must return <0 , otherwise >0 to give */
 		/* XMail to ability to resume the command */
 		int iReturnCode = USmtpIsFatalError(&SMTPE) ?
@@ -878,6 +995,7 @@ static int SMAILCmd_smtp(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
 
 		return iReturnCode;
 	}
+	SMAILFreeGroup(hSvrConfig, hShbSMAIL, pGroup);
 	USmtpCleanupError(&SMTPE);
 
 	return 0;
@@ -953,8 +1071,12 @@ static int SMAILCmd_smtprelay(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
 
 		USmtpCleanupError(&SMTPE);
 
-		if (USmtpSendMail(ppGws[i], pszHeloDomain, pszSendMailFrom,
-				  pszSendRcptTo, &FSect, &SMTPE) == 0) {
+		SMAILBusyCountAdd(0, +1, hShbSMAIL);
+		int iSendResult = USmtpSendMail(ppGws[i], pszHeloDomain, pszSendMailFrom,
+						pszSendRcptTo, &FSect, &SMTPE);
+
+		SMAILBusyCountAdd(0, -1, hShbSMAIL);
+		if (iSendResult == 0) {
 			/* Log Mailer operation */
 			if (SMAILLogEnabled(hShbSMAIL)) {
 				char szRmtMsgID[256];
@@ -971,7 +1093,7 @@ static int SMAILCmd_smtprelay(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hShbSMAIL,
 			return 0;
 		}
 
-		int iErrorCode = ErrGetErrorCode();
+		int iErrorCode = iSendResult;
 		char szSmtpError[512];
 
 		USmtpGetSMTPError(&SMTPE, szSmtpError, sizeof(szSmtpError));
@@ -1249,14 +1371,23 @@ static int SMAILHandleRemoteUserMessage(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hSh
 						 hQueue, hMessage, pszDestDomain,
 						 pszDestUser, szCustFilePath);
 
-	/* Fall down to use standard SMTP delivery */
+	/*
+	 * Fall down to use standard SMTP delivery. Other queued messages bound to
+	 * the same domain, and coming from the same SMTP transaction, might join
+	 * this delivery. Their outcome is handled by SMAILFreeGroup().
+	 */
 	SMTPError SMTPE;
+	SMAILRcptGroup *pGroup;
 
 	USmtpInitError(&SMTPE);
+	if ((pGroup = SMAILCreateGroup(hQueue, hMessage, hFSpool, pszDestDomain, &SMTPE,
+				       SMAIL_MAX_GROUP_RCPTS)) == NULL)
+		return ErrGetErrorCode();
 
-	if (SMAILRemoteMsgSMTPSend(hSvrConfig, hShbSMAIL, hFSpool, hQueue, hMessage,
-				   pszDestDomain, &SMTPE) < 0) {
+	if (SMAILRemoteMsgSMTPSend(hSvrConfig, hShbSMAIL, pGroup) < 0) {
 		ErrorPush();
+		SMAILFreeGroup(hSvrConfig, hShbSMAIL, pGroup);
+
 		/*
 		 * If a permanent SMTP error has been detected, then notify the message
 		 * sender and remove the spool file
@@ -1270,6 +1401,7 @@ static int SMAILHandleRemoteUserMessage(SVRCFG_HANDLE hSvrConfig, SHB_HANDLE hSh
 
 		return ErrorPop();
 	}
+	SMAILFreeGroup(hSvrConfig, hShbSMAIL, pGroup);
 	USmtpCleanupError(&SMTPE);
 
 	return 0;
@@ -1473,7 +1605,7 @@ static int SMAILTryProcessMessage(SVRCFG_HANDLE hSvrConfig, QUEUE_HANDLE hQueue,
 	return 0;
 }
 
-static int SMAILTryProcessSpool(SHB_HANDLE hShbSMAIL)
+static int SMAILTryProcessSpool(SHB_HANDLE hShbSMAIL, long lThreadId)
 {
 	SMAILConfig *pSMAILCfg = SMAILGetConfigCopy(hShbSMAIL);
 
@@ -1482,8 +1614,9 @@ static int SMAILTryProcessSpool(SHB_HANDLE hShbSMAIL)
 		SysLogMessage(LOG_LEV_ERROR, "%s\n", ErrGetErrorString());
 		return ErrorPop();
 	}
-	/* Get queue file to process */
-	QMSG_HANDLE hMessage = QueExtractMessage(hSpoolQueue, SMAIL_WAITMSG_TIMEOUT);
+	/* Get queue file to process, preferring the queue shard of this thread */
+	QMSG_HANDLE hMessage = QueExtractMessage(hSpoolQueue, SMAIL_WAITMSG_TIMEOUT,
+						 (int) lThreadId);
 
 	if (hMessage != INVALID_QMSG_HANDLE) {
 		/* Get configuration handle */
@@ -1506,7 +1639,9 @@ static int SMAILTryProcessSpool(SHB_HANDLE hShbSMAIL)
 			return ErrorPop();
 		}
 		/* Process queue file */
+		SMAILBusyCountAdd(+1, 0, hShbSMAIL);
 		SMAILTryProcessMessage(hSvrConfig, hSpoolQueue, hMessage, hShbSMAIL, pSMAILCfg);
+		SMAILBusyCountAdd(-1, 0, hShbSMAIL);
 
 		SvrReleaseConfigHandle(hSvrConfig);
 	}
@@ -1524,8 +1659,8 @@ unsigned int SMAILThreadProc(void *pThreadData)
 		SysLogMessage(LOG_LEV_ERROR, "%s\n", ErrGetErrorString());
 		return ErrorPop();
 	}
-	/* Get thread id */
-	long lThreadId = pSMAILCfg->lThreadCount;
+	/* The thread id is the slot of the thread inside the mailer pool */
+	long lThreadId = (long) pThreadData;
 
 	/* Increase thread count */
 	SMAILThreadCountAdd(+1, hShbSMAIL, pSMAILCfg);
@@ -1547,10 +1682,19 @@ unsigned int SMAILThreadProc(void *pThreadData)
 				ShbUnlock(hShbSMAIL);
 			break;
 		}
+		/* Threads are asked to leave by the pool manager when idle */
+		if (pSMAILCfg->lRetireCount > 0) {
+			pSMAILCfg->lRetireCount--;
+			ShbUnlock(hShbSMAIL);
+
+			SysLogMessage(LOG_LEV_MESSAGE, "SMAIL thread [%02ld] retiring\n",
+				      lThreadId);
+			break;
+		}
 		ShbUnlock(hShbSMAIL);
 
 		/* Process spool files */
-		SMAILTryProcessSpool(hShbSMAIL);
+		SMAILTryProcessSpool(hShbSMAIL, lThreadId);
 	}
 
 	/* Decrease thread count */
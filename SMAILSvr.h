@@ -29,7 +29,11 @@
 struct SMAILConfig {
 	unsigned long ulFlags;
 	long lThreadCount;
-
+	long lMinThreads;
+	long lMaxThreads;
+	long lBusyThreads;
+	long lNetThreads;
+	long lRetireCount;
 };
 
 unsigned int SMAILThreadProc(void *pThreadData);
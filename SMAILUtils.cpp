@@ -45,6 +45,7 @@
 #include "MailSvr.h"
 
 #define SFF_HEADER_MODIFIED             (1 << 0)
+#define SFF_MESSAGE_RELOADED            (1 << 1)
 
 #define STD_TAG_BUFFER_LENGTH           1024
 #define CUSTOM_CMD_LINE_MAX             512
@@ -70,6 +71,7 @@ struct SpoolFileData {
 	char szSMTPDomain[MAX_ADDR_NAME];
 	char szMessageID[128];
 	char szMessFilePath[SYS_MAX_PATH];
+	char szBodyFilePath[SYS_MAX_PATH];
 	SYS_OFF_T llMessageOffset;
 	SYS_OFF_T llMailDataOffset;
 	SYS_OFF_T llMessageSize;
@@ -457,6 +459,72 @@ char *USmlBuildSendRcptTo(char const *const *ppszFrom, char const *const *ppszRc
 	return pszConcat;
 }
 
+SYS_OFF_T USmlFindBodyOffset(FILE *pMsgFile, SYS_OFF_T llMsgOffset)
+{
+	/* Returns the offset past the empty line ending the message headers */
+	int iChar;
+	bool bLineStart = true;
+
+	Sys_fseek(pMsgFile, llMsgOffset, SEEK_SET);
+	while ((iChar = getc(pMsgFile)) != EOF) {
+		if (bLineStart && iChar == '\r' && (iChar = getc(pMsgFile)) == '\n')
+			return Sys_ftell(pMsgFile);
+		if (bLineStart && iChar == '\n')
+			return Sys_ftell(pMsgFile);
+		bLineStart = iChar == '\n';
+	}
+
+	return (SYS_OFF_T) -1;
+}
+
+static int USmlGetBodyFilePath(SpoolFileData const *pSFD, char *pszBodyFilePath)
+{
+	/*
+	 * Queue files are stored as "ROOT/L1/L2/QDIR/FILE", and their shared
+	 * message body (if any) as "ROOT/L1/L2/body/FILE".
+	 */
+	char szQueueDir[SYS_MAX_PATH] = "";
+
+	MscSplitPath(pSFD->szMessFilePath, szQueueDir, sizeof(szQueueDir), NULL, 0, NULL, 0);
+	DelFinalSlash(szQueueDir);
+
+	char *pszSlash = strrchr(szQueueDir, SYS_SLASH_CHAR);
+
+	if (pszSlash == NULL) {
+		ErrSetErrorCode(ERR_NOT_FOUND);
+		return ERR_NOT_FOUND;
+	}
+	pszSlash[1] = '\0';
+	SysSNPrintf(pszBodyFilePath, SYS_MAX_PATH - 1, "%s%s%s%s", szQueueDir,
+		    QUEUE_BODY_DIR, SYS_SLASH_STR, pSFD->szSpoolFile);
+
+	return 0;
+}
+
+static int USmlLoadBody(SpoolFileData *pSFD, FILE *pSpoolFile, SYS_OFF_T llFileSize)
+{
+	char szBodyFilePath[SYS_MAX_PATH] = "";
+	SYS_FILE_INFO FI;
+
+	if (USmlGetBodyFilePath(pSFD, szBodyFilePath) < 0 || !SysExistFile(szBodyFilePath) ||
+	    SysGetFileInfo(szBodyFilePath, FI) < 0)
+		return 0;
+
+	/*
+	 * A spool file detached from its body ends right after the empty line
+	 * closing the message headers. If data follows it, the body has already
+	 * been reattached and only the link removal did not make it.
+	 */
+	if (USmlFindBodyOffset(pSpoolFile, pSFD->llMessageOffset) != llFileSize) {
+		SysRemove(szBodyFilePath);
+		return 0;
+	}
+	StrSNCpy(pSFD->szBodyFilePath, szBodyFilePath);
+	pSFD->llMessageSize += FI.llSize;
+
+	return 0;
+}
+
 static int USmlLoadHandle(SpoolFileData *pSFD, char const *pszMessFilePath)
 {
 	char szFName[SYS_MAX_PATH] = "";
@@ -567,7 +635,12 @@ static int USmlLoadHandle(SpoolFileData *pSFD, char const *pszMessFilePath)
 
 	fseek(pSpoolFile, 0, SEEK_END);
 
-	pSFD->llMessageSize = (SYS_OFF_T) ftell(pSpoolFile) - pSFD->llMessageOffset;
+	SYS_OFF_T llFileSize = (SYS_OFF_T) ftell(pSpoolFile);
+
+	pSFD->llMessageSize = llFileSize - pSFD->llMessageOffset;
+
+	/* Look for a message body shared with other recipients */
+	USmlLoadBody(pSFD, pSpoolFile, llFileSize);
 
 	fclose(pSpoolFile);
 
@@ -585,6 +658,7 @@ static void USmlInitHandle(SpoolFileData *pSFD)
 	pSFD->pszSendRcptTo = NULL;
 	pSFD->pszRelayDomain = NULL;
 	SetEmptyString(pSFD->szSMTPDomain);
+	SetEmptyString(pSFD->szBodyFilePath);
 	pSFD->ulFlags = 0;
 	ListInit(pSFD->hTagList);
 }
@@ -645,6 +719,7 @@ int USmlReloadHandle(SPLF_HANDLE hFSpool)
 	USmlFreeData(pSFD);
 
 	*pSFD = *pNewSFD;
+	pSFD->ulFlags |= SFF_MESSAGE_RELOADED;
 
 	/* We don't have to call USmlFreeData() since its content has been tranfered */
 	/* to the original structure to replace the old information */
@@ -653,6 +728,13 @@ int USmlReloadHandle(SPLF_HANDLE hFSpool)
 	return 0;
 }
 
+bool USmlMessageModified(SPLF_HANDLE hFSpool)
+{
+	SpoolFileData *pSFD = (SpoolFileData *) hFSpool;
+
+	return (pSFD->ulFlags & (SFF_HEADER_MODIFIED | SFF_MESSAGE_RELOADED)) != 0;
+}
+
 char const *USmlGetRelayDomain(SPLF_HANDLE hFSpool)
 {
 	SpoolFileData *pSFD = (SpoolFileData *) hFSpool;
@@ -744,7 +826,7 @@ SYS_OFF_T USmlMessageSize(SPLF_HANDLE hFSpool)
 	return pSFD->llMessageSize;
 }
 
-static int USmlFlushMessageFile(SpoolFileData *pSFD)
+static int USmlFlushMessageFile(SpoolFileData *pSFD, bool bAttachBody)
 {
 	char szTmpMsgFile[SYS_MAX_PATH] = "";
 
@@ -767,38 +849,78 @@ static int USmlFlushMessageFile(SpoolFileData *pSFD)
 		ErrSetErrorCode(ERR_FILE_OPEN, pSFD->szMessFilePath);
 		return ERR_FILE_OPEN;
 	}
-	/* Dump info section ( start = 0 - bytes = ulMessageOffset ) */
-	if (MscCopyFile(pMsgFile, pMessFile, 0, pSFD->llMessageOffset) < 0) {
-		ErrorPush();
-		fclose(pMessFile);
-		fclose(pMsgFile);
-		CheckRemoveFile(szTmpMsgFile);
-		return ErrorPop();
-	}
-	/* Dump message headers */
-	if (USmlDumpHeaders(pMsgFile, pSFD->hTagList, "\r\n") < 0) {
-		ErrorPush();
-		fclose(pMessFile);
-		fclose(pMsgFile);
-		CheckRemoveFile(szTmpMsgFile);
-		return ErrorPop();
-	}
+	if (pSFD->ulFlags & SFF_HEADER_MODIFIED) {
+		/* Dump info section ( start = 0 - bytes = ulMessageOffset ) */
+		if (MscCopyFile(pMsgFile, pMessFile, 0, pSFD->llMessageOffset) < 0) {
+			ErrorPush();
+			fclose(pMessFile);
+			fclose(pMsgFile);
+			CheckRemoveFile(szTmpMsgFile);
+			return ErrorPop();
+		}
+		/* Dump message headers */
+		if (USmlDumpHeaders(pMsgFile, pSFD->hTagList, "\r\n") < 0) {
+			ErrorPush();
+			fclose(pMessFile);
+			fclose(pMsgFile);
+			CheckRemoveFile(szTmpMsgFile);
+			return ErrorPop();
+		}
 
-	fprintf(pMsgFile, "\r\n");
+		fprintf(pMsgFile, "\r\n");
+	} else {
+		/* Dump info section and headers ( start = 0 - bytes = ulMailDataOffset ) */
+		if (MscCopyFile(pMsgFile, pMessFile, 0, pSFD->llMailDataOffset) < 0) {
+			ErrorPush();
+			fclose(pMessFile);
+			fclose(pMsgFile);
+			CheckRemoveFile(szTmpMsgFile);
+			return ErrorPop();
+		}
+	}
 
 	/* Get the new message body offset */
 	SYS_OFF_T llMailDataOffset = (SYS_OFF_T) ftell(pMsgFile);
+	SYS_OFF_T llBodySize = 0;
 
-	/* Dump message data ( start = ulMailDataOffset - bytes = -1 [EOF] ) */
-	if (MscCopyFile(pMsgFile, pMessFile, pSFD->llMailDataOffset,
-			(SYS_OFF_T) -1) < 0) {
-		ErrorPush();
+	/*
+	 * Dump message data ( start = ulMailDataOffset - bytes = -1 [EOF] ), or
+	 * the whole shared body file if the message is to be detached from it.
+	 * Otherwise the spool file keeps ending with the message headers.
+	 */
+	if (!IsEmptyString(pSFD->szBodyFilePath)) {
+		fclose(pMessFile);
+		if (!bAttachBody) {
+			SYS_FILE_INFO FI;
+
+			if (SysGetFileInfo(pSFD->szBodyFilePath, FI) < 0) {
+				ErrorPush();
+				fclose(pMsgFile);
+				CheckRemoveFile(szTmpMsgFile);
+				return ErrorPop();
+			}
+			llBodySize = FI.llSize;
+			pMessFile = NULL;
+		} else if ((pMessFile = fopen(pSFD->szBodyFilePath, "rb")) == NULL) {
+			fclose(pMsgFile);
+			CheckRemoveFile(szTmpMsgFile);
+
+			ErrSetErrorCode(ERR_FILE_OPEN, pSFD->szBodyFilePath);
+			return ERR_FILE_OPEN;
+		}
+	}
+	if (pMessFile != NULL) {
+		if (MscCopyFile(pMsgFile, pMessFile,
+				IsEmptyString(pSFD->szBodyFilePath) ? pSFD->llMailDataOffset: 0,
+				(SYS_OFF_T) -1) < 0) {
+			ErrorPush();
+			fclose(pMessFile);
+			fclose(pMsgFile);
+			CheckRemoveFile(szTmpMsgFile);
+			return ErrorPop();
+		}
 		fclose(pMessFile);
-		fclose(pMsgFile);
-		CheckRemoveFile(szTmpMsgFile);
-		return ErrorPop();
 	}
-	fclose(pMessFile);
 
 	if (SysFileSync(pMsgFile) < 0) {
 		ErrorPush();
@@ -806,7 +928,7 @@ static int USmlFlushMessageFile(SpoolFileData *pSFD)
 		CheckRemoveFile(szTmpMsgFile);
 		return ErrorPop();
 	}
-	pSFD->llMessageSize = (SYS_OFF_T) ftell(pMsgFile) - pSFD->llMessageOffset;
+	pSFD->llMessageSize = (SYS_OFF_T) ftell(pMsgFile) - pSFD->llMessageOffset + llBodySize;
 
 	if (fclose(pMsgFile)) {
 		CheckRemoveFile(szTmpMsgFile);
@@ -823,6 +945,12 @@ static int USmlFlushMessageFile(SpoolFileData *pSFD)
 	/* Set the new message body offset */
 	pSFD->llMailDataOffset = llMailDataOffset;
 
+	/* The spool file has now its own copy of the body */
+	if (bAttachBody && !IsEmptyString(pSFD->szBodyFilePath)) {
+		SysRemove(pSFD->szBodyFilePath);
+		SetEmptyString(pSFD->szBodyFilePath);
+	}
+
 	return 0;
 }
 
@@ -831,7 +959,7 @@ int USmlSyncChanges(SPLF_HANDLE hFSpool)
 	SpoolFileData *pSFD = (SpoolFileData *) hFSpool;
 
 	if (pSFD->ulFlags & SFF_HEADER_MODIFIED) {
-		if (USmlFlushMessageFile(pSFD) == 0)
+		if (USmlFlushMessageFile(pSFD, false) == 0)
 			pSFD->ulFlags &= ~SFF_HEADER_MODIFIED;
 
 	}
@@ -839,6 +967,22 @@ int USmlSyncChanges(SPLF_HANDLE hFSpool)
 	return 0;
 }
 
+int USmlAttachMsgBody(SPLF_HANDLE hFSpool)
+{
+	SpoolFileData *pSFD = (SpoolFileData *) hFSpool;
+
+	/*
+	 * External programs (and whoever reads the spool file by itself) need
+	 * the whole message inside the spool file, so the shared body gets
+	 * copied back into it.
+	 */
+	if (USmlSyncChanges(hFSpool) < 0 ||
+	    (!IsEmptyString(pSFD->szBodyFilePath) && USmlFlushMessageFile(pSFD, true) < 0))
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
 int USmlGetMsgFileSection(SPLF_HANDLE hFSpool, FileSection &FSect)
 {
 	SpoolFileData *pSFD = (SpoolFileData *) hFSpool;
@@ -847,11 +991,15 @@ int USmlGetMsgFileSection(SPLF_HANDLE hFSpool, FileSection &FSect)
 	if (USmlSyncChanges(hFSpool) < 0)
 		return ErrGetErrorCode();
 
-	/* Setup file section fields */
+	/*
+	 * Setup file section fields. A shared body stays where it is, and it is
+	 * streamed right after the headers stored inside the spool file.
+	 */
 	ZeroData(FSect);
 	StrSNCpy(FSect.szFilePath, pSFD->szMessFilePath);
 	FSect.llStartOffset = pSFD->llMessageOffset;
 	FSect.llEndOffset = (SYS_OFF_T) -1;
+	StrSNCpy(FSect.szTailFilePath, pSFD->szBodyFilePath);
 
 	return 0;
 }
@@ -867,11 +1015,14 @@ int USmlWriteMailFile(SPLF_HANDLE hFSpool, FILE *pMsgFile, bool bMBoxFile)
 
 	fputs(pszLF, pMsgFile);
 
-	/* Dump message data */
-	FILE *pMessFile = fopen(pSFD->szMessFilePath, "rb");
+	/* Dump message data, straight from the shared body file if any */
+	bool bShared = !IsEmptyString(pSFD->szBodyFilePath);
+	char const *pszDataFile = bShared ? pSFD->szBodyFilePath: pSFD->szMessFilePath;
+	SYS_OFF_T llDataOffset = bShared ? 0: pSFD->llMailDataOffset;
+	FILE *pMessFile = fopen(pszDataFile, "rb");
 
 	if (pMessFile == NULL) {
-		ErrSetErrorCode(ERR_FILE_OPEN, pSFD->szMessFilePath);
+		ErrSetErrorCode(ERR_FILE_OPEN, pszDataFile);
 		return ERR_FILE_OPEN;
 	}
 
@@ -882,13 +1033,13 @@ int USmlWriteMailFile(SPLF_HANDLE hFSpool, FILE *pMsgFile, bool bMBoxFile)
 		bWantCRLF = true;
 #endif
 	if (bWantCRLF) {
-		if (MscCopyFile(pMsgFile, pMessFile, pSFD->llMailDataOffset,
+		if (MscCopyFile(pMsgFile, pMessFile, llDataOffset,
 				(SYS_OFF_T) -1) < 0) {
 			fclose(pMessFile);
 			return ErrGetErrorCode();
 		}
 	} else {
-		Sys_fseek(pMessFile, pSFD->llMailDataOffset, SEEK_SET);
+		Sys_fseek(pMessFile, llDataOffset, SEEK_SET);
 		if (MscDos2UnixFile(pMsgFile, pMessFile) < 0) {
 			fclose(pMessFile);
 			return ErrGetErrorCode();
@@ -1298,6 +1449,9 @@ static char *USmlMacroLkupProc(void *pPrivate, char const *pszName, size_t sSize
 
 		return SysStrDup(szUserAddress);
 	} else if (MemMatch(pszName, sSize, "FILE", 4)) {
+		/* External programs get the whole message inside the spool file */
+		if (USmlAttachMsgBody(pMSC->hFSpool) < 0)
+			return NULL;
 
 		return SysStrDup(pMSC->FSect.szFilePath);
 	} else if (MemMatch(pszName, sSize, "MSGID", 5)) {
@@ -1317,6 +1471,8 @@ static char *USmlMacroLkupProc(void *pPrivate, char const *pszName, size_t sSize
 	} else if (MemMatch(pszName, sSize, "TMPFILE", 7)) {
 		char szTmpFile[SYS_MAX_PATH] = "";
 
+		if (USmlAttachMsgBody(pMSC->hFSpool) < 0)
+			return NULL;
 		MscSafeGetTmpFile(szTmpFile, sizeof(szTmpFile));
 		if (MscCopyFile(szTmpFile, pMSC->FSect.szFilePath) < 0) {
 			CheckRemoveFile(szTmpFile);
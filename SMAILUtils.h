@@ -62,6 +62,7 @@ char *USmlBuildSendRcptTo(char const *const *ppszFrom, char const *const *ppszRc
 SPLF_HANDLE USmlCreateHandle(char const *pszMessFilePath);
 void USmlCloseHandle(SPLF_HANDLE hFSpool);
 int USmlReloadHandle(SPLF_HANDLE hFSpool);
+bool USmlMessageModified(SPLF_HANDLE hFSpool);
 char const *USmlGetRelayDomain(SPLF_HANDLE hFSpool);
 char const *USmlGetSpoolFilePath(SPLF_HANDLE hFSpool);
 char const *USmlGetSpoolFile(SPLF_HANDLE hFSpool);
@@ -75,7 +76,9 @@ char const *const *USmlGetRcptTo(SPLF_HANDLE hFSpool);
 char const *USmlRcptTo(SPLF_HANDLE hFSpool);
 char const *USmlSendRcptTo(SPLF_HANDLE hFSpool);
 SYS_OFF_T USmlMessageSize(SPLF_HANDLE hFSpool);
+SYS_OFF_T USmlFindBodyOffset(FILE *pMsgFile, SYS_OFF_T llMsgOffset);
 int USmlSyncChanges(SPLF_HANDLE hFSpool);
+int USmlAttachMsgBody(SPLF_HANDLE hFSpool);
 int USmlGetMsgFileSection(SPLF_HANDLE hFSpool, FileSection &FSect);
 int USmlWriteMailFile(SPLF_HANDLE hFSpool, FILE *pMsgFile, bool bMBoxFile = false);
 char *USmlGetTag(SPLF_HANDLE hFSpool, char const *pszTagName, TAG_POSITION &TagPosition);
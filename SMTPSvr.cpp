@@ -46,10 +46,12 @@
 #include "POP3Utils.h"
 #include "Filter.h"
 #include "MailConfig.h"
+#include "ConnEngine.h"
 #include "AppDefines.h"
 #include "MailSvr.h"
 
 #define SMTP_MAX_LINE_SIZE      2048
+#define SMTP_BDAT_BUFFER_SIZE   (64 * 1024)
 #define STD_SMTP_TIMEOUT        30000
 #define SMTP_IPMAP_FILE         "smtp.ipmap.tab"
 #define SMTP_LOG_FILE           "smtp"
@@ -100,6 +102,7 @@ enum SMTPStates {
 	stateAuthenticated,
 	stateMail,
 	stateRcpt,
+	stateBdat,
 
 	stateExit
 };
@@ -107,6 +110,7 @@ enum SMTPStates {
 struct SMTPSession {
 	int iSMTPState;
 	ThreadConfig const *pThCfg;
+	BSOCK_HANDLE hBSock;
 	SMTPConfig *pSMTPCfg;
 	SVRCFG_HANDLE hSvrConfig;
 	SYS_INET_ADDR PeerInfo;
@@ -121,6 +125,10 @@ struct SMTPSession {
 	char szLogonUser[128];
 	char szMsgFile[SYS_MAX_PATH];
 	FILE *pMsgFile;
+	QMSG_HANDLE hMessage;
+	char szSpoolFile[SYS_MAX_PATH];
+	size_t sDataSize;
+	int iDataNL;
 	char *pszFrom;
 	char *pszRcpt;
 	char *pszSendRcpt;
@@ -138,6 +146,15 @@ struct SMTPSession {
 	char *pszNoTLSAuths;
 };
 
+struct SMTPPackedInfo {
+	char **ppszMsgInfo;
+	char szSMTPDomain[256];
+	char szMessageID[128];
+	char szMailFrom[MAX_SPOOL_LINE];
+	char **ppszRcpts;
+	int iRcptCount;
+};
+
 enum SmtpAuthFields {
 	smtpaUsername = 0,
 	smtpaPassword,
@@ -785,9 +802,11 @@ static int SMTPInitSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock,
 	ZeroData(SMTPS);
 	SMTPS.iSMTPState = stateInit;
 	SMTPS.pThCfg = pThCfg;
+	SMTPS.hBSock = INVALID_BSOCK_HANDLE;
 	SMTPS.hSvrConfig = INVALID_SVRCFG_HANDLE;
 	SMTPS.pSMTPCfg = NULL;
 	SMTPS.pMsgFile = NULL;
+	SMTPS.hMessage = INVALID_QMSG_HANDLE;
 	SMTPS.pszFrom = NULL;
 	SMTPS.pszRcpt = NULL;
 	SMTPS.pszSendRcpt = NULL;
@@ -911,11 +930,28 @@ static int SMTPInitSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock,
 	return 0;
 }
 
+static void SMTPDropSpoolFile(SMTPSession &SMTPS)
+{
+	if (SMTPS.hMessage != INVALID_QMSG_HANDLE) {
+		QueCleanupMessage(hSpoolQueue, SMTPS.hMessage);
+		QueCloseMessage(hSpoolQueue, SMTPS.hMessage);
+		SMTPS.hMessage = INVALID_QMSG_HANDLE;
+		SetEmptyString(SMTPS.szSpoolFile);
+	}
+}
+
+static char const *SMTPDataFile(SMTPSession const &SMTPS)
+{
+	/* Message data goes either to the SMTP message file, or straight into the spool */
+	return SMTPS.hMessage != INVALID_QMSG_HANDLE ? SMTPS.szSpoolFile: SMTPS.szMsgFile;
+}
+
 static void SMTPClearSession(SMTPSession &SMTPS)
 {
 	if (SMTPS.pMsgFile != NULL)
 		fclose(SMTPS.pMsgFile), SMTPS.pMsgFile = NULL;
 	SysRemove(SMTPS.szMsgFile);
+	SMTPDropSpoolFile(SMTPS);
 
 	if (SMTPS.hSvrConfig != INVALID_SVRCFG_HANDLE)
 		SvrReleaseConfigHandle(SMTPS.hSvrConfig), SMTPS.hSvrConfig =
@@ -935,11 +971,13 @@ static void SMTPResetSession(SMTPSession &SMTPS)
 	SMTPS.ulFlags = SMTPS.ulSetupFlags | (SMTPS.ulFlags & SMTPF_RESET_MASK);
 	SMTPS.ullMessageID = 0;
 	SMTPS.iRcptCount = 0;
+	SMTPS.sDataSize = 0;
 	SetEmptyString(SMTPS.szMessageID);
 
 	if (SMTPS.pMsgFile != NULL)
 		fclose(SMTPS.pMsgFile), SMTPS.pMsgFile = NULL;
 	SysRemove(SMTPS.szMsgFile);
+	SMTPDropSpoolFile(SMTPS);
 
 	SetEmptyString(SMTPS.szDestDomain);
 	SysFreeNullify(SMTPS.pszFrom);
@@ -1734,6 +1772,277 @@ static char *SMTPTrimRcptLine(char *pszRcptLn)
 	return pszRcptLn;
 }
 
+static char **SMTPLoadRcptList(FILE *pPkgFile, int &iRcptCount)
+{
+	char **ppszRcpts, **ppszNew;
+	char szSpoolLine[MAX_SPOOL_LINE] = "";
+
+	iRcptCount = 0;
+	if ((ppszRcpts = (char **) SysAlloc(sizeof(char *))) == NULL)
+		return NULL;
+	while (MscGetString(pPkgFile, szSpoolLine, sizeof(szSpoolLine) - 1) != NULL &&
+	       StrINComp(szSpoolLine, RCPT_TO_STR) == 0) {
+		if ((ppszNew = (char **) SysRealloc(ppszRcpts,
+						    (iRcptCount + 2) * sizeof(char *))) == NULL) {
+			StrFreeStrings(ppszRcpts);
+			return NULL;
+		}
+		ppszRcpts = ppszNew;
+
+		/* Cleanup the RCPT line from extra info */
+		if ((ppszRcpts[iRcptCount] = SysStrDup(SMTPTrimRcptLine(szSpoolLine))) == NULL) {
+			StrFreeStrings(ppszRcpts);
+			return NULL;
+		}
+		ppszRcpts[++iRcptCount] = NULL;
+	}
+
+	return ppszRcpts;
+}
+
+static char *SMTPGetRemoteDomain(char const *pszRcptLn)
+{
+	char szAddress[MAX_SMTP_ADDRESS] = "";
+	char szUser[MAX_ADDR_NAME] = "";
+	char szDomain[MAX_HOST_NAME] = "";
+	char szADomain[MAX_HOST_NAME] = "";
+
+	/*
+	 * Source routed recipients, and recipients handled by this server,
+	 * never take part in remote group deliveries.
+	 */
+	if (USmlParseAddress(pszRcptLn, NULL, 0, szAddress, sizeof(szAddress) - 1) < 0 ||
+	    szAddress[0] == '@' || USmtpSplitEmailAddr(szAddress, szUser, szDomain) < 0 ||
+	    MDomIsHandledDomain(szDomain) == 0 || ADomLookupDomain(szDomain, szADomain, true))
+		return NULL;
+
+	return SysStrDup(StrLower(szDomain));
+}
+
+static char **SMTPGetGroupKeys(char const *pszMessageID, char const *const *ppszRcpts,
+			       int iRcptCount)
+{
+	int i, j;
+	char **ppszDomains, **ppszKeys;
+
+	if ((ppszDomains = (char **) SysAlloc(iRcptCount * sizeof(char *))) == NULL)
+		return NULL;
+	if ((ppszKeys = (char **) SysAlloc(iRcptCount * sizeof(char *))) == NULL) {
+		SysFree(ppszDomains);
+		return NULL;
+	}
+	for (i = 0; i < iRcptCount; i++)
+		ppszDomains[i] = SMTPGetRemoteDomain(ppszRcpts[i]);
+
+	/*
+	 * Recipients of the same remote domain are tagged with a common group
+	 * key, so that the SMAIL server can deliver them within a single SMTP
+	 * transaction.
+	 */
+	for (i = 0; i < iRcptCount; i++) {
+		if (ppszDomains[i] == NULL)
+			continue;
+		for (j = 0; j < iRcptCount; j++)
+			if (j != i && ppszDomains[j] != NULL &&
+			    strcmp(ppszDomains[i], ppszDomains[j]) == 0)
+				break;
+		if (j < iRcptCount)
+			ppszKeys[i] = StrSprint("%s/%s", pszMessageID, ppszDomains[i]);
+	}
+	for (i = 0; i < iRcptCount; i++)
+		SysFree(ppszDomains[i]);
+	SysFree(ppszDomains);
+
+	return ppszKeys;
+}
+
+static void SMTPFreeGroupKeys(char **ppszKeys, int iRcptCount)
+{
+	if (ppszKeys != NULL) {
+		for (int i = 0; i < iRcptCount; i++)
+			SysFree(ppszKeys[i]);
+		SysFree(ppszKeys);
+	}
+}
+
+static void SMTPDropMessages(QMSG_HANDLE *phMessages, int iCount)
+{
+	for (int i = 0; i < iCount; i++) {
+		QueCleanupMessage(hSpoolQueue, phMessages[i]);
+		QueCloseMessage(hSpoolQueue, phMessages[i]);
+	}
+}
+
+static void SMTPFreePackedInfo(SMTPPackedInfo &SPI)
+{
+	StrFreeStrings(SPI.ppszRcpts);
+	StrFreeStrings(SPI.ppszMsgInfo);
+}
+
+static int SMTPLoadPackedInfo(FILE *pPkgFile, SMTPPackedInfo &SPI)
+{
+	char szSpoolLine[MAX_SPOOL_LINE] = "";
+
+	ZeroData(SPI);
+
+	/* Read SMTP message info ( 1st row of the smtp-mail file ) */
+	if (MscGetString(pPkgFile, szSpoolLine, sizeof(szSpoolLine) - 1) == NULL ||
+	    (SPI.ppszMsgInfo = StrTokenize(szSpoolLine, ";")) == NULL ||
+	    StrStringsCount(SPI.ppszMsgInfo) < smsgiMax) {
+		if (SPI.ppszMsgInfo != NULL)
+			StrFreeStrings(SPI.ppszMsgInfo);
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+	/* Read SMTP domain ( 2nd row of the smtp-mail file ) */
+	if (MscGetString(pPkgFile, SPI.szSMTPDomain, sizeof(SPI.szSMTPDomain) - 1) == NULL) {
+		StrFreeStrings(SPI.ppszMsgInfo);
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+	/* Read message ID ( 3th row of the smtp-mail file ) */
+	if (MscGetString(pPkgFile, SPI.szMessageID, sizeof(SPI.szMessageID) - 1) == NULL) {
+		StrFreeStrings(SPI.ppszMsgInfo);
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+	/* Read "MAIL FROM:" ( 4th row of the smtp-mail file ) */
+	if (MscGetString(pPkgFile, SPI.szMailFrom, sizeof(SPI.szMailFrom) - 1) == NULL ||
+	    StrINComp(SPI.szMailFrom, MAIL_FROM_STR) != 0) {
+		StrFreeStrings(SPI.ppszMsgInfo);
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
+	/* Read "RCPT TO:" ( 5th[,...] row(s) of the smtp-mail file ) */
+	if ((SPI.ppszRcpts = SMTPLoadRcptList(pPkgFile, SPI.iRcptCount)) == NULL) {
+		ErrorPush();
+		StrFreeStrings(SPI.ppszMsgInfo);
+		return ErrorPop();
+	}
+
+	return 0;
+}
+
+static int SMTPWriteSpoolHeader(SMTPSession &SMTPS, FILE *pSpoolFile, SMTPPackedInfo const &SPI,
+				char const *pszRcpt, bool bShared, int iReceivedType)
+{
+	char const *const *ppszMsgInfo = SPI.ppszMsgInfo;
+
+	/* Write info line */
+	USmtpWriteInfoLine(pSpoolFile, ppszMsgInfo[smsgiClientAddr],
+			   ppszMsgInfo[smsgiServerAddr], ppszMsgInfo[smsgiTime]);
+
+	/* Write SMTP domain */
+	fprintf(pSpoolFile, "%s\r\n", SPI.szSMTPDomain);
+
+	/* Write message ID */
+	fprintf(pSpoolFile, "%s\r\n", SPI.szMessageID);
+
+	/* Write "MAIL FROM:" */
+	fprintf(pSpoolFile, "%s\r\n", SPI.szMailFrom);
+
+	/* Write "RCPT TO:" */
+	fprintf(pSpoolFile, "%s\r\n", pszRcpt);
+
+	/* Write SPOOL_FILE_DATA_START */
+	fprintf(pSpoolFile, "%s\r\n", SPOOL_FILE_DATA_START);
+
+	/* Write "X-AuthUser:" tag */
+	if (!IsEmptyString(SMTPS.szLogonUser) &&
+	    !(SMTPS.ulFlags & SMTPF_NOEMIT_AUTH))
+		fprintf(pSpoolFile, "X-AuthUser: %s\r\n", SMTPS.szLogonUser);
+
+	/*
+	 * Write "Received:" tag. Grouped recipients share the same message
+	 * body on the wire, so their "for" clause must not be emitted. Single
+	 * recipient messages, and recipients not sharing their domain with any
+	 * other one, are never grouped and keep it.
+	 */
+	return SMTPAddReceived(iReceivedType,
+			       IsEmptyString(SMTPS.szLogonUser) ? NULL: SMTPS.szLogonUser,
+			       ppszMsgInfo, SPI.szMailFrom, bShared ? NULL: pszRcpt,
+			       SPI.szMessageID, pSpoolFile);
+}
+
+static int SMTPShareBody(FILE *pPkgFile, SYS_OFF_T llBodyOffset, QMSG_HANDLE hMessage,
+			 char *pszBodyFilePath, FILE *pSpoolFile)
+{
+	char szFilePath[SYS_MAX_PATH] = "";
+
+	QueGetFilePath(hSpoolQueue, hMessage, szFilePath, QUEUE_BODY_DIR);
+
+	/* The first recipient creates the shared body file ... */
+	if (IsEmptyString(pszBodyFilePath)) {
+		FILE *pBodyFile = fopen(szFilePath, "wb");
+
+		if (pBodyFile == NULL) {
+			ErrSetErrorCode(ERR_FILE_CREATE, szFilePath);
+			return ERR_FILE_CREATE;
+		}
+		if (MscCopyFile(pBodyFile, pPkgFile, llBodyOffset, (SYS_OFF_T) -1) < 0 ||
+		    SysFileSync(pBodyFile) < 0) {
+			ErrorPush();
+			fclose(pBodyFile);
+			SysRemove(szFilePath);
+			return ErrorPop();
+		}
+		if (fclose(pBodyFile)) {
+			SysRemove(szFilePath);
+			ErrSetErrorCode(ERR_FILE_WRITE, szFilePath);
+			return ERR_FILE_WRITE;
+		}
+		StrNCpy(pszBodyFilePath, szFilePath, SYS_MAX_PATH);
+
+		return 0;
+	}
+
+	/*
+	 * ... and the others get a link to it, so that the file system keeps
+	 * the reference count for us. Should the link fail, the recipient gets
+	 * its own copy of the body.
+	 */
+	if (SysLinkFile(pszBodyFilePath, szFilePath) < 0)
+		return MscCopyFile(pSpoolFile, pPkgFile, llBodyOffset, (SYS_OFF_T) -1);
+
+	return 0;
+}
+
+static int SMTPWriteRcptSpool(SMTPSession &SMTPS, FILE *pPkgFile, SMTPPackedInfo const &SPI,
+			      QMSG_HANDLE hMessage, char const *pszRcpt, bool bShared,
+			      int iReceivedType, bool bSync, SYS_OFF_T llMsgOffset,
+			      SYS_OFF_T llBodyOffset, char *pszBodyFilePath)
+{
+	char szQueueFilePath[SYS_MAX_PATH] = "";
+
+	QueGetFilePath(hSpoolQueue, hMessage, szQueueFilePath);
+
+	FILE *pSpoolFile = fopen(szQueueFilePath, "wb");
+
+	if (pSpoolFile == NULL) {
+		ErrSetErrorCode(ERR_FILE_CREATE, szQueueFilePath);
+		return ERR_FILE_CREATE;
+	}
+	/* Write the spool header and the mail data (only its headers, if the body is shared) */
+	if (SMTPWriteSpoolHeader(SMTPS, pSpoolFile, SPI, pszRcpt, bShared, iReceivedType) < 0 ||
+	    MscCopyFile(pSpoolFile, pPkgFile, llMsgOffset,
+			llBodyOffset != (SYS_OFF_T) -1 ? llBodyOffset - llMsgOffset:
+			(SYS_OFF_T) -1) < 0 ||
+	    (llBodyOffset != (SYS_OFF_T) -1 &&
+	     SMTPShareBody(pPkgFile, llBodyOffset, hMessage, pszBodyFilePath,
+			   pSpoolFile) < 0) ||
+	    (bSync && SysFileSync(pSpoolFile) < 0)) {
+		ErrorPush();
+		fclose(pSpoolFile);
+		return ErrorPop();
+	}
+	if (fclose(pSpoolFile)) {
+		ErrSetErrorCode(ERR_FILE_WRITE, szQueueFilePath);
+		return ERR_FILE_WRITE;
+	}
+
+	return 0;
+}
+
 static int SMTPSubmitPackedFile(SMTPSession &SMTPS, char const *pszPkgFile)
 {
 	FILE *pPkgFile = fopen(pszPkgFile, "rb");
@@ -1759,170 +2068,190 @@ static int SMTPSubmitPackedFile(SMTPSession &SMTPS, char const *pszPkgFile)
 
 	rewind(pPkgFile);
 
-	/* Read SMTP message info ( 1st row of the smtp-mail file ) */
-	char **ppszMsgInfo = NULL;
+	SMTPPackedInfo SPI;
 
-	if (MscGetString(pPkgFile, szSpoolLine, sizeof(szSpoolLine) - 1) == NULL ||
-	    (ppszMsgInfo = StrTokenize(szSpoolLine, ";")) == NULL ||
-	    StrStringsCount(ppszMsgInfo) < smsgiMax) {
-		if (ppszMsgInfo != NULL)
-			StrFreeStrings(ppszMsgInfo);
+	if (SMTPLoadPackedInfo(pPkgFile, SPI) < 0) {
+		ErrorPush();
 		fclose(pPkgFile);
-		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
-		return ERR_INVALID_SPOOL_FILE;
+		return ErrorPop();
 	}
-	/* Read SMTP domain ( 2nd row of the smtp-mail file ) */
-	char szSMTPDomain[256] = "";
+	/* Get the Received: header type to emit */
+	int iReceivedType = SvrGetConfigInt("ReceivedHdrType", RECEIVED_TYPE_STD,
+					    SMTPS.hSvrConfig);
 
-	if (MscGetString(pPkgFile, szSMTPDomain, sizeof(szSMTPDomain) - 1) == NULL) {
-		StrFreeStrings(ppszMsgInfo);
-		fclose(pPkgFile);
-		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
-		return ERR_INVALID_SPOOL_FILE;
-	}
-	/* Read message ID ( 3th row of the smtp-mail file ) */
-	char szMessageID[128] = "";
+	/* With the group commit enabled, the spool files are synced in batches */
+	int iSyncWait = SvrGetConfigInt("SpoolSyncGroupWait", 0, SMTPS.hSvrConfig);
+
+	/* Tag the recipients that can share the same remote delivery */
+	char **ppszGroupKeys = NULL;
 
-	if (MscGetString(pPkgFile, szMessageID, sizeof(szMessageID) - 1) == NULL) {
-		StrFreeStrings(ppszMsgInfo);
+	if (SPI.iRcptCount > 1 &&
+	    SvrTestConfigFlag("GroupRemoteRcpts", true, SMTPS.hSvrConfig) &&
+	    (ppszGroupKeys = SMTPGetGroupKeys(SPI.szMessageID, SPI.ppszRcpts,
+					      SPI.iRcptCount)) == NULL) {
+		ErrorPush();
+		SMTPFreePackedInfo(SPI);
 		fclose(pPkgFile);
-		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
-		return ERR_INVALID_SPOOL_FILE;
+		return ErrorPop();
 	}
-	/* Read "MAIL FROM:" ( 4th row of the smtp-mail file ) */
-	char szMailFrom[MAX_SPOOL_LINE] = "";
 
-	if (MscGetString(pPkgFile, szMailFrom, sizeof(szMailFrom) - 1) == NULL ||
-	    StrINComp(szMailFrom, MAIL_FROM_STR) != 0) {
-		StrFreeStrings(ppszMsgInfo);
+	/*
+	 * With more than one recipient, the message body is stored only once in
+	 * the spool, and the recipient files carry only the envelope and the
+	 * message headers.
+	 */
+	SYS_OFF_T llBodyOffset = (SYS_OFF_T) -1;
+	char szBodyFilePath[SYS_MAX_PATH] = "";
+
+	if (SPI.iRcptCount > 1 && SvrTestConfigFlag("SharedSpoolBody", true, SMTPS.hSvrConfig))
+		llBodyOffset = USmlFindBodyOffset(pPkgFile, llMsgOffset);
+
+	/*
+	 * Messages are committed to the spool only once all of them have been
+	 * created, so that either all the recipients get the message, or none
+	 * of them does (and the client will retry).
+	 */
+	int iMsgCount = 0;
+	QMSG_HANDLE *phMessages = (QMSG_HANDLE *) SysAlloc((SPI.iRcptCount + 1) *
+							    sizeof(QMSG_HANDLE));
+
+	if (phMessages == NULL) {
+		ErrorPush();
+		SMTPFreeGroupKeys(ppszGroupKeys, SPI.iRcptCount);
+		SMTPFreePackedInfo(SPI);
 		fclose(pPkgFile);
-		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
-		return ERR_INVALID_SPOOL_FILE;
+		return ErrorPop();
 	}
-	/* Get the Received: header type to emit */
-	int iReceivedType = SvrGetConfigInt("ReceivedHdrType", RECEIVED_TYPE_STD,
-					    SMTPS.hSvrConfig);
+	int i;
 
-	/* Read "RCPT TO:" ( 5th[,...] row(s) of the smtp-mail file ) */
-	while (MscGetString(pPkgFile, szSpoolLine, sizeof(szSpoolLine) - 1) != NULL &&
-	       StrINComp(szSpoolLine, RCPT_TO_STR) == 0) {
-		/* Cleanup the RCPT line from extra info */
-		SMTPTrimRcptLine(szSpoolLine);
+	for (i = 0; i < SPI.iRcptCount; i++) {
+		char const *pszGroupKey = ppszGroupKeys != NULL ? ppszGroupKeys[i]: NULL;
 
 		/* Get message handle */
 		QMSG_HANDLE hMessage = QueCreateMessage(hSpoolQueue);
 
-		if (hMessage == INVALID_QMSG_HANDLE) {
-			ErrorPush();
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			return ErrorPop();
-		}
+		if (hMessage == INVALID_QMSG_HANDLE)
+			break;
+		phMessages[iMsgCount++] = hMessage;
+		if (QueSetMessageGroup(hMessage, pszGroupKey) < 0 ||
+		    QueUtSetMessageDomain(hMessage, SPI.ppszRcpts[i]) < 0 ||
+		    SMTPWriteRcptSpool(SMTPS, pPkgFile, SPI, hMessage, SPI.ppszRcpts[i],
+				       pszGroupKey != NULL, iReceivedType, iSyncWait <= 0,
+				       llMsgOffset, llBodyOffset, szBodyFilePath) < 0)
+			break;
+	}
+	if (i < SPI.iRcptCount) {
+		ErrorPush();
+		SMTPDropMessages(phMessages, iMsgCount);
+		SysFree(phMessages);
+		SMTPFreeGroupKeys(ppszGroupKeys, SPI.iRcptCount);
+		SMTPFreePackedInfo(SPI);
+		fclose(pPkgFile);
+		return ErrorPop();
+	}
+	SMTPFreeGroupKeys(ppszGroupKeys, SPI.iRcptCount);
+	SMTPFreePackedInfo(SPI);
+	fclose(pPkgFile);
 
-		char szQueueFilePath[SYS_MAX_PATH] = "";
+	/* Transfer files to the spool */
+	if ((iSyncWait > 0 ? QueSyncCommitMessages(hSpoolQueue, phMessages, iMsgCount, iSyncWait):
+	     QueCommitMessages(hSpoolQueue, phMessages, iMsgCount)) < 0) {
+		ErrorPush();
+		SMTPDropMessages(phMessages, iMsgCount);
+		SysFree(phMessages);
+		return ErrorPop();
+	}
+	SysFree(phMessages);
 
-		QueGetFilePath(hSpoolQueue, hMessage, szQueueFilePath);
+	return 0;
+}
 
-		FILE *pSpoolFile = fopen(szQueueFilePath, "wb");
+static int SMTPOpenSpoolFile(SMTPSession &SMTPS)
+{
+	/* Load the envelope collected so far */
+	SMTPPackedInfo SPI;
 
-		if (pSpoolFile == NULL) {
-			QueCleanupMessage(hSpoolQueue, hMessage);
-			QueCloseMessage(hSpoolQueue, hMessage);
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			ErrSetErrorCode(ERR_FILE_CREATE);
-			return ERR_FILE_CREATE;
-		}
-		/* Write info line */
-		USmtpWriteInfoLine(pSpoolFile, ppszMsgInfo[smsgiClientAddr],
-				   ppszMsgInfo[smsgiServerAddr], ppszMsgInfo[smsgiTime]);
+	if (fflush(SMTPS.pMsgFile)) {
+		ErrSetErrorCode(ERR_FILE_WRITE, SMTPS.szMsgFile);
+		return ERR_FILE_WRITE;
+	}
+	rewind(SMTPS.pMsgFile);
+	if (SMTPLoadPackedInfo(SMTPS.pMsgFile, SPI) < 0)
+		return ErrGetErrorCode();
+	if (SPI.iRcptCount != 1) {
+		SMTPFreePackedInfo(SPI);
+		ErrSetErrorCode(ERR_INVALID_SPOOL_FILE);
+		return ERR_INVALID_SPOOL_FILE;
+	}
 
-		/* Write SMTP domain */
-		fprintf(pSpoolFile, "%s\r\n", szSMTPDomain);
+	QMSG_HANDLE hMessage = QueCreateMessage(hSpoolQueue);
 
-		/* Write message ID */
-		fprintf(pSpoolFile, "%s\r\n", szMessageID);
+	if (hMessage == INVALID_QMSG_HANDLE) {
+		ErrorPush();
+		SMTPFreePackedInfo(SPI);
+		return ErrorPop();
+	}
+	if (QueUtSetMessageDomain(hMessage, SPI.ppszRcpts[0]) < 0) {
+		ErrorPush();
+		QueCloseMessage(hSpoolQueue, hMessage);
+		SMTPFreePackedInfo(SPI);
+		return ErrorPop();
+	}
+
+	char szQueueFilePath[SYS_MAX_PATH] = "";
 
-		/* Write "MAIL FROM:" */
-		fprintf(pSpoolFile, "%s\r\n", szMailFrom);
+	QueGetFilePath(hSpoolQueue, hMessage, szQueueFilePath);
 
-		/* Write "RCPT TO:" */
-		fprintf(pSpoolFile, "%s\r\n", szSpoolLine);
+	FILE *pSpoolFile = fopen(szQueueFilePath, "wb");
 
-		/* Write SPOOL_FILE_DATA_START */
-		fprintf(pSpoolFile, "%s\r\n", SPOOL_FILE_DATA_START);
+	if (pSpoolFile == NULL) {
+		QueCleanupMessage(hSpoolQueue, hMessage);
+		QueCloseMessage(hSpoolQueue, hMessage);
+		SMTPFreePackedInfo(SPI);
+		ErrSetErrorCode(ERR_FILE_CREATE, szQueueFilePath);
+		return ERR_FILE_CREATE;
+	}
+	if (SMTPWriteSpoolHeader(SMTPS, pSpoolFile, SPI, SPI.ppszRcpts[0], false,
+				 SvrGetConfigInt("ReceivedHdrType", RECEIVED_TYPE_STD,
+						 SMTPS.hSvrConfig)) < 0) {
+		ErrorPush();
+		fclose(pSpoolFile);
+		QueCleanupMessage(hSpoolQueue, hMessage);
+		QueCloseMessage(hSpoolQueue, hMessage);
+		SMTPFreePackedInfo(SPI);
+		return ErrorPop();
+	}
+	SMTPFreePackedInfo(SPI);
 
-		/* Write "X-AuthUser:" tag */
-		if (!IsEmptyString(SMTPS.szLogonUser) &&
-		    !(SMTPS.ulFlags & SMTPF_NOEMIT_AUTH))
-			fprintf(pSpoolFile, "X-AuthUser: %s\r\n", SMTPS.szLogonUser);
+	/* From now on, message data goes straight into the spool file */
+	fclose(SMTPS.pMsgFile);
+	SysRemove(SMTPS.szMsgFile);
+	SMTPS.pMsgFile = pSpoolFile;
+	SMTPS.hMessage = hMessage;
+	StrSNCpy(SMTPS.szSpoolFile, szQueueFilePath);
 
-		/* Write "Received:" tag */
-		SMTPAddReceived(iReceivedType,
-				IsEmptyString(SMTPS.szLogonUser) ? NULL: SMTPS.szLogonUser,
-				ppszMsgInfo, szMailFrom, szSpoolLine, szMessageID,
-				pSpoolFile);
+	return 0;
+}
 
-		/* Write mail data, saving and restoring the current file pointer */
-		SYS_OFF_T llCurrOffset = Sys_ftell(pPkgFile);
+static int SMTPCommitSpoolFile(SMTPSession &SMTPS)
+{
+	int iSyncWait = SvrGetConfigInt("SpoolSyncGroupWait", 0, SMTPS.hSvrConfig);
 
-		if (MscCopyFile(pSpoolFile, pPkgFile, llMsgOffset, (SYS_OFF_T) -1) < 0) {
-			ErrorPush();
-			fclose(pSpoolFile);
-			QueCleanupMessage(hSpoolQueue, hMessage);
-			QueCloseMessage(hSpoolQueue, hMessage);
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			return ErrorPop();
-		}
-		if (SysFileSync(pSpoolFile) < 0) {
-			ErrorPush();
-			fclose(pSpoolFile);
-			QueCleanupMessage(hSpoolQueue, hMessage);
-			QueCloseMessage(hSpoolQueue, hMessage);
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			return ErrorPop();
-		}
-		if (fclose(pSpoolFile)) {
-			QueCleanupMessage(hSpoolQueue, hMessage);
-			QueCloseMessage(hSpoolQueue, hMessage);
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			ErrSetErrorCode(ERR_FILE_WRITE, szQueueFilePath);
-			return ERR_FILE_WRITE;
-		}
-		Sys_fseek(pPkgFile, llCurrOffset, SEEK_SET);
+	if ((iSyncWait > 0 ? QueSyncCommitMessages(hSpoolQueue, &SMTPS.hMessage, 1, iSyncWait):
+	     QueCommitMessage(hSpoolQueue, SMTPS.hMessage)) < 0)
+		return ErrGetErrorCode();
 
-		/* Transfer file to the spool */
-		if (QueCommitMessage(hSpoolQueue, hMessage) < 0) {
-			ErrorPush();
-			QueCleanupMessage(hSpoolQueue, hMessage);
-			QueCloseMessage(hSpoolQueue, hMessage);
-			StrFreeStrings(ppszMsgInfo);
-			fclose(pPkgFile);
-			return ErrorPop();
-		}
-	}
-	StrFreeStrings(ppszMsgInfo);
-	fclose(pPkgFile);
+	/* The message is now owned by the spool */
+	SMTPS.hMessage = INVALID_QMSG_HANDLE;
+	SetEmptyString(SMTPS.szSpoolFile);
 
 	return 0;
 }
 
-static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSession &SMTPS)
+static int SMTPBeginData(BSOCK_HANDLE hBSock, SMTPSession &SMTPS)
 {
 	char *pszError;
 
-	if (SMTPS.iSMTPState != stateRcpt) {
-		SMTPResetSession(SMTPS);
-
-		SMTPSendError(hBSock, SMTPS, "503 Bad sequence of commands");
-
-		ErrSetErrorCode(ERR_SMTP_BAD_CMD_SEQUENCE);
-		return ERR_SMTP_BAD_CMD_SEQUENCE;
-	}
-
 	/* Run the pre-DATA filter */
 	pszError = NULL;
 	if (SMTPFilterMessage(SMTPS, SMTP_PRE_DATA_FILTER, pszError) < 0) {
@@ -1938,6 +2267,28 @@ static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPS
 		return ErrorPop();
 	}
 
+	/*
+	 * Single recipient messages are written directly in the spool format,
+	 * and committed with a rename once the data is complete. Post-DATA
+	 * filters expect the SMTP message file, so they keep the old path.
+	 */
+	char szFilterFile[SYS_MAX_PATH] = "";
+
+	if (SMTPS.iRcptCount == 1 &&
+	    !SMTPGetFilterFile(SMTP_POST_DATA_FILTER, szFilterFile, sizeof(szFilterFile) - 1)) {
+		if (SMTPOpenSpoolFile(SMTPS) < 0) {
+			ErrorPush();
+			SMTPResetSession(SMTPS);
+
+			SMTPSendError(hBSock, SMTPS,
+				      "451 Requested action aborted: (%d) local error in processing",
+				      ErrorFetch());
+			return ErrorPop();
+		}
+
+		return 0;
+	}
+
 	/* Write data begin marker */
 	if (StrWriteCRLFString(SMTPS.pMsgFile, SPOOL_FILE_DATA_START) < 0) {
 		ErrorPush();
@@ -1949,13 +2300,105 @@ static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPS
 		return ErrorPop();
 	}
 
+	return 0;
+}
+
+static int SMTPEndData(BSOCK_HANDLE hBSock, SMTPSession &SMTPS, int iError,
+		       char const *pszSmtpError)
+{
+	char *pszError;
+
+	/*
+	 * A spool file written directly must hit the disk before being committed,
+	 * unless the group commit is going to take care of it.
+	 */
+	if (iError == 0 && SMTPS.hMessage != INVALID_QMSG_HANDLE &&
+	    SvrGetConfigInt("SpoolSyncGroupWait", 0, SMTPS.hSvrConfig) <= 0 &&
+	    SysFileSync(SMTPS.pMsgFile) < 0)
+		iError = ErrGetErrorCode();
+
+	/* Check fclose() return value coz data might be buffered and fail to flush */
+	if (fclose(SMTPS.pMsgFile))
+		ErrSetErrorCode(iError = ERR_FILE_WRITE, SMTPDataFile(SMTPS));
+	SMTPS.pMsgFile = NULL;
+
+	if (iError == 0) {
+		/*
+		 * Run the post-DATA filter. Messages written directly into the
+		 * spool were only allowed to, because no post-DATA filter was
+		 * configured when the DATA command started. Their SMTP message
+		 * file is gone, so a filter set up in the meanwhile must wait
+		 * for the next message.
+		 */
+		pszError = NULL;
+		if (SMTPS.hMessage == INVALID_QMSG_HANDLE &&
+		    SMTPFilterMessage(SMTPS, SMTP_POST_DATA_FILTER, pszError) < 0) {
+			ErrorPush();
+			SMTPResetSession(SMTPS);
+
+			if (pszError != NULL) {
+				SMTPSendError(hBSock, SMTPS, "%s", pszError);
+				SysFree(pszError);
+			} else
+				BSckSendString(hBSock, "554 Transaction failed",
+					       SMTPS.pSMTPCfg->iTimeout);
+			return ErrorPop();
+		}
+
+		/* Transfer spool file */
+		if ((iError = SMTPS.hMessage != INVALID_QMSG_HANDLE ? SMTPCommitSpoolFile(SMTPS):
+		     SMTPSubmitPackedFile(SMTPS, SMTPS.szMsgFile)) < 0) {
+			SMTPResetSession(SMTPS);
+
+			SMTPSendError(hBSock, SMTPS,
+				      "451 Requested action aborted: (%d) local error in processing",
+				      ErrGetErrorCode());
+		} else {
+			/* Log the message receive */
+			if (SMTPLogEnabled(SMTPS.pThCfg->hThShb, SMTPS.pSMTPCfg))
+				SMTPLogSession(SMTPS, SMTPS.pszFrom, SMTPS.pszRcpt, "RECV=OK",
+					       SMTPS.sDataSize);
+
+			/* Send the ack only when everything is OK */
+			BSckVSendString(hBSock, SMTPS.pSMTPCfg->iTimeout, "250 OK <%s>",
+					SMTPS.szMessageID);
+
+			SMTPResetSession(SMTPS);
+		}
+	} else {
+		SMTPResetSession(SMTPS);
+
+		/* Notify the client the error condition */
+		if (pszSmtpError == NULL)
+			SMTPSendError(hBSock, SMTPS,
+				      "451 Requested action aborted: (%d) local error in processing",
+				      ErrGetErrorCode());
+		else
+			SMTPSendError(hBSock, SMTPS, "%s", pszSmtpError);
+	}
+
+	return iError;
+}
+
+static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSession &SMTPS)
+{
+	if (SMTPS.iSMTPState != stateRcpt) {
+		SMTPResetSession(SMTPS);
+
+		SMTPSendError(hBSock, SMTPS, "503 Bad sequence of commands");
+
+		ErrSetErrorCode(ERR_SMTP_BAD_CMD_SEQUENCE);
+		return ERR_SMTP_BAD_CMD_SEQUENCE;
+	}
+	if (SMTPBeginData(hBSock, SMTPS) < 0)
+		return ErrGetErrorCode();
+
 	BSckSendString(hBSock, "354 Start mail input; end with <CRLF>.<CRLF>",
 		       SMTPS.pSMTPCfg->iTimeout);
 
 	/* Write data */
 	size_t sLineLength;
 	int iError = 0, iGotNL, iGotNLPrev = 1;
-	size_t sMessageSize = 0;
 	size_t sMaxMsgSize = SMTPS.sMaxMsgSize;
 	char const *pszSmtpError = NULL;
 	char szBuffer[SMTP_MAX_LINE_SIZE + 4];
@@ -1985,14 +2428,14 @@ static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPS
 		if (iError == 0) {
 			/* Write data on disk */
 			if (!fwrite(szBuffer, sLineLength, 1, SMTPS.pMsgFile)) {
-				ErrSetErrorCode(iError = ERR_FILE_WRITE, SMTPS.szMsgFile);
+				ErrSetErrorCode(iError = ERR_FILE_WRITE, SMTPDataFile(SMTPS));
 
 			}
 		}
-		sMessageSize += sLineLength;
+		SMTPS.sDataSize += sLineLength;
 
 		/* Check the message size */
-		if ((sMaxMsgSize != 0) && (sMaxMsgSize < sMessageSize)) {
+		if ((sMaxMsgSize != 0) && (sMaxMsgSize < SMTPS.sDataSize)) {
 			pszSmtpError = "552 Message exceeds fixed maximum message size";
 
 			ErrSetErrorCode(iError = ERR_MESSAGE_SIZE);
@@ -2006,59 +2449,146 @@ static int SMTPHandleCmd_DATA(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPS
 		iGotNLPrev = iGotNL;
 	}
 
-	/* Check fclose() return value coz data might be buffered and fail to flush */
-	if (fclose(SMTPS.pMsgFile))
-		ErrSetErrorCode(iError = ERR_FILE_WRITE, SMTPS.szMsgFile);
-	SMTPS.pMsgFile = NULL;
+	return SMTPEndData(hBSock, SMTPS, iError, pszSmtpError);
+}
 
-	if (iError == 0) {
-		/* Run the post-DATA filter */
-		pszError = NULL;
-		if (SMTPFilterMessage(SMTPS, SMTP_POST_DATA_FILTER, pszError) < 0) {
-			ErrorPush();
-			SMTPResetSession(SMTPS);
+static int SMTPWriteChunkData(SMTPSession &SMTPS, char const *pData, size_t sSize)
+{
+	char const *pEnd = pData + sSize, *pNext;
 
-			if (pszError != NULL) {
-				SMTPSendError(hBSock, SMTPS, "%s", pszError);
-				SysFree(pszError);
-			} else
-				BSckSendString(hBSock, "554 Transaction failed",
-					       SMTPS.pSMTPCfg->iTimeout);
-			return ErrorPop();
+	/*
+	 * BDAT chunks carry the message as-is, while the spool stores it in
+	 * the same dot-stuffed form a DATA transfer would have produced.
+	 */
+	for (; pData < pEnd; pData = pNext) {
+		if (SMTPS.iDataNL && *pData == '.') {
+			if (putc('.', SMTPS.pMsgFile) == EOF) {
+				ErrSetErrorCode(ERR_FILE_WRITE, SMTPDataFile(SMTPS));
+				return ERR_FILE_WRITE;
+			}
+			SMTPS.sDataSize++;
 		}
+		if ((pNext = (char const *) memchr(pData, '\n', pEnd - pData)) != NULL)
+			pNext++, SMTPS.iDataNL = 1;
+		else
+			pNext = pEnd, SMTPS.iDataNL = 0;
+		if (!fwrite(pData, pNext - pData, 1, SMTPS.pMsgFile)) {
+			ErrSetErrorCode(ERR_FILE_WRITE, SMTPDataFile(SMTPS));
+			return ERR_FILE_WRITE;
+		}
+		SMTPS.sDataSize += pNext - pData;
+	}
 
-		/* Transfer spool file */
-		if ((iError = SMTPSubmitPackedFile(SMTPS, SMTPS.szMsgFile)) < 0) {
-			SMTPResetSession(SMTPS);
+	return 0;
+}
 
-			SMTPSendError(hBSock, SMTPS,
-				      "451 Requested action aborted: (%d) local error in processing",
-				      ErrGetErrorCode());
-		} else {
-			/* Log the message receive */
-			if (SMTPLogEnabled(SMTPS.pThCfg->hThShb, SMTPS.pSMTPCfg))
-				SMTPLogSession(SMTPS, SMTPS.pszFrom, SMTPS.pszRcpt, "RECV=OK",
-					       sMessageSize);
+static int SMTPReadChunk(BSOCK_HANDLE hBSock, SMTPSession &SMTPS, SYS_UINT64 ullChunkSize,
+			 int &iError, char const *&pszSmtpError)
+{
+	char *pBuffer = (char *) SysAlloc(SMTP_BDAT_BUFFER_SIZE);
 
-			/* Send the ack only when everything is OK */
-			BSckVSendString(hBSock, SMTPS.pSMTPCfg->iTimeout, "250 OK <%s>",
-					SMTPS.szMessageID);
+	if (pBuffer == NULL)
+		return ErrGetErrorCode();
 
-			SMTPResetSession(SMTPS);
+	/*
+	 * The chunk octets always need to be consumed, in order to keep the
+	 * link in sync, even if we are not going to store them.
+	 */
+	while (ullChunkSize > 0) {
+		size_t sRdSize = (size_t) Min(ullChunkSize, (SYS_UINT64) SMTP_BDAT_BUFFER_SIZE);
+
+		if ((sRdSize = BSckReadData(hBSock, pBuffer, sRdSize,
+					    SMTPS.pSMTPCfg->iTimeout)) == 0) {
+			SysFree(pBuffer);
+			return ErrGetErrorCode();
 		}
-	} else {
+		ullChunkSize -= sRdSize;
+		if (iError == 0 && SMTPS.iSMTPState == stateBdat) {
+			if (SMTPWriteChunkData(SMTPS, pBuffer, sRdSize) < 0)
+				iError = ErrGetErrorCode();
+			else if (SMTPS.sMaxMsgSize != 0 && SMTPS.sMaxMsgSize < SMTPS.sDataSize) {
+				pszSmtpError = "552 Message exceeds fixed maximum message size";
+
+				ErrSetErrorCode(iError = ERR_MESSAGE_SIZE);
+			}
+		}
+		if (SvrInShutdown()) {
+			SysFree(pBuffer);
+			ErrSetErrorCode(ERR_SERVER_SHUTDOWN);
+			return ERR_SERVER_SHUTDOWN;
+		}
+	}
+	SysFree(pBuffer);
+
+	return 0;
+}
+
+static int SMTPHandleCmd_BDAT(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSession &SMTPS)
+{
+	int iTokensCount;
+	char **ppszTokens = StrTokenize(pszCommand, " ");
+
+	if (ppszTokens == NULL || (iTokensCount = StrStringsCount(ppszTokens)) < 2 ||
+	    iTokensCount > 3 || !isdigit(*ppszTokens[1]) ||
+	    (iTokensCount == 3 && stricmp(ppszTokens[2], "LAST") != 0)) {
+		if (ppszTokens != NULL)
+			StrFreeStrings(ppszTokens);
 		SMTPResetSession(SMTPS);
 
-		/* Notify the client the error condition */
-		if (pszSmtpError == NULL)
-			SMTPSendError(hBSock, SMTPS,
-				      "451 Requested action aborted: (%d) local error in processing",
-				      ErrGetErrorCode());
+		SMTPSendError(hBSock, SMTPS, "501 Syntax error in parameters or arguments");
+
+		/* Without a valid chunk size there is no way to resync the link */
+		SMTPS.iSMTPState = stateExit;
+
+		ErrSetErrorCode(ERR_SMTP_BAD_DATA);
+		return ERR_SMTP_BAD_DATA;
+	}
+
+	SYS_UINT64 ullChunkSize = (SYS_UINT64) Sys_atoi64(ppszTokens[1]);
+	int iLastChunk = iTokensCount == 3;
+
+	StrFreeStrings(ppszTokens);
+
+	int iError = 0;
+	char const *pszSmtpError = NULL;
+
+	if (SMTPS.iSMTPState == stateRcpt) {
+		if ((iError = SMTPBeginData(hBSock, SMTPS)) == 0) {
+			SMTPS.iDataNL = 1;
+			SMTPS.iSMTPState = stateBdat;
+		}
+	} else if (SMTPS.iSMTPState != stateBdat) {
+		pszSmtpError = "503 Bad sequence of commands";
+
+		ErrSetErrorCode(iError = ERR_SMTP_BAD_CMD_SEQUENCE);
+	}
+	if (SMTPReadChunk(hBSock, SMTPS, ullChunkSize, iError, pszSmtpError) < 0) {
+		ErrorPush();
+		if (ErrorFetch() == ERR_SERVER_SHUTDOWN)
+			SMTPResetSession(SMTPS);
 		else
+			SMTPS.iSMTPState = stateExit;
+		return ErrorPop();
+	}
+	/* Errors raised by SMTPBeginData() have already been notified */
+	if (SMTPS.iSMTPState != stateBdat) {
+		if (pszSmtpError != NULL) {
+			SMTPResetSession(SMTPS);
+
 			SMTPSendError(hBSock, SMTPS, "%s", pszSmtpError);
+		}
+		return iError;
 	}
+	if (!iLastChunk && iError == 0) {
+		BSckVSendString(hBSock, SMTPS.pSMTPCfg->iTimeout,
+				"250 " SYS_LLU_FMT " octets received", ullChunkSize);
+		return 0;
+	}
+	/* Make sure the spooled message ends with a CRLF */
+	if (iError == 0 && !SMTPS.iDataNL && StrWriteCRLFString(SMTPS.pMsgFile, "") < 0)
+		iError = ErrGetErrorCode();
 
-	return iError;
+	return SMTPEndData(hBSock, SMTPS, iError, pszSmtpError);
 }
 
 static int SMTPHandleCmd_HELO(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSession &SMTPS)
@@ -2276,6 +2806,8 @@ static int SMTPHandleCmd_EHLO(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPS
 		  "250 ETRN\r\n"
 		  "250 8BITMIME\r\n"
 		  "250 PIPELINING\r\n");
+	if (SvrTestConfigFlag("EnableSMTP-CHUNKING", true, SMTPS.hSvrConfig))
+		StrDynAdd(&DynS, "250 CHUNKING\r\n");
 
 	/* Emit external authentication methods */
 	SMTPListAuths(&DynS, SMTPS, iLinkSSL);
@@ -2348,7 +2880,17 @@ static int SMTPHandleCmd_STARTTLS(char const *pszCommand, BSOCK_HANDLE hBSock, S
 		return ErrorPop();
 	}
 
-	BSckSendString(hBSock, "220 Ready to start TLS", SMTPS.pSMTPCfg->iTimeout);
+	/*
+	 * The TLS negotiation bypasses the socket bufferer, so the reply needs
+	 * to be on the wire before we start it.
+	 */
+	if (BSckSendString(hBSock, "220 Ready to start TLS", SMTPS.pSMTPCfg->iTimeout) < 0 ||
+	    BSckFlush(hBSock, SMTPS.pSMTPCfg->iTimeout) < 0) {
+		ErrorPush();
+		CSslBindCleanup(&SSLB);
+		SMTPS.iSMTPState = stateExit;
+		return ErrorPop();
+	}
 
 	iError = BSslBindServer(hBSock, &SSLB, SMTPSslEnvCB, &SMTPS);
 
@@ -3152,6 +3694,8 @@ static int SMTPHandleCommand(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSe
 		iError = SMTPHandleCmd_RCPT(pszCommand, hBSock, SMTPS);
 	else if (StrCmdMatch(pszCommand, "DATA"))
 		iError = SMTPHandleCmd_DATA(pszCommand, hBSock, SMTPS);
+	else if (StrCmdMatch(pszCommand, "BDAT"))
+		iError = SMTPHandleCmd_BDAT(pszCommand, hBSock, SMTPS);
 	else if (StrCmdMatch(pszCommand, "HELO"))
 		iError = SMTPHandleCmd_HELO(pszCommand, hBSock, SMTPS);
 	else if (StrCmdMatch(pszCommand, "EHLO"))
@@ -3178,11 +3722,78 @@ static int SMTPHandleCommand(char const *pszCommand, BSOCK_HANDLE hBSock, SMTPSe
 	return iError;
 }
 
+static void SMTPEndSession(SMTPSession *pSMTPS)
+{
+	char szIP[128] = "???.???.???.???";
+
+	SysLogMessage(LOG_LEV_MESSAGE, "SMTP client exit [%s]\n",
+		      SysInetNToA(pSMTPS->PeerInfo, szIP, sizeof(szIP)));
+
+	SMTPThreadCountAdd(-1, pSMTPS->pThCfg->hThShb);
+	SMTPClearSession(*pSMTPS);
+
+	/* Unlink socket from the bufferer and close it */
+	BSckDetach(pSMTPS->hBSock, 1);
+	SysFree(pSMTPS);
+}
+
+static int SMTPResumeSession(void *pPrivate, int iEvent);
+
+static int SMTPSessionLoop(SMTPSession &SMTPS, bool bCanPark)
+{
+	char szCommand[1024] = "";
+
+	while (!SvrInShutdown() && SMTPS.iSMTPState != stateExit) {
+		if (SMTPS.pThCfg->ulFlags & THCF_SHUTDOWN)
+			break;
+
+		/*
+		 * If the client has nothing for us yet, do not keep this thread
+		 * blocked on it. The connection engine will resume the session
+		 * on a new thread once there is something to read (so a resumed
+		 * session goes straight to read the command).
+		 */
+		if (bCanPark && CEngEnabled() && !BSckInputPending(SMTPS.hBSock) &&
+		    BSckFlush(SMTPS.hBSock, SMTPS.pSMTPCfg->iTimeout) == 0 &&
+		    CEngPark(BSckGetAttachedSocket(SMTPS.hBSock),
+			     SMTPS.pSMTPCfg->iSessionTimeout, SMTPResumeSession,
+			     &SMTPS) == 0)
+			return 1;
+		bCanPark = true;
+
+		if (BSckGetString(SMTPS.hBSock, szCommand, sizeof(szCommand) - 1,
+				  SMTPS.pSMTPCfg->iSessionTimeout) == NULL ||
+		    MscCmdStringCheck(szCommand) < 0)
+			break;
+
+		/* Handle command */
+		SMTPHandleCommand(szCommand, SMTPS.hBSock, SMTPS);
+	}
+
+	return 0;
+}
+
+static int SMTPResumeSession(void *pPrivate, int iEvent)
+{
+	SMTPSession *pSMTPS = (SMTPSession *) pPrivate;
+
+	if (iEvent == CENG_EV_READ && SMTPSessionLoop(*pSMTPS, false) > 0)
+		return 0;
+	SMTPEndSession(pSMTPS);
+
+	return 0;
+}
+
 static int SMTPHandleSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock)
 {
 	/* Session structure declaration and init */
 	char *pszSMTPError = NULL;
-	SMTPSession SMTPS;
+	SMTPSession *pSMTPS = (SMTPSession *) SysAlloc(sizeof(SMTPSession));
+
+	if (pSMTPS == NULL)
+		return ErrGetErrorCode();
+
+	SMTPSession &SMTPS = *pSMTPS;
 
 	if (SMTPInitSession(pThCfg, hBSock, SMTPS, pszSMTPError) < 0) {
 		ErrorPush();
@@ -3194,6 +3805,7 @@ static int SMTPHandleSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock)
 			BSckVSendString(hBSock, STD_SMTP_TIMEOUT,
 					"421 %s service not available (%d), closing transmission channel",
 					SMTP_SERVER_NAME, ErrorFetch());
+		SysFree(pSMTPS);
 
 		return ErrorPop();
 	}
@@ -3213,26 +3825,23 @@ static int SMTPHandleSession(ThreadConfig const *pThCfg, BSOCK_HANDLE hBSock)
 			    SMTPS.szTimeStamp, SMTP_SERVER_NAME, szTime) < 0) {
 		ErrorPush();
 		SMTPClearSession(SMTPS);
+		SysFree(pSMTPS);
 		return ErrorPop();
 	}
-	/* Command loop */
-	char szCommand[1024] = "";
-
-	while (!SvrInShutdown() && SMTPS.iSMTPState != stateExit &&
-	       BSckGetString(hBSock, szCommand, sizeof(szCommand) - 1,
-			     SMTPS.pSMTPCfg->iSessionTimeout) != NULL &&
-	       MscCmdStringCheck(szCommand) == 0) {
-		if (pThCfg->ulFlags & THCF_SHUTDOWN)
-			break;
-
-		/* Handle command */
-		SMTPHandleCommand(szCommand, hBSock, SMTPS);
-	}
-
-	SysLogMessage(LOG_LEV_MESSAGE, "SMTP client exit [%s]\n",
-		      SysInetNToA(SMTPS.PeerInfo, szIP, sizeof(szIP)));
+	/*
+	 * Responses are corked (PIPELINING, RFC2920), and they are flushed
+	 * only once we consumed all the commands the client sent us, that is,
+	 * right before we need to wait for more input.
+	 */
+	BSckCork(hBSock);
 
-	SMTPClearSession(SMTPS);
+	/*
+	 * From now on the session owns the socket and the thread count slot,
+	 * and it will release them in SMTPEndSession().
+	 */
+	SMTPS.hBSock = hBSock;
+	if (SMTPSessionLoop(SMTPS, true) == 0)
+		SMTPEndSession(pSMTPS);
 
 	return 0;
 }
@@ -3298,13 +3907,13 @@ unsigned int SMTPClientThread(void *pThreadData)
 	}
 
 	/* Handle client session */
-	SMTPHandleSession(pThCtx->pThCfg, hBSock);
-
-	/* Decrease threads count */
-	SMTPThreadCountAdd(-1, pThCtx->pThCfg->hThShb);
+	if (SMTPHandleSession(pThCtx->pThCfg, hBSock) < 0) {
+		/* Decrease threads count */
+		SMTPThreadCountAdd(-1, pThCtx->pThCfg->hThShb);
 
-	/* Unlink socket from the bufferer and close it */
-	BSckDetach(hBSock, 1);
+		/* Unlink socket from the bufferer and close it */
+		BSckDetach(hBSock, 1);
+	}
 	SysFree(pThCtx);
 
 	return 0;
@@ -59,9 +59,11 @@
 #define SPAMMERS_LINE_MAX       512
 #define SPAM_ADDRESS_LINE_MAX   512
 #define SMTPAUTH_LINE_MAX       512
+#define SMTP_HOST_HASH_INIT     64
 
 #define SMTPCH_SUPPORT_SIZE     (1 << 0)
 #define SMTPCH_SUPPORT_TLS      (1 << 1)
+#define SMTPCH_SUPPORT_PIPELINING (1 << 2)
 
 enum SmtpGwFileds {
 	gwDomain = 0,
@@ -100,6 +102,10 @@ struct SmtpMXRecords {
 };
 
 struct SmtpChannel {
+	SysListHead LLink;
+	char *pszCacheKey;
+	int iMsgCount;
+	time_t tIdleTime;
 	BSOCK_HANDLE hBSock;
 	unsigned long ulFlags;
 	unsigned long ulMaxMsgSize;
@@ -108,6 +114,12 @@ struct SmtpChannel {
 	char *pszDomain;
 };
 
+struct SmtpHostStatus {
+	HashNode HN;
+	time_t tExpire;
+	char *pszHost;
+};
+
 
 static int USmtpGetResponse(BSOCK_HANDLE hBSock, char *pszResponse, size_t sMaxResponse,
 			    int iTimeout = STD_SMTP_TIMEOUT);
@@ -115,6 +127,17 @@ static int USmtpSendCommand(BSOCK_HANDLE hBSock, char const *pszCommand,
 			    char *pszResponse, size_t sMaxResponse,
 			    int iTimeout = STD_SMTP_TIMEOUT);
 
+static SYS_MUTEX hChCacheMutex = SYS_INVALID_MUTEX;
+static SysListHead ChCacheList;
+static int iChCacheCount;
+static int iChCacheMax;
+static int iChMaxIdle;
+static int iChMaxMsgs;
+static SYS_MUTEX hHstCacheMutex = SYS_INVALID_MUTEX;
+static HASH_HANDLE hHstCacheHash = INVALID_HASH_HANDLE;
+static int iHstDownExpire;
+static time_t tHstNextSweep;
+
 static char *USmtpGetGwTableFilePath(char *pszGwFilePath, size_t sMaxPath)
 {
 	CfgGetRootPath(pszGwFilePath, sMaxPath);
@@ -1120,6 +1143,8 @@ static int USmtpParseEhloResponse(SmtpChannel *pSmtpCh, char const *pszResponse)
 				pSmtpCh->ulMaxMsgSize = (unsigned long) atol(pszLine + 5);
 		} else if (StrCmdMatch(pszLine, "STARTTLS")) {
 			pSmtpCh->ulFlags |= SMTPCH_SUPPORT_TLS;
+		} else if (StrCmdMatch(pszLine, "PIPELINING")) {
+			pSmtpCh->ulFlags |= SMTPCH_SUPPORT_PIPELINING;
 		}
 	}
 
@@ -1176,7 +1201,19 @@ static int USmtpSwitchToSSL(SmtpChannel *pSmtpCh, SMTPGateway const *pGw, SMTPEr
 		return ErrGetErrorCode();
 	ZeroData(SslE);
 
-	iError = BSslBindClient(pSmtpCh->hBSock, &SSLB, USmtpSslEnvCB, &SslE);
+	/*
+	 * TLS sessions are cached by remote host name and address, so that
+	 * subsequent deliveries to the same MX can resume them and skip the
+	 * full handshake.
+	 */
+	char szAddrStr[256] = "", szSessKey[MAX_HOST_NAME + 256] = "";
+
+	MscGetAddrString(pSmtpCh->SvrAddr, szAddrStr, sizeof(szAddrStr) - 1);
+	SysSNPrintf(szSessKey, sizeof(szSessKey) - 1, "smtp:%s/%s",
+		    pSmtpCh->pszServer, szAddrStr);
+
+	iError = BSslBindClient(pSmtpCh->hBSock, &SSLB, USmtpSslEnvCB, &SslE,
+				szSessKey);
 
 	CSslBindCleanup(&SSLB);
 	/*
@@ -1191,18 +1228,150 @@ static int USmtpSwitchToSSL(SmtpChannel *pSmtpCh, SMTPGateway const *pGw, SMTPEr
 
 static void USmtpCleanEHLO(SmtpChannel *pSmtpCh)
 {
-	pSmtpCh->ulFlags &= ~(SMTPCH_SUPPORT_SIZE | SMTPCH_SUPPORT_TLS);
+	pSmtpCh->ulFlags &= ~(SMTPCH_SUPPORT_SIZE | SMTPCH_SUPPORT_TLS |
+			      SMTPCH_SUPPORT_PIPELINING);
 	pSmtpCh->ulMaxMsgSize = 0;
 }
 
 static void USmtpFreeChannel(SmtpChannel *pSmtpCh)
 {
 	BSckDetach(pSmtpCh->hBSock, 1);
+	SysFree(pSmtpCh->pszCacheKey);
 	SysFree(pSmtpCh->pszServer);
 	SysFree(pSmtpCh->pszDomain);
 	SysFree(pSmtpCh);
 }
 
+static char *USmtpHostKey(SYS_INET_ADDR const &SvrAddr, char *pszKey, size_t sMaxKey)
+{
+	char szIP[128] = "";
+
+	SysSNPrintf(pszKey, sMaxKey - 1, "%s:%d", SysInetNToA(SvrAddr, szIP, sizeof(szIP)),
+		    SysGetAddrPort(SvrAddr));
+
+	return pszKey;
+}
+
+static void USmtpFreeHostStatus(void *pPrivate, HashNode *pHNode)
+{
+	SmtpHostStatus *pHS = SYS_LIST_ENTRY(pHNode, SmtpHostStatus, HN);
+
+	SysFree(pHS->pszHost);
+	SysFree(pHS);
+}
+
+static SmtpHostStatus *USmtpFindHostStatus(char const *pszKey)
+{
+	HashDatum Key;
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	Key.pData = (void *) pszKey;
+	if (HashGetFirst(hHstCacheHash, &Key, &HEnum, &pHNode) < 0)
+		return NULL;
+
+	return SYS_LIST_ENTRY(pHNode, SmtpHostStatus, HN);
+}
+
+static void USmtpSweepHostCache(time_t tCurr)
+{
+	HashEnum HEnum;
+	HashNode *pHNode;
+
+	if (HashFirst(hHstCacheHash, &HEnum, &pHNode) == 0) {
+		do {
+			SmtpHostStatus *pHS = SYS_LIST_ENTRY(pHNode, SmtpHostStatus, HN);
+
+			if (tCurr >= pHS->tExpire) {
+				HashDel(hHstCacheHash, pHNode);
+				USmtpFreeHostStatus(NULL, pHNode);
+			}
+		} while (HashNext(hHstCacheHash, &HEnum, &pHNode) == 0);
+	}
+	tHstNextSweep = tCurr + iHstDownExpire;
+}
+
+static int USmtpHostIsDown(SYS_INET_ADDR const &SvrAddr)
+{
+	int iDown;
+	SmtpHostStatus *pHS;
+	char szKey[256];
+
+	if (hHstCacheHash == INVALID_HASH_HANDLE)
+		return 0;
+	USmtpHostKey(SvrAddr, szKey, sizeof(szKey));
+	if (SysLockMutex(hHstCacheMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return 0;
+	iDown = (pHS = USmtpFindHostStatus(szKey)) != NULL && time(NULL) < pHS->tExpire;
+	SysUnlockMutex(hHstCacheMutex);
+
+	return iDown;
+}
+
+static void USmtpSetHostDown(SYS_INET_ADDR const &SvrAddr)
+{
+	time_t tCurr = time(NULL);
+	SmtpHostStatus *pHS;
+	char szKey[256];
+
+	if (hHstCacheHash == INVALID_HASH_HANDLE)
+		return;
+	USmtpHostKey(SvrAddr, szKey, sizeof(szKey));
+	if (SysLockMutex(hHstCacheMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return;
+	if (tCurr >= tHstNextSweep)
+		USmtpSweepHostCache(tCurr);
+	if ((pHS = USmtpFindHostStatus(szKey)) == NULL &&
+	    (pHS = (SmtpHostStatus *) SysAlloc(sizeof(SmtpHostStatus))) != NULL) {
+		HashInitNode(&pHS->HN);
+		if ((pHS->pszHost = SysStrDup(szKey)) == NULL) {
+			SysFree(pHS);
+			pHS = NULL;
+		} else {
+			pHS->HN.Key.pData = pHS->pszHost;
+			if (HashAdd(hHstCacheHash, &pHS->HN) < 0) {
+				USmtpFreeHostStatus(NULL, &pHS->HN);
+				pHS = NULL;
+			}
+		}
+	}
+	if (pHS != NULL)
+		pHS->tExpire = tCurr + iHstDownExpire;
+	SysUnlockMutex(hHstCacheMutex);
+}
+
+int USmtpInitHostCache(int iDownExpire)
+{
+	HashOps HOps;
+
+	if ((iHstDownExpire = iDownExpire) <= 0)
+		return 0;
+	if ((hHstCacheMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
+		return ErrGetErrorCode();
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((hHstCacheHash = HashCreate(&HOps, SMTP_HOST_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		SysCloseMutex(hHstCacheMutex);
+		hHstCacheMutex = SYS_INVALID_MUTEX;
+		return ErrorPop();
+	}
+	tHstNextSweep = time(NULL) + iHstDownExpire;
+
+	return 0;
+}
+
+void USmtpCleanupHostCache(void)
+{
+	if (hHstCacheHash != INVALID_HASH_HANDLE) {
+		HashFree(hHstCacheHash, USmtpFreeHostStatus, NULL);
+		hHstCacheHash = INVALID_HASH_HANDLE;
+		SysCloseMutex(hHstCacheMutex);
+		hHstCacheMutex = SYS_INVALID_MUTEX;
+	}
+}
+
 SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain, SMTPError *pSMTPE)
 {
 	/* Decode server address */
@@ -1217,6 +1386,16 @@ SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain,
 	if (MscGetServerAddress(szAddress, SvrAddr, iPortNo) < 0)
 		return INVALID_SMTPCH_HANDLE;
 
+	/*
+	 * Do not burn a mailer thread for a whole connect timeout on a server
+	 * that failed us a short while ago. The caller will move to the next
+	 * MX, or defer the message if none is left.
+	 */
+	if (USmtpHostIsDown(SvrAddr)) {
+		ErrSetErrorCode(ERR_SMTP_HOST_DOWN, pGw->pszHost);
+		return INVALID_SMTPCH_HANDLE;
+	}
+
 	SYS_SOCKET SockFD = SysCreateSocket(SysGetAddrFamily(SvrAddr), SOCK_STREAM, 0);
 
 	if (SockFD == SYS_INVALID_SOCKET)
@@ -1235,7 +1414,10 @@ SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain,
 		}
 	}
 	if (SysConnect(SockFD, &SvrAddr, STD_SMTP_TIMEOUT) < 0) {
+		ErrorPush();
 		SysCloseSocket(SockFD);
+		USmtpSetHostDown(SvrAddr);
+		ErrorPop();
 		return INVALID_SMTPCH_HANDLE;
 	}
 
@@ -1270,6 +1452,9 @@ SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain,
 		BSckDetach(hBSock, 1);
 		return INVALID_SMTPCH_HANDLE;
 	}
+	SYS_INIT_LIST_LINK(&pSmtpCh->LLink);
+	pSmtpCh->pszCacheKey = NULL;
+	pSmtpCh->iMsgCount = 0;
 	pSmtpCh->hBSock = hBSock;
 	pSmtpCh->ulFlags = 0;
 	pSmtpCh->ulMaxMsgSize = 0;
@@ -1289,7 +1474,19 @@ SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain,
 					      pSmtpCh->pszServer);
 			ErrSetErrorCode(ERR_BAD_SERVER_RESPONSE, szRTXBuffer);
 		}
+
+		/*
+		 * A server that answered, even with an error, is not down. Its
+		 * reply must reach the caller, since a 5xx greeting is a permanent
+		 * failure that must not turn into a host down deferral.
+		 */
+		bool bHostDown = iSvrReponse <= 0 && ErrGetErrorCode() == ERR_TIMEOUT;
+
+		ErrorPush();
 		USmtpFreeChannel(pSmtpCh);
+		if (bHostDown)
+			USmtpSetHostDown(SvrAddr);
+		ErrorPop();
 
 		return INVALID_SMTPCH_HANDLE;
 	}
@@ -1381,6 +1578,158 @@ int USmtpCloseChannel(SMTPCH_HANDLE hSmtpCh, int iHardClose, SMTPError *pSMTPE)
 	return 0;
 }
 
+static int USmtpRcptsError(SmtpChannel *pSmtpCh, SMTPRecipient *pRcpts, int iRcptCount,
+			   int iSvrReponse, char const *pszResponse, int iErrorCode)
+{
+	/*
+	 * Fail all the recipients still pending inside the transaction. If we
+	 * do not have a server response (I/O error), the error code is the one
+	 * already set by the lower layers.
+	 */
+	if (iSvrReponse > 0)
+		ErrSetErrorCode(iErrorCode, pszResponse);
+	else
+		iErrorCode = ErrGetErrorCode();
+	for (int i = 0; i < iRcptCount; i++) {
+		if (pRcpts[i].iError < 0)
+			continue;
+		if (iSvrReponse > 0 && pRcpts[i].pSMTPE != NULL)
+			USmtpSetError(pRcpts[i].pSMTPE, iSvrReponse, pszResponse,
+				      pSmtpCh->pszServer);
+		pRcpts[i].iError = iErrorCode;
+	}
+
+	return iErrorCode;
+}
+
+static int USmtpCheckResponse(SmtpChannel *pSmtpCh, int iSvrReponse, int iResponseClass,
+			      char const *pszResponse, int iErrorCode,
+			      SMTPRecipient *pRcpts, int iRcptCount)
+{
+	if (!USmtpResponseClass(iSvrReponse, iResponseClass))
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, iSvrReponse,
+				       pszResponse, iErrorCode);
+
+	return 0;
+}
+
+static int USmtpQueueEnvelope(SmtpChannel *pSmtpCh, char const *pszMailCmd,
+			      SMTPRecipient const *pRcpts, int iRcptCount)
+{
+	int i;
+	char szRTXBuffer[2048] = "";
+
+	if (BSckSendString(pSmtpCh->hBSock, pszMailCmd, STD_SMTP_TIMEOUT) <= 0)
+		return ErrGetErrorCode();
+	for (i = 0; i < iRcptCount; i++) {
+		SysSNPrintf(szRTXBuffer, sizeof(szRTXBuffer) - 1, "RCPT TO:<%s>",
+			    pRcpts[i].pszRcpt);
+		if (BSckSendString(pSmtpCh->hBSock, szRTXBuffer, STD_SMTP_TIMEOUT) <= 0)
+			return ErrGetErrorCode();
+	}
+	if (BSckSendString(pSmtpCh->hBSock, "DATA", STD_SMTP_TIMEOUT) <= 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
+static int USmtpPipeEnvelope(SmtpChannel *pSmtpCh, char const *pszMailCmd,
+			     SMTPRecipient *pRcpts, int iRcptCount)
+{
+	/*
+	 * RFC2920 - The MAIL FROM, RCPT TO and DATA commands are sent in one
+	 * batch, and the responses are then collected in order. All of them
+	 * need to be read to keep the link in sync. A MAIL FROM failure fails
+	 * the whole transaction, while a RCPT TO failure only fails the
+	 * recipient it refers to.
+	 */
+	int i, iError, iSvrReponse, iAccepted = 0;
+	char szRTXBuffer[2048] = "";
+
+	/*
+	 * The socket is corked only while the envelope is queued, so that the
+	 * whole batch leaves in as few segments as possible. The message body
+	 * that follows is streamed directly.
+	 */
+	if (BSckCork(pSmtpCh->hBSock) < 0)
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, -1, NULL, 0);
+	iError = USmtpQueueEnvelope(pSmtpCh, pszMailCmd, pRcpts, iRcptCount);
+	if (BSckUncork(pSmtpCh->hBSock, STD_SMTP_TIMEOUT) < 0 || iError < 0)
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, -1, NULL, 0);
+
+	if ((iSvrReponse = USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer,
+					    sizeof(szRTXBuffer) - 1)) < 0)
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, iSvrReponse, NULL, 0);
+	USmtpCheckResponse(pSmtpCh, iSvrReponse, 200, szRTXBuffer, ERR_SMTP_BAD_MAIL_FROM,
+			   pRcpts, iRcptCount);
+
+	for (i = 0; i < iRcptCount; i++) {
+		if ((iSvrReponse = USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer,
+						    sizeof(szRTXBuffer) - 1)) < 0)
+			return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, iSvrReponse,
+					       NULL, 0);
+		if (pRcpts[i].iError == 0 &&
+		    USmtpCheckResponse(pSmtpCh, iSvrReponse, 200, szRTXBuffer,
+				       ERR_SMTP_BAD_RCPT_TO, &pRcpts[i], 1) == 0)
+			iAccepted++;
+	}
+
+	if ((iSvrReponse = USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer,
+					    sizeof(szRTXBuffer) - 1)) < 0)
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, iSvrReponse, NULL, 0);
+	if (iAccepted > 0)
+		return USmtpCheckResponse(pSmtpCh, iSvrReponse, 300, szRTXBuffer,
+					  ERR_SMTP_BAD_DATA, pRcpts, iRcptCount);
+
+	/*
+	 * The envelope failed, but the server might still have accepted the
+	 * DATA command. In that case we need to close the (empty) message body
+	 * and discard the server response.
+	 */
+	if (USmtpResponseClass(iSvrReponse, 300) &&
+	    (BSckSendString(pSmtpCh->hBSock, ".", STD_SMTP_TIMEOUT) <= 0 ||
+	     USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer, sizeof(szRTXBuffer) - 1) < 0))
+		return ErrGetErrorCode();
+
+	return pRcpts[0].iError;
+}
+
+static int USmtpSendEnvelope(SmtpChannel *pSmtpCh, char const *pszMailCmd,
+			     SMTPRecipient *pRcpts, int iRcptCount)
+{
+	int i, iError, iSvrReponse, iAccepted = 0;
+	char szRTXBuffer[2048] = "";
+
+	/* Send MAIL FROM: and read result */
+	if ((iError = USmtpCheckResponse(pSmtpCh,
+					 USmtpSendCommand(pSmtpCh->hBSock, pszMailCmd,
+							  szRTXBuffer, sizeof(szRTXBuffer) - 1),
+					 200, szRTXBuffer, ERR_SMTP_BAD_MAIL_FROM,
+					 pRcpts, iRcptCount)) < 0)
+		return iError;
+
+	/* Send RCPT TO: and read result */
+	for (i = 0; i < iRcptCount; i++) {
+		SysSNPrintf(szRTXBuffer, sizeof(szRTXBuffer) - 1, "RCPT TO:<%s>",
+			    pRcpts[i].pszRcpt);
+		if ((iSvrReponse = USmtpSendCommand(pSmtpCh->hBSock, szRTXBuffer, szRTXBuffer,
+						    sizeof(szRTXBuffer) - 1)) < 0)
+			return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, iSvrReponse,
+					       NULL, 0);
+		if (USmtpCheckResponse(pSmtpCh, iSvrReponse, 200, szRTXBuffer,
+				       ERR_SMTP_BAD_RCPT_TO, &pRcpts[i], 1) == 0)
+			iAccepted++;
+	}
+	if (iAccepted == 0)
+		return pRcpts[0].iError;
+
+	/* Send DATA and read the "ready to receive" */
+	return USmtpCheckResponse(pSmtpCh,
+				  USmtpSendCommand(pSmtpCh->hBSock, "DATA",
+						   szRTXBuffer, sizeof(szRTXBuffer) - 1),
+				  300, szRTXBuffer, ERR_SMTP_BAD_DATA, pRcpts, iRcptCount);
+}
+
 int USmtpChannelReset(SMTPCH_HANDLE hSmtpCh, SMTPError *pSMTPE)
 {
 	SmtpChannel *pSmtpCh = (SmtpChannel *) hSmtpCh;
@@ -1405,128 +1754,285 @@ int USmtpChannelReset(SMTPCH_HANDLE hSmtpCh, SMTPError *pSMTPE)
 	return 0;
 }
 
-int USmtpSendMail(SMTPCH_HANDLE hSmtpCh, char const *pszFrom, char const *pszRcpt,
-		  FileSection const *pFS, SMTPError *pSMTPE)
+int USmtpSendMail(SMTPCH_HANDLE hSmtpCh, char const *pszFrom, SMTPRecipient *pRcpts,
+		  int iRcptCount, FileSection const *pFS)
 {
 	SmtpChannel *pSmtpCh = (SmtpChannel *) hSmtpCh;
+	int i, iError;
+
+	pSmtpCh->iMsgCount++;
+	for (i = 0; i < iRcptCount; i++)
+		pRcpts[i].iError = 0;
 
 	/* Check message size ( if the remote server support the SIZE extension ) */
 	SYS_OFF_T llMessageSize = 0;
 
 	if (pSmtpCh->ulMaxMsgSize != 0) {
 		if (MscGetSectionSize(pFS, &llMessageSize) < 0)
-			return ErrGetErrorCode();
-
-		if (llMessageSize >= (SYS_OFF_T) pSmtpCh->ulMaxMsgSize) {
-			if (pSMTPE != NULL)
-				USmtpSetError(pSMTPE, SMTP_FATAL_ERROR,
-					      ErrGetErrorString(ERR_SMTPSRV_MSG_SIZE),
-					      pSmtpCh->pszServer);
+			return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, -1, NULL, 0);
 
-			ErrSetErrorCode(ERR_SMTPSRV_MSG_SIZE);
-			return ERR_SMTPSRV_MSG_SIZE;
-		}
+		if (llMessageSize >= (SYS_OFF_T) pSmtpCh->ulMaxMsgSize)
+			return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, SMTP_FATAL_ERROR,
+					       ErrGetErrorString(ERR_SMTPSRV_MSG_SIZE),
+					       ERR_SMTPSRV_MSG_SIZE);
 	}
-	/* Send MAIL FROM: and read result */
+	/* Build the MAIL FROM: command */
 	int iSvrReponse = -1;
 	char szRTXBuffer[2048] = "";
 
 	if (pSmtpCh->ulFlags & SMTPCH_SUPPORT_SIZE) {
 		if (llMessageSize == 0 && MscGetSectionSize(pFS, &llMessageSize) < 0)
-			return ErrGetErrorCode();
+			return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, -1, NULL, 0);
 
 		SysSNPrintf(szRTXBuffer, sizeof(szRTXBuffer) - 1,
 			    "MAIL FROM:<%s> SIZE=" SYS_OFFT_FMT, pszFrom, llMessageSize);
 	} else
 		SysSNPrintf(szRTXBuffer, sizeof(szRTXBuffer) - 1, "MAIL FROM:<%s>", pszFrom);
 
-	if (!USmtpResponseClass(iSvrReponse = USmtpSendCommand(pSmtpCh->hBSock, szRTXBuffer,
-							       szRTXBuffer,
-							       sizeof(szRTXBuffer) - 1), 200)) {
-		if (iSvrReponse > 0) {
-			if (pSMTPE != NULL)
-				USmtpSetError(pSMTPE, iSvrReponse, szRTXBuffer,
-					      pSmtpCh->pszServer);
-			ErrSetErrorCode(ERR_SMTP_BAD_MAIL_FROM, szRTXBuffer);
-		}
+	if (pSmtpCh->ulFlags & SMTPCH_SUPPORT_PIPELINING)
+		iError = USmtpPipeEnvelope(pSmtpCh, szRTXBuffer, pRcpts, iRcptCount);
+	else
+		iError = USmtpSendEnvelope(pSmtpCh, szRTXBuffer, pRcpts, iRcptCount);
+	if (iError < 0)
+		return iError;
 
-		return ErrGetErrorCode();
-	}
-	/* Send RCPT TO: and read result */
-	SysSNPrintf(szRTXBuffer, sizeof(szRTXBuffer) - 1, "RCPT TO:<%s>", pszRcpt);
-
-	if (!USmtpResponseClass(iSvrReponse = USmtpSendCommand(pSmtpCh->hBSock, szRTXBuffer,
-							       szRTXBuffer,
-							       sizeof(szRTXBuffer) - 1), 200)) {
-		if (iSvrReponse > 0) {
-			if (pSMTPE != NULL)
-				USmtpSetError(pSMTPE, iSvrReponse, szRTXBuffer,
-					      pSmtpCh->pszServer);
-			ErrSetErrorCode(ERR_SMTP_BAD_RCPT_TO, szRTXBuffer);
-		}
-
-		return ErrGetErrorCode();
-	}
-	/* Send DATA and read the "ready to receive" */
-	if (!USmtpResponseClass(iSvrReponse = USmtpSendCommand(pSmtpCh->hBSock, "DATA",
-							       szRTXBuffer,
-							       sizeof(szRTXBuffer) - 1), 300)) {
-		if (iSvrReponse > 0) {
-			if (pSMTPE != NULL)
-				USmtpSetError(pSMTPE, iSvrReponse, szRTXBuffer,
-					      pSmtpCh->pszServer);
-			ErrSetErrorCode(ERR_SMTP_BAD_DATA, szRTXBuffer);
-		}
-
-		return ErrGetErrorCode();
-	}
 	/* Send file and END OF DATA */
 	if (BSckSendFile(pSmtpCh->hBSock, pFS->szFilePath, pFS->llStartOffset,
 			 pFS->llEndOffset, STD_SMTP_TIMEOUT) < 0 ||
+	    (!IsEmptyString(pFS->szTailFilePath) &&
+	     BSckSendFile(pSmtpCh->hBSock, pFS->szTailFilePath, 0, (SYS_OFF_T) -1,
+			  STD_SMTP_TIMEOUT) < 0) ||
 	    BSckSendString(pSmtpCh->hBSock, ".", STD_SMTP_TIMEOUT) <= 0)
-		return ErrGetErrorCode();
+		return USmtpRcptsError(pSmtpCh, pRcpts, iRcptCount, -1, NULL, 0);
 
-	if (!USmtpResponseClass(iSvrReponse = USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer,
-							       sizeof(szRTXBuffer) - 1), 200)) {
-		if (iSvrReponse > 0) {
-			if (pSMTPE != NULL)
-				USmtpSetError(pSMTPE, iSvrReponse, szRTXBuffer,
-					      pSmtpCh->pszServer);
-			ErrSetErrorCode(ERR_BAD_SERVER_RESPONSE, szRTXBuffer);
-		}
+	if ((iError = USmtpCheckResponse(pSmtpCh,
+					 iSvrReponse = USmtpGetResponse(pSmtpCh->hBSock, szRTXBuffer,
+									sizeof(szRTXBuffer) - 1),
+					 200, szRTXBuffer, ERR_BAD_SERVER_RESPONSE,
+					 pRcpts, iRcptCount)) < 0)
+		return iError;
 
-		return ErrGetErrorCode();
-	}
 	/*
 	 * Set the final response to the DATA command. This should contain the
 	 * remote MTA message ID, that can be logged and used to track messages.
 	 */
-	if (pSMTPE != NULL)
-		USmtpSetError(pSMTPE, iSvrReponse, szRTXBuffer, pSmtpCh->pszServer);
+	for (i = 0; i < iRcptCount; i++)
+		if (pRcpts[i].iError == 0 && pRcpts[i].pSMTPE != NULL)
+			USmtpSetError(pRcpts[i].pSMTPE, iSvrReponse, szRTXBuffer,
+				      pSmtpCh->pszServer);
 
 	return 0;
 }
 
-int USmtpSendMail(SMTPGateway const *pGw, char const *pszDomain, char const *pszFrom,
-		  char const *pszRcpt, FileSection const *pFS, SMTPError *pSMTPE)
+int USmtpSendMail(SMTPCH_HANDLE hSmtpCh, char const *pszFrom, char const *pszRcpt,
+		  FileSection const *pFS, SMTPError *pSMTPE)
+{
+	SMTPRecipient Rcpt;
+
+	Rcpt.pszRcpt = pszRcpt;
+	Rcpt.pSMTPE = pSMTPE;
+
+	return USmtpSendMail(hSmtpCh, pszFrom, &Rcpt, 1, pFS);
+}
+
+static char *USmtpChannelKey(SMTPGateway const *pGw, char const *pszDomain)
+{
+	/*
+	 * Channels are interchangeable only if they talk to the same server,
+	 * from the same interface, with the same HELO domain and TLS options.
+	 * The AUTH credentials are looked up by server name, so they are
+	 * covered by the host part of the key.
+	 */
+	return StrSprint("%s|%s|%lx|%s", pGw->pszHost,
+			 pGw->pszIFace != NULL ? pGw->pszIFace: "", pGw->ulFlags,
+			 pszDomain != NULL ? pszDomain: "");
+}
+
+static int USmtpChannelInSync(int iError)
+{
+	/*
+	 * Failures reported by the remote server leave the SMTP dialog in a
+	 * known state, while I/O errors and garbled responses do not.
+	 */
+	return iError == 0 || iError == ERR_SMTP_BAD_MAIL_FROM ||
+		iError == ERR_SMTP_BAD_RCPT_TO || iError == ERR_SMTP_BAD_DATA ||
+		iError == ERR_BAD_SERVER_RESPONSE || iError == ERR_SMTPSRV_MSG_SIZE;
+}
+
+static void USmtpCloseChannelList(SysListHead *pHead, int iHardClose)
+{
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_FIRST(pHead)) != NULL) {
+		SmtpChannel *pSmtpCh = SYS_LIST_ENTRY(pLLink, SmtpChannel, LLink);
+
+		SYS_LIST_DEL(pLLink);
+		USmtpCloseChannel((SMTPCH_HANDLE) pSmtpCh, iHardClose);
+	}
+}
+
+static int USmtpChannelExpired(SmtpChannel const *pSmtpCh, time_t tCurr)
+{
+	return tCurr - pSmtpCh->tIdleTime >= iChMaxIdle;
+}
+
+static SmtpChannel *USmtpGetCachedChannel(char const *pszKey)
+{
+	time_t tCurr = time(NULL);
+	SysListHead *pLLink, *pNext, ExpList;
+	SmtpChannel *pSmtpCh, *pCacheCh = NULL;
+
+	SYS_INIT_LIST_HEAD(&ExpList);
+	if (iChCacheMax <= 0 || SysLockMutex(hChCacheMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
+	SYS_LIST_FOR_EACH_SAFE(pLLink, pNext, &ChCacheList) {
+		pSmtpCh = SYS_LIST_ENTRY(pLLink, SmtpChannel, LLink);
+
+		if (USmtpChannelExpired(pSmtpCh, tCurr)) {
+			SYS_LIST_DEL(pLLink);
+			SYS_LIST_ADDT(pLLink, &ExpList);
+			iChCacheCount--;
+		} else if (pCacheCh == NULL && strcmp(pSmtpCh->pszCacheKey, pszKey) == 0) {
+			SYS_LIST_DEL(pLLink);
+			iChCacheCount--;
+			pCacheCh = pSmtpCh;
+		}
+	}
+	SysUnlockMutex(hChCacheMutex);
+
+	/* Say goodbye to the idle channels outside of the cache lock */
+	USmtpCloseChannelList(&ExpList, 0);
+
+	/*
+	 * The remote server might have dropped the connection while it was
+	 * sitting inside the cache, so make sure it is still alive before
+	 * handing it out.
+	 */
+	if (pCacheCh != NULL && USmtpChannelReset((SMTPCH_HANDLE) pCacheCh) < 0) {
+		USmtpCloseChannel((SMTPCH_HANDLE) pCacheCh, 1);
+		pCacheCh = NULL;
+	}
+
+	return pCacheCh;
+}
+
+static int USmtpCacheChannel(SmtpChannel *pSmtpCh)
 {
-	/* Set server host name inside the SMTP error structure */
-	if (pSMTPE != NULL)
-		USmtpSetErrorServer(pSMTPE, pGw->pszHost);
+	SysListHead *pLLink, ExpList;
+
+	if (iChCacheMax <= 0 || pSmtpCh->iMsgCount >= iChMaxMsgs ||
+	    SysLockMutex(hChCacheMutex, SYS_INFINITE_TIMEOUT) < 0) {
+		USmtpCloseChannel((SMTPCH_HANDLE) pSmtpCh);
+		return 0;
+	}
+	SYS_INIT_LIST_HEAD(&ExpList);
+	pSmtpCh->tIdleTime = time(NULL);
+	SYS_LIST_ADDH(&pSmtpCh->LLink, &ChCacheList);
+	iChCacheCount++;
 
-	/* Open STMP channel and try to send the message */
-	SMTPCH_HANDLE hSmtpCh = USmtpCreateChannel(pGw, pszDomain, pSMTPE);
+	/* Evict the least recently used channels if we went over the limit */
+	for (; iChCacheCount > iChCacheMax; iChCacheCount--) {
+		pLLink = SYS_LIST_LAST(&ChCacheList);
+		SYS_LIST_DEL(pLLink);
+		SYS_LIST_ADDT(pLLink, &ExpList);
+	}
+	SysUnlockMutex(hChCacheMutex);
+
+	USmtpCloseChannelList(&ExpList, 0);
 
-	if (hSmtpCh == INVALID_SMTPCH_HANDLE)
+	return 0;
+}
+
+int USmtpInitChannelCache(int iMaxChannels, int iMaxIdle, int iMaxMsgs)
+{
+	if ((hChCacheMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
 		return ErrGetErrorCode();
+	SYS_INIT_LIST_HEAD(&ChCacheList);
+	iChCacheCount = 0;
+	iChCacheMax = iMaxChannels;
+	iChMaxIdle = iMaxIdle;
+	iChMaxMsgs = iMaxMsgs;
+
+	return 0;
+}
+
+void USmtpCleanupChannelCache(void)
+{
+	/*
+	 * We get here at shutdown time, when socket waits are no more allowed,
+	 * so there is no point trying the QUIT dialog.
+	 */
+	if (hChCacheMutex != SYS_INVALID_MUTEX) {
+		USmtpCloseChannelList(&ChCacheList, 1);
+		iChCacheCount = 0;
+		SysCloseMutex(hChCacheMutex);
+		hChCacheMutex = SYS_INVALID_MUTEX;
+	}
+}
+
+int USmtpSendMail(SMTPGateway const *pGw, char const *pszDomain, char const *pszFrom,
+		  SMTPRecipient *pRcpts, int iRcptCount, FileSection const *pFS)
+{
+	int i;
 
-	int iSendResult = USmtpSendMail(hSmtpCh, pszFrom, pszRcpt, pFS, pSMTPE);
+	/* Set server host name inside the SMTP error structures */
+	for (i = 0; i < iRcptCount; i++) {
+		pRcpts[i].iError = 0;
+		if (pRcpts[i].pSMTPE != NULL)
+			USmtpSetErrorServer(pRcpts[i].pSMTPE, pGw->pszHost);
+	}
 
-	USmtpCloseChannel(hSmtpCh, 0, pSMTPE);
+	/* Look for an idle channel to the same server, or open a new one */
+	char *pszKey = iChCacheMax > 0 ? USmtpChannelKey(pGw, pszDomain): NULL;
+	SmtpChannel *pSmtpCh = pszKey != NULL ? USmtpGetCachedChannel(pszKey): NULL;
+
+	if (pSmtpCh == NULL) {
+		SMTPError *pSMTPE = pRcpts[0].pSMTPE;
+		SMTPCH_HANDLE hSmtpCh = USmtpCreateChannel(pGw, pszDomain, pSMTPE);
+
+		if (hSmtpCh == INVALID_SMTPCH_HANDLE) {
+			ErrorPush();
+			SysFree(pszKey);
+
+			/* The connection failure is shared by all the recipients */
+			for (i = 0; i < iRcptCount; i++) {
+				if (i > 0 && pSMTPE != NULL && pRcpts[i].pSMTPE != NULL &&
+				    pSMTPE->pszSTMPResponse != NULL)
+					USmtpSetError(pRcpts[i].pSMTPE, pSMTPE->iSTMPResponse,
+						      pSMTPE->pszSTMPResponse, pGw->pszHost);
+				pRcpts[i].iError = ErrorFetch();
+			}
+
+			return ErrorPop();
+		}
+		pSmtpCh = (SmtpChannel *) hSmtpCh;
+		pSmtpCh->pszCacheKey = pszKey;
+	} else
+		SysFree(pszKey);
+
+	int iSendResult = USmtpSendMail((SMTPCH_HANDLE) pSmtpCh, pszFrom, pRcpts, iRcptCount,
+					pFS);
+
+	if (pSmtpCh->pszCacheKey != NULL && USmtpChannelInSync(iSendResult))
+		USmtpCacheChannel(pSmtpCh);
+	else
+		USmtpCloseChannel((SMTPCH_HANDLE) pSmtpCh, 0,
+				  iRcptCount == 1 ? pRcpts[0].pSMTPE: NULL);
 
 	return iSendResult;
 }
 
+int USmtpSendMail(SMTPGateway const *pGw, char const *pszDomain, char const *pszFrom,
+		  char const *pszRcpt, FileSection const *pFS, SMTPError *pSMTPE)
+{
+	SMTPRecipient Rcpt;
+
+	Rcpt.pszRcpt = pszRcpt;
+	Rcpt.pSMTPE = pSMTPE;
+
+	return USmtpSendMail(pGw, pszDomain, pszFrom, &Rcpt, 1, pFS);
+}
+
 static SMTPGateway *USmtpGetDefaultGateway(SVRCFG_HANDLE hSvrConfig, char const *pszServer)
 {
 	SMTPGateway *pGw;
@@ -1547,22 +2053,39 @@ static SMTPGateway *USmtpGetDefaultGateway(SVRCFG_HANDLE hSvrConfig, char const
 }
 
 int USmtpMailRmtDeliver(SVRCFG_HANDLE hSvrConfig, char const *pszServer, char const *pszDomain,
-			char const *pszFrom, char const *pszRcpt, FileSection const *pFS,
-			SMTPError *pSMTPE)
+			char const *pszFrom, SMTPRecipient *pRcpts, int iRcptCount,
+			FileSection const *pFS)
 {
 	int iError;
 	SMTPGateway *pGw;
 
-	if ((pGw = USmtpGetDefaultGateway(hSvrConfig, pszServer)) == NULL)
-		return ErrGetErrorCode();
+	if ((pGw = USmtpGetDefaultGateway(hSvrConfig, pszServer)) == NULL) {
+		iError = ErrGetErrorCode();
+		for (int i = 0; i < iRcptCount; i++)
+			pRcpts[i].iError = iError;
+
+		return iError;
+	}
 
-	iError = USmtpSendMail(pGw, pszDomain, pszFrom, pszRcpt, pFS, pSMTPE);
+	iError = USmtpSendMail(pGw, pszDomain, pszFrom, pRcpts, iRcptCount, pFS);
 
 	USmtpFreeGateway(pGw);
 
 	return iError;
 }
 
+int USmtpMailRmtDeliver(SVRCFG_HANDLE hSvrConfig, char const *pszServer, char const *pszDomain,
+			char const *pszFrom, char const *pszRcpt, FileSection const *pFS,
+			SMTPError *pSMTPE)
+{
+	SMTPRecipient Rcpt;
+
+	Rcpt.pszRcpt = pszRcpt;
+	Rcpt.pSMTPE = pSMTPE;
+
+	return USmtpMailRmtDeliver(hSvrConfig, pszServer, pszDomain, pszFrom, &Rcpt, 1, pFS);
+}
+
 char *USmtpBuildRcptPath(char const *const *ppszRcptTo, SVRCFG_HANDLE hSvrConfig)
 {
 	int iRcptCount = StrStringsCount(ppszRcptTo);
@@ -1985,6 +2508,7 @@ char *USmtpGetReceived(int iType, char const *pszAuth, char const *const *ppszMs
 	int iError;
 	char szFrom[MAX_SMTP_ADDRESS] = "";
 	char szRcpt[MAX_SMTP_ADDRESS] = "";
+	char szFor[MAX_SMTP_ADDRESS + 16] = "";
 
 	/*
 	 * We allow empty senders. The "szFrom" is already initialized to the empty
@@ -1994,8 +2518,15 @@ char *USmtpGetReceived(int iType, char const *pszAuth, char const *const *ppszMs
 				       sizeof(szFrom) - 1)) < 0 &&
 	    iError != ERR_EMPTY_ADDRESS)
 		return NULL;
-	if (USmlParseAddress(pszRcptTo, NULL, 0, szRcpt, sizeof(szRcpt) - 1) < 0)
-		return NULL;
+	/*
+	 * A NULL recipient is used when the same message body is shared among
+	 * multiple recipients, in which case the "for" clause is omitted.
+	 */
+	if (pszRcptTo != NULL) {
+		if (USmlParseAddress(pszRcptTo, NULL, 0, szRcpt, sizeof(szRcpt) - 1) < 0)
+			return NULL;
+		SysSNPrintf(szFor, sizeof(szFor) - 1, "for <%s> ", szRcpt);
+	}
 
 	/* Parse special types to hide client info */
 	bool bHideClient = false;
@@ -2014,10 +2545,10 @@ char *USmtpGetReceived(int iType, char const *pszAuth, char const *const *ppszMs
 	case RECEIVED_TYPE_STRICT:
 		pszReceived = StrSprint("Received: from %s\r\n"
 					"\tby %s with %s\r\n"
-					"\tid <%s> for <%s> from <%s>;\r\n"
+					"\tid <%s> %sfrom <%s>;\r\n"
 					"\t%s\r\n", ppszMsgInfo[smsgiClientDomain],
 					ppszMsgInfo[smsgiServerDomain],
-					ppszMsgInfo[smsgiSeverName], pszMessageID, szRcpt, szFrom,
+					ppszMsgInfo[smsgiSeverName], pszMessageID, szFor, szFrom,
 					ppszMsgInfo[smsgiTime]);
 		break;
 
@@ -2025,21 +2556,21 @@ char *USmtpGetReceived(int iType, char const *pszAuth, char const *const *ppszMs
 		if (!bHideClient)
 			pszReceived = StrSprint("Received: from %s (%s)\r\n"
 						"\tby %s (%s) with %s\r\n"
-						"\tid <%s> for <%s> from <%s>;\r\n"
+						"\tid <%s> %sfrom <%s>;\r\n"
 						"\t%s\r\n", ppszMsgInfo[smsgiClientDomain],
 						ppszMsgInfo[smsgiClientAddr],
 						ppszMsgInfo[smsgiServerDomain],
 						ppszMsgInfo[smsgiServerAddr],
-						ppszMsgInfo[smsgiSeverName], pszMessageID, szRcpt,
+						ppszMsgInfo[smsgiSeverName], pszMessageID, szFor,
 						szFrom, ppszMsgInfo[smsgiTime]);
 		else
 			pszReceived = StrSprint("Received: from %s\r\n"
 						"\tby %s (%s) with %s\r\n"
-						"\tid <%s> for <%s> from <%s>;\r\n"
+						"\tid <%s> %sfrom <%s>;\r\n"
 						"\t%s\r\n", ppszMsgInfo[smsgiClientDomain],
 						ppszMsgInfo[smsgiServerDomain],
 						ppszMsgInfo[smsgiServerAddr],
-						ppszMsgInfo[smsgiSeverName], pszMessageID, szRcpt,
+						ppszMsgInfo[smsgiSeverName], pszMessageID, szFor,
 						szFrom, ppszMsgInfo[smsgiTime]);
 		break;
 
@@ -2048,19 +2579,19 @@ char *USmtpGetReceived(int iType, char const *pszAuth, char const *const *ppszMs
 		if (!bHideClient)
 			pszReceived = StrSprint("Received: from %s (%s)\r\n"
 						"\tby %s with %s\r\n"
-						"\tid <%s> for <%s> from <%s>;\r\n"
+						"\tid <%s> %sfrom <%s>;\r\n"
 						"\t%s\r\n", ppszMsgInfo[smsgiClientDomain],
 						ppszMsgInfo[smsgiClientAddr],
 						ppszMsgInfo[smsgiServerDomain],
-						ppszMsgInfo[smsgiSeverName], pszMessageID, szRcpt,
+						ppszMsgInfo[smsgiSeverName], pszMessageID, szFor,
 						szFrom, ppszMsgInfo[smsgiTime]);
 		else
 			pszReceived = StrSprint("Received: from %s\r\n"
 						"\tby %s with %s\r\n"
-						"\tid <%s> for <%s> from <%s>;\r\n"
+						"\tid <%s> %sfrom <%s>;\r\n"
 						"\t%s\r\n", ppszMsgInfo[smsgiClientDomain],
 						ppszMsgInfo[smsgiServerDomain],
-						ppszMsgInfo[smsgiSeverName], pszMessageID, szRcpt,
+						ppszMsgInfo[smsgiSeverName], pszMessageID, szFor,
 						szFrom, ppszMsgInfo[smsgiTime]);
 		break;
 	}
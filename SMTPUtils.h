@@ -38,6 +38,11 @@
 #define DEFAULT_SMTP_ERR            "417 Temporary delivery error"
 #define SMTP_SERVER_VARNAME         "SMTP-Server"
 
+#define STD_SMTPCH_CACHE_SIZE       32
+#define STD_SMTPCH_MAX_IDLE         15
+#define STD_SMTPCH_MAX_MSGS         100
+#define STD_SMTP_HOST_DOWN_EXPIRE   60
+
 #define SMTP_GWF_USE_TLS            (1 << 0)
 #define SMTP_GWF_FORCE_TLS          (1 << 1)
 
@@ -53,6 +58,12 @@ struct SMTPError {
 	char *pszSTMPResponse;
 };
 
+struct SMTPRecipient {
+	char const *pszRcpt;
+	SMTPError *pSMTPE;
+	int iError;
+};
+
 struct SMTPGateway {
 	char *pszHost;
 	char *pszIFace;
@@ -106,10 +117,21 @@ SMTPCH_HANDLE USmtpCreateChannel(SMTPGateway const *pGw, char const *pszDomain,
 				 SMTPError *pSMTPE = NULL);
 int USmtpCloseChannel(SMTPCH_HANDLE hSmtpCh, int iHardClose = 0, SMTPError *pSMTPE = NULL);
 int USmtpChannelReset(SMTPCH_HANDLE hSmtpCh, SMTPError *pSMTPE = NULL);
+int USmtpInitChannelCache(int iMaxChannels, int iMaxIdle, int iMaxMsgs);
+void USmtpCleanupChannelCache(void);
+int USmtpInitHostCache(int iDownExpire);
+void USmtpCleanupHostCache(void);
+int USmtpSendMail(SMTPCH_HANDLE hSmtpCh, char const *pszFrom, SMTPRecipient *pRcpts,
+		  int iRcptCount, FileSection const *pFS);
 int USmtpSendMail(SMTPCH_HANDLE hSmtpCh, char const *pszFrom, char const *pszRcpt,
 		  FileSection const *pFS, SMTPError *pSMTPE = NULL);
+int USmtpSendMail(SMTPGateway const *pGw, char const *pszDomain, char const *pszFrom,
+		  SMTPRecipient *pRcpts, int iRcptCount, FileSection const *pFS);
 int USmtpSendMail(SMTPGateway const *pGw, char const *pszDomain, char const *pszFrom,
 		  char const *pszRcpt, FileSection const *pFS, SMTPError *pSMTPE = NULL);
+int USmtpMailRmtDeliver(SVRCFG_HANDLE hSvrConfig, char const *pszServer, char const *pszDomain,
+			char const *pszFrom, SMTPRecipient *pRcpts, int iRcptCount,
+			FileSection const *pFS);
 int USmtpMailRmtDeliver(SVRCFG_HANDLE hSvrConfig, char const *pszServer, char const *pszDomain,
 			char const *pszFrom, char const *pszRcpt, FileSection const *pFS,
 			SMTPError *pSMTPE = NULL);
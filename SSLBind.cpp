@@ -24,8 +24,10 @@
 #include "SysDep.h"
 #include "SvrDefines.h"
 #include "StrUtils.h"
+#include "ShBlocks.h"
 #include "BuffSock.h"
 #include "SSLBind.h"
+#include "MiscUtils.h"
 
 #include "openssl/bio.h"
 #include "openssl/rsa.h"
@@ -39,8 +41,29 @@
 #include "openssl/engine.h"
 #endif
 
+/*
+ * Kernel TLS offload requires SSL_sendfile(), which appeared in OpenSSL 3.0.
+ */
+#if defined(SYS_HAS_KTLS) && !defined(OPENSSL_NO_KTLS) && OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define BSSL_HAS_KTLS
+#endif
+
 
 #define BSSL_WRITE_BLKSIZE (1024 * 64)
+#define BSSL_SENDFILE_BLKSIZE (1024 * 1024)
+#define BSSL_CTX_CHECK_TIME 4
+#define BSSL_SESS_ID_CTX "XMail"
+#define BSSL_CLISESS_HASHSIZE 256
+#define BSSL_CLISESS_MAX 1024
+
+enum BSslCtxFiles {
+	BSSL_CTXF_CERT = 0,
+	BSSL_CTXF_KEY,
+	BSSL_CTXF_CAFILE,
+	BSSL_CTXF_CAPATH,
+
+	BSSL_CTXF_MAX
+};
 
 
 struct SslBindCtx {
@@ -50,8 +73,34 @@ struct SslBindCtx {
 	SSL *pSSL;
 };
 
+struct SslFileStamp {
+	SYS_OFF_T llSize;
+	time_t tMod;
+};
+
+struct SslCtxEntry {
+	SysListHead LLink;
+	int iServer;
+	SslServerBind *pSSLB;
+	SslServerBind SSLB;
+	SslFileStamp Stamps[BSSL_CTXF_MAX];
+	time_t tLastCheck;
+	SSL_CTX *pSCtx;
+};
+
+struct SslCliSess {
+	HashNode HN;
+	SysListHead LLink;
+	SSL_SESSION *pSess;
+};
+
 
 static SYS_MUTEX *pSslMtxs;
+static SYS_MUTEX hCtxMutex = SYS_INVALID_MUTEX;
+static SysListHead CtxList;
+static HASH_HANDLE hCliSessHash = INVALID_HASH_HANDLE;
+static SysListHead CliSessLRU;
+static SslSessStats SessStats;
 
 
 static void BSslLockingCB(int iMode, int iType, const char *pszFile, int iLine)
@@ -74,9 +123,55 @@ static void BSslFreeOSSL(void)
 	EVP_cleanup();
 }
 
+static void BSslFreeCtxEntry(SslCtxEntry *pCE)
+{
+	if (pCE->pSCtx != NULL)
+		SSL_CTX_free(pCE->pSCtx);
+	SysFree(pCE->SSLB.pszKeyFile);
+	SysFree(pCE->SSLB.pszCertFile);
+	SysFree(pCE->SSLB.pszCAFile);
+	SysFree(pCE->SSLB.pszCAPath);
+	SysFree(pCE);
+}
+
+static void BSslFreeCliSess(SslCliSess *pCS)
+{
+	SSL_SESSION_free(pCS->pSess);
+	SysFree(pCS->HN.Key.pData);
+	SysFree(pCS);
+}
+
+static void BSslFreeCliSessCache(void)
+{
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_FIRST(&CliSessLRU)) != NULL) {
+		SslCliSess *pCS = SYS_LIST_ENTRY(pLLink, SslCliSess, LLink);
+
+		SYS_LIST_DEL(pLLink);
+		HashDel(hCliSessHash, &pCS->HN);
+		BSslFreeCliSess(pCS);
+	}
+	HashFree(hCliSessHash, NULL, NULL);
+	hCliSessHash = INVALID_HASH_HANDLE;
+}
+
+static void BSslFreeCtxCache(void)
+{
+	SysListHead *pLLink;
+
+	while ((pLLink = SYS_LIST_FIRST(&CtxList)) != NULL) {
+		SslCtxEntry *pCE = SYS_LIST_ENTRY(pLLink, SslCtxEntry, LLink);
+
+		SYS_LIST_DEL(pLLink);
+		BSslFreeCtxEntry(pCE);
+	}
+}
+
 int BSslInit(void)
 {
 	int i, iNumLocks = CRYPTO_num_locks();
+	HashOps HOps;
 
 	if ((pSslMtxs = (SYS_MUTEX *) SysAlloc(iNumLocks * sizeof(SYS_MUTEX))) == NULL)
 		return ErrGetErrorCode();
@@ -89,6 +184,28 @@ int BSslInit(void)
 			return ErrorPop();
 		}
 	}
+	if ((hCtxMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+		ErrorPush();
+		for (i = 0; i < iNumLocks; i++)
+			SysCloseMutex(pSslMtxs[i]);
+		SysFreeNullify(pSslMtxs);
+		return ErrorPop();
+	}
+	SYS_INIT_LIST_HEAD(&CtxList);
+	SYS_INIT_LIST_HEAD(&CliSessLRU);
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((hCliSessHash = HashCreate(&HOps,
+				       BSSL_CLISESS_HASHSIZE)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		SysCloseMutex(hCtxMutex);
+		for (i = 0; i < iNumLocks; i++)
+			SysCloseMutex(pSslMtxs[i]);
+		SysFreeNullify(pSslMtxs);
+		return ErrorPop();
+	}
+	ZeroData(SessStats);
 	SSL_load_error_strings();
 	SSLeay_add_ssl_algorithms();
 	CRYPTO_set_id_callback(SysGetCurrentThreadId);
@@ -105,6 +222,8 @@ void BSslCleanup(void)
 	BIO *pErrBIO = BIO_new_fp(stderr, BIO_NOCLOSE);
 #endif
 
+	BSslFreeCliSessCache();
+	BSslFreeCtxCache();
 	BSslFreeOSSL();
 
 #ifdef DEBUG_OSSL
@@ -120,6 +239,8 @@ void BSslCleanup(void)
 	for (i = 0; i < iNumLocks; i++)
 		SysCloseMutex(pSslMtxs[i]);
 	SysFreeNullify(pSslMtxs);
+	SysCloseMutex(hCtxMutex);
+	hCtxMutex = SYS_INVALID_MUTEX;
 }
 
 static int BSslHandleAsync(SslBindCtx *pCtx, int iCode, int iDefError, int iTimeo)
@@ -205,12 +326,20 @@ static char const *BSslCtx__Name(void *pPrivate)
 	return BSSL_BIO_NAME;
 }
 
+static void BSslFreeSSL(SSL *pSSL)
+{
+	char *pszSessKey = (char *) SSL_get_app_data(pSSL);
+
+	SSL_free(pSSL);
+	SysFree(pszSessKey);
+}
+
 static int BSslCtx__Free(void *pPrivate)
 {
 	SslBindCtx *pCtx = (SslBindCtx *) pPrivate;
 
 	BSslShutdown(pCtx);
-	SSL_free(pCtx->pSSL);
+	BSslFreeSSL(pCtx->pSSL);
 	SSL_CTX_free(pCtx->pSCtx);
 
 	/*
@@ -236,6 +365,55 @@ static ssize_t BSslCtx__Write(void *pPrivate, void const *pData, size_t sSize, i
 	return BSslWriteLL(pCtx, pData, sSize, iTimeo);
 }
 
+#ifdef BSSL_HAS_KTLS
+
+/*
+ * When the kernel has taken over the record encryption (kTLS), we can feed
+ * the file straight to the socket with SSL_sendfile(), which maps to the
+ * sendfile(2) zero-copy path.
+ */
+static int BSslKtlsSendFile(SslBindCtx *pCtx, char const *pszFilePath, SYS_OFF_T llOffStart,
+			    SYS_OFF_T llOffEnd, int iTimeo)
+{
+	int iFileID, iError;
+	SYS_OFF_T llSize;
+
+	if ((iFileID = open(pszFilePath, O_RDONLY)) == -1) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszFilePath);
+		return ERR_FILE_OPEN;
+	}
+	llSize = (SYS_OFF_T) lseek(iFileID, 0, SEEK_END);
+	if (llOffEnd == -1)
+		llOffEnd = llSize;
+	if (llOffStart > llSize || llOffEnd > llSize || llOffStart > llOffEnd) {
+		close(iFileID);
+		ErrSetErrorCode(ERR_INVALID_PARAMETER);
+		return ERR_INVALID_PARAMETER;
+	}
+	while (llOffStart < llOffEnd) {
+		size_t sSize = (size_t) Min(BSSL_SENDFILE_BLKSIZE, llOffEnd - llOffStart);
+		ossl_ssize_t sSent = SSL_sendfile(pCtx->pSSL, iFileID, (off_t) llOffStart,
+						  sSize, 0);
+
+		if (sSent <= 0) {
+			if ((iError = BSslHandleAsync(pCtx, (int) sSent, ERR_SENDFILE,
+						      iTimeo)) == 0)
+				iError = ErrorSet(ERR_SENDFILE);
+			if (iError < 0) {
+				close(iFileID);
+				return iError;
+			}
+			continue;
+		}
+		llOffStart += sSent;
+	}
+	close(iFileID);
+
+	return 0;
+}
+
+#endif
+
 static int BSslCtx__SendFile(void *pPrivate, char const *pszFilePath, SYS_OFF_T llOffStart,
 			     SYS_OFF_T llOffEnd, int iTimeo)
 {
@@ -245,6 +423,10 @@ static int BSslCtx__SendFile(void *pPrivate, char const *pszFilePath, SYS_OFF_T
 	void *pMapAddr;
 	char *pCurAddr;
 
+#ifdef BSSL_HAS_KTLS
+	if (BIO_get_ktls_send(SSL_get_wbio(pCtx->pSSL)))
+		return BSslKtlsSendFile(pCtx, pszFilePath, llOffStart, llOffEnd, iTimeo);
+#endif
 	if ((hMap = SysCreateMMap(pszFilePath, SYS_MMAP_READ)) == SYS_INVALID_MMAP)
 		return ErrGetErrorCode();
 	llSize = SysMMapSize(hMap);
@@ -282,6 +464,13 @@ static int BSslCtx__SendFile(void *pPrivate, char const *pszFilePath, SYS_OFF_T
 	return 0;
 }
 
+static int BSslCtx__Pending(void *pPrivate)
+{
+	SslBindCtx *pCtx = (SslBindCtx *) pPrivate;
+
+	return SSL_pending(pCtx->pSSL);
+}
+
 static int BSslAllocCtx(SslBindCtx **ppCtx, SYS_SOCKET SockFD, SSL_CTX *pSCtx, SSL *pSSL)
 {
 	SslBindCtx *pCtx;
@@ -294,6 +483,7 @@ static int BSslAllocCtx(SslBindCtx **ppCtx, SYS_SOCKET SockFD, SSL_CTX *pSCtx, S
 	pCtx->IOOps.pRead = BSslCtx__Read;
 	pCtx->IOOps.pWrite = BSslCtx__Write;
 	pCtx->IOOps.pSendFile = BSslCtx__SendFile;
+	pCtx->IOOps.pPending = BSslCtx__Pending;
 	pCtx->SockFD = SockFD;
 	pCtx->pSCtx = pSCtx;
 	pCtx->pSSL = pSSL;
@@ -410,36 +600,381 @@ static int BSslSetupVerify(SSL_CTX *pSCtx, SslServerBind const *pSSLB)
 	return 0;
 }
 
-int BSslBindClient(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
-		   int (*pfEnvCB)(void *, int, void const *), void *pPrivate)
+static int BSslStrSame(char const *pszA, char const *pszB)
+{
+	if (pszA == NULL || pszB == NULL)
+		return pszA == pszB;
+
+	return strcmp(pszA, pszB) == 0;
+}
+
+static char const *BSslStrOrEmpty(char const *pszStr)
+{
+	return pszStr != NULL ? pszStr: "";
+}
+
+static int BSslCtxMatch(SslCtxEntry const *pCE, int iServer, SslServerBind const *pSSLB)
+{
+	if (pCE->iServer != iServer)
+		return 0;
+	if (pSSLB == NULL || pCE->pSSLB == NULL)
+		return pSSLB == pCE->pSSLB;
+
+	return pCE->SSLB.ulFlags == pSSLB->ulFlags &&
+		pCE->SSLB.iMaxDepth == pSSLB->iMaxDepth &&
+		pCE->SSLB.iSessCacheSize == pSSLB->iSessCacheSize &&
+		pCE->SSLB.iSessTimeout == pSSLB->iSessTimeout &&
+		BSslStrSame(pCE->SSLB.pszCertFile, pSSLB->pszCertFile) &&
+		BSslStrSame(pCE->SSLB.pszKeyFile, pSSLB->pszKeyFile) &&
+		BSslStrSame(pCE->SSLB.pszCAFile, pSSLB->pszCAFile) &&
+		BSslStrSame(pCE->SSLB.pszCAPath, pSSLB->pszCAPath);
+}
+
+static void BSslFileStamp(char const *pszFilePath, SslFileStamp *pFS)
+{
+	SYS_FILE_INFO FI;
+
+	ZeroData(*pFS);
+	if (pszFilePath != NULL && SysGetFileInfo(pszFilePath, FI) == 0) {
+		pFS->llSize = FI.llSize;
+		pFS->tMod = FI.tMod;
+	}
+}
+
+static void BSslCtxStamps(SslServerBind const *pSSLB, SslFileStamp *pStamps)
+{
+	if (pSSLB == NULL) {
+		memset(pStamps, 0, BSSL_CTXF_MAX * sizeof(SslFileStamp));
+		return;
+	}
+	BSslFileStamp(pSSLB->pszCertFile, &pStamps[BSSL_CTXF_CERT]);
+	BSslFileStamp(pSSLB->pszKeyFile, &pStamps[BSSL_CTXF_KEY]);
+	BSslFileStamp(pSSLB->pszCAFile, &pStamps[BSSL_CTXF_CAFILE]);
+	BSslFileStamp(pSSLB->pszCAPath, &pStamps[BSSL_CTXF_CAPATH]);
+}
+
+static SslCliSess *BSslCliSessLookup(char const *pszSessKey)
+{
+	HashNode *pHNode;
+	HashEnum HEnum;
+	HashDatum Key;
+
+	Key.pData = (void *) pszSessKey;
+	if (HashGetFirst(hCliSessHash, &Key, &HEnum, &pHNode) < 0)
+		return NULL;
+
+	return SYS_LIST_ENTRY(pHNode, SslCliSess, HN);
+}
+
+static void BSslCliSessDrop(SslCliSess *pCS)
+{
+	SYS_LIST_DEL(&pCS->LLink);
+	HashDel(hCliSessHash, &pCS->HN);
+	BSslFreeCliSess(pCS);
+	SessStats.ulCliCached--;
+}
+
+/*
+ * Called by OpenSSL (with our lock not held) every time a client connection
+ * receives a new resumable session. With TLS 1.3 this happens after the
+ * handshake has completed, when the server sends us its tickets. Returning
+ * one means we took ownership of the session reference.
+ */
+static int BSslNewSessionCB(SSL *pSSL, SSL_SESSION *pSess)
+{
+	char const *pszSessKey = (char const *) SSL_get_app_data(pSSL);
+	SslCliSess *pCS;
+
+	if (pszSessKey == NULL || !SSL_SESSION_is_resumable(pSess) ||
+	    SysLockMutex(hCtxMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return 0;
+	if ((pCS = BSslCliSessLookup(pszSessKey)) != NULL) {
+		SSL_SESSION_free(pCS->pSess);
+		pCS->pSess = pSess;
+		SYS_LIST_DEL(&pCS->LLink);
+		SYS_LIST_ADDH(&pCS->LLink, &CliSessLRU);
+	} else {
+		if ((pCS = (SslCliSess *) SysAlloc(sizeof(SslCliSess))) == NULL) {
+			SysUnlockMutex(hCtxMutex);
+			return 0;
+		}
+		HashInitNode(&pCS->HN);
+		if ((pCS->HN.Key.pData = SysStrDup(pszSessKey)) == NULL) {
+			SysFree(pCS);
+			SysUnlockMutex(hCtxMutex);
+			return 0;
+		}
+		if (HashAdd(hCliSessHash, &pCS->HN) < 0) {
+			SysFree(pCS->HN.Key.pData);
+			SysFree(pCS);
+			SysUnlockMutex(hCtxMutex);
+			return 0;
+		}
+		pCS->pSess = pSess;
+		SYS_LIST_ADDH(&pCS->LLink, &CliSessLRU);
+		if (++SessStats.ulCliCached > BSSL_CLISESS_MAX)
+			BSslCliSessDrop(SYS_LIST_ENTRY(SYS_LIST_LAST(&CliSessLRU),
+						       SslCliSess, LLink));
+	}
+	SysUnlockMutex(hCtxMutex);
+
+	return 1;
+}
+
+static SSL_SESSION *BSslCliSessGet(char const *pszSessKey)
+{
+	SslCliSess *pCS;
+	SSL_SESSION *pSess = NULL;
+
+	if (SysLockMutex(hCtxMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
+	if ((pCS = BSslCliSessLookup(pszSessKey)) != NULL) {
+		if ((time_t) (SSL_SESSION_get_time(pCS->pSess) +
+			      SSL_SESSION_get_timeout(pCS->pSess)) <= time(NULL))
+			BSslCliSessDrop(pCS);
+		else {
+			pSess = pCS->pSess;
+			SSL_SESSION_up_ref(pSess);
+			SYS_LIST_DEL(&pCS->LLink);
+			SYS_LIST_ADDH(&pCS->LLink, &CliSessLRU);
+		}
+	}
+	SysUnlockMutex(hCtxMutex);
+
+	return pSess;
+}
+
+static void BSslSessStat(unsigned long *pulCounter)
+{
+	if (SysLockMutex(hCtxMutex, SYS_INFINITE_TIMEOUT) == 0) {
+		(*pulCounter)++;
+		SysUnlockMutex(hCtxMutex);
+	}
+}
+
+static SSL_CTX *BSslCreateCtx(int iServer, SslServerBind const *pSSLB)
 {
-	int iError;
-	SYS_SOCKET SockFD;
 	SSL_METHOD const *pMethod;
 	SSL_CTX *pSCtx;
-	SSL *pSSL;
-	X509 *pCert;
-	SslBindCtx *pCtx;
 
-	pMethod = SSLv23_client_method();
+	pMethod = iServer ? SSLv23_server_method(): SSLv23_client_method();
 	if ((pSCtx = SSL_CTX_new((SSL_METHOD *) pMethod)) == NULL) {
 		ErrSetErrorCode(ERR_SSLCTX_CREATE);
-		return ERR_SSLCTX_CREATE;
+		return NULL;
 	}
-	SSL_CTX_set_session_cache_mode(pSCtx, SSL_SESS_CACHE_OFF);
+	if (iServer) {
+		/*
+		 * Session IDs are looked up in the context internal cache,
+		 * while tickets are sealed with keys generated at context
+		 * creation time. Both only work because the context is shared
+		 * among all the connections using the same configuration.
+		 */
+		SSL_CTX_set_session_id_context(pSCtx, (unsigned char const *) BSSL_SESS_ID_CTX,
+					       CStringSize(BSSL_SESS_ID_CTX));
+		if (pSSLB->iSessCacheSize > 0) {
+			SSL_CTX_set_session_cache_mode(pSCtx, SSL_SESS_CACHE_SERVER);
+			SSL_CTX_sess_set_cache_size(pSCtx, pSSLB->iSessCacheSize);
+		} else
+			SSL_CTX_set_session_cache_mode(pSCtx, SSL_SESS_CACHE_OFF);
+		if (pSSLB->iSessTimeout > 0)
+			SSL_CTX_set_timeout(pSCtx, pSSLB->iSessTimeout);
+	} else {
+		/*
+		 * Client sessions are stored by BSslNewSessionCB() inside our
+		 * own cache, indexed by the key supplied to BSslBindClient().
+		 */
+		SSL_CTX_set_session_cache_mode(pSCtx, SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(pSCtx, BSslNewSessionCB);
+	}
+	if (pSSLB != NULL && (pSSLB->ulFlags & BSSLF_NO_TICKETS))
+		SSL_CTX_set_options(pSCtx, SSL_OP_NO_TICKET);
+#ifdef BSSL_HAS_KTLS
+	/*
+	 * OpenSSL enables kTLS only if the kernel supports it for the
+	 * negotiated cipher, and silently falls back to user space
+	 * encryption otherwise. BSslCtx__SendFile() checks which one we got.
+	 */
+	if (pSSLB != NULL && (pSSLB->ulFlags & BSSLF_KTLS))
+		SSL_CTX_set_options(pSCtx, SSL_OP_ENABLE_KTLS);
+#endif
 	/*
 	 * Client may not supply a certificate.
 	 */
 	if (pSSLB != NULL &&
 	    BSslSetupVerify(pSCtx, pSSLB) < 0) {
 		SSL_CTX_free(pSCtx);
-		return ErrGetErrorCode();
+		return NULL;
+	}
+
+	return pSCtx;
+}
+
+static SslCtxEntry *BSslAllocCtxEntry(int iServer, SslServerBind const *pSSLB)
+{
+	SslCtxEntry *pCE;
+
+	if ((pCE = (SslCtxEntry *) SysAlloc(sizeof(SslCtxEntry))) == NULL)
+		return NULL;
+	pCE->iServer = iServer;
+	if (pSSLB != NULL) {
+		pCE->SSLB.ulFlags = pSSLB->ulFlags;
+		pCE->SSLB.iMaxDepth = pSSLB->iMaxDepth;
+		pCE->SSLB.iSessCacheSize = pSSLB->iSessCacheSize;
+		pCE->SSLB.iSessTimeout = pSSLB->iSessTimeout;
+		if ((pSSLB->pszCertFile != NULL &&
+		     (pCE->SSLB.pszCertFile = SysStrDup(pSSLB->pszCertFile)) == NULL) ||
+		    (pSSLB->pszKeyFile != NULL &&
+		     (pCE->SSLB.pszKeyFile = SysStrDup(pSSLB->pszKeyFile)) == NULL) ||
+		    (pSSLB->pszCAFile != NULL &&
+		     (pCE->SSLB.pszCAFile = SysStrDup(pSSLB->pszCAFile)) == NULL) ||
+		    (pSSLB->pszCAPath != NULL &&
+		     (pCE->SSLB.pszCAPath = SysStrDup(pSSLB->pszCAPath)) == NULL)) {
+			BSslFreeCtxEntry(pCE);
+			return NULL;
+		}
+		pCE->pSSLB = &pCE->SSLB;
+	}
+
+	return pCE;
+}
+
+/*
+ * Returns a referenced SSL_CTX for the given bind configuration. Contexts
+ * are built once per configuration and shared among all the connections
+ * using it, since loading certificates and keys is by far the most
+ * expensive part of the handshake setup. Every BSSL_CTX_CHECK_TIME seconds
+ * the certificate, key and CA files are checked, and the context is rebuilt
+ * if any of them changed. Sessions already using the old context keep their
+ * own reference to it, which is dropped when they close.
+ */
+static SSL_CTX *BSslGetCtx(int iServer, SslServerBind const *pSSLB)
+{
+	time_t tNow = time(NULL);
+	SysListHead *pLLink;
+	SslCtxEntry *pCE = NULL;
+	SslFileStamp Stamps[BSSL_CTXF_MAX];
+	SSL_CTX *pSCtx;
+
+	if (SysLockMutex(hCtxMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
+	SYS_LIST_FOR_EACH(pLLink, &CtxList) {
+		SslCtxEntry *pCurr = SYS_LIST_ENTRY(pLLink, SslCtxEntry, LLink);
+
+		if (BSslCtxMatch(pCurr, iServer, pSSLB)) {
+			pCE = pCurr;
+			break;
+		}
+	}
+	if (pCE == NULL) {
+		if ((pCE = BSslAllocCtxEntry(iServer, pSSLB)) == NULL) {
+			ErrorPush();
+			SysUnlockMutex(hCtxMutex);
+			ErrorPop();
+			return NULL;
+		}
+		SYS_LIST_ADDT(&pCE->LLink, &CtxList);
 	}
+	if (pCE->pSCtx == NULL || tNow < pCE->tLastCheck ||
+	    tNow >= pCE->tLastCheck + BSSL_CTX_CHECK_TIME) {
+		pCE->tLastCheck = tNow;
+		BSslCtxStamps(pCE->pSSLB, Stamps);
+		if (pCE->pSCtx == NULL ||
+		    memcmp(Stamps, pCE->Stamps, sizeof(Stamps)) != 0) {
+			/*
+			 * The verify callback fetches the bind configuration
+			 * from the context application data, so we need to
+			 * hand it the copy owned by the cache entry.
+			 */
+			if ((pSCtx = BSslCreateCtx(iServer, pCE->pSSLB)) == NULL) {
+				ErrorPush();
+				if (pCE->pSSLB != NULL && pCE->pSSLB->pszCertFile != NULL)
+					SysLogMessage(LOG_LEV_ERROR,
+						      "Unable to load SSL context for \"%s\" (%d)\n",
+						      pCE->pSSLB->pszCertFile, ErrorFetch());
+				/*
+				 * Keep serving with the previous context (if any),
+				 * in case we caught the files while being updated.
+				 */
+				if (pCE->pSCtx == NULL) {
+					SysUnlockMutex(hCtxMutex);
+					ErrorPop();
+					return NULL;
+				}
+			} else {
+				if (pCE->pSCtx != NULL)
+					SSL_CTX_free(pCE->pSCtx);
+				pCE->pSCtx = pSCtx;
+				memcpy(pCE->Stamps, Stamps, sizeof(Stamps));
+			}
+		}
+	}
+	pSCtx = pCE->pSCtx;
+	SSL_CTX_up_ref(pSCtx);
+	SysUnlockMutex(hCtxMutex);
+
+	return pSCtx;
+}
+
+/*
+ * The caller key only names the peer. Sessions negotiated under a given
+ * verification policy, or with a given client certificate, must never be
+ * resumed under a different one, so the bind configuration and the verify
+ * mode of the context become part of the cache key too.
+ */
+static char *BSslCliSessKey(SSL_CTX *pSCtx, SslServerBind const *pSSLB,
+			    char const *pszSessKey)
+{
+	if (pSSLB == NULL)
+		return StrSprint("%s|%x", pszSessKey, SSL_CTX_get_verify_mode(pSCtx));
+
+	return StrSprint("%s|%x|%lx|%d|%s|%s|%s|%s", pszSessKey,
+			 SSL_CTX_get_verify_mode(pSCtx), pSSLB->ulFlags,
+			 pSSLB->iMaxDepth, BSslStrOrEmpty(pSSLB->pszCertFile),
+			 BSslStrOrEmpty(pSSLB->pszKeyFile),
+			 BSslStrOrEmpty(pSSLB->pszCAFile),
+			 BSslStrOrEmpty(pSSLB->pszCAPath));
+}
+
+int BSslBindClient(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
+		   int (*pfEnvCB)(void *, int, void const *), void *pPrivate,
+		   char const *pszSessKey)
+{
+	int iError;
+	SYS_SOCKET SockFD;
+	SSL_CTX *pSCtx;
+	SSL *pSSL;
+	SSL_SESSION *pSess;
+	X509 *pCert;
+	SslBindCtx *pCtx;
+	char *pszKey = NULL;
+
+	if ((pSCtx = BSslGetCtx(0, pSSLB)) == NULL)
+		return ErrGetErrorCode();
 	if ((pSSL = SSL_new(pSCtx)) == NULL) {
 		SSL_CTX_free(pSCtx);
 		ErrSetErrorCode(ERR_SSL_CREATE);
 		return ERR_SSL_CREATE;
 	}
+	if (pszSessKey != NULL) {
+		/*
+		 * The SSL application data holds our private copy of the
+		 * session key, so that BSslNewSessionCB() knows where to store
+		 * the sessions the server hands us. It is released together
+		 * with the SSL object, by BSslFreeSSL().
+		 */
+		if ((pszKey = BSslCliSessKey(pSCtx, pSSLB, pszSessKey)) == NULL) {
+			ErrorPush();
+			SSL_free(pSSL);
+			SSL_CTX_free(pSCtx);
+			return ErrorPop();
+		}
+		SSL_set_app_data(pSSL, pszKey);
+		if ((pSess = BSslCliSessGet(pszKey)) != NULL) {
+			SSL_set_session(pSSL, pSess);
+			SSL_SESSION_free(pSess);
+		}
+	}
 	SockFD = BSckGetAttachedSocket(hBSock);
 	/*
 	 * We want blocking sockets during the initial SSL negotiation.
@@ -448,18 +983,20 @@ int BSslBindClient(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 	SSL_set_fd(pSSL, (int) SockFD);
 	if (SSL_connect(pSSL) == -1) {
 		SysBlockSocket(SockFD, -1);
-		SSL_free(pSSL);
+		BSslFreeSSL(pSSL);
 		SSL_CTX_free(pSCtx);
 		ErrSetErrorCode(ERR_SSL_CONNECT);
 		return ERR_SSL_CONNECT;
 	}
-	SSL_CTX_set_app_data(pSCtx, NULL);
+	if (pszKey != NULL)
+		BSslSessStat(SSL_session_reused(pSSL) ? &SessStats.ulCliHits:
+			     &SessStats.ulCliMisses);
 	/*
 	 * Server must supply a certificate.
 	 */
 	if ((pCert = SSL_get_peer_certificate(pSSL)) == NULL) {
 		SysBlockSocket(SockFD, -1);
-		SSL_free(pSSL);
+		BSslFreeSSL(pSSL);
 		SSL_CTX_free(pSCtx);
 		ErrSetErrorCode(ERR_SSL_NOCERT);
 		return ERR_SSL_NOCERT;
@@ -471,7 +1008,7 @@ int BSslBindClient(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 	    BSslAllocCtx(&pCtx, SockFD, pSCtx, pSSL) < 0) {
 		ErrorPush();
 		SysBlockSocket(SockFD, -1);
-		SSL_free(pSSL);
+		BSslFreeSSL(pSSL);
 		SSL_CTX_free(pSCtx);
 		return ErrorPop();
 	}
@@ -489,22 +1026,13 @@ int BSslBindServer(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 {
 	int iError;
 	SYS_SOCKET SockFD;
-	SSL_METHOD const *pMethod;
 	SSL_CTX *pSCtx;
 	SSL *pSSL;
 	X509 *pCert;
 	SslBindCtx *pCtx;
 
-	pMethod = SSLv23_server_method();
-	if ((pSCtx = SSL_CTX_new((SSL_METHOD *) pMethod)) == NULL) {
-		ErrSetErrorCode(ERR_SSLCTX_CREATE);
-		return ERR_SSLCTX_CREATE;
-	}
-	SSL_CTX_set_session_cache_mode(pSCtx, SSL_SESS_CACHE_OFF);
-	if (BSslSetupVerify(pSCtx, pSSLB) < 0) {
-		SSL_CTX_free(pSCtx);
+	if ((pSCtx = BSslGetCtx(1, pSSLB)) == NULL)
 		return ErrGetErrorCode();
-	}
 	if ((pSSL = SSL_new(pSCtx)) == NULL) {
 		SSL_CTX_free(pSCtx);
 		ErrSetErrorCode(ERR_SSL_CREATE);
@@ -523,7 +1051,7 @@ int BSslBindServer(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 		ErrSetErrorCode(ERR_SSL_ACCEPT);
 		return ERR_SSL_ACCEPT;
 	}
-	SSL_CTX_set_app_data(pSCtx, NULL);
+	BSslSessStat(SSL_session_reused(pSSL) ? &SessStats.ulSvrHits: &SessStats.ulSvrMisses);
 	/*
 	 * Client may not supply a certificate.
 	 */
@@ -549,3 +1077,13 @@ int BSslBindServer(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 
 	return 0;
 }
+
+int BSslGetSessStats(SslSessStats *pSStats)
+{
+	if (SysLockMutex(hCtxMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+	*pSStats = SessStats;
+	SysUnlockMutex(hCtxMutex);
+
+	return 0;
+}
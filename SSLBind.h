@@ -31,6 +31,8 @@
 #define BSSLF_WANT_VERIFY (1 << 0)
 #define BSSLF_WANT_CERT (1 << 1)
 #define BSSLF_ALLOW_SEFLSIGNED (1 << 2)
+#define BSSLF_NO_TICKETS (1 << 3)
+#define BSSLF_KTLS (1 << 4)
 
 
 struct SslServerBind {
@@ -40,6 +42,16 @@ struct SslServerBind {
 	int iMaxDepth;
 	char *pszCAFile;
 	char *pszCAPath;
+	int iSessCacheSize;
+	int iSessTimeout;
+};
+
+struct SslSessStats {
+	unsigned long ulSvrHits;
+	unsigned long ulSvrMisses;
+	unsigned long ulCliHits;
+	unsigned long ulCliMisses;
+	unsigned long ulCliCached;
 };
 
 struct SslBindEnv {
@@ -51,9 +63,11 @@ struct SslBindEnv {
 int BSslInit(void);
 void BSslCleanup(void);
 int BSslBindClient(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
-		   int (*pfEnvCB)(void *, int, void const *), void *pPrivate);
+		   int (*pfEnvCB)(void *, int, void const *), void *pPrivate,
+		   char const *pszSessKey = NULL);
 int BSslBindServer(BSOCK_HANDLE hBSock, SslServerBind const *pSSLB,
 		   int (*pfEnvCB)(void *, int, void const *), void *pPrivate);
+int BSslGetSessStats(SslSessStats *pSStats);
 
 #endif
 
@@ -36,6 +36,9 @@
 #include "MailConfig.h"
 #include "AppDefines.h"
 
+#define STD_SSL_SESS_CACHE_SIZE 20480
+#define STD_SSL_SESS_TIMEOUT 300
+
 
 int CSslBindSetup(SslServerBind *pSSLB)
 {
@@ -77,6 +80,16 @@ int CSslBindSetup(SslServerBind *pSSLB)
 
 	pSSLB->iMaxDepth = SvrGetConfigInt("SSLMaxCertsDepth", 0, hCfg);
 
+	pSSLB->iSessCacheSize = SvrGetConfigInt("SSLSessionCacheSize",
+						STD_SSL_SESS_CACHE_SIZE, hCfg);
+	pSSLB->iSessTimeout = SvrGetConfigInt("SSLSessionTimeout",
+					      STD_SSL_SESS_TIMEOUT, hCfg);
+	if (!SvrTestConfigFlag("SSLSessionTickets", true, hCfg))
+		pSSLB->ulFlags |= BSSLF_NO_TICKETS;
+
+	if (SvrTestConfigFlag("SSLEnableKTLS", false, hCfg))
+		pSSLB->ulFlags |= BSSLF_KTLS;
+
 	SvrReleaseConfigHandle(hCfg);
 
 
@@ -82,3 +82,11 @@ int ShbUnlock(SHB_HANDLE hBlock)
 	return 0;
 }
 
+void *ShbGetData(SHB_HANDLE hBlock)
+{
+	/* No locking, only for fields updated with SysInterlockedAdd() */
+	SharedBlock *pSHB = (SharedBlock *) hBlock;
+
+	return pSHB->pData;
+}
+
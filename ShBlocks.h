@@ -31,5 +31,6 @@ SHB_HANDLE ShbCreateBlock(unsigned int uSize);
 int ShbCloseBlock(SHB_HANDLE hBlock);
 void *ShbLock(SHB_HANDLE hBlock);
 int ShbUnlock(SHB_HANDLE hBlock);
+void *ShbGetData(SHB_HANDLE hBlock);
 
 #endif
@@ -32,6 +32,7 @@
 #define MAX_HOST_NAME               256
 #define MAX_MESSAGE_ID              SYS_MAX_PATH
 #define MAX_ACCEPT_ADDRESSES        32
+#define MAX_ACCEPT_THREADS          16
 #define LOG_ROTATE_HOURS            24
 #define STD_SERVER_TIMEOUT          90000
 #define LOCAL_ADDRESS               "127.0.0.1"
@@ -42,6 +42,7 @@
 
 #define SVR_PROFILE_FILE            "server.tab"
 #define MESSAGEID_FILE              "message.id"
+#define MESSAGEID_BLOCK_SIZE        10000
 #define SMTP_SPOOL_DIR              "spool"
 #define SVR_PROFILE_LINE_MAX        2048
 #define SYS_RES_CHECK_INTERVAL      8
@@ -56,8 +57,19 @@ struct ServerConfigData {
 	RLCK_HANDLE hResLock;
 	int iWriteLock;
 	HASH_HANDLE hHash;
+	int iRefCount;
+	SYS_OFF_T llSize;
+	time_t tMod;
 };
 
+static SYS_MUTEX hCfgMutex = SYS_INVALID_MUTEX;
+static ServerConfigData *pCfgSnap;
+static unsigned long ulCfgGeneration;
+
+static SYS_MUTEX hMsgIDMutex = SYS_INVALID_MUTEX;
+static SYS_UINT64 ullNextMsgID;
+static SYS_UINT64 ullMsgIDLimit;
+
 
 static char *SvrGetProfileFilePath(char *pszFilePath, size_t sMaxPath)
 {
@@ -161,6 +173,7 @@ static ServerConfigData *SvrAllocConfig(RLCK_HANDLE hResLock, int iWriteLock,
 		return NULL;
 	pSCD->hResLock = hResLock;
 	pSCD->iWriteLock = iWriteLock;
+	pSCD->iRefCount = 1;
 
 	ZeroData(HOps);
 	HOps.pGetHashVal = MscStringHashCB;
@@ -179,6 +192,114 @@ static ServerConfigData *SvrAllocConfig(RLCK_HANDLE hResLock, int iWriteLock,
 	return pSCD;
 }
 
+static void SvrFreeConfig(ServerConfigData *pSCD)
+{
+	HashFree(pSCD->hHash, SvrHFreeConfigVar, NULL);
+	SysFree(pSCD);
+}
+
+static void SvrUnrefConfig(ServerConfigData *pSCD)
+{
+	/* Must be called with hCfgMutex held */
+	if (--pSCD->iRefCount == 0)
+		SvrFreeConfig(pSCD);
+}
+
+int SvrInitConfigCache(void)
+{
+	if ((hCfgMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
+		return ErrGetErrorCode();
+	pCfgSnap = NULL;
+	ulCfgGeneration = 0;
+
+	return 0;
+}
+
+void SvrCleanupConfigCache(void)
+{
+	if (hCfgMutex != SYS_INVALID_MUTEX) {
+		if (pCfgSnap != NULL)
+			SvrUnrefConfig(pCfgSnap);
+		pCfgSnap = NULL;
+		SysCloseMutex(hCfgMutex);
+		hCfgMutex = SYS_INVALID_MUTEX;
+	}
+}
+
+void SvrInvalidateConfigCache(void)
+{
+	if (hCfgMutex == SYS_INVALID_MUTEX ||
+	    SysLockMutex(hCfgMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return;
+	ulCfgGeneration++;
+	if (pCfgSnap != NULL) {
+		SvrUnrefConfig(pCfgSnap);
+		pCfgSnap = NULL;
+	}
+	SysUnlockMutex(hCfgMutex);
+}
+
+static ServerConfigData *SvrGetConfigSnapshot(const char *pszProfilePath)
+{
+	unsigned long ulGeneration;
+	ServerConfigData *pSCD;
+	SYS_FILE_INFO FI;
+
+	/*
+	 * Readers share an immutable parsed snapshot of the profile, that is
+	 * replaced when the file size or modify time changes, or when someone
+	 * invalidates the cache (CTRL "cfgfileset" or SysFlushConfig()).
+	 */
+	if (SysGetFileInfo(pszProfilePath, FI) < 0) {
+		ErrSetErrorCode(ERR_NO_USER_PRFILE, pszProfilePath);
+		return NULL;
+	}
+	if (SysLockMutex(hCfgMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
+	if ((pSCD = pCfgSnap) != NULL) {
+		if (pSCD->llSize == FI.llSize && pSCD->tMod == FI.tMod) {
+			pSCD->iRefCount++;
+			SysUnlockMutex(hCfgMutex);
+
+			return pSCD;
+		}
+		SvrUnrefConfig(pSCD);
+		pCfgSnap = NULL;
+	}
+	ulGeneration = ulCfgGeneration;
+	SysUnlockMutex(hCfgMutex);
+
+	/*
+	 * The file is parsed outside the cache mutex, since SvrReadConfig()
+	 * takes the profile resource lock, and write lock holders might need
+	 * the cache mutex to invalidate the snapshot.
+	 */
+	if ((pSCD = SvrAllocConfig(INVALID_RLCK_HANDLE, 0, pszProfilePath)) == NULL)
+		return NULL;
+	pSCD->llSize = FI.llSize;
+	pSCD->tMod = FI.tMod;
+
+	if (SysLockMutex(hCfgMutex, SYS_INFINITE_TIMEOUT) < 0) {
+		ErrorPush();
+		SvrFreeConfig(pSCD);
+		ErrorPop();
+		return NULL;
+	}
+	/*
+	 * Publish the new snapshot only if no invalidation happened while we
+	 * were loading it. Otherwise the caller gets a private copy.
+	 */
+	if (ulGeneration == ulCfgGeneration) {
+		if (pCfgSnap != NULL)
+			SvrUnrefConfig(pCfgSnap);
+		pCfgSnap = pSCD;
+		pSCD->iRefCount++;
+	}
+	SysUnlockMutex(hCfgMutex);
+
+	return pSCD;
+}
+
 SVRCFG_HANDLE SvrGetConfigHandle(int iWriteLock)
 {
 	RLCK_HANDLE hResLock;
@@ -187,6 +308,12 @@ SVRCFG_HANDLE SvrGetConfigHandle(int iWriteLock)
 	char szResLock[SYS_MAX_PATH];
 
 	SvrGetProfileFilePath(szProfilePath, sizeof(szProfilePath));
+	if (!iWriteLock && hCfgMutex != SYS_INVALID_MUTEX) {
+		if ((pSCD = SvrGetConfigSnapshot(szProfilePath)) == NULL)
+			return INVALID_SVRCFG_HANDLE;
+
+		return (SVRCFG_HANDLE) pSCD;
+	}
 	if (iWriteLock) {
 		if ((hResLock =
 		     RLckLockEX(CfgGetBasedPath(szProfilePath, szResLock,
@@ -213,12 +340,20 @@ void SvrReleaseConfigHandle(SVRCFG_HANDLE hSvrConfig)
 {
 	ServerConfigData *pSCD = (ServerConfigData *) hSvrConfig;
 
+	if (pSCD->hResLock == INVALID_RLCK_HANDLE) {
+		/* Shared snapshot reference */
+		if (SysLockMutex(hCfgMutex, SYS_INFINITE_TIMEOUT) < 0)
+			return;
+		SvrUnrefConfig(pSCD);
+		SysUnlockMutex(hCfgMutex);
+
+		return;
+	}
 	if (pSCD->iWriteLock)
 		RLckUnlockEX(pSCD->hResLock);
 	else
 		RLckUnlockSH(pSCD->hResLock);
-	HashFree(pSCD->hHash, SvrHFreeConfigVar, NULL);
-	SysFree(pSCD);
+	SvrFreeConfig(pSCD);
 }
 
 char *SvrGetConfigVar(SVRCFG_HANDLE hSvrConfig, const char *pszName, const char *pszDefault)
@@ -294,12 +429,17 @@ int SysFlushConfig(SVRCFG_HANDLE hSvrConfig)
 	}
 	iError = SvrWriteConfig(pSCD->hHash, pFile);
 	fclose(pFile);
+	SvrInvalidateConfigCache();
 
 	return iError;
 }
 
-int SvrGetMessageID(SYS_UINT64 *pullMessageID)
+static int SvrUpdateMessageIDFile(SYS_UINT64 *pullMessageID, SYS_UINT64 ullReserve)
 {
+	/*
+	 * Load the last message ID given out, and store it back increased by
+	 * ullReserve. A zero ullReserve stores *pullMessageID instead.
+	 */
 	char szMsgIDFile[SYS_MAX_PATH] = "";
 
 	CfgGetRootPath(szMsgIDFile, sizeof(szMsgIDFile));
@@ -312,17 +452,18 @@ int SvrGetMessageID(SYS_UINT64 *pullMessageID)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pMsgIDFile = fopen(szMsgIDFile, "r+b");
+	FILE *pMsgIDFile = fopen(szMsgIDFile, ullReserve > 0 ? "r+b": "wb");
 
 	if (pMsgIDFile == NULL) {
-		if ((pMsgIDFile = fopen(szMsgIDFile, "wb")) == NULL) {
+		/* Only a missing file restarts the IDs, never a failed store */
+		if (ullReserve == 0 || (pMsgIDFile = fopen(szMsgIDFile, "wb")) == NULL) {
 			RLckUnlockEX(hResLock);
 
 			ErrSetErrorCode(ERR_FILE_CREATE, szMsgIDFile);
 			return ERR_FILE_CREATE;
 		}
 		*pullMessageID = 1;
-	} else {
+	} else if (ullReserve > 0) {
 		char szMessageID[128] = "";
 
 		if ((MscGetString(pMsgIDFile, szMessageID, sizeof(szMessageID) - 1) == NULL) ||
@@ -342,15 +483,75 @@ int SvrGetMessageID(SYS_UINT64 *pullMessageID)
 		}
 	}
 
-	++*pullMessageID;
 	fseek(pMsgIDFile, 0, SEEK_SET);
-	fprintf(pMsgIDFile, SYS_LLU_FMT "\r\n", *pullMessageID);
+	fprintf(pMsgIDFile, SYS_LLU_FMT "\r\n", *pullMessageID + ullReserve);
 	fclose(pMsgIDFile);
 	RLckUnlockEX(hResLock);
 
 	return 0;
 }
 
+int SvrInitMessageID(void)
+{
+	if ((hMsgIDMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
+		return ErrGetErrorCode();
+
+	/* The first block gets reserved with the first message */
+	ullNextMsgID = 1;
+	ullMsgIDLimit = 0;
+
+	return 0;
+}
+
+void SvrCleanupMessageID(void)
+{
+	if (hMsgIDMutex != SYS_INVALID_MUTEX) {
+		/*
+		 * Give back the unused part of the current block, so that a clean
+		 * restart does not skip it. After a crash the whole block is lost,
+		 * but IDs stay unique.
+		 */
+		if (ullNextMsgID <= ullMsgIDLimit) {
+			SYS_UINT64 ullLastID = ullNextMsgID - 1;
+
+			SvrUpdateMessageIDFile(&ullLastID, 0);
+		}
+		SysCloseMutex(hMsgIDMutex);
+		hMsgIDMutex = SYS_INVALID_MUTEX;
+	}
+}
+
+int SvrGetMessageID(SYS_UINT64 *pullMessageID)
+{
+	/* Without the allocator, fall back to one file round trip per ID */
+	if (hMsgIDMutex == SYS_INVALID_MUTEX) {
+		if (SvrUpdateMessageIDFile(pullMessageID, 1) < 0)
+			return ErrGetErrorCode();
+		++*pullMessageID;
+
+		return 0;
+	}
+	if (SysLockMutex(hMsgIDMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return ErrGetErrorCode();
+
+	/* IDs are handed out from memory, going to disk once per block */
+	if (ullNextMsgID > ullMsgIDLimit) {
+		SYS_UINT64 ullLastID;
+
+		if (SvrUpdateMessageIDFile(&ullLastID, MESSAGEID_BLOCK_SIZE) < 0) {
+			ErrorPush();
+			SysUnlockMutex(hMsgIDMutex);
+			return ErrorPop();
+		}
+		ullNextMsgID = ullLastID + 1;
+		ullMsgIDLimit = ullLastID + MESSAGEID_BLOCK_SIZE;
+	}
+	*pullMessageID = ullNextMsgID++;
+	SysUnlockMutex(hMsgIDMutex);
+
+	return 0;
+}
+
 char *SvrGetLogsDir(char *pszLogsPath, size_t sMaxPath)
 {
 	CfgGetRootPath(pszLogsPath, sMaxPath);
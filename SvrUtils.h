@@ -30,6 +30,9 @@
 typedef struct SVRCFG_HANDLE_struct {
 } *SVRCFG_HANDLE;
 
+int SvrInitConfigCache(void);
+void SvrCleanupConfigCache(void);
+void SvrInvalidateConfigCache(void);
 SVRCFG_HANDLE SvrGetConfigHandle(int iWriteLock = 0);
 void SvrReleaseConfigHandle(SVRCFG_HANDLE hSvrConfig);
 char *SvrGetConfigVar(SVRCFG_HANDLE hSvrConfig, const char *pszName,
@@ -39,6 +42,8 @@ bool SvrTestConfigFlag(const char *pszName, bool bDefault,
 int SvrGetConfigInt(const char *pszName, int iDefault,
 		    SVRCFG_HANDLE hSvrConfig = INVALID_SVRCFG_HANDLE);
 int SysFlushConfig(SVRCFG_HANDLE hSvrConfig);
+int SvrInitMessageID(void);
+void SvrCleanupMessageID(void);
 int SvrGetMessageID(SYS_UINT64 * pullMessageID);
 char *SvrGetLogsDir(char *pszLogsPath, size_t sMaxPath);
 char *SvrGetSpoolDir(char *pszSpoolPath, size_t sMaxPath);
@@ -58,6 +58,7 @@ struct SYS_FILE_INFO {
 	int iFileType;
 	SYS_OFF_T llSize;
 	time_t tMod;
+	SYS_UINT64 ullFileId;
 };
 
 struct SYS_INET_ADDR {
@@ -78,6 +79,7 @@ int SysShutdownSocket(SYS_SOCKET SockFD, int iHow);
 int SysBlockSocket(SYS_SOCKET SockFD, int iBlocking);
 int SysBindSocket(SYS_SOCKET SockFD, const SYS_INET_ADDR *SockName);
 void SysListenSocket(SYS_SOCKET SockFD, int iConnections);
+int SysSetReusePort(SYS_SOCKET SockFD);
 ssize_t SysRecvData(SYS_SOCKET SockFD, char *pszBuffer, size_t sBufferSize, int iTimeout);
 ssize_t SysRecv(SYS_SOCKET SockFD, char *pszBuffer, size_t sBufferSize, int iTimeout);
 ssize_t SysRecvDataFrom(SYS_SOCKET SockFD, SYS_INET_ADDR *pFrom, char *pszBuffer,
@@ -92,6 +94,11 @@ int SysSelect(int iMaxFD, SYS_fd_set *pReadFDs, SYS_fd_set *pWriteFDs, SYS_fd_se
 	      int iTimeout);
 int SysSendFile(SYS_SOCKET SockFD, char const *pszFileName, SYS_OFF_T llBaseOffset,
 		SYS_OFF_T llEndOffset, int iTimeout);
+SYS_HANDLE SysCreateIOPoll(void);
+void SysCloseIOPoll(SYS_HANDLE hIOPoll);
+int SysIOPollAdd(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD, void *pPrivate);
+int SysIOPollDel(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD);
+int SysIOPollWait(SYS_HANDLE hIOPoll, void **ppPrivate, int iMaxEvents, int iTimeout);
 int SysInetAnySetup(SYS_INET_ADDR &AddrInfo, int iFamily, int iPortNo);
 int SysGetAddrFamily(SYS_INET_ADDR const &AddrInfo);
 int SysGetAddrPort(SYS_INET_ADDR const &AddrInfo);
@@ -144,6 +151,8 @@ int SysTryWaitPEvent(SYS_PEVENT hPEvent);
 SYS_THREAD SysCreateThread(unsigned int (*pThreadProc) (void *), void *pThreadData);
 void SysCloseThread(SYS_THREAD ThreadID, int iForce);
 int SysSetThreadPriority(SYS_THREAD ThreadID, int iPriority);
+int SysSetThreadAffinity(SYS_THREAD ThreadID, int iCPU);
+int SysGetCPUCount(void);
 int SysWaitThread(SYS_THREAD ThreadID, int iTimeout);
 unsigned long SysGetCurrentThreadId(void);
 int SysExec(char const *pszCommand, char const *const *pszArgs, int iWaitTimeout = 0,
@@ -157,6 +166,7 @@ int SysSetTlsKeyData(SYS_TLSKEY &TlsKey, void *pData);
 void *SysGetTlsKeyData(SYS_TLSKEY &TlsKey);
 
 void SysThreadOnce(SYS_THREAD_ONCE *pThrOnce, void (*pOnceProc) (void));
+long SysInterlockedAdd(long volatile *plValue, long lIncrement);
 
 void *SysAllocNZ(size_t sSize);
 void *SysAlloc(size_t sSize);
@@ -192,9 +202,12 @@ int SysRemove(char const *pszFileName);
 int SysMakeDir(char const *pszPath);
 int SysRemoveDir(char const *pszPath);
 int SysMoveFile(char const *pszOldName, char const *pszNewName);
+int SysLinkFile(char const *pszOldName, char const *pszNewName);
 
 int SysVSNPrintf(char *pszBuffer, int iSize, char const *pszFormat, va_list Args);
 int SysFileSync(FILE *pFile);
+int SysPathSync(char const *pszPath);
+int SysFsSync(char const *pszPath);
 
 char *SysStrTok(char *pszData, char const *pszDelim, char **ppszSavePtr);
 char *SysCTime(time_t *pTimer, char *pszBuffer, size_t sBufferSize);
@@ -111,6 +111,120 @@ int SysSendFile(SYS_SOCKET SockFD, char const *pszFileName, SYS_OFF_T llBaseOffs
 
 #endif
 
+#ifdef SYS_HAS_EPOLL
+
+/*
+ * The I/O poll set is used in one-shot mode. Once a descriptor is reported
+ * ready, it is the caller responsibility to re-add it (if needed) to the set.
+ */
+SYS_HANDLE SysCreateIOPoll(void)
+{
+	IOPollData *pIOPD;
+
+	if ((pIOPD = (IOPollData *) SysAlloc(sizeof(IOPollData))) == NULL)
+		return SYS_INVALID_HANDLE;
+	if ((pIOPD->iEPollFD = epoll_create(SYS_IOPOLL_SIZEHINT)) == -1) {
+		SysFree(pIOPD);
+		ErrSetErrorCode(ERR_IOPOLL);
+		return SYS_INVALID_HANDLE;
+	}
+	fcntl(pIOPD->iEPollFD, F_SETFD, FD_CLOEXEC);
+
+	return (SYS_HANDLE) pIOPD;
+}
+
+void SysCloseIOPoll(SYS_HANDLE hIOPoll)
+{
+	IOPollData *pIOPD = (IOPollData *) hIOPoll;
+
+	if (pIOPD != NULL) {
+		close(pIOPD->iEPollFD);
+		SysFree(pIOPD);
+	}
+}
+
+int SysIOPollAdd(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD, void *pPrivate)
+{
+	IOPollData *pIOPD = (IOPollData *) hIOPoll;
+	struct epoll_event EPEvt;
+
+	ZeroData(EPEvt);
+	EPEvt.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	EPEvt.data.ptr = pPrivate;
+	if (epoll_ctl(pIOPD->iEPollFD, EPOLL_CTL_ADD, (int) SockFD, &EPEvt) == -1 &&
+	    (errno != EEXIST ||
+	     epoll_ctl(pIOPD->iEPollFD, EPOLL_CTL_MOD, (int) SockFD, &EPEvt) == -1)) {
+		ErrSetErrorCode(ERR_IOPOLL);
+		return ERR_IOPOLL;
+	}
+
+	return 0;
+}
+
+int SysIOPollDel(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD)
+{
+	IOPollData *pIOPD = (IOPollData *) hIOPoll;
+	struct epoll_event EPEvt;
+
+	/*
+	 * Pre 2.6.9 kernels want a non NULL event pointer, even for EPOLL_CTL_DEL.
+	 */
+	ZeroData(EPEvt);
+	if (epoll_ctl(pIOPD->iEPollFD, EPOLL_CTL_DEL, (int) SockFD, &EPEvt) == -1) {
+		ErrSetErrorCode(ERR_IOPOLL);
+		return ERR_IOPOLL;
+	}
+
+	return 0;
+}
+
+int SysIOPollWait(SYS_HANDLE hIOPoll, void **ppPrivate, int iMaxEvents, int iTimeout)
+{
+	IOPollData *pIOPD = (IOPollData *) hIOPoll;
+	int i, iNumEvents;
+	struct epoll_event EPEvts[SYS_IOPOLL_MAXEVENTS];
+
+	iMaxEvents = Min(iMaxEvents, (int) CountOf(EPEvts));
+	while ((iNumEvents = epoll_wait(pIOPD->iEPollFD, EPEvts, iMaxEvents,
+					iTimeout)) == -1 && errno == EINTR);
+	if (iNumEvents == -1) {
+		ErrSetErrorCode(ERR_IOPOLL);
+		return ERR_IOPOLL;
+	}
+	if (iNumEvents == 0) {
+		ErrSetErrorCode(ERR_TIMEOUT);
+		return ERR_TIMEOUT;
+	}
+	for (i = 0; i < iNumEvents; i++)
+		ppPrivate[i] = EPEvts[i].data.ptr;
+
+	return iNumEvents;
+}
+
+#endif /* SYS_HAS_EPOLL */
+
+#ifdef SYS_HAS_SYNCFS
+
+int SysFsSync(char const *pszPath)
+{
+	int iFD = open(pszPath, O_RDONLY);
+
+	if (iFD == -1) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszPath);
+		return ERR_FILE_OPEN;
+	}
+	if (syncfs(iFD)) {
+		close(iFD);
+		ErrSetErrorCode(ERR_FILE_WRITE, pszPath);
+		return ERR_FILE_WRITE;
+	}
+	close(iFD);
+
+	return 0;
+}
+
+#endif /* SYS_HAS_SYNCFS */
+
 int SysSetThreadPriority(SYS_THREAD ThreadID, int iPriority)
 {
 	ThrData *pTD = (ThrData *) ThreadID;
@@ -147,6 +261,25 @@ int SysSetThreadPriority(SYS_THREAD ThreadID, int iPriority)
 	return 0;
 }
 
+int SysSetThreadAffinity(SYS_THREAD ThreadID, int iCPU)
+{
+	ThrData *pTD = (ThrData *) ThreadID;
+	cpu_set_t CpuSet;
+
+	if (iCPU < 0 || iCPU >= CPU_SETSIZE) {
+		ErrSetErrorCode(ERR_SET_THREAD_AFFINITY);
+		return ERR_SET_THREAD_AFFINITY;
+	}
+	CPU_ZERO(&CpuSet);
+	CPU_SET(iCPU, &CpuSet);
+	if (pthread_setaffinity_np(pTD->ThreadId, sizeof(CpuSet), &CpuSet) != 0) {
+		ErrSetErrorCode(ERR_SET_THREAD_AFFINITY);
+		return ERR_SET_THREAD_AFFINITY;
+	}
+
+	return 0;
+}
+
 long SysGetTimeZone(void)
 {
 	return (long) timezone;
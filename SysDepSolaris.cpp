@@ -75,6 +75,12 @@ int SysSetThreadPriority(SYS_THREAD ThreadID, int iPriority)
 	return 0;
 }
 
+int SysSetThreadAffinity(SYS_THREAD ThreadID, int iCPU)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
 long SysGetTimeZone(void)
 {
 	return (long) timezone;
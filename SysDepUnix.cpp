@@ -572,6 +572,29 @@ void SysListenSocket(SYS_SOCKET SockFD, int iConnections)
 	listen((int) SockFD, iConnections);
 }
 
+int SysSetReusePort(SYS_SOCKET SockFD)
+{
+#ifdef SO_REUSEPORT
+	int iActivate = 1;
+
+	if (setsockopt((int) SockFD, SOL_SOCKET, SO_REUSEPORT, (const char *) &iActivate,
+		       sizeof(iActivate)) != 0) {
+		/* Kernels (or sandboxes) may know the option but refuse it */
+		if (errno == ENOPROTOOPT || errno == EINVAL || errno == EOPNOTSUPP) {
+			ErrSetErrorCode(ERR_NOT_SUPPORTED);
+			return ERR_NOT_SUPPORTED;
+		}
+		ErrSetErrorCode(ERR_SETSOCKOPT);
+		return ERR_SETSOCKOPT;
+	}
+
+	return 0;
+#else
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+#endif
+}
+
 ssize_t SysRecvData(SYS_SOCKET SockFD, char *pszBuffer, size_t sBufferSize, int iTimeout)
 {
 	ssize_t sRecvBytes;
@@ -823,6 +846,57 @@ int SysSendFile(SYS_SOCKET SockFD, char const *pszFileName, SYS_OFF_T llBaseOffs
 
 #endif /* !SYS_HAS_SENDFILE */
 
+#if !defined(SYS_HAS_SYNCFS)
+
+/*
+ * Without a way to flush a single file system, callers need to fall back
+ * to flushing the files they care about one by one.
+ */
+int SysFsSync(char const *pszPath)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+#endif /* !SYS_HAS_SYNCFS */
+
+#if !defined(SYS_HAS_EPOLL)
+
+/*
+ * Platforms w/out a scalable readiness API do not get an I/O poll set.
+ * Callers detect this and fall back to the thread-per-connection model.
+ */
+SYS_HANDLE SysCreateIOPoll(void)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return SYS_INVALID_HANDLE;
+}
+
+void SysCloseIOPoll(SYS_HANDLE hIOPoll)
+{
+
+}
+
+int SysIOPollAdd(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD, void *pPrivate)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+int SysIOPollDel(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+int SysIOPollWait(SYS_HANDLE hIOPoll, void **ppPrivate, int iMaxEvents, int iTimeout)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+#endif /* !SYS_HAS_EPOLL */
+
 SYS_SEMAPHORE SysCreateSemaphore(int iInitCount, int iMaxCount)
 {
 	SemData *pSD = (SemData *) SysAlloc(sizeof(SemData));
@@ -1385,6 +1459,11 @@ void SysThreadOnce(SYS_THREAD_ONCE *pThrOnce, void (*pOnceProc) (void))
 	pthread_once(pThrOnce, pOnceProc);
 }
 
+long SysInterlockedAdd(long volatile *plValue, long lIncrement)
+{
+	return __sync_add_and_fetch(plValue, lIncrement);
+}
+
 void *SysAllocNZ(size_t sSize)
 {
 	void *pData = malloc(sSize);
@@ -1568,6 +1647,13 @@ SYS_INT64 SysMsTime(void)
 	return 1000 * (SYS_INT64) tv.tv_sec + (SYS_INT64) tv.tv_usec / 1000;
 }
 
+int SysGetCPUCount(void)
+{
+	long lNumCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return lNumCPUs > 0 ? (int) lNumCPUs: 1;
+}
+
 int SysExistFile(char const *pszFilePath)
 {
 	struct stat FStat;
@@ -1711,6 +1797,7 @@ int SysGetFileInfo(char const *pszFileName, SYS_FILE_INFO &FI)
 		 ((S_ISLNK(stat_buffer.st_mode)) ? ftLink: ftOther));
 	FI.llSize = stat_buffer.st_size;
 	FI.tMod = stat_buffer.st_mtime;
+	FI.ullFileId = (SYS_UINT64) stat_buffer.st_ino;
 
 	return 0;
 }
@@ -1799,6 +1886,16 @@ int SysMoveFile(char const *pszOldName, char const *pszNewName)
 	return 0;
 }
 
+int SysLinkFile(char const *pszOldName, char const *pszNewName)
+{
+	if (link(pszOldName, pszNewName) != 0) {
+		ErrSetErrorCode(ERR_FILE_LINK, pszNewName);
+		return ERR_FILE_LINK;
+	}
+
+	return 0;
+}
+
 int SysVSNPrintf(char *pszBuffer, int iSize, char const *pszFormat, va_list Args)
 {
 	int iPrintResult = vsnprintf(pszBuffer, iSize, pszFormat, Args);
@@ -1816,6 +1913,24 @@ int SysFileSync(FILE *pFile)
 	return 0;
 }
 
+int SysPathSync(char const *pszPath)
+{
+	int iFD = open(pszPath, O_RDONLY);
+
+	if (iFD == -1) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszPath);
+		return ERR_FILE_OPEN;
+	}
+	if (fsync(iFD)) {
+		close(iFD);
+		ErrSetErrorCode(ERR_FILE_WRITE, pszPath);
+		return ERR_FILE_WRITE;
+	}
+	close(iFD);
+
+	return 0;
+}
+
 char *SysStrTok(char *pszData, char const *pszDelim, char **ppszSavePtr)
 {
 	return strtok_r(pszData, pszDelim, ppszSavePtr);
@@ -26,6 +26,8 @@
 #define MIN_TCP_SEND_SIZE  (1024 * 8)
 #define MAX_TCP_SEND_SIZE  (1024 * 128)
 #define K_IO_TIME_RATIO    8
+#define SYS_IOPOLL_SIZEHINT     1024
+#define SYS_IOPOLL_MAXEVENTS    256
 
 #define SYS_INVALID_EVENTFD     ((SYS_EVENTFD) 0)
 
@@ -86,6 +88,10 @@ struct FileFindData {
 	struct stat FStat;
 };
 
+struct IOPollData {
+	int iEPollFD;
+};
+
 struct MMapData {
 	unsigned long ulPageSize;
 	int iFD;
@@ -404,6 +404,12 @@ void SysListenSocket(SYS_SOCKET SockFD, int iConnections)
 	listen(SockFD, iConnections);
 }
 
+int SysSetReusePort(SYS_SOCKET SockFD)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
 static ssize_t SysRecvLL(SYS_SOCKET SockFD, char *pszBuffer, size_t sBufferSize)
 {
 	DWORD dwRtxBytes = 0;
@@ -793,6 +799,35 @@ int SysSelect(int iMaxFD, SYS_fd_set *pReadFDs, SYS_fd_set *pWriteFDs, SYS_fd_se
 	return iSelectResult;
 }
 
+SYS_HANDLE SysCreateIOPoll(void)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return SYS_INVALID_HANDLE;
+}
+
+void SysCloseIOPoll(SYS_HANDLE hIOPoll)
+{
+
+}
+
+int SysIOPollAdd(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD, void *pPrivate)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+int SysIOPollDel(SYS_HANDLE hIOPoll, SYS_SOCKET SockFD)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
+int SysIOPollWait(SYS_HANDLE hIOPoll, void **ppPrivate, int iMaxEvents, int iTimeout)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
 int SysSendFile(SYS_SOCKET SockFD, char const *pszFileName, SYS_OFF_T llBaseOffset,
 		SYS_OFF_T llEndOffset, int iTimeout)
 {
@@ -1136,6 +1171,17 @@ int SysSetThreadPriority(SYS_THREAD ThreadID, int iPriority)
 	return 0;
 }
 
+int SysSetThreadAffinity(SYS_THREAD ThreadID, int iCPU)
+{
+	if (iCPU < 0 || iCPU >= (int) (sizeof(DWORD_PTR) * 8) ||
+	    SetThreadAffinityMask((HANDLE) ThreadID, (DWORD_PTR) 1 << iCPU) == 0) {
+		ErrSetErrorCode(ERR_SET_THREAD_AFFINITY);
+		return ERR_SET_THREAD_AFFINITY;
+	}
+
+	return 0;
+}
+
 int SysWaitThread(SYS_THREAD ThreadID, int iTimeout)
 {
 	if (WaitForSingleObject((HANDLE) ThreadID,
@@ -1320,6 +1366,11 @@ void SysThreadOnce(SYS_THREAD_ONCE *pThrOnce, void (*pOnceProc) (void))
 		Sleep(0);
 }
 
+long SysInterlockedAdd(long volatile *plValue, long lIncrement)
+{
+	return InterlockedExchangeAdd(plValue, lIncrement) + lIncrement;
+}
+
 void *SysAllocNZ(size_t sSize)
 {
 	void *pData = malloc(sSize);
@@ -1542,6 +1593,15 @@ SYS_INT64 SysMsTime(void)
 	return MsTicks;
 }
 
+int SysGetCPUCount(void)
+{
+	SYSTEM_INFO SI;
+
+	GetSystemInfo(&SI);
+
+	return SI.dwNumberOfProcessors > 0 ? (int) SI.dwNumberOfProcessors: 1;
+}
+
 int SysExistFile(char const *pszFilePath)
 {
 	DWORD dwAttr = GetFileAttributes(pszFilePath);
@@ -1646,6 +1706,7 @@ int SysGetFileInfo(char const *pszFileName, SYS_FILE_INFO &FI)
 	FI.iFileType = (WFD.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? ftDirectory: ftNormal;
 	FI.llSize = (SYS_OFF_T) WFD.nFileSizeLow | (((SYS_OFF_T) WFD.nFileSizeHigh) << 32);
 	FI.tMod = SysFileTimeToTimet(&WFD.ftLastWriteTime);
+	/* Not available from the find data, ullFileId stays zero */
 
 	FindClose(hFind);
 
@@ -1763,6 +1824,16 @@ int SysMoveFile(char const *pszOldName, char const *pszNewName)
 	return 0;
 }
 
+int SysLinkFile(char const *pszOldName, char const *pszNewName)
+{
+	if (!CreateHardLink(pszNewName, pszOldName, NULL)) {
+		ErrSetErrorCode(ERR_FILE_LINK, pszNewName);
+		return ERR_FILE_LINK;
+	}
+
+	return 0;
+}
+
 int SysVSNPrintf(char *pszBuffer, int iSize, char const *pszFormat, va_list Args)
 {
 	return _vsnprintf(pszBuffer, iSize, pszFormat, Args);
@@ -1778,6 +1849,34 @@ int SysFileSync(FILE *pFile)
 	return 0;
 }
 
+int SysPathSync(char const *pszPath)
+{
+	/* NTFS directory updates do not need (nor allow) an explicit flush */
+	if (SysExistDir(pszPath))
+		return 0;
+
+	int iFD = _open(pszPath, _O_RDWR | _O_BINARY);
+
+	if (iFD == -1) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszPath);
+		return ERR_FILE_OPEN;
+	}
+	if (_commit(iFD)) {
+		_close(iFD);
+		ErrSetErrorCode(ERR_FILE_WRITE, pszPath);
+		return ERR_FILE_WRITE;
+	}
+	_close(iFD);
+
+	return 0;
+}
+
+int SysFsSync(char const *pszPath)
+{
+	ErrSetErrorCode(ERR_NOT_SUPPORTED);
+	return ERR_NOT_SUPPORTED;
+}
+
 char *SysStrTok(char *pszData, char const *pszDelim, char **ppszSavePtr)
 {
 	return *ppszSavePtr = strtok(pszData, pszDelim);
@@ -65,4 +65,8 @@
 #include <sys/eventfd.h>
 #endif
 
+#ifdef SYS_HAS_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #endif
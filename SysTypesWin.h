@@ -39,6 +39,7 @@
 
 #define SYS_EOL                 "\r\n"
 #define SYS_CRLF_EOL            1
+#define SYS_MMAP_LOCKS_FILE     1
 #define SYS_SLASH_CHAR          '\\'
 #define SYS_SLASH_STR           "\\"
 #define SYS_BASE_FS_STR         "\\\\?\\"
@@ -23,10 +23,10 @@
 #include "SysInclude.h"
 #include "SysDep.h"
 #include "SvrDefines.h"
-#include "Array.h"
 #include "ShBlocks.h"
 #include "StrUtils.h"
 #include "SList.h"
+#include "Hash.h"
 #include "BuffSock.h"
 #include "MiscUtils.h"
 #include "TabIndex.h"
@@ -34,7 +34,7 @@
 /*
  * The index version MUST be incremented at every file format change!
  */
-#define TAB_INDEX_CURR_VERSION      3
+#define TAB_INDEX_CURR_VERSION      4
 
 #define TAB_SAMPLE_LINES            32
 #define TAB_MIN_HASH_SIZE           17
@@ -44,6 +44,8 @@
 #define TAB_RECORD_BUFFER_SIZE      2048
 #define TOKEN_SEP_STR               "\t"
 #define TAB_INIT_RESSET_SIZE        128
+#define TAB_MAP_HASH_INIT           32
+#define TAB_MIN_OVERFLOW            64
 
 
 struct TabHashLink {
@@ -56,10 +58,22 @@ struct TabHashNode {
 	TabIdxUINT uCount;
 };
 
+/*
+ * Index file layout: header, main table with the offsets of the bucket
+ * tables, overflow chain heads, bucket tables, overflow links. Overflow
+ * links are appended by TbixAppendRecord() and folded into the bucket
+ * tables by the next full rebuild.
+ */
 struct TabHashFileHeader {
 	SYS_UINT32 uMagic;
 	SYS_UINT32 uVersion;
 	SYS_UINT32 uHashSize;
+	SYS_UINT32 uOvfCount;
+};
+
+struct TabOvfLink {
+	TabIdxUINT uNext;
+	TabIdxUINT uOffset;
 };
 
 struct TabHashIndex {
@@ -67,15 +81,207 @@ struct TabHashIndex {
 	FILE *pIdxFile;
 };
 
+struct TabMapFile {
+	HashNode HN;
+	int iRefCount;
+	bool bCached;
+	SYS_MMAP hMap;
+	char const *pData;
+	SYS_OFF_T llSize;
+	time_t tMod;
+	SYS_UINT64 ullFileId;
+};
+
 struct IndexLookupData {
-	ARRAY_HANDLE hArray;
+	TabIdxUINT *pOffsets;
 	long lRecCount;
-	FILE *pTabFile;
-	TabIdxUINT *pHTblC;
-	long lArIdx;
-	long lHTblI;
+	long lCurrRec;
+	TabMapFile *pIdxMap;
+	TabMapFile *pTabMap;
 };
 
+static SYS_MUTEX hTbixMapMutex = SYS_INVALID_MUTEX;
+static HASH_HANDLE hTbixMapHash = INVALID_HASH_HANDLE;
+
+
+static void TbixFreeMap(TabMapFile *pTMF)
+{
+	if (pTMF->pData != NULL)
+		SysUnmapMMap(pTMF->hMap, (void *) pTMF->pData, (SYS_SIZE_T) pTMF->llSize);
+	SysCloseMMap(pTMF->hMap);
+	SysFree(pTMF->HN.Key.pData);
+	SysFree(pTMF);
+}
+
+static void TbixHFreeMap(void *pPrivate, HashNode *pHN)
+{
+	TabMapFile *pTMF = SYS_LIST_ENTRY(pHN, TabMapFile, HN);
+
+	TbixFreeMap(pTMF);
+}
+
+static TabMapFile *TbixCreateMap(char const *pszFilePath, SYS_FILE_INFO const &FI)
+{
+	TabMapFile *pTMF;
+
+	if ((pTMF = (TabMapFile *) SysAlloc(sizeof(TabMapFile))) == NULL)
+		return NULL;
+	HashInitNode(&pTMF->HN);
+	if ((pTMF->HN.Key.pData = SysStrDup(pszFilePath)) == NULL) {
+		SysFree(pTMF);
+		return NULL;
+	}
+	if ((pTMF->hMap = SysCreateMMap(pszFilePath, SYS_MMAP_READ)) == SYS_INVALID_MMAP) {
+		ErrorPush();
+		SysFree(pTMF->HN.Key.pData);
+		SysFree(pTMF);
+		ErrorPop();
+		return NULL;
+	}
+	pTMF->iRefCount = 1;
+	pTMF->llSize = SysMMapSize(pTMF->hMap);
+	pTMF->tMod = FI.tMod;
+	pTMF->ullFileId = FI.ullFileId;
+
+	/* Empty files get no mapping, lookups will just find nothing */
+	if (pTMF->llSize > 0 &&
+	    (pTMF->pData = (char const *) SysMapMMap(pTMF->hMap, 0,
+						     (SYS_SIZE_T) pTMF->llSize)) == NULL) {
+		ErrorPush();
+		SysCloseMMap(pTMF->hMap);
+		SysFree(pTMF->HN.Key.pData);
+		SysFree(pTMF);
+		ErrorPop();
+		return NULL;
+	}
+
+	return pTMF;
+}
+
+int TbixInitCache(void)
+{
+#ifndef SYS_MMAP_LOCKS_FILE
+	HashOps HOps;
+
+	if ((hTbixMapMutex = SysCreateMutex()) == SYS_INVALID_MUTEX)
+		return ErrGetErrorCode();
+	ZeroData(HOps);
+	HOps.pGetHashVal = MscStringHashCB;
+	HOps.pCompare = MscStringCompareCB;
+	if ((hTbixMapHash = HashCreate(&HOps, TAB_MAP_HASH_INIT)) == INVALID_HASH_HANDLE) {
+		ErrorPush();
+		SysCloseMutex(hTbixMapMutex);
+		hTbixMapMutex = SYS_INVALID_MUTEX;
+		return ErrorPop();
+	}
+#endif
+
+	return 0;
+}
+
+void TbixCleanupCache(void)
+{
+	if (hTbixMapMutex != SYS_INVALID_MUTEX) {
+		HashFree(hTbixMapHash, TbixHFreeMap, NULL);
+		hTbixMapHash = INVALID_HASH_HANDLE;
+		SysCloseMutex(hTbixMapMutex);
+		hTbixMapMutex = SYS_INVALID_MUTEX;
+	}
+}
+
+static void TbixUnrefMap(TabMapFile *pTMF)
+{
+	/* Must be called with hTbixMapMutex held, if the cache is active */
+	if (--pTMF->iRefCount == 0)
+		TbixFreeMap(pTMF);
+}
+
+static void TbixDropCachedMap(TabMapFile *pTMF)
+{
+	HashDel(hTbixMapHash, &pTMF->HN);
+	pTMF->bCached = false;
+	TbixUnrefMap(pTMF);
+}
+
+static TabMapFile *TbixGetMap(char const *pszFilePath)
+{
+	SYS_FILE_INFO FI;
+	TabMapFile *pTMF;
+
+	if (SysGetFileInfo(pszFilePath, FI) < 0) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszFilePath);
+		return NULL;
+	}
+	if (hTbixMapMutex == SYS_INVALID_MUTEX)
+		return TbixCreateMap(pszFilePath, FI);
+
+	/*
+	 * Mappings are kept across lookups, and replaced when the size, the
+	 * modify time or the inode of the file changes. The inode catches a
+	 * table replaced by a rename within the same second, with the same
+	 * size. Callers hold the table resource lock, so the file cannot be
+	 * rewritten while it is being walked.
+	 */
+	HashNode *pHNode;
+	HashEnum HEnum;
+	HashDatum Key;
+
+	if (SysLockMutex(hTbixMapMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return NULL;
+	Key.pData = (void *) pszFilePath;
+	if (HashGetFirst(hTbixMapHash, &Key, &HEnum, &pHNode) == 0) {
+		pTMF = SYS_LIST_ENTRY(pHNode, TabMapFile, HN);
+		if (pTMF->llSize == FI.llSize && pTMF->tMod == FI.tMod &&
+		    pTMF->ullFileId == FI.ullFileId) {
+			pTMF->iRefCount++;
+			SysUnlockMutex(hTbixMapMutex);
+
+			return pTMF;
+		}
+		TbixDropCachedMap(pTMF);
+	}
+	if ((pTMF = TbixCreateMap(pszFilePath, FI)) == NULL ||
+	    HashAdd(hTbixMapHash, &pTMF->HN) < 0) {
+		ErrorPush();
+		if (pTMF != NULL)
+			TbixFreeMap(pTMF);
+		SysUnlockMutex(hTbixMapMutex);
+		ErrorPop();
+		return NULL;
+	}
+	pTMF->bCached = true;
+	pTMF->iRefCount++;
+	SysUnlockMutex(hTbixMapMutex);
+
+	return pTMF;
+}
+
+static void TbixReleaseMap(TabMapFile *pTMF)
+{
+	if (hTbixMapMutex == SYS_INVALID_MUTEX) {
+		TbixUnrefMap(pTMF);
+		return;
+	}
+	if (SysLockMutex(hTbixMapMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return;
+	TbixUnrefMap(pTMF);
+	SysUnlockMutex(hTbixMapMutex);
+}
+
+static void TbixInvalidateMap(char const *pszFilePath)
+{
+	HashNode *pHNode;
+	HashEnum HEnum;
+	HashDatum Key;
+
+	if (hTbixMapMutex == SYS_INVALID_MUTEX ||
+	    SysLockMutex(hTbixMapMutex, SYS_INFINITE_TIMEOUT) < 0)
+		return;
+	Key.pData = (void *) pszFilePath;
+	if (HashGetFirst(hTbixMapHash, &Key, &HEnum, &pHNode) == 0)
+		TbixDropCachedMap(SYS_LIST_ENTRY(pHNode, TabMapFile, HN));
+	SysUnlockMutex(hTbixMapMutex);
+}
 
 static int TbixCalcHashSize(FILE *pTabFile, char *pszLnBuff, int iBufferSize)
 {
@@ -164,7 +370,7 @@ int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCa
 		pHashFunc = TbixCalculateHash;
 
 	/* Build index file name */
-	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) < 0)
+	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) == NULL)
 		return ErrGetErrorCode();
 
 	if ((pTabFile = fopen(pszTabFilePath, "rb")) == NULL) {
@@ -228,6 +434,7 @@ int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCa
 	HFH.uMagic = TAB_INDEX_MAGIC;
 	HFH.uVersion = TAB_INDEX_CURR_VERSION;
 	HFH.uHashSize = iHashSize;
+	HFH.uOvfCount = 0;
 
 	if (!fwrite(&HFH, sizeof(HFH), 1, pIdxFile)) {
 		fclose(pIdxFile);
@@ -238,7 +445,7 @@ int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCa
 		return ERR_FILE_WRITE;
 	}
 	/* Dump main table */
-	TabIdxUINT uCurrOffset = sizeof(HFH) + iHashSize * sizeof(TabIdxUINT);
+	TabIdxUINT uCurrOffset = sizeof(HFH) + 2 * iHashSize * sizeof(TabIdxUINT);
 
 	for (i = 0; i < iHashSize; i++) {
 		TabIdxUINT uTableOffset = 0;
@@ -257,6 +464,20 @@ int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCa
 		}
 	}
 
+	/* Dump empty overflow chain heads */
+	for (i = 0; i < iHashSize; i++) {
+		TabIdxUINT uOvfHead = 0;
+
+		if (!fwrite(&uOvfHead, sizeof(uOvfHead), 1, pIdxFile)) {
+			fclose(pIdxFile);
+			SysRemove(szIdxFile);
+			TbixFreeHash(pHash, iHashSize);
+
+			ErrSetErrorCode(ERR_FILE_WRITE);
+			return ERR_FILE_WRITE;
+		}
+	}
+
 	/* Dump hash tables */
 	for (i = 0; i < iHashSize; i++) {
 		TabIdxUINT uRecCount = pHash[i].uCount;
@@ -293,6 +514,151 @@ int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCa
 	fclose(pIdxFile);
 	TbixFreeHash(pHash, iHashSize);
 
+	/* Drop the cached mappings, since the offsets just changed */
+	TbixInvalidateMap(szIdxFile);
+	TbixInvalidateMap(pszTabFilePath);
+
+	return 0;
+}
+
+static int TbixLoadHashValue(char const *pszTabFilePath, SYS_OFF_T llRecOffset,
+			     int const *piFieldsIdx, bool bCaseSens,
+			     int (*pHashFunc) (char const *const *, int const *,
+					       unsigned long *, bool),
+			     unsigned long *pulHashVal)
+{
+	FILE *pTabFile;
+	char **ppszToks;
+	char szLnBuff[TAB_RECORD_BUFFER_SIZE];
+
+	if ((pTabFile = fopen(pszTabFilePath, "rb")) == NULL) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszTabFilePath);
+		return ERR_FILE_OPEN;
+	}
+	if (Sys_fseek(pTabFile, llRecOffset, SEEK_SET) != 0 ||
+	    MscGetString(pTabFile, szLnBuff, sizeof(szLnBuff) - 1) == NULL) {
+		fclose(pTabFile);
+		ErrSetErrorCode(ERR_FILE_READ, pszTabFilePath);
+		return ERR_FILE_READ;
+	}
+	fclose(pTabFile);
+
+	/* Same rules of TbixCreateIndex() for what gets indexed */
+	if (szLnBuff[0] == TAB_COMMENT_CHAR ||
+	    (ppszToks = StrGetTabLineStrings(szLnBuff)) == NULL) {
+		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
+		return ERR_RECORD_NOT_FOUND;
+	}
+	if ((*pHashFunc)(ppszToks, piFieldsIdx, pulHashVal, bCaseSens) < 0) {
+		StrFreeStrings(ppszToks);
+		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
+		return ERR_RECORD_NOT_FOUND;
+	}
+	StrFreeStrings(ppszToks);
+
+	return 0;
+}
+
+static int TbixAppendOverflow(char const *pszIdxFile, unsigned long ulHashVal,
+			      TabIdxUINT uRecOffset)
+{
+	FILE *pIdxFile;
+	SYS_OFF_T llHeadOffset, llLinkOffset;
+	TabOvfLink OvfLink;
+	TabHashFileHeader HFH;
+
+	if ((pIdxFile = fopen(pszIdxFile, "r+b")) == NULL) {
+		ErrSetErrorCode(ERR_FILE_OPEN, pszIdxFile);
+		return ERR_FILE_OPEN;
+	}
+	if (!fread(&HFH, sizeof(HFH), 1, pIdxFile) || HFH.uMagic != TAB_INDEX_MAGIC ||
+	    HFH.uVersion != TAB_INDEX_CURR_VERSION) {
+		fclose(pIdxFile);
+		ErrSetErrorCode(ERR_BAD_INDEX_FILE, pszIdxFile);
+		return ERR_BAD_INDEX_FILE;
+	}
+	/*
+	 * Too many appended records make the chains long, so let the caller
+	 * compact them into a fresh index. This keeps appends O(1) amortized.
+	 */
+	if (HFH.uOvfCount >= (SYS_UINT32) Max(TAB_MIN_OVERFLOW, HFH.uHashSize / 2)) {
+		fclose(pIdxFile);
+		ErrSetErrorCode(ERR_INDEX_COMPACT);
+		return ERR_INDEX_COMPACT;
+	}
+	llHeadOffset = sizeof(HFH) +
+		(HFH.uHashSize + ulHashVal % HFH.uHashSize) * sizeof(TabIdxUINT);
+	if (Sys_fseek(pIdxFile, llHeadOffset, SEEK_SET) != 0 ||
+	    !fread(&OvfLink.uNext, sizeof(OvfLink.uNext), 1, pIdxFile) ||
+	    Sys_fseek(pIdxFile, 0, SEEK_END) != 0) {
+		fclose(pIdxFile);
+		ErrSetErrorCode(ERR_FILE_READ, pszIdxFile);
+		return ERR_FILE_READ;
+	}
+	llLinkOffset = Sys_ftell(pIdxFile);
+	if (llLinkOffset + (SYS_OFF_T) sizeof(OvfLink) > (SYS_OFF_T) ((TabIdxUINT) -1)) {
+		fclose(pIdxFile);
+		ErrSetErrorCode(ERR_INDEX_COMPACT);
+		return ERR_INDEX_COMPACT;
+	}
+	OvfLink.uOffset = uRecOffset;
+
+	/* Link first, then head and count, so a partial update is harmless */
+	TabIdxUINT uNewHead = (TabIdxUINT) llLinkOffset;
+
+	HFH.uOvfCount++;
+	if (!fwrite(&OvfLink, sizeof(OvfLink), 1, pIdxFile) ||
+	    Sys_fseek(pIdxFile, llHeadOffset, SEEK_SET) != 0 ||
+	    !fwrite(&uNewHead, sizeof(uNewHead), 1, pIdxFile) ||
+	    Sys_fseek(pIdxFile, 0, SEEK_SET) != 0 ||
+	    !fwrite(&HFH, sizeof(HFH), 1, pIdxFile)) {
+		fclose(pIdxFile);
+		ErrSetErrorCode(ERR_FILE_WRITE, pszIdxFile);
+		return ERR_FILE_WRITE;
+	}
+	if (fclose(pIdxFile) != 0) {
+		ErrSetErrorCode(ERR_FILE_WRITE, pszIdxFile);
+		return ERR_FILE_WRITE;
+	}
+
+	return 0;
+}
+
+int TbixAppendRecord(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens,
+		     SYS_OFF_T llRecOffset, time_t tTabMod,
+		     int (*pHashFunc) (char const *const *, int const *, unsigned long *,
+				       bool))
+{
+	unsigned long ulHashVal;
+	SYS_FILE_INFO FI;
+	char szIdxFile[SYS_MAX_PATH];
+
+	/* Adjust hash function */
+	if (pHashFunc == NULL)
+		pHashFunc = TbixCalculateHash;
+	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) == NULL)
+		return ErrGetErrorCode();
+
+	/*
+	 * Records that would not be indexed by a full rebuild leave the index
+	 * as is. Any trouble with the index file (or the need to compact it)
+	 * falls back to a full rebuild. So does an index older than the table
+	 * was before the caller write (tTabMod), since it missed some change
+	 * done behind our back, like a table edited by hand.
+	 */
+	if (llRecOffset > (SYS_OFF_T) ((TabIdxUINT) -1) ||
+	    SysGetFileInfo(szIdxFile, FI) < 0 || FI.tMod < tTabMod)
+		return TbixCreateIndex(pszTabFilePath, piFieldsIdx, bCaseSens, pHashFunc);
+	if (TbixLoadHashValue(pszTabFilePath, llRecOffset, piFieldsIdx, bCaseSens,
+			      pHashFunc, &ulHashVal) < 0)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0:
+			TbixCreateIndex(pszTabFilePath, piFieldsIdx, bCaseSens, pHashFunc);
+	if (TbixAppendOverflow(szIdxFile, ulHashVal, (TabIdxUINT) llRecOffset) < 0)
+		return TbixCreateIndex(pszTabFilePath, piFieldsIdx, bCaseSens, pHashFunc);
+
+	TbixInvalidateMap(szIdxFile);
+	TbixInvalidateMap(pszTabFilePath);
+
 	return 0;
 }
 
@@ -393,77 +759,123 @@ static int TbixCheckIndex(char const *pszIdxFile)
 	return 0;
 }
 
-static TabIdxUINT *TbixReadTable(TabHashIndex &THI, unsigned long ulHashVal)
+static TabMapFile *TbixGetIndexMap(char const *pszIdxFile)
 {
-	unsigned long ulHashIndex;
-	TabIdxUINT uTableOffset, uTableSize;
-	SYS_OFF_T llTblOffset;
-	TabIdxUINT *pOffTbl;
+	TabMapFile *pIdxMap = TbixGetMap(pszIdxFile);
 
-	ulHashIndex = ulHashVal % THI.HFH.uHashSize;
-	llTblOffset = sizeof(TabHashFileHeader) + ulHashIndex * sizeof(TabIdxUINT);
-	if (Sys_fseek(THI.pIdxFile, llTblOffset, SEEK_SET) != 0) {
-		ErrSetErrorCode(ERR_BAD_INDEX_FILE);
+	if (pIdxMap == NULL)
 		return NULL;
-	}
-	if (!fread(&uTableOffset, sizeof(uTableOffset), 1, THI.pIdxFile)) {
-		ErrSetErrorCode(ERR_FILE_READ);
+
+	TabHashFileHeader const *pHFH = (TabHashFileHeader const *) pIdxMap->pData;
+
+	if (pIdxMap->llSize < (SYS_OFF_T) sizeof(TabHashFileHeader) ||
+	    pHFH->uMagic != TAB_INDEX_MAGIC || pHFH->uVersion != TAB_INDEX_CURR_VERSION ||
+	    pIdxMap->llSize < (SYS_OFF_T) (sizeof(TabHashFileHeader) +
+					   2 * pHFH->uHashSize * sizeof(TabIdxUINT))) {
+		TbixReleaseMap(pIdxMap);
+
+		ErrSetErrorCode(ERR_BAD_INDEX_FILE, pszIdxFile);
 		return NULL;
 	}
-	if (uTableOffset == 0) {
+
+	return pIdxMap;
+}
+
+static int TbixGetBucket(TabMapFile const *pIdxMap, unsigned long ulHashVal,
+			 TabIdxUINT const **ppOffTbl, TabIdxUINT *puOvfHead)
+{
+	TabHashFileHeader const *pHFH = (TabHashFileHeader const *) pIdxMap->pData;
+	TabIdxUINT const *pMainTbl = (TabIdxUINT const *) (pHFH + 1);
+	unsigned long ulHashIndex = ulHashVal % pHFH->uHashSize;
+	TabIdxUINT uTableOffset = pMainTbl[ulHashIndex];
+
+	*ppOffTbl = NULL;
+	*puOvfHead = pMainTbl[pHFH->uHashSize + ulHashIndex];
+	if (uTableOffset != 0) {
+		if ((SYS_OFF_T) uTableOffset + (SYS_OFF_T) sizeof(TabIdxUINT) > pIdxMap->llSize) {
+			ErrSetErrorCode(ERR_BAD_INDEX_FILE);
+			return ERR_BAD_INDEX_FILE;
+		}
+
+		/* The record count is followed by the record offsets */
+		TabIdxUINT const *pOffTbl = (TabIdxUINT const *) (pIdxMap->pData + uTableOffset);
+
+		if ((SYS_OFF_T) uTableOffset +
+		    (SYS_OFF_T) (pOffTbl[0] + 1) * (SYS_OFF_T) sizeof(TabIdxUINT) >
+		    pIdxMap->llSize) {
+			ErrSetErrorCode(ERR_BAD_INDEX_FILE);
+			return ERR_BAD_INDEX_FILE;
+		}
+		*ppOffTbl = pOffTbl;
+	}
+	if (*ppOffTbl == NULL && *puOvfHead == 0) {
 		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
-		return NULL;
+		return ERR_RECORD_NOT_FOUND;
 	}
-	if (Sys_fseek(THI.pIdxFile, uTableOffset, SEEK_SET) != 0) {
+
+	return 0;
+}
+
+static TabOvfLink const *TbixGetOvfLink(TabMapFile const *pIdxMap, TabIdxUINT uLink)
+{
+	if ((SYS_OFF_T) uLink + (SYS_OFF_T) sizeof(TabOvfLink) > pIdxMap->llSize) {
 		ErrSetErrorCode(ERR_BAD_INDEX_FILE);
 		return NULL;
 	}
-	if (!fread(&uTableSize, sizeof(uTableSize), 1, THI.pIdxFile)) {
-		ErrSetErrorCode(ERR_FILE_READ);
-		return NULL;
-	}
-	if ((pOffTbl = (TabIdxUINT *)
-	     SysAlloc((uTableSize + 1) * sizeof(TabIdxUINT))) == NULL)
-		return NULL;
-	pOffTbl[0] = uTableSize;
-	if (!fread(&pOffTbl[1], uTableSize * sizeof(TabIdxUINT), 1,
-		   THI.pIdxFile)) {
-		SysFree(pOffTbl);
-		ErrSetErrorCode(ERR_FILE_READ);
-		return NULL;
-	}
 
-	return pOffTbl;
+	return (TabOvfLink const *) (pIdxMap->pData + uLink);
 }
 
-static char **TbixLoadRecord(FILE *pTabFile, TabIdxUINT uOffset)
+static char **TbixLoadRecord(TabMapFile const *pTabMap, TabIdxUINT uOffset)
 {
+	char const *pszLine, *pszEnd, *pszEOL;
+	size_t sLength;
 	char szLnBuff[TAB_RECORD_BUFFER_SIZE];
 
-	if (Sys_fseek(pTabFile, uOffset, SEEK_SET) != 0) {
+	if ((SYS_OFF_T) uOffset >= pTabMap->llSize) {
 		ErrSetErrorCode(ERR_BAD_INDEX_FILE);
 		return NULL;
 	}
-	if (MscGetString(pTabFile, szLnBuff,
-			 sizeof(szLnBuff) - 1) == NULL) {
-		ErrSetErrorCode(ERR_FILE_READ);
-		return NULL;
-	}
+	pszLine = pTabMap->pData + uOffset;
+	pszEnd = pTabMap->pData + pTabMap->llSize;
+	if ((pszEOL = (char const *) memchr(pszLine, '\n', pszEnd - pszLine)) == NULL)
+		pszEOL = pszEnd;
+	for (; pszEOL > pszLine && pszEOL[-1] == '\r'; pszEOL--);
+	sLength = Min((size_t) (pszEOL - pszLine), sizeof(szLnBuff) - 1);
+	memcpy(szLnBuff, pszLine, sLength);
+	szLnBuff[sLength] = '\0';
 
 	return StrGetTabLineStrings(szLnBuff);
 }
 
+static char **TbixMatchRecord(TabMapFile const *pTabMap, TabIdxUINT uOffset,
+			     int const *piFieldsIdx, bool bCaseSens, char const *pszRefKey)
+{
+	char **ppszToks = TbixLoadRecord(pTabMap, uOffset);
+	char szKey[KEY_BUFFER_SIZE];
+
+	if (ppszToks == NULL)
+		return NULL;
+	if (TbixBuildKey(szKey, ppszToks, piFieldsIdx, bCaseSens) == 0 &&
+	    (bCaseSens ? strcmp(szKey, pszRefKey): stricmp(szKey, pszRefKey)) == 0)
+		return ppszToks;
+	StrFreeStrings(ppszToks);
+
+	return NULL;
+}
+
 char **TbixLookup(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens, ...)
 {
 	int i, iHashNodes;
 	unsigned long ulHashVal;
-	TabIdxUINT *pHashTable;
-	FILE *pTabFile;
+	TabIdxUINT uOvfLink, uOvfCount;
+	TabIdxUINT const *pHashTable;
+	TabMapFile *pIdxMap, *pTabMap;
+	char **ppszToks;
 	va_list Args;
-	TabHashIndex THI;
 	char szIdxFile[SYS_MAX_PATH], szRefKey[KEY_BUFFER_SIZE];
 
-	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) < 0)
+	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) == NULL)
 		return NULL;
 
 	/* Calculate key & hash */
@@ -474,51 +886,56 @@ char **TbixLookup(char const *pszTabFilePath, int const *piFieldsIdx, bool bCase
 	}
 	va_end(Args);
 
-	/* Open index */
+	/* Walk the mapped index */
 	ulHashVal = MscHashString(szRefKey, strlen(szRefKey));
-	if (TbixOpenIndex(szIdxFile, THI) < 0)
+	if ((pIdxMap = TbixGetIndexMap(szIdxFile)) == NULL)
 		return NULL;
-
-	/* Try to lookup records */
-	pHashTable = TbixReadTable(THI, ulHashVal);
-
-	TbixCloseIndex(THI);
-	if (pHashTable == NULL)
+	if (TbixGetBucket(pIdxMap, ulHashVal, &pHashTable, &uOvfLink) < 0) {
+		ErrorPush();
+		TbixReleaseMap(pIdxMap);
+		ErrorPop();
 		return NULL;
+	}
 
 	/* Search for the matched one */
-	if ((pTabFile = fopen(pszTabFilePath, "rb")) == NULL) {
-		SysFree(pHashTable);
+	if ((pTabMap = TbixGetMap(pszTabFilePath)) == NULL) {
+		TbixReleaseMap(pIdxMap);
 		ErrSetErrorCode(ERR_FILE_OPEN, pszTabFilePath);
 		return NULL;
 	}
 
-	iHashNodes = (int) pHashTable[0];
+	iHashNodes = pHashTable != NULL ? (int) pHashTable[0]: 0;
 	for (i = 0; i < iHashNodes; i++) {
-		char **ppszToks = TbixLoadRecord(pTabFile, pHashTable[i + 1]);
-		char szKey[KEY_BUFFER_SIZE];
-
-		if (ppszToks != NULL) {
-			if (TbixBuildKey(szKey, ppszToks, piFieldsIdx, bCaseSens) == 0) {
-				if (bCaseSens) {
-					if (strcmp(szKey, szRefKey) == 0) {
-						fclose(pTabFile);
-						SysFree(pHashTable);
-						return ppszToks;
-					}
-				} else {
-					if (stricmp(szKey, szRefKey) == 0) {
-						fclose(pTabFile);
-						SysFree(pHashTable);
-						return ppszToks;
-					}
-				}
-			}
-			StrFreeStrings(ppszToks);
+		if ((ppszToks = TbixMatchRecord(pTabMap, pHashTable[i + 1], piFieldsIdx,
+						bCaseSens, szRefKey)) != NULL) {
+			TbixReleaseMap(pTabMap);
+			TbixReleaseMap(pIdxMap);
+			return ppszToks;
 		}
 	}
-	fclose(pTabFile);
-	SysFree(pHashTable);
+	/* Then the records appended after the last rebuild */
+	uOvfCount = ((TabHashFileHeader const *) pIdxMap->pData)->uOvfCount;
+	for (; uOvfLink != 0 && uOvfCount > 0; uOvfCount--) {
+		TabOvfLink const *pLink = TbixGetOvfLink(pIdxMap, uOvfLink);
+
+		/* A broken chain must not look like a missing record */
+		if (pLink == NULL) {
+			ErrorPush();
+			TbixReleaseMap(pTabMap);
+			TbixReleaseMap(pIdxMap);
+			ErrorPop();
+			return NULL;
+		}
+		if ((ppszToks = TbixMatchRecord(pTabMap, pLink->uOffset, piFieldsIdx,
+						bCaseSens, szRefKey)) != NULL) {
+			TbixReleaseMap(pTabMap);
+			TbixReleaseMap(pIdxMap);
+			return ppszToks;
+		}
+		uOvfLink = pLink->uNext;
+	}
+	TbixReleaseMap(pTabMap);
+	TbixReleaseMap(pIdxMap);
 
 	ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
 
@@ -533,7 +950,7 @@ int TbixCheckIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCas
 	char szIdxFile[SYS_MAX_PATH];
 
 	if (SysGetFileInfo(pszTabFilePath, FI_Tab) < 0 ||
-	    TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) < 0)
+	    TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) == NULL)
 		return ErrGetErrorCode();
 	if (SysGetFileInfo(szIdxFile, FI_Index) < 0 || FI_Tab.tMod > FI_Index.tMod ||
 	    TbixCheckIndex(szIdxFile) < 0) {
@@ -546,60 +963,96 @@ int TbixCheckIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCas
 	return 0;
 }
 
+static long TbixCollectBucket(TabMapFile const *pIdxMap, unsigned long ulHashVal,
+			      TabIdxUINT *pOffsets)
+{
+	long lCount = 0;
+	TabIdxUINT uOvfLink, uOvfCount;
+	TabIdxUINT const *pHashTable;
+
+	/*
+	 * Store (if pOffsets is not NULL) and count the record offsets of the
+	 * bucket, in file order.
+	 */
+	if (TbixGetBucket(pIdxMap, ulHashVal, &pHashTable, &uOvfLink) < 0)
+		return 0;
+	if (pHashTable != NULL) {
+		if (pOffsets != NULL)
+			memcpy(pOffsets, &pHashTable[1], pHashTable[0] * sizeof(TabIdxUINT));
+		lCount = (long) pHashTable[0];
+	}
+
+	long lOvfStart = lCount;
+
+	uOvfCount = ((TabHashFileHeader const *) pIdxMap->pData)->uOvfCount;
+	for (; uOvfLink != 0 && uOvfCount > 0; uOvfCount--) {
+		TabOvfLink const *pLink = TbixGetOvfLink(pIdxMap, uOvfLink);
+
+		if (pLink == NULL)
+			break;
+		if (pOffsets != NULL)
+			pOffsets[lCount] = pLink->uOffset;
+		lCount++;
+		uOvfLink = pLink->uNext;
+	}
+	/* Overflow chains are linked newest first */
+	if (pOffsets != NULL)
+		for (long i = lOvfStart, j = lCount - 1; i < j; i++, j--) {
+			TabIdxUINT uOffset = pOffsets[i];
+
+			pOffsets[i] = pOffsets[j];
+			pOffsets[j] = uOffset;
+		}
+
+	return lCount;
+}
+
 INDEX_HANDLE TbixOpenHandle(char const *pszTabFilePath, int const *piFieldsIdx,
 			    unsigned long const *pulHashVal, int iNumVals)
 {
 	int i;
 	long lRecCount;
-	ARRAY_HANDLE hArray;
-	FILE *pTabFile;
+	TabIdxUINT *pOffsets;
+	TabMapFile *pIdxMap, *pTabMap;
 	IndexLookupData *pILD;
-	TabHashIndex THI;
 	char szIdxFile[SYS_MAX_PATH];
 
-	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) < 0 ||
-	    (hArray = ArrayCreate(TAB_INIT_RESSET_SIZE)) == INVALID_ARRAY_HANDLE)
+	if (TbixGetIndexFile(pszTabFilePath, piFieldsIdx, szIdxFile) == NULL ||
+	    (pIdxMap = TbixGetIndexMap(szIdxFile)) == NULL)
 		return INVALID_INDEX_HANDLE;
 
-	if (TbixOpenIndex(szIdxFile, THI) < 0) {
-		ArrayFree(hArray, MscSysFreeCB, NULL);
-		return INVALID_INDEX_HANDLE;
-	}
-	for (i = 0, lRecCount = 0; i < iNumVals; i++) {
-		TabIdxUINT *pHashTable = TbixReadTable(THI, pulHashVal[i]);
-
-		if (pHashTable != NULL) {
-			if (ArrayAppend(hArray, pHashTable) < 0) {
-				SysFree(pHashTable);
-				ArrayFree(hArray, MscSysFreeCB, NULL);
-				TbixCloseIndex(THI);
-				return INVALID_INDEX_HANDLE;
-			}
-			lRecCount += (long) pHashTable[0];
-		}
-	}
-	TbixCloseIndex(THI);
+	for (i = 0, lRecCount = 0; i < iNumVals; i++)
+		lRecCount += TbixCollectBucket(pIdxMap, pulHashVal[i], NULL);
 	if (lRecCount == 0) {
-		ArrayFree(hArray, MscSysFreeCB, NULL);
+		TbixReleaseMap(pIdxMap);
 		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
 		return INVALID_INDEX_HANDLE;
 	}
+	if ((pOffsets = (TabIdxUINT *) SysAlloc(lRecCount * sizeof(TabIdxUINT))) == NULL) {
+		TbixReleaseMap(pIdxMap);
+		return INVALID_INDEX_HANDLE;
+	}
+	for (i = 0, lRecCount = 0; i < iNumVals; i++)
+		lRecCount += TbixCollectBucket(pIdxMap, pulHashVal[i], pOffsets + lRecCount);
 
-	/* Open tab file */
-	if ((pTabFile = fopen(pszTabFilePath, "rb")) == NULL) {
-		ArrayFree(hArray, MscSysFreeCB, NULL);
+	/* Map tab file */
+	if ((pTabMap = TbixGetMap(pszTabFilePath)) == NULL) {
+		SysFree(pOffsets);
+		TbixReleaseMap(pIdxMap);
 		ErrSetErrorCode(ERR_FILE_OPEN, pszTabFilePath);
 		return INVALID_INDEX_HANDLE;
 	}
 	/* Setup lookup struct */
 	if ((pILD = (IndexLookupData *) SysAlloc(sizeof(IndexLookupData))) == NULL) {
-		fclose(pTabFile);
-		ArrayFree(hArray, MscSysFreeCB, NULL);
+		TbixReleaseMap(pTabMap);
+		SysFree(pOffsets);
+		TbixReleaseMap(pIdxMap);
 		return INVALID_INDEX_HANDLE;
 	}
-	pILD->hArray = hArray;
+	pILD->pOffsets = pOffsets;
 	pILD->lRecCount = lRecCount;
-	pILD->pTabFile = pTabFile;
+	pILD->pIdxMap = pIdxMap;
+	pILD->pTabMap = pTabMap;
 
 	return (INDEX_HANDLE) pILD;
 }
@@ -608,8 +1061,9 @@ int TbixCloseHandle(INDEX_HANDLE hIndexLookup)
 {
 	IndexLookupData *pILD = (IndexLookupData *) hIndexLookup;
 
-	fclose(pILD->pTabFile);
-	ArrayFree(pILD->hArray, MscSysFreeCB, NULL);
+	TbixReleaseMap(pILD->pTabMap);
+	TbixReleaseMap(pILD->pIdxMap);
+	SysFree(pILD->pOffsets);
 	SysFree(pILD);
 
 	return 0;
@@ -626,35 +1080,21 @@ char **TbixFirstRecord(INDEX_HANDLE hIndexLookup)
 {
 	IndexLookupData *pILD = (IndexLookupData *) hIndexLookup;
 
-	pILD->lArIdx = 0;
-	pILD->lHTblI = 0;
-	if ((pILD->pHTblC = (TabIdxUINT *) ArrayGet(pILD->hArray,
-						    pILD->lArIdx)) == NULL) {
-		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
-		return NULL;
-	}
+	pILD->lCurrRec = 0;
 
-	return TbixLoadRecord(pILD->pTabFile, pILD->pHTblC[++pILD->lHTblI]);
+	return TbixLoadRecord(pILD->pTabMap, pILD->pOffsets[pILD->lCurrRec]);
 }
 
 char **TbixNextRecord(INDEX_HANDLE hIndexLookup)
 {
 	IndexLookupData *pILD = (IndexLookupData *) hIndexLookup;
 
-	if (pILD->pHTblC == NULL) {
-		ErrSetErrorCode(ERR_BAD_SEQUENCE);
+	if (++pILD->lCurrRec >= pILD->lRecCount) {
+		pILD->lCurrRec = pILD->lRecCount;
+		ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
 		return NULL;
 	}
-	if (pILD->lHTblI == (long) pILD->pHTblC[0]) {
-		pILD->lArIdx++;
-		if ((pILD->pHTblC = (TabIdxUINT *) ArrayGet(pILD->hArray,
-							    pILD->lArIdx)) == NULL) {
-			ErrSetErrorCode(ERR_RECORD_NOT_FOUND);
-			return NULL;
-		}
-		pILD->lHTblI = 0;
-	}
 
-	return TbixLoadRecord(pILD->pTabFile, pILD->pHTblC[++pILD->lHTblI]);
+	return TbixLoadRecord(pILD->pTabMap, pILD->pOffsets[pILD->lCurrRec]);
 }
 
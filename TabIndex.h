@@ -35,12 +35,18 @@ typedef SYS_UINT32 TabIdxUINT;
 typedef struct INDEX_HANDLE_struct {
 } *INDEX_HANDLE;
 
+int TbixInitCache(void);
+void TbixCleanupCache(void);
 char *TbixGetIndexFile(char const *pszTabFilePath, int const *piFieldsIdx, char *pszIdxFile);
 int TbixCreateIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens,
 		    int (*pHashFunc) (char const *const *, int const *, unsigned long *,
 				      bool) = NULL);
 int TbixCalculateHash(char const *const *ppszToks, int const *piFieldsIdx,
 		      unsigned long *pulHashVal, bool bCaseSens);
+int TbixAppendRecord(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens,
+		     SYS_OFF_T llRecOffset, time_t tTabMod,
+		     int (*pHashFunc) (char const *const *, int const *, unsigned long *,
+				       bool) = NULL);
 char **TbixLookup(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens, ...);
 int TbixCheckIndex(char const *pszTabFilePath, int const *piFieldsIdx, bool bCaseSens,
 		   int (*pHashFunc) (char const *const *, int const *, unsigned long *,
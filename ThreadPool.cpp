@@ -0,0 +1,250 @@
+/*
+ *  XMail by Davide Libenzi (Intranet and Internet mail server)
+ *  Copyright (C) 1999,..,2010  Davide Libenzi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#include "SysInclude.h"
+#include "SysDep.h"
+#include "SvrDefines.h"
+#include "ThreadPool.h"
+
+#define THP_QUEUE_RATIO         2
+
+struct ThPoolJob {
+	SysListHead LLink;
+	unsigned int (*pfProc)(void *);
+	void *pData;
+};
+
+struct ThPool {
+	SYS_MUTEX hMutex;
+	SYS_SEMAPHORE hJobSem;
+	SysListHead JobList;
+	int iMinThreads;
+	int iMaxThreads;
+	int iIdleTimeout;
+	int iMaxQueued;
+	int iNumThreads;
+	int iNumIdle;
+	int iNumQueued;
+	unsigned long ulNumSpawned;
+	int iClosed;
+};
+
+
+static void ThpFree(ThPool *pThp)
+{
+	SysCloseSemaphore(pThp->hJobSem);
+	SysCloseMutex(pThp->hMutex);
+	SysFree(pThp);
+}
+
+static unsigned int ThpWorkerThread(void *pThreadData)
+{
+	ThPool *pThp = (ThPool *) pThreadData;
+	int iWaitResult, iFree;
+	SysListHead *pLLink;
+	ThPoolJob *pJob;
+
+	SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	for (;;) {
+		if (pThp->iClosed && pThp->iNumQueued == 0)
+			break;
+
+		pThp->iNumIdle++;
+		SysUnlockMutex(pThp->hMutex);
+
+		iWaitResult = SysWaitSemaphore(pThp->hJobSem, pThp->iIdleTimeout);
+
+		SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+		pThp->iNumIdle--;
+
+		/*
+		 * A worker which timed out may still find a job queued before it
+		 * could re-acquire the lock, and it must serve it. This leaves the
+		 * semaphore with one stale count, which is harmless since an empty
+		 * job list is always checked.
+		 */
+		if ((pLLink = SYS_LIST_FIRST(&pThp->JobList)) == NULL) {
+			if (pThp->iClosed ||
+			    (iWaitResult < 0 && pThp->iNumThreads > pThp->iMinThreads))
+				break;
+			continue;
+		}
+		pJob = SYS_LIST_ENTRY(pLLink, ThPoolJob, LLink);
+		SYS_LIST_DEL(&pJob->LLink);
+		pThp->iNumQueued--;
+		SysUnlockMutex(pThp->hMutex);
+
+		(*pJob->pfProc)(pJob->pData);
+		SysFree(pJob);
+
+		SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	}
+	pThp->iNumThreads--;
+	iFree = pThp->iClosed && pThp->iNumThreads == 0;
+	SysUnlockMutex(pThp->hMutex);
+
+	/*
+	 * The last worker leaving a closed pool gets rid of it.
+	 */
+	if (iFree)
+		ThpFree(pThp);
+
+	return 0;
+}
+
+static int ThpSpawnWorker(ThPool *pThp)
+{
+	SYS_THREAD hThread;
+
+	if ((hThread = SysCreateThread(ThpWorkerThread, pThp)) == SYS_INVALID_THREAD)
+		return ErrGetErrorCode();
+	SysCloseThread(hThread, 0);
+	pThp->iNumThreads++;
+	pThp->ulNumSpawned++;
+
+	return 0;
+}
+
+THPOOL_HANDLE ThpCreate(int iMinThreads, int iMaxThreads, int iIdleTimeout)
+{
+	int i;
+	ThPool *pThp;
+
+	if ((pThp = (ThPool *) SysAlloc(sizeof(ThPool))) == NULL)
+		return INVALID_THPOOL_HANDLE;
+	if ((pThp->hMutex = SysCreateMutex()) == SYS_INVALID_MUTEX) {
+		SysFree(pThp);
+		return INVALID_THPOOL_HANDLE;
+	}
+	pThp->iMaxThreads = Max(iMaxThreads, 1);
+	pThp->iMinThreads = Min(iMinThreads, pThp->iMaxThreads);
+	pThp->iIdleTimeout = iIdleTimeout;
+
+	/*
+	 * Jobs are queued only while all the workers are busy. Past a small
+	 * backlog the caller is better off refusing the client right away,
+	 * than leaving it waiting for a worker with no reply at all.
+	 */
+	pThp->iMaxQueued = THP_QUEUE_RATIO * pThp->iMaxThreads;
+	if ((pThp->hJobSem = SysCreateSemaphore(0, pThp->iMaxQueued + pThp->iMaxThreads)) ==
+	    SYS_INVALID_SEMAPHORE) {
+		SysCloseMutex(pThp->hMutex);
+		SysFree(pThp);
+		return INVALID_THPOOL_HANDLE;
+	}
+	SYS_INIT_LIST_HEAD(&pThp->JobList);
+
+	SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	for (i = 0; i < pThp->iMinThreads; i++)
+		if (ThpSpawnWorker(pThp) < 0) {
+			ErrorPush();
+			SysUnlockMutex(pThp->hMutex);
+			ThpClose((THPOOL_HANDLE) pThp);
+			ErrorPop();
+			return INVALID_THPOOL_HANDLE;
+		}
+	SysUnlockMutex(pThp->hMutex);
+
+	return (THPOOL_HANDLE) pThp;
+}
+
+void ThpClose(THPOOL_HANDLE hThPool)
+{
+	ThPool *pThp = (ThPool *) hThPool;
+
+	SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	pThp->iClosed++;
+	if (pThp->iNumThreads == 0) {
+		SysUnlockMutex(pThp->hMutex);
+		ThpFree(pThp);
+		return;
+	}
+
+	/*
+	 * Workers still busy running jobs (like long client sessions) are
+	 * not waited for. They will drain the queue and drop out one by one,
+	 * with the last one freeing the pool.
+	 */
+	SysReleaseSemaphore(pThp->hJobSem, pThp->iNumThreads);
+	SysUnlockMutex(pThp->hMutex);
+}
+
+int ThpQueue(THPOOL_HANDLE hThPool, unsigned int (*pfProc)(void *), void *pData)
+{
+	ThPool *pThp = (ThPool *) hThPool;
+	ThPoolJob *pJob;
+
+	if ((pJob = (ThPoolJob *) SysAlloc(sizeof(ThPoolJob))) == NULL)
+		return ErrGetErrorCode();
+	pJob->pfProc = pfProc;
+	pJob->pData = pData;
+
+	SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	if (pThp->iClosed) {
+		SysUnlockMutex(pThp->hMutex);
+		SysFree(pJob);
+		ErrSetErrorCode(ERR_SERVER_SHUTDOWN);
+		return ERR_SERVER_SHUTDOWN;
+	}
+	if (pThp->iNumQueued >= pThp->iMaxQueued) {
+		SysUnlockMutex(pThp->hMutex);
+		SysFree(pJob);
+		ErrSetErrorCode(ERR_SERVER_BUSY);
+		return ERR_SERVER_BUSY;
+	}
+	SYS_LIST_ADDT(&pJob->LLink, &pThp->JobList);
+	pThp->iNumQueued++;
+
+	/*
+	 * Grow the pool only if the idle workers are not enough to cover the
+	 * queued jobs. If we cannot spawn, the job is left to the existing
+	 * workers, unless there are none.
+	 */
+	if (pThp->iNumIdle < pThp->iNumQueued && pThp->iNumThreads < pThp->iMaxThreads &&
+	    ThpSpawnWorker(pThp) < 0 && pThp->iNumThreads == 0) {
+		ErrorPush();
+		SYS_LIST_DEL(&pJob->LLink);
+		pThp->iNumQueued--;
+		SysUnlockMutex(pThp->hMutex);
+		SysFree(pJob);
+		return ErrorPop();
+	}
+	SysUnlockMutex(pThp->hMutex);
+	SysReleaseSemaphore(pThp->hJobSem, 1);
+
+	return 0;
+}
+
+int ThpGetStats(THPOOL_HANDLE hThPool, ThPoolStats *pThpS)
+{
+	ThPool *pThp = (ThPool *) hThPool;
+
+	SysLockMutex(pThp->hMutex, SYS_INFINITE_TIMEOUT);
+	pThpS->iNumThreads = pThp->iNumThreads;
+	pThpS->iNumIdle = pThp->iNumIdle;
+	pThpS->iNumQueued = pThp->iNumQueued;
+	pThpS->ulNumSpawned = pThp->ulNumSpawned;
+	SysUnlockMutex(pThp->hMutex);
+
+	return 0;
+}
+
@@ -0,0 +1,44 @@
+/*
+ *  XMail by Davide Libenzi (Intranet and Internet mail server)
+ *  Copyright (C) 1999,..,2010  Davide Libenzi
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *  Davide Libenzi <davidel@xmailserver.org>
+ *
+ */
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+#define INVALID_THPOOL_HANDLE ((THPOOL_HANDLE) 0)
+
+typedef struct THPOOL_HANDLE_struct {
+} *THPOOL_HANDLE;
+
+struct ThPoolStats {
+	int iNumThreads;
+	int iNumIdle;
+	int iNumQueued;
+	unsigned long ulNumSpawned;
+};
+
+THPOOL_HANDLE ThpCreate(int iMinThreads, int iMaxThreads, int iIdleTimeout);
+void ThpClose(THPOOL_HANDLE hThPool);
+int ThpQueue(THPOOL_HANDLE hThPool, unsigned int (*pfProc)(void *), void *pData);
+int ThpGetStats(THPOOL_HANDLE hThPool, ThPoolStats *pThpS);
+
+#endif
+
@@ -95,6 +95,12 @@ struct AliasDBScanData {
 	FILE *pDBFile;
 };
 
+struct UsrMaxIDCache {
+	SYS_OFF_T llSize;
+	time_t tMod;
+	unsigned int uMaxUserID;
+};
+
 static int UsrLoadUserDefaultInfo(HSLIST &InfoList, char const *pszDomain = NULL);
 static int UsrAliasLookupNameLK(char const *pszAlsFilePath, char const *pszDomain,
 				char const *pszAlias, char *pszName = NULL,
@@ -112,6 +118,13 @@ static int iIdxAlias_Domain_Alias[] = {
 	INDEX_SEQUENCE_TERMINATOR
 };
 
+/*
+ * Highest user ID inside the users table, valid as long as the table still
+ * has the size and time it had when it was recorded. Only accessed with the
+ * table locked in exclusive mode.
+ */
+static UsrMaxIDCache UsrMaxID = { -1, 0, 0 };
+
 static bool UsrIsWildAlias(char const *pszAlias)
 {
 	return (strchr(pszAlias, '*') != NULL) || (strchr(pszAlias, '?') != NULL);
@@ -194,6 +207,28 @@ static int UsrRebuildAliasesIndexes(char const *pszAlsFilePath)
 	return 0;
 }
 
+static int UsrAppendUsersIndexes(char const *pszUsrFilePath, SYS_OFF_T llRecOffset,
+				 time_t tTabMod)
+{
+	/* Add the new record to the Domain-Name index */
+	if (TbixAppendRecord(pszUsrFilePath, iIdxUser_Domain_Name, false, llRecOffset,
+			     tTabMod) < 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
+static int UsrAppendAliasesIndexes(char const *pszAlsFilePath, SYS_OFF_T llRecOffset,
+				   time_t tTabMod)
+{
+	/* Add the new record to the Domain-Alias index */
+	if (TbixAppendRecord(pszAlsFilePath, iIdxAlias_Domain_Alias, false, llRecOffset,
+			     tTabMod, UsrCalcAliasHash) < 0)
+		return ErrGetErrorCode();
+
+	return 0;
+}
+
 char *UsrGetMLTableFilePath(UserInfo *pUI, char *pszMLTablePath, size_t sMaxPath)
 {
 	UsrGetUserPath(pUI, pszMLTablePath, sMaxPath, 1);
@@ -688,6 +723,42 @@ void UsrFreeAlias(AliasInfo *pAI)
 	SysFree(pAI);
 }
 
+static int UsrAliasExistLK(char const *pszAlsFilePath, char const *pszDomain,
+			   char const *pszAlias)
+{
+	char **ppszTabTokens;
+
+	if (!UsrIsWildAlias(pszDomain) && !UsrIsWildAlias(pszAlias)) {
+		if ((ppszTabTokens = TbixLookup(pszAlsFilePath, iIdxAlias_Domain_Alias, false,
+						pszDomain, pszAlias, NULL)) == NULL)
+			return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+		StrFreeStrings(ppszTabTokens);
+
+		return 1;
+	}
+
+	/* Wild aliases are all grouped under the WILD_ALIASES_HASH hash key */
+	int iExist = 0;
+	unsigned long ulLkHVal = WILD_ALIASES_HASH;
+	INDEX_HANDLE hIndexLookup = TbixOpenHandle(pszAlsFilePath, iIdxAlias_Domain_Alias,
+						   &ulLkHVal, 1);
+
+	if (hIndexLookup == INVALID_INDEX_HANDLE)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+	for (ppszTabTokens = TbixFirstRecord(hIndexLookup); ppszTabTokens != NULL;
+	     ppszTabTokens = TbixNextRecord(hIndexLookup)) {
+		iExist = StrStringsCount(ppszTabTokens) >= alsMax &&
+			stricmp(pszDomain, ppszTabTokens[alsDomain]) == 0 &&
+			stricmp(pszAlias, ppszTabTokens[alsAlias]) == 0;
+		StrFreeStrings(ppszTabTokens);
+		if (iExist)
+			break;
+	}
+	TbixCloseHandle(hIndexLookup);
+
+	return iExist;
+}
+
 int UsrAddAlias(AliasInfo *pAI)
 {
 	char szAlsFilePath[SYS_MAX_PATH];
@@ -701,38 +772,38 @@ int UsrAddAlias(AliasInfo *pAI)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pAlsFile = fopen(szAlsFilePath, "r+t");
+	int iExist = UsrAliasExistLK(szAlsFilePath, pAI->pszDomain, pAI->pszAlias);
 
-	if (pAlsFile == NULL) {
-		ErrSetErrorCode(ERR_ALIAS_FILE_NOT_FOUND);
-		RLckUnlockEX(hResLock);
-		return ERR_ALIAS_FILE_NOT_FOUND;
-	}
+	/* A lookup failing for other reasons than a missing record means a broken index */
+	if (iExist < 0 && UsrRebuildAliasesIndexes(szAlsFilePath) == 0)
+		iExist = UsrAliasExistLK(szAlsFilePath, pAI->pszDomain, pAI->pszAlias);
 
-	char szAlsLine[USR_ALIAS_LINE_MAX];
+	if (iExist != 0) {
+		RLckUnlockEX(hResLock);
+		if (iExist < 0)
+			return iExist;
 
-	while (MscFGets(szAlsLine, sizeof(szAlsLine) - 1, pAlsFile) != NULL) {
-		char **ppszStrings = StrGetTabLineStrings(szAlsLine);
+		ErrSetErrorCode(ERR_ALIAS_EXIST);
+		return ERR_ALIAS_EXIST;
+	}
 
-		if (ppszStrings == NULL)
-			continue;
+	/* The index is later checked against the table as it is before our write */
+	SYS_FILE_INFO TabFI;
 
-		int iFieldsCount = StrStringsCount(ppszStrings);
+	if (SysGetFileInfo(szAlsFilePath, TabFI) < 0)
+		TabFI.tMod = 0;
 
-		if ((iFieldsCount >= alsMax) &&
-		    (stricmp(pAI->pszDomain, ppszStrings[alsDomain]) == 0) &&
-		    (stricmp(pAI->pszAlias, ppszStrings[alsAlias]) == 0)) {
-			StrFreeStrings(ppszStrings);
-			fclose(pAlsFile);
-			RLckUnlockEX(hResLock);
-
-			ErrSetErrorCode(ERR_ALIAS_EXIST);
-			return ERR_ALIAS_EXIST;
-		}
+	FILE *pAlsFile = fopen(szAlsFilePath, "r+t");
 
-		StrFreeStrings(ppszStrings);
+	if (pAlsFile == NULL) {
+		ErrSetErrorCode(ERR_ALIAS_FILE_NOT_FOUND);
+		RLckUnlockEX(hResLock);
+		return ERR_ALIAS_FILE_NOT_FOUND;
 	}
 	fseek(pAlsFile, 0, SEEK_END);
+
+	SYS_OFF_T llRecOffset = Sys_ftell(pAlsFile);
+
 	if (UsrWriteAlias(pAlsFile, pAI) < 0) {
 		fclose(pAlsFile);
 		RLckUnlockEX(hResLock);
@@ -742,8 +813,8 @@ int UsrAddAlias(AliasInfo *pAI)
 	}
 	fclose(pAlsFile);
 
-	/* Rebuild indexes */
-	if (UsrRebuildAliasesIndexes(szAlsFilePath) < 0) {
+	/* Update indexes */
+	if (UsrAppendAliasesIndexes(szAlsFilePath, llRecOffset, TabFI.tMod) < 0) {
 		ErrorPush();
 		RLckUnlockEX(hResLock);
 		return ErrorPop();
@@ -1571,6 +1642,74 @@ static int UsrPrepareUserEnv(UserInfo *pUI)
 	return 0;
 }
 
+static int UsrUserExistLK(char const *pszUsrFilePath, char const *pszDomain,
+			  char const *pszName)
+{
+	char **ppszTabTokens = TbixLookup(pszUsrFilePath, iIdxUser_Domain_Name, false,
+					  pszDomain, pszName, NULL);
+
+	if (ppszTabTokens == NULL)
+		return ErrGetErrorCode() == ERR_RECORD_NOT_FOUND ? 0: ErrGetErrorCode();
+	StrFreeStrings(ppszTabTokens);
+
+	return 1;
+}
+
+static int UsrGetMaxUserIDLK(char const *pszUsrFilePath, unsigned int *puMaxUserID)
+{
+	SYS_FILE_INFO FI;
+
+	if (SysGetFileInfo(pszUsrFilePath, FI) < 0)
+		return ErrGetErrorCode();
+	if (FI.llSize != UsrMaxID.llSize || FI.tMod != UsrMaxID.tMod) {
+		/* The table changed behind our back, so it needs a full scan */
+		FILE *pUsrFile = fopen(pszUsrFilePath, "rt");
+
+		if (pUsrFile == NULL) {
+			ErrSetErrorCode(ERR_USERS_FILE_NOT_FOUND);
+			return ERR_USERS_FILE_NOT_FOUND;
+		}
+
+		unsigned int uMaxUserID = 0;
+		char szUsrLine[USR_TABLE_LINE_MAX];
+
+		while (MscFGets(szUsrLine, sizeof(szUsrLine) - 1, pUsrFile) != NULL) {
+			char **ppszStrings = StrGetTabLineStrings(szUsrLine);
+
+			if (ppszStrings == NULL)
+				continue;
+			if (StrStringsCount(ppszStrings) >= usrMax) {
+				unsigned int uUserID = (unsigned int) atol(ppszStrings[usrID]);
+
+				if (uUserID > uMaxUserID)
+					uMaxUserID = uUserID;
+			}
+			StrFreeStrings(ppszStrings);
+		}
+		fclose(pUsrFile);
+
+		UsrMaxID.llSize = FI.llSize;
+		UsrMaxID.tMod = FI.tMod;
+		UsrMaxID.uMaxUserID = uMaxUserID;
+	}
+	*puMaxUserID = UsrMaxID.uMaxUserID;
+
+	return 0;
+}
+
+static void UsrSetMaxUserIDLK(char const *pszUsrFilePath, unsigned int uMaxUserID)
+{
+	SYS_FILE_INFO FI;
+
+	if (SysGetFileInfo(pszUsrFilePath, FI) < 0) {
+		UsrMaxID.llSize = -1;
+		return;
+	}
+	UsrMaxID.llSize = FI.llSize;
+	UsrMaxID.tMod = FI.tMod;
+	UsrMaxID.uMaxUserID = uMaxUserID;
+}
+
 int UsrAddUser(UserInfo *pUI)
 {
 	/* Search for overlapping alias ( wildcard alias not checked here ) */
@@ -1590,56 +1729,54 @@ int UsrAddUser(UserInfo *pUI)
 	if (hResLock == INVALID_RLCK_HANDLE)
 		return ErrGetErrorCode();
 
-	FILE *pUsrFile = fopen(szUsrFilePath, "r+t");
+	int iExist = UsrUserExistLK(szUsrFilePath, pUI->pszDomain, pUI->pszName);
 
-	if (pUsrFile == NULL) {
+	/* A lookup failing for other reasons than a missing record means a broken index */
+	if (iExist < 0 && UsrRebuildUsersIndexes(szUsrFilePath) == 0)
+		iExist = UsrUserExistLK(szUsrFilePath, pUI->pszDomain, pUI->pszName);
+
+	if (iExist != 0) {
 		RLckUnlockEX(hResLock);
+		if (iExist < 0)
+			return iExist;
 
-		ErrSetErrorCode(ERR_USERS_FILE_NOT_FOUND);
-		return ERR_USERS_FILE_NOT_FOUND;
+		ErrSetErrorCode(ERR_USER_EXIST);
+		return ERR_USER_EXIST;
 	}
 
 	unsigned int uMaxUserID = 0;
-	char szUsrLine[USR_TABLE_LINE_MAX];
 
-	while (MscFGets(szUsrLine, sizeof(szUsrLine) - 1, pUsrFile) != NULL) {
-		char **ppszStrings = StrGetTabLineStrings(szUsrLine);
-
-		if (ppszStrings == NULL)
-			continue;
-
-		int iFieldsCount = StrStringsCount(ppszStrings);
+	if (UsrGetMaxUserIDLK(szUsrFilePath, &uMaxUserID) < 0) {
+		ErrorPush();
+		RLckUnlockEX(hResLock);
+		return ErrorPop();
+	}
+	pUI->uUserID = uMaxUserID + 1;
 
-		if (iFieldsCount >= usrMax) {
-			if ((stricmp(pUI->pszDomain, ppszStrings[usrDomain]) == 0) &&
-			    (stricmp(pUI->pszName, ppszStrings[usrName]) == 0)) {
-				StrFreeStrings(ppszStrings);
-				fclose(pUsrFile);
-				RLckUnlockEX(hResLock);
+	/* The index is later checked against the table as it is before our write */
+	SYS_FILE_INFO TabFI;
 
-				ErrSetErrorCode(ERR_USER_EXIST);
-				return ERR_USER_EXIST;
-			}
+	if (SysGetFileInfo(szUsrFilePath, TabFI) < 0)
+		TabFI.tMod = 0;
 
-			unsigned int uUserID = (unsigned int) atol(ppszStrings[usrID]);
+	FILE *pUsrFile = fopen(szUsrFilePath, "r+t");
 
-			if (uUserID > uMaxUserID)
-				uMaxUserID = uUserID;
-		}
+	if (pUsrFile == NULL) {
+		RLckUnlockEX(hResLock);
 
-		StrFreeStrings(ppszStrings);
+		ErrSetErrorCode(ERR_USERS_FILE_NOT_FOUND);
+		return ERR_USERS_FILE_NOT_FOUND;
 	}
-
-	pUI->uUserID = uMaxUserID + 1;
-
 	if (UsrPrepareUserEnv(pUI) < 0) {
+		ErrorPush();
 		fclose(pUsrFile);
 		RLckUnlockEX(hResLock);
-		return ErrGetErrorCode();
+		return ErrorPop();
 	}
-
 	fseek(pUsrFile, 0, SEEK_END);
 
+	SYS_OFF_T llRecOffset = Sys_ftell(pUsrFile);
+
 	if (UsrWriteUser(pUI, pUsrFile) < 0) {
 		fclose(pUsrFile);
 		RLckUnlockEX(hResLock);
@@ -1649,9 +1786,10 @@ int UsrAddUser(UserInfo *pUI)
 	}
 
 	fclose(pUsrFile);
+	UsrSetMaxUserIDLK(szUsrFilePath, pUI->uUserID);
 
-	/* Rebuild indexes */
-	if (UsrRebuildUsersIndexes(szUsrFilePath) < 0) {
+	/* Update indexes */
+	if (UsrAppendUsersIndexes(szUsrFilePath, llRecOffset, TabFI.tMod) < 0) {
 		ErrorPush();
 		RLckUnlockEX(hResLock);
 		return ErrorPop();